@@ -0,0 +1,203 @@
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <stdarg.h>
+#include <pthread.h>
+#include <iconv.h>
+
+#include <sys/time.h>
+
+#include <stdexcept>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "machine_arch.h"
+#include "exceptions.h"
+#include "protocol.h"
+#include "util.h"
+#include "UruString.h"
+#include "PlKey.h"
+
+#include "Logger.h"
+#include "SDL.h"
+
+#include "AgeCheckpoint.h"
+
+AgeCheckpoint::AgeCheckpoint() :
+    m_log(NULL), m_any_new(false), m_have_thread(false), m_writing(false), m_write_err(0) {
+  if (pthread_mutex_init(&m_mutex, NULL)) {
+    throw std::bad_alloc();
+  }
+}
+
+AgeCheckpoint::~AgeCheckpoint() {
+  wait();
+  pthread_mutex_destroy(&m_mutex);
+}
+
+std::string AgeCheckpoint::state_id(SDLState *state) {
+  uint8_t keybuf[512];
+  uint32_t keylen = state->key().send_len();
+  std::string id;
+  if (keylen <= sizeof(keybuf)) {
+    keylen = state->key().write_out(keybuf, sizeof(keybuf));
+    id.assign((const char*) keybuf, keylen);
+  }
+  // descriptor names are case-insensitive
+  for (const char *c = state->get_desc()->name(); *c; c++) {
+    id += (char) tolower(*c);
+  }
+  return id;
+}
+
+bool AgeCheckpoint::checkpoint(std::list<SDLState*> &states) {
+  std::list<SDLState*>::iterator iter;
+  for (iter = states.begin(); iter != states.end(); iter++) {
+    SDLState *s = *iter;
+    if (!s->changed()) {
+      continue;
+    }
+    s->clear_changed();
+    if (!s->persistent()) {
+      continue;
+    }
+    std::string record;
+    if (s->write_file_record(record)) {
+      m_changed[state_id(s)].swap(record);
+      m_any_new = true;
+    } else {
+      log_warn(m_log, "Cannot encode %s SDL for age state checkpoint\n", s->get_desc()->name());
+    }
+  }
+
+  collect();
+  if (m_have_thread) {
+    // the changes will be in the next one
+    log_debug(m_log, "Age state checkpoint still being written, skipping this one\n");
+    return true;
+  }
+  if (!m_any_new || m_fname.size() == 0) {
+    return true;
+  }
+
+  // the writer gets its own copy, so the game server can carry on
+  m_write_buf.clear();
+  std::map<std::string, std::string>::const_iterator c_iter;
+  for (c_iter = m_changed.begin(); c_iter != m_changed.end(); c_iter++) {
+    m_write_buf.append(c_iter->second);
+  }
+  pthread_mutex_lock(&m_mutex);
+  m_writing = true;
+  pthread_mutex_unlock(&m_mutex);
+  int ret = pthread_create(&m_thread, NULL, writer, this);
+  if (ret) {
+    m_writing = false;
+    log_warn(m_log, "Cannot start age state checkpoint writer: %s\n", strerror(ret));
+    return false;
+  }
+  m_have_thread = true;
+  m_any_new = false;
+  log_debug(m_log, "Writing age state checkpoint of %u states to %s\n", (uint32_t) m_changed.size(), m_fname.c_str());
+  return true;
+}
+
+void* AgeCheckpoint::writer(void *arg) {
+  AgeCheckpoint *cp = (AgeCheckpoint*) arg;
+  std::string tmpname = cp->m_fname + ".new";
+  int err = 0;
+
+  FILE *f = fopen(tmpname.c_str(), "wb");
+  if (!f) {
+    err = errno;
+  } else {
+    if (cp->m_write_buf.size() > 0
+        && fwrite(cp->m_write_buf.data(), cp->m_write_buf.size(), 1, f) != 1) {
+      err = errno ? errno : EIO;
+    }
+    if (!err && fflush(f)) {
+      err = errno;
+    }
+    if (!err && fsync(fileno(f))) {
+      err = errno;
+    }
+    if (fclose(f) && !err) {
+      err = errno;
+    }
+    if (!err && rename(tmpname.c_str(), cp->m_fname.c_str())) {
+      err = errno;
+    }
+    if (err) {
+      unlink(tmpname.c_str());
+    }
+  }
+
+  pthread_mutex_lock(&cp->m_mutex);
+  cp->m_write_err = err;
+  cp->m_writing = false;
+  pthread_mutex_unlock(&cp->m_mutex);
+  return NULL;
+}
+
+void AgeCheckpoint::collect() {
+  if (!m_have_thread) {
+    return;
+  }
+  pthread_mutex_lock(&m_mutex);
+  bool writing = m_writing;
+  pthread_mutex_unlock(&m_mutex);
+  if (!writing) {
+    wait();
+  }
+}
+
+void AgeCheckpoint::wait() {
+  if (!m_have_thread) {
+    return;
+  }
+  pthread_join(m_thread, NULL);
+  m_have_thread = false;
+  if (m_write_err) {
+    log_warn(m_log, "Error writing age state checkpoint %s: %s\n", m_fname.c_str(), strerror(m_write_err));
+    // make sure everything is written next time
+    m_any_new = true;
+  }
+}
+
+void AgeCheckpoint::saved_all() {
+  wait();
+  m_changed.clear();
+  m_any_new = false;
+  if (m_fname.size() > 0 && unlink(m_fname.c_str()) && errno != ENOENT) {
+    log_warn(m_log, "Cannot remove age state checkpoint %s: %s\n", m_fname.c_str(), strerror(errno));
+  }
+}
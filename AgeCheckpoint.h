@@ -0,0 +1,91 @@
+/* -*- c++ -*- */
+
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * AgeCheckpoint keeps the persistent SDL that has changed since the age
+ * state file was last written, so a game server that dies does not lose
+ * everything since it started.
+ *
+ * Every AGESTATE_CHECKPOINT_INTERVAL the game server hands over its SDL.
+ * The states changed since the last checkpoint are encoded (on the game
+ * server's thread, so the SDL cannot change underneath) and replace any
+ * older copy; then a copy of all of them is written by a separate thread
+ * to a temporary file, which is renamed over the delta file. The delta
+ * file has the same records as the old agestate.moss, and at startup it is
+ * read after the age state file, with its states replacing those in it.
+ * When the full state is saved at shutdown the delta file is removed.
+ */
+
+//#include <pthread.h>
+//
+//#include <list>
+//#include <map>
+//#include <string>
+//
+//#include "Logger.h"
+//#include "SDL.h"
+
+#ifndef _AGE_CHECKPOINT_H_
+#define _AGE_CHECKPOINT_H_
+
+class AgeCheckpoint {
+public:
+  AgeCheckpoint();
+  // waits for any write in progress
+  ~AgeCheckpoint();
+
+  void set_file(const std::string &delta_file, Logger *log) {
+    m_fname = delta_file;
+    m_log = log;
+  }
+
+  // Encode any changed persistent states and start writing the delta file,
+  // unless the previous write is still going (the changes will go out with
+  // the next one). Returns false if the write could not be started.
+  bool checkpoint(std::list<SDLState*> &states);
+  // wait for a write in progress to finish
+  void wait();
+  // the full state has been saved, so forget the changes and remove the
+  // delta file
+  void saved_all();
+
+protected:
+  Logger *m_log;
+  std::string m_fname;
+
+  // encoded file records of changed states, keyed by the plKey and
+  // descriptor name
+  std::map<std::string, std::string> m_changed;
+  bool m_any_new; // m_changed has changed since the last write started
+
+  // the writer thread
+  pthread_mutex_t m_mutex;
+  pthread_t m_thread;
+  bool m_have_thread;
+  bool m_writing; // protected by m_mutex
+  int m_write_err; // protected by m_mutex; errno from the last write
+  std::string m_write_buf; // owned by the writer while m_writing
+
+  static void* writer(void *arg);
+  void collect(); // join a finished writer and report its result
+  static std::string state_id(SDLState *state);
+};
+
+#endif /* _AGE_CHECKPOINT_H_ */
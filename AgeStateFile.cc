@@ -0,0 +1,310 @@
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <stdarg.h>
+#include <pthread.h>
+#include <iconv.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include <sys/time.h>
+
+#include <stdexcept>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "machine_arch.h"
+#include "exceptions.h"
+#include "protocol.h"
+#include "util.h"
+#include "UruString.h"
+#include "PlKey.h"
+
+#include "Logger.h"
+#include "SDL.h"
+
+#include "AgeStateFile.h"
+
+/*
+ * if mmap() MAP_FILE flag is not defined by system, define it here as a no-op
+ */
+#ifndef MAP_FILE
+#define MAP_FILE (0)
+#endif
+
+static const char agestate_magic[8] = { 'M', 'O', 'S', 'S', 'A', 'G', 'S', 'T' };
+
+AgeStateFile::AgeStateFile() :
+    m_data(NULL), m_len(0), m_mapped(false) {
+}
+
+AgeStateFile::~AgeStateFile() {
+  if (m_data) {
+    if (m_mapped) {
+      munmap(m_data, m_len);
+    } else {
+      delete[] m_data;
+    }
+  }
+}
+
+bool AgeStateFile::load(const char *fname, std::list<SDLState*> &load, const SDLDescIndex &descs, Logger *log) {
+  if (m_data) {
+    // programmer error
+    throw std::logic_error("AgeStateFile already loaded");
+  }
+  int fd = open(fname, O_RDONLY, 0);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      log_err(log, "Open failed for age state %s: %s\n", fname, strerror(errno));
+    }
+    return false;
+  }
+  struct stat s;
+  if (fstat(fd, &s) < 0) {
+    log_err(log, "Cannot stat age state %s: %s\n", fname, strerror(errno));
+    close(fd);
+    return false;
+  }
+  if (s.st_size < header_len || s.st_size > 0x7fffffff) {
+    log_err(log, "Age state %s has bad size %lld\n", fname, (long long) s.st_size);
+    close(fd);
+    return false;
+  }
+  m_len = s.st_size;
+  m_data = (uint8_t*) mmap(NULL, m_len, PROT_READ, MAP_FILE | MAP_PRIVATE, fd, 0);
+  if (m_data == MAP_FAILED) {
+    log_warn(log, "mmap() of %s failed: %s\n", fname, strerror(errno));
+    // read it instead
+    m_data = new uint8_t[m_len];
+    uint32_t got = 0;
+    while (got < m_len) {
+      ssize_t ret = read(fd, m_data + got, m_len - got);
+      if (ret <= 0) {
+        log_err(log, "Read failed for age state %s: %s\n", fname, ret < 0 ? strerror(errno) : "short read");
+        close(fd);
+        delete[] m_data;
+        m_data = NULL;
+        return false;
+      }
+      got += ret;
+    }
+  } else {
+    m_mapped = true;
+  }
+  close(fd);
+
+  // check over everything before making any states
+  bool ok = false;
+  uint32_t desc_count = 0, state_count = 0, desc_off = 0, state_off = 0, msg_off = 0;
+  if (memcmp(m_data, agestate_magic, sizeof(agestate_magic))) {
+    log_err(log, "%s is not an age state file\n", fname);
+  } else if (read32(m_data, 8) != format_version) {
+    log_err(log, "Age state %s has unknown format version %u\n", fname, read32(m_data, 8));
+  } else if (read32(m_data, 32) != m_len) {
+    log_err(log, "Age state %s is the wrong length (%u, expected %u)\n", fname, m_len, read32(m_data, 32));
+  } else {
+    desc_count = read32(m_data, 12);
+    state_count = read32(m_data, 16);
+    desc_off = read32(m_data, 20);
+    state_off = read32(m_data, 24);
+    msg_off = read32(m_data, 28);
+    ok = (desc_off >= header_len && desc_off <= state_off && state_off <= msg_off && msg_off <= m_len
+        && state_count <= (msg_off - state_off) / 12);
+    if (!ok) {
+      log_err(log, "Age state %s has a bad header\n", fname);
+    }
+  }
+  std::vector<SDLDesc*> file_descs;
+  uint32_t offset = desc_off;
+  for (uint32_t i = 0; ok && i < desc_count; i++) {
+    if (state_off < offset + 4 || state_off < offset + 4 + read16(m_data, offset + 2)) {
+      log_err(log, "Age state %s descriptor table is truncated\n", fname);
+      ok = false;
+      break;
+    }
+    uint16_t version = read16(m_data, offset);
+    std::string name((const char*) m_data + offset + 4, read16(m_data, offset + 2));
+    offset += 4 + name.size();
+    SDLDesc *desc = descs.find(name.c_str(), version);
+    if (!desc) {
+      log_err(log, "Unknown SDL %s-v%u in age state\n", name.c_str(), version);
+    }
+    file_descs.push_back(desc);
+  }
+  offset = state_off;
+  for (uint32_t i = 0; ok && i < state_count; i++, offset += 12) {
+    uint32_t msg_start = read32(m_data, offset + 4);
+    uint32_t msg_len = read32(m_data, offset + 8);
+    if (read32(m_data, offset) >= desc_count || msg_start > m_len - msg_off || msg_len > m_len - msg_off - msg_start) {
+      log_err(log, "Age state %s has a bad state table entry\n", fname);
+      ok = false;
+    }
+  }
+  if (!ok) {
+    if (m_mapped) {
+      munmap(m_data, m_len);
+    } else {
+      delete[] m_data;
+    }
+    m_data = NULL;
+    m_mapped = false;
+    return false;
+  }
+
+  offset = state_off;
+  for (uint32_t i = 0; i < state_count; i++, offset += 12) {
+    SDLDesc *desc = file_descs[read32(m_data, offset)];
+    if (!desc) {
+      // already logged
+      continue;
+    }
+    SDLState *state = new SDLState();
+    if (!state->attach(m_data + msg_off + read32(m_data, offset + 4), read32(m_data, offset + 8), desc, log)) {
+      log_err(log, "Bad %s SDL message in age state\n", desc->name());
+      delete state;
+    } else {
+      load.push_back(state);
+    }
+  }
+  return true;
+}
+
+bool AgeStateFile::save(const char *fname, std::list<SDLState*> &save) {
+  Writer file;
+  std::string record;
+  std::list<SDLState*>::iterator iter;
+  for (iter = save.begin(); iter != save.end(); iter++) {
+    SDLState *s = *iter;
+    if (!s->persistent()) {
+      continue;
+    }
+    record.clear();
+    // the record is the message after a length
+    if (!s->write_file_record(record)
+        || !file.add((const uint8_t*) record.data() + 4, record.size() - 4)) {
+      return false;
+    }
+  }
+  return file.write(fname);
+}
+
+bool AgeStateFile::Writer::add(const uint8_t *msg, uint32_t len) {
+  uint16_t version;
+  std::string name;
+  PlKey key;
+  key.m_name = NULL;
+  try {
+    uint32_t offset = key.read_in(msg, len);
+    key.delete_name();
+    if (len < offset + 11 || msg[offset + 4] != CompressionNone || read32(msg, offset + 5) != len - (offset + 9)) {
+      return false;
+    }
+    offset += 11;
+    UruString sdlname(msg + offset, len - offset, true, false, false);
+    offset += sdlname.arrival_len();
+    if (len < offset + 2) {
+      return false;
+    }
+    name = sdlname.c_str();
+    version = read16(msg, offset);
+  } catch (const truncated_message &e) {
+    key.delete_name();
+    return false;
+  } catch (const parse_error &e) {
+    key.delete_name();
+    return false;
+  }
+
+  std::pair<uint16_t, std::string> d(version, name);
+  std::map<std::pair<uint16_t, std::string>, uint32_t>::iterator di = m_desc_idx.find(d);
+  uint32_t idx;
+  if (di == m_desc_idx.end()) {
+    idx = m_desc_count++;
+    m_desc_idx[d] = idx;
+    uint8_t buf[4];
+    write16(buf, 0, version);
+    write16(buf, 2, name.size());
+    m_descs.append((const char*) buf, 4);
+    m_descs.append(name);
+  } else {
+    idx = di->second;
+  }
+  uint8_t entry[12];
+  write32(entry, 0, idx);
+  write32(entry, 4, m_msgs.size());
+  write32(entry, 8, len);
+  m_states.append((const char*) entry, 12);
+  m_msgs.append((const char*) msg, len);
+  m_state_count++;
+  return true;
+}
+
+bool AgeStateFile::Writer::write(const char *fname) {
+  uint8_t header[header_len];
+  uint32_t desc_off = header_len;
+  uint32_t state_off = desc_off + m_descs.size();
+  uint32_t msg_off = state_off + m_states.size();
+  memcpy(header, agestate_magic, sizeof(agestate_magic));
+  write32(header, 8, format_version);
+  write32(header, 12, m_desc_count);
+  write32(header, 16, m_state_count);
+  write32(header, 20, desc_off);
+  write32(header, 24, state_off);
+  write32(header, 28, msg_off);
+  write32(header, 32, msg_off + m_msgs.size());
+
+  FILE *f = fopen(fname, "wb");
+  if (!f) {
+    return false;
+  }
+  // the file is renamed over the last one right after this, so it has to
+  // be on disk first
+  bool ok = (fwrite(header, header_len, 1, f) == 1);
+  if (ok && m_descs.size() > 0) {
+    ok = (fwrite(m_descs.data(), m_descs.size(), 1, f) == 1);
+  }
+  if (ok && m_states.size() > 0) {
+    ok = (fwrite(m_states.data(), m_states.size(), 1, f) == 1);
+  }
+  if (ok && m_msgs.size() > 0) {
+    ok = (fwrite(m_msgs.data(), m_msgs.size(), 1, f) == 1);
+  }
+  if (ok && (fflush(f) || fsync(fileno(f)))) {
+    ok = false;
+  }
+  if (fclose(f)) {
+    ok = false;
+  }
+  return ok;
+}
@@ -0,0 +1,97 @@
+/* -*- c++ -*- */
+
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * AgeStateFile is the binary age state snapshot (agestate.bin). It
+ * replaces agestate.moss, which had to be read through and parsed state by
+ * state before a game server could start.
+ *
+ * The file is (all numbers little-endian):
+ *   header: "MOSSAGST", u32 format version, u32 descriptor count,
+ *     u32 state count, u32 descriptor table offset, u32 state table
+ *     offset, u32 message area offset, u32 file length
+ *   descriptor table: u16 SDL version, u16 name length, name
+ *   state table: u32 descriptor index, u32 message offset (from the start
+ *     of the message area), u32 message length
+ *   message area: each state as an uncompressed SDL message, exactly as
+ *     it is sent to clients
+ *
+ * Loading maps the file and looks up each descriptor once; the states are
+ * attached to their messages without parsing them (see
+ * SDLState::attach()), so the AgeStateFile has to outlive them.
+ */
+
+//#include <list>
+//#include <map>
+//#include <string>
+//
+//#include "Logger.h"
+//#include "SDL.h"
+
+#ifndef _AGE_STATE_FILE_H_
+#define _AGE_STATE_FILE_H_
+
+class AgeStateFile {
+public:
+  AgeStateFile();
+  ~AgeStateFile();
+
+  /// Map the file and append its states to load. Returns false, with
+  // nothing added, if the file cannot be read or is not a valid snapshot.
+  // A file can only be loaded once per AgeStateFile.
+  bool load(const char *fname, std::list<SDLState*> &load, const SDLDescIndex &descs, Logger *log);
+
+  /// write the persistent states in save to the file
+  static bool save(const char *fname, std::list<SDLState*> &save);
+
+  /**
+   * Writer builds up a snapshot from SDL messages.
+   */
+  class Writer {
+  public:
+    Writer() :
+        m_desc_count(0), m_state_count(0) {
+    }
+
+    /// add an uncompressed SDL message (as SDLState::write_msg(..., true)
+    // makes); returns false if it is not one
+    bool add(const uint8_t *msg, uint32_t len);
+    bool write(const char *fname);
+
+  protected:
+    // descriptor table indexes, keyed by version and name
+    std::map<std::pair<uint16_t, std::string>, uint32_t> m_desc_idx;
+    std::string m_descs;
+    std::string m_states;
+    std::string m_msgs;
+    uint32_t m_desc_count;
+    uint32_t m_state_count;
+  };
+
+  static const uint32_t format_version = 1;
+  static const uint32_t header_len = 36;
+
+protected:
+  uint8_t *m_data;
+  uint32_t m_len;
+  bool m_mapped; // otherwise m_data was allocated with new
+};
+
+#endif /* _AGE_STATE_FILE_H_ */
@@ -84,8 +84,12 @@
 #include "moss_serv.h"
 #include "AuthServer.h"
 
-AuthServer::AuthServer(int32_t the_fd, const char *server_dir, bool is_a_thread, struct sockaddr_in &vault_address, bool allow_vaultmanager) :
-    Server(server_dir, is_a_thread), m_keydata(NULL), m_vault_addr(vault_address), m_vault(NULL), m_state(START), m_reqid(0), m_nonce(
+AuthServer::AuthServer(int32_t the_fd, const char *server_dir, bool is_a_thread, struct sockaddr_in &vault_address, bool allow_vaultmanager,
+    const struct sockaddr_in *auth_address, const struct sockaddr_in *vault_service_address) :
+    Server(server_dir, is_a_thread), m_keydata(NULL), m_vault_addr(vault_address), m_auth_backend_addr(
+        auth_address ? *auth_address : vault_address), m_vault_backend_addr(
+        vault_service_address ? *vault_service_address : vault_address), m_vault(NULL), m_auth_backend(NULL), m_vault_backend(
+        NULL), m_state(START), m_reqid(0), m_nonce(
         0), m_download_dir(NULL), m_download(NULL), m_is_visitor(true/*until authed*/), m_kinum(0), m_allow_vaultmanager(allow_vaultmanager) {
   memset(m_client_uuid, 0, 16);
   Connection *conn = new AuthConnection(the_fd, m_state, m_log);
@@ -117,21 +121,49 @@ AuthServer::~AuthServer() {
     delete[] m_pelletbuf;
   }
 #endif
-  // do not delete m_vault (it is in m_conns and deleted in ~Server)
+  // do not delete backend connections (they are in m_conns and deleted in
+  // ~Server)
+}
+
+static bool same_addr(const struct sockaddr_in &a, const struct sockaddr_in &b) {
+  return (a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port);
+}
+
+bool AuthServer::connect_backend(struct sockaddr_in &addr, Connection **conn) {
+  *conn = connect_to_backend(&addr);
+  if (!*conn) {
+    // error was already logged
+    return false;
+  }
+  m_conns.push_back(*conn);
+  if (!(*conn)->in_connect()) {
+    // make sure to send hello
+    conn_completed(*conn);
+  }
+  return true;
 }
 
 int32_t AuthServer::init() {
   // set up vault/tracking server connection
-  m_vault = connect_to_backend(&m_vault_addr);
-  if (m_vault) {
-    m_conns.push_back(m_vault);
-    if (!m_vault->in_connect()) {
-      // make sure to send hello
-      conn_completed(m_vault);
+  if (!connect_backend(m_vault_addr, &m_vault)) {
+    return -1;
+  }
+  // and the auth and vault services, if they are elsewhere
+  if (same_addr(m_auth_backend_addr, m_vault_addr)) {
+    m_auth_backend = m_vault;
+  } else {
+    if (!connect_backend(m_auth_backend_addr, &m_auth_backend)) {
+      return -1;
     }
+  }
+  if (same_addr(m_vault_backend_addr, m_vault_addr)) {
+    m_vault_backend = m_vault;
+  } else if (same_addr(m_vault_backend_addr, m_auth_backend_addr)) {
+    m_vault_backend = m_auth_backend;
   } else {
-    // error was already logged
-    return -1;
+    if (!connect_backend(m_vault_backend_addr, &m_vault_backend)) {
+      return -1;
+    }
   }
   return 0;
 }
@@ -141,7 +173,7 @@ bool AuthServer::shutdown(reason_t reason) {
   std::list<Connection*>::iterator iter;
   for (iter = m_conns.begin(); iter != m_conns.end(); iter++) {
     Connection *conn = *iter;
-    if (conn == m_vault) {
+    if (is_backend(conn)) {
       conn->msg_queue()->clear_queue();
       // here, we don't bother to queue a message to the backend server saying
       // the player is offline; the backend will notice our shutdown and do
@@ -232,7 +264,7 @@ bool is_email_username(const char *c_str, size_t len) {
     conn->enqueue(kicked);
 
 Server::reason_t AuthServer::message_read(Connection *conn, NetworkMessage *in) {
-  if (conn == m_vault) {
+  if (is_backend(conn)) {
     // retrofit (from old style)
     return backend_message(conn, (BackendMessage*) in);
   }
@@ -364,7 +396,7 @@ Server::reason_t AuthServer::message_read(Connection *conn, NetworkMessage *in)
             }
             AuthAcctLogin_ToBackendMessage *query = new AuthAcctLogin_ToBackendMessage(m_ipaddr, m_id, m_reqid, login->login(),
                 login->hash(), atype, m_nonce, login->nonce());
-            m_vault->enqueue(query);
+            backend_for(query)->enqueue(query);
           }
         }
         break;
@@ -398,7 +430,7 @@ Server::reason_t AuthServer::message_read(Connection *conn, NetworkMessage *in)
             // send message to backend server
             AuthChangePassword_ToBackendMessage *query = new AuthChangePassword_ToBackendMessage(m_ipaddr, m_id, m_client_uuid,
                 pass->reqid(), name, pass->hash());
-            m_vault->enqueue(query);
+            backend_for(query)->enqueue(query);
           }
         }
       }
@@ -564,7 +596,7 @@ Server::reason_t AuthServer::message_read(Connection *conn, NetworkMessage *in)
             log_msgs(m_log, "PlayerCreateRequest for name \"%s\" -> backend\n", msg->name().c_str());
             VaultPlayerCreate_ToBackendMessage *query = new VaultPlayerCreate_ToBackendMessage(m_ipaddr, m_id, m_reqid,
                 m_client_uuid, name, msg->gender());
-            m_vault->enqueue(query);
+            backend_for(query)->enqueue(query);
           }
         }
         break;
@@ -645,7 +677,7 @@ Server::reason_t AuthServer::message_read(Connection *conn, NetworkMessage *in)
             if (msg->owns_buffer()) {
               msg->make_unowned();
             }
-            m_vault->enqueue(vaultmsg);
+            backend_for(vaultmsg)->enqueue(vaultmsg);
           }
             break;
           default:
@@ -677,7 +709,7 @@ Server::reason_t AuthServer::message_read(Connection *conn, NetworkMessage *in)
 
         TrackAgeRequest_ToBackendMessage *query = new TrackAgeRequest_ToBackendMessage(m_ipaddr, m_id, m_reqid, msg->name(),
             msg->uuid());
-        m_vault->enqueue(query);
+        backend_for(query)->enqueue(query);
       }
         break;
 
@@ -755,7 +787,7 @@ Server::reason_t AuthServer::message_read(Connection *conn, NetworkMessage *in)
               // to)
               AuthKIValidate_ToBackendMessage *query = new AuthKIValidate_ToBackendMessage(m_ipaddr, m_id, m_client_uuid,
                   newkinum);
-              m_vault->enqueue(query);
+              backend_for(query)->enqueue(query);
             } else {
               // shortcut
               m_reqid = 0;
@@ -765,7 +797,7 @@ Server::reason_t AuthServer::message_read(Connection *conn, NetworkMessage *in)
                 // need to tell backend so it can clean up the previously
                 // logged in player properly
                 AuthPlayerLogout_BackendMessage *notice = new AuthPlayerLogout_BackendMessage(m_ipaddr, m_id, m_kinum);
-                m_vault->enqueue(notice);
+                backend_for(notice)->enqueue(notice);
               }
             }
             m_kinum = newkinum;
@@ -797,7 +829,7 @@ Server::reason_t AuthServer::message_read(Connection *conn, NetworkMessage *in)
           } else {
             log_msgs(m_log, "PlayerDeleteRequest for %u -> backend\n", req_ki);
             VaultPlayerDelete_ToBackendMessage *query = new VaultPlayerDelete_ToBackendMessage(m_ipaddr, m_id, m_reqid, req_ki);
-            m_vault->enqueue(query);
+            backend_for(query)->enqueue(query);
           }
         }
           break;
@@ -835,7 +867,7 @@ Server::reason_t AuthServer::backend_message(Connection *vault, BackendMessage *
   Connection *client = NULL;
   std::list<Connection*>::iterator iter;
   for (iter = m_conns.begin(); iter != m_conns.end(); iter++) {
-    if ((*iter) != m_vault) {
+    if (!is_backend(*iter)) {
       client = *iter;
       break;
     }
@@ -1128,7 +1160,7 @@ Server::reason_t AuthServer::backend_message(Connection *vault, BackendMessage *
 
 void AuthServer::conn_completed(Connection *conn) {
   conn->set_in_connect(false);
-  if (conn == m_vault) {
+  if (is_backend(conn)) {
     conn->m_interval = BACKEND_KEEPALIVE_INTERVAL;
     gettimeofday(&conn->m_timeout, NULL);
     conn->m_timeout.tv_sec += conn->m_interval;
@@ -1141,10 +1173,10 @@ void AuthServer::conn_completed(Connection *conn) {
 }
 
 Server::reason_t AuthServer::conn_timeout(Connection *conn, Server::reason_t why) {
-  if (conn == m_vault) {
+  if (is_backend(conn)) {
     TrackPing_BackendMessage *msg = new TrackPing_BackendMessage(m_ipaddr, m_id);
-    m_vault->enqueue(msg);
-    m_vault->m_timeout.tv_sec += m_vault->m_interval;
+    conn->enqueue(msg);
+    conn->m_timeout.tv_sec += conn->m_interval;
     return NO_SHUTDOWN;
   }
 
@@ -1152,7 +1184,7 @@ Server::reason_t AuthServer::conn_timeout(Connection *conn, Server::reason_t why
 }
 
 Server::reason_t AuthServer::conn_shutdown(Connection *conn, Server::reason_t why) {
-  if (conn == m_vault) {
+  if (is_backend(conn)) {
     // XXX this is only recoverable in very particular circumstances,
     // and I will do them later if I ever get to it
 
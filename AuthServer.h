@@ -31,6 +31,7 @@
 //#include <netinet/in.h>
 //
 //#include "Buffer.h"
+//#include "backend_typecodes.h"
 //
 //#include "Logger.h"
 //#include "FileTransaction.h"
@@ -41,7 +42,10 @@
 
 class AuthServer: public Server {
 public:
-  AuthServer(int32_t the_fd, const char *server_dir, bool is_a_thread, struct sockaddr_in &vault_address, bool allow_vaultmanager);
+  // auth_address and vault_service_address are only needed when the
+  // backend services are split up; otherwise everything goes to vault_address
+  AuthServer(int32_t the_fd, const char *server_dir, bool is_a_thread, struct sockaddr_in &vault_address, bool allow_vaultmanager,
+      const struct sockaddr_in *auth_address = NULL, const struct sockaddr_in *vault_service_address = NULL);
   void setkey(void *keydata) {
     m_keydata = keydata;
   }
@@ -96,9 +100,23 @@ public:
 protected:
   void *m_keydata;
 
-  // backend connection(s)
-  struct sockaddr_in m_vault_addr;
-  Connection *m_vault;
+  // backend connection(s): m_vault is the tracking server (and the only one
+  // when the backend is not split up); m_auth_backend and m_vault_backend
+  // are the same Connection as m_vault unless their address is different
+  struct sockaddr_in m_vault_addr, m_auth_backend_addr, m_vault_backend_addr;
+  Connection *m_vault, *m_auth_backend, *m_vault_backend;
+  Connection* backend_for(const BackendMessage *msg) const {
+    if (msg->type() & CLASS_AUTH) {
+      return m_auth_backend;
+    } else if (msg->type() & CLASS_VAULT) {
+      return m_vault_backend;
+    }
+    return m_vault;
+  }
+  bool is_backend(const Connection *conn) const {
+    return (conn == m_vault || conn == m_auth_backend || conn == m_vault_backend);
+  }
+  bool connect_backend(struct sockaddr_in &addr, Connection **conn);
 
   const char* state_c_str() {
     switch (m_state) {
@@ -256,6 +256,9 @@ char *BackendMessage::backend_msgtype_c_str_alloc(int32_t t) {
     case ADMIN_BYE:             elements.push_back("ADMIN_BYE"); break;
     case ADMIN_HELLO:           elements.push_back("ADMIN_HELLO"); break;
     case ADMIN_KILL_CLIENT:     elements.push_back("ADMIN_KILL_CLIENT"); break;
+    case ADMIN_PEER_ENTITY:     elements.push_back("ADMIN_PEER_ENTITY"); break;
+    case ADMIN_PEER_PROPAGATE:  elements.push_back("ADMIN_PEER_PROPAGATE"); break;
+    case ADMIN_STATS:           elements.push_back("ADMIN_STATS"); break;
     case AUTH_ACCT_LOGIN:       elements.push_back("AUTH_ACCT_LOGIN"); break;
     case AUTH_CHANGE_PASSWORD:  elements.push_back("AUTH_CHANGE_PASSWORD"); break;
     case AUTH_KI_VALIDATE:      elements.push_back("AUTH_KI_VALIDATE"); break;
@@ -339,6 +342,13 @@ NetworkMessage* BackendMessage::make_if_enough(const uint8_t *buf, size_t len, i
     return new Hello_BackendMessage(buf, *want_len, become_owner);
   case ADMIN_KILL_CLIENT|FROM_SERVER:
     return new KillClient_BackendMessage(buf, *want_len, become_owner);
+  case ADMIN_PEER_ENTITY:
+    return new AdminPeerEntity_BackendMessage(buf, *want_len, become_owner);
+  case ADMIN_PEER_PROPAGATE:
+    return new AdminPeerPropagate_BackendMessage(buf, *want_len, become_owner);
+  case ADMIN_STATS:
+  case ADMIN_STATS|FROM_SERVER:
+    return new AdminStats_BackendMessage(buf, *want_len, msg_type, become_owner);
   case AUTH_ACCT_LOGIN:
     return new AuthAcctLogin_ToBackendMessage(buf, *want_len, become_owner);
   case AUTH_ACCT_LOGIN|FROM_SERVER:
@@ -365,6 +375,8 @@ NetworkMessage* BackendMessage::make_if_enough(const uint8_t *buf, size_t len, i
     return new VaultPassthrough_BackendMessage(buf, *want_len, false, become_owner);
   case TRACK_PING:
     return new TrackPing_BackendMessage(buf, *want_len, become_owner);
+  case TRACK_STATUS:
+    return new TrackStatus_BackendMessage(buf, *want_len, become_owner);
   case TRACK_DISPATCHER_HELLO:
     return new TrackDispatcherHello_BackendMessage(buf, *want_len, become_owner);
   case TRACK_DISPATCHER_BYE:
@@ -644,6 +656,195 @@ uint32_t KillClient_BackendMessage::
   END_FILL_TYPE;
 }
 
+AdminPeerEntity_BackendMessage::
+  AdminPeerEntity_BackendMessage(uint32_t id1, uint32_t id2,
+         uint32_t entity_type, uint32_t fields,
+         const uint8_t *uuid, kinum_t kinum,
+         const UruString *name, in_addr_t ipaddr,
+         uint32_t server_id, uint32_t players)
+    : BackendMessage(ADMIN_PEER_ENTITY), m_entity_type(htole32(entity_type)),
+      m_fields(htole32(fields)), m_kinum(htole32(kinum)),
+      m_ipaddr(htole32(ipaddr)), m_id(htole32(server_id)),
+      m_players(htole32(players)), m_name(NULL)
+{
+  if (uuid) {
+    memcpy(m_uuid, uuid, UUID_RAW_LEN);
+  }
+  else {
+    memset(m_uuid, 0, UUID_RAW_LEN);
+  }
+  if (name) {
+    m_name = new UruString(*name, true);
+  }
+  else {
+    m_name = new UruString("");
+  }
+  setup_header(id1, id2,
+         24+UUID_RAW_LEN+m_name->send_len(true, true, true));
+}
+
+AdminPeerEntity_BackendMessage::
+  AdminPeerEntity_BackendMessage(const uint8_t *inbuf, size_t in_len,
+         bool become_owner)
+    : BackendMessage(ADMIN_PEER_ENTITY, inbuf, in_len), m_entity_type(0),
+      m_fields(0), m_kinum(0), m_ipaddr(0), m_id(0), m_players(0),
+      m_name(NULL)
+{
+  uint32_t read_at = 16;
+  m_entity_type = read32le(inbuf, read_at);
+  read_at += 4;
+  m_fields = read32le(inbuf, read_at);
+  read_at += 4;
+  memcpy(m_uuid, inbuf+read_at, UUID_RAW_LEN);
+  read_at += UUID_RAW_LEN;
+  m_kinum = read32le(inbuf, read_at);
+  read_at += 4;
+  m_ipaddr = read32le(inbuf, read_at);
+  read_at += 4;
+  m_id = read32le(inbuf, read_at);
+  read_at += 4;
+  m_players = read32le(inbuf, read_at);
+  read_at += 4;
+  m_name = new UruString(inbuf+read_at, in_len-read_at, true, true, true);
+  if (become_owner) {
+    delete[] inbuf;
+  }
+#ifdef DEBUG_ENABLE
+  m_unsafe = false;
+#endif
+}
+
+uint32_t AdminPeerEntity_BackendMessage::
+  fill_type(bool iovs, uint32_t start_at, bool *msg_done,
+      struct iovec *iov, uint32_t iov_ct, uint8_t *buffer, size_t buflen) {
+  START_FILL_TYPE;
+  WRITE_4_BYTES(m_entity_type, false);
+  WRITE_4_BYTES(m_fields, false);
+  WRITE_BUFFER(m_uuid, UUID_RAW_LEN, false);
+  WRITE_4_BYTES(m_kinum, false);
+  WRITE_4_BYTES(m_ipaddr, false);
+  WRITE_4_BYTES(m_id, false);
+  WRITE_4_BYTES(m_players, false);
+  WRITE_URU_STRING_PTR(m_name, true, true, true, false, true);
+  END_FILL_TYPE;
+}
+
+AdminPeerPropagate_BackendMessage::
+  AdminPeerPropagate_BackendMessage(uint32_t id1, uint32_t id2,
+            change_t change, uint32_t nodeid,
+            uint32_t child, uint32_t ownerid,
+            const uint8_t *transuuid, bool check_age)
+    : BackendMessage(ADMIN_PEER_PROPAGATE), m_change(htole32(change)),
+      m_nodeid(htole32(nodeid)), m_child(htole32(child)),
+      m_ownerid(htole32(ownerid)), m_flags(0)
+{
+  uint32_t flags = (check_age ? CHECK_AGE : 0);
+  if (transuuid) {
+    memcpy(m_transuuid, transuuid, UUID_RAW_LEN);
+    flags |= HAS_UUID;
+  }
+  else {
+    memset(m_transuuid, 0, UUID_RAW_LEN);
+  }
+  m_flags = htole32(flags);
+  setup_header(id1, id2, 20+UUID_RAW_LEN);
+}
+
+AdminPeerPropagate_BackendMessage::
+  AdminPeerPropagate_BackendMessage(const uint8_t *inbuf, size_t in_len,
+            bool become_owner)
+    : BackendMessage(ADMIN_PEER_PROPAGATE, inbuf, in_len), m_change(0),
+      m_nodeid(0), m_child(0), m_ownerid(0), m_flags(0)
+{
+  m_change = read32le(inbuf, 16);
+  m_nodeid = read32le(inbuf, 20);
+  m_child = read32le(inbuf, 24);
+  m_ownerid = read32le(inbuf, 28);
+  m_flags = read32le(inbuf, 32);
+  memcpy(m_transuuid, inbuf+36, UUID_RAW_LEN);
+  if (become_owner) {
+    delete[] inbuf;
+  }
+#ifdef DEBUG_ENABLE
+  m_unsafe = false;
+#endif
+}
+
+uint32_t AdminPeerPropagate_BackendMessage::
+  fill_type(bool iovs, uint32_t start_at, bool *msg_done,
+      struct iovec *iov, uint32_t iov_ct, uint8_t *buffer, size_t buflen) {
+  START_FILL_TYPE;
+  WRITE_4_BYTES(m_change, false);
+  WRITE_4_BYTES(m_nodeid, false);
+  WRITE_4_BYTES(m_child, false);
+  WRITE_4_BYTES(m_ownerid, false);
+  WRITE_4_BYTES(m_flags, false);
+  WRITE_BUFFER(m_transuuid, UUID_RAW_LEN, true);
+  END_FILL_TYPE;
+}
+
+AdminStats_BackendMessage::
+  AdminStats_BackendMessage(uint32_t id1, uint32_t id2, bool reset)
+    : BackendMessage(ADMIN_STATS), m_flags(htole32(reset ? RESET : 0)),
+      m_data_off(0), m_datalen(0)
+{
+  setup_header(id1, id2, 8);
+}
+
+AdminStats_BackendMessage::
+  AdminStats_BackendMessage(uint32_t id1, uint32_t id2,
+          const std::string &report)
+    : BackendMessage(ADMIN_STATS|FROM_SERVER), m_flags(0), m_data_off(0),
+      m_datalen(htole32(report.size()))
+{
+  m_buf = new uint8_t[report.size()+1];
+  memcpy(m_buf, report.c_str(), report.size()+1);
+  setup_header(id1, id2, 8+report.size());
+}
+
+AdminStats_BackendMessage::
+  AdminStats_BackendMessage(const uint8_t *inbuf, size_t in_len,
+          int32_t msg_type, bool become_owner)
+    : BackendMessage(msg_type, inbuf, in_len), m_flags(0), m_data_off(0),
+      m_datalen(0)
+{
+  size_t len = 0;
+  if (in_len >= 24) {
+    m_flags = read32le(inbuf, 16);
+    len = le32toh(read32le(inbuf, 20));
+    if (len > in_len-24) {
+      // a short message; keep only what arrived
+      len = in_len-24;
+    }
+  }
+  else if (in_len >= 20) {
+    m_flags = read32le(inbuf, 16);
+  }
+  m_datalen = htole32(len);
+  // the report is not null-terminated on the wire, so always copy it
+  m_buf = new uint8_t[len+1];
+  memcpy(m_buf, inbuf+24, len);
+  m_buf[len] = '\0';
+  if (become_owner) {
+    delete[] inbuf;
+  }
+#ifdef DEBUG_ENABLE
+  m_unsafe = false;
+#endif
+}
+
+uint32_t AdminStats_BackendMessage::
+  fill_type(bool iovs, uint32_t start_at, bool *msg_done,
+      struct iovec *iov, uint32_t iov_ct, uint8_t *buffer, size_t buflen) {
+  START_FILL_TYPE;
+  WRITE_4_BYTES(m_flags, false);
+  WRITE_4_BYTES(m_datalen, (report_len() == 0));
+  if (report_len() > 0) {
+    WRITE_BUFFER((m_buf+m_data_off), report_len(), true);
+  }
+  END_FILL_TYPE;
+}
+
 const char *AuthAcctLogin_ToBackendMessage::authtype_t_str(authtype_t t) {
   switch (t) {
     case PLAIN_HASH:         return "PLAIN_HASH";
@@ -1288,6 +1489,26 @@ uint32_t VaultPassthrough_BackendMessage::
   END_FILL_TYPE;
 }
 
+Relay_BackendMessage::
+  Relay_BackendMessage(const uint8_t *inbuf, size_t in_len)
+    : BackendMessage(read32(inbuf, 4), inbuf, in_len)
+{
+  m_buflen = in_len-16;
+  m_buf = new uint8_t[m_buflen];
+  memcpy(m_buf, inbuf+16, m_buflen);
+#ifdef DEBUG_ENABLE
+  m_unsafe = false;
+#endif
+}
+
+uint32_t Relay_BackendMessage::
+  fill_type(bool iovs, uint32_t start_at, bool *msg_done,
+      struct iovec *iov, uint32_t iov_ct, uint8_t *buffer, size_t buflen) {
+  START_FILL_TYPE;
+  WRITE_BUFFER(m_buf, m_buflen, true);
+  END_FILL_TYPE;
+}
+
 VaultFetchRefs_ToBackendMessage::
   VaultFetchRefs_ToBackendMessage(const uint8_t *inbuf,
           size_t in_len, bool become_owner)
@@ -1852,6 +2073,47 @@ TrackPing_BackendMessage::
 #endif
 }
 
+TrackStatus_BackendMessage::
+  TrackStatus_BackendMessage(uint32_t id1, uint32_t id2,
+           uint32_t games, uint32_t players, uint32_t clients,
+           uint32_t cpu_percent, uint32_t lag_ms)
+    : BackendMessage(TRACK_STATUS), m_games(htole32(games)),
+      m_players(htole32(players)), m_clients(htole32(clients)),
+      m_cpu(htole32(cpu_percent)), m_lag(htole32(lag_ms))
+{
+  setup_header(id1, id2, 20);
+}
+
+TrackStatus_BackendMessage::
+  TrackStatus_BackendMessage(const uint8_t *inbuf, size_t in_len,
+           bool become_owner)
+    : BackendMessage(TRACK_STATUS, inbuf, in_len)
+{
+  m_games = read32le(inbuf, 16);
+  m_players = read32le(inbuf, 20);
+  m_clients = read32le(inbuf, 24);
+  m_cpu = read32le(inbuf, 28);
+  m_lag = read32le(inbuf, 32);
+  if (become_owner) {
+    delete[] inbuf;
+  }
+#ifdef DEBUG_ENABLE
+  // message should not be queued m_unsafe = false;
+#endif
+}
+
+uint32_t TrackStatus_BackendMessage::
+  fill_type(bool iovs, uint32_t start_at, bool *msg_done,
+      struct iovec *iov, uint32_t iov_ct, uint8_t *buffer, size_t buflen) {
+  START_FILL_TYPE;
+  WRITE_4_BYTES(m_games, false);
+  WRITE_4_BYTES(m_players, false);
+  WRITE_4_BYTES(m_clients, false);
+  WRITE_4_BYTES(m_cpu, false);
+  WRITE_4_BYTES(m_lag, true);
+  END_FILL_TYPE;
+}
+
 TrackDispatcherHello_BackendMessage::
   TrackDispatcherHello_BackendMessage(const uint8_t *inbuf, size_t in_len,
               bool become_owner)
@@ -225,6 +225,156 @@ protected:
       uint8_t *buffer, size_t buflen);
 };
 
+// the Peer messages only travel between backend services, when auth, vault
+// and tracking are run as separate processes; id1 and id2 are those of the
+// connection entity the message is about, not of the sender
+
+/*****************************************************************//**
+ * \class AdminPeerEntity_BackendMessage
+ */
+class AdminPeerEntity_BackendMessage : public BackendMessage {
+public:
+  // which of the fields are meaningful (the sender does not know the rest)
+  typedef enum {
+    ACCT_UUID = 0x01,   ///< auth: account UUID; game: age UUID
+    PLAYER = 0x02,      ///< auth: KI number and name
+    LOCATION = 0x04,    ///< auth: player's game server; game: its own ID
+    PLAYERS = 0x08,     ///< game: player count
+    IN_SHUTDOWN = 0x10, ///< game: server is shutting down
+    GONE = 0x80         ///< the entity no longer exists
+  } field_t;
+
+  // pre-send
+  AdminPeerEntity_BackendMessage(uint32_t id1, uint32_t id2,
+         uint32_t entity_type, uint32_t fields,
+         const uint8_t *uuid, kinum_t kinum,
+         const UruString *name, in_addr_t ipaddr,
+         uint32_t server_id, uint32_t players);
+
+  // post-receive
+  AdminPeerEntity_BackendMessage(const uint8_t *inbuf, size_t in_len,
+         bool become_owner=false);
+
+  virtual ~AdminPeerEntity_BackendMessage() {
+    if (m_name) delete m_name;
+  }
+
+  // accessors
+  uint32_t entity_type() const { return le32toh(m_entity_type); }
+  uint32_t fields() const { return le32toh(m_fields); }
+  const uint8_t * uuid() const { return m_uuid; }
+  kinum_t kinum() const { return (kinum_t)le32toh(m_kinum); }
+  UruString * name() const { return m_name; }
+  in_addr_t ipaddr() const { return le32toh(m_ipaddr); }
+  uint32_t server_id() const { return le32toh(m_id); }
+  uint32_t players() const { return le32toh(m_players); }
+
+protected:
+  uint32_t m_entity_type; // little-endian
+  uint32_t m_fields; // little-endian
+  uint8_t m_uuid[UUID_RAW_LEN];
+  uint32_t m_kinum; // little-endian
+  in_addr_t m_ipaddr; // little-endian
+  uint32_t m_id; // little-endian
+  uint32_t m_players; // little-endian
+  UruString *m_name;
+
+  uint32_t fill_type(bool iovs, uint32_t start_at, bool *msg_done,
+      struct iovec *iov, uint32_t iov_ct,
+      uint8_t *buffer, size_t buflen);
+};
+
+// sent to the vault service by a service that changed a node outside the
+// vault (e.g. auth setting a player offline) so the vault can tell the
+// interested clients
+
+/*****************************************************************//**
+ * \class AdminPeerPropagate_BackendMessage
+ */
+class AdminPeerPropagate_BackendMessage : public BackendMessage {
+public:
+  typedef enum {
+    CHANGED = 0,
+    ADDED = 1,
+    REMOVED = 2
+  } change_t;
+
+  // pre-send
+  // if transuuid is NULL the vault generates one
+  AdminPeerPropagate_BackendMessage(uint32_t id1, uint32_t id2,
+            change_t change, uint32_t nodeid,
+            uint32_t child, uint32_t ownerid,
+            const uint8_t *transuuid, bool check_age);
+
+  // post-receive
+  AdminPeerPropagate_BackendMessage(const uint8_t *inbuf, size_t in_len,
+            bool become_owner=false);
+
+  // accessors
+  change_t change() const { return (change_t)le32toh(m_change); }
+  uint32_t nodeid() const { return le32toh(m_nodeid); }
+  uint32_t child() const { return le32toh(m_child); }
+  uint32_t ownerid() const { return le32toh(m_ownerid); }
+  bool check_age() const { return (le32toh(m_flags) & CHECK_AGE) != 0; }
+  const uint8_t * transuuid() const {
+    return (le32toh(m_flags) & HAS_UUID) ? m_transuuid : NULL;
+  }
+
+protected:
+  enum {
+    CHECK_AGE = 0x01,
+    HAS_UUID = 0x02
+  };
+  uint32_t m_change; // little-endian
+  uint32_t m_nodeid; // little-endian
+  uint32_t m_child; // little-endian
+  uint32_t m_ownerid; // little-endian
+  uint32_t m_flags; // little-endian
+  uint8_t m_transuuid[UUID_RAW_LEN];
+
+  uint32_t fill_type(bool iovs, uint32_t start_at, bool *msg_done,
+      struct iovec *iov, uint32_t iov_ct,
+      uint8_t *buffer, size_t buflen);
+};
+
+/*****************************************************************//**
+ * \class AdminStats_BackendMessage
+ *
+ * The request has no report; the reply (FROM_SERVER) carries the
+ * backend's statistics as text, one line per message type or transactor.
+ */
+class AdminStats_BackendMessage : public BackendMessage {
+public:
+  // pre-send (request)
+  AdminStats_BackendMessage(uint32_t id1, uint32_t id2, bool reset);
+  // pre-send (reply); this constructor copies the report
+  AdminStats_BackendMessage(uint32_t id1, uint32_t id2,
+          const std::string &report);
+
+  // post-receive
+  AdminStats_BackendMessage(const uint8_t *inbuf, size_t in_len,
+          int32_t msg_type, bool become_owner=false);
+
+  virtual ~AdminStats_BackendMessage() { if (m_buf) delete[] m_buf; }
+
+  // accessors
+  bool reset() const { return (le32toh(m_flags) & RESET) != 0; }
+  const char *report() const { return (const char *)(m_buf+m_data_off); }
+  uint32_t report_len() const { return le32toh(m_datalen); }
+
+protected:
+  enum {
+    RESET = 0x01
+  };
+  uint32_t m_flags; // little-endian
+  uint32_t m_data_off;
+  uint32_t m_datalen; // little-endian
+
+  uint32_t fill_type(bool iovs, uint32_t start_at, bool *msg_done,
+      struct iovec *iov, uint32_t iov_ct,
+      uint8_t *buffer, size_t buflen);
+};
+
 
 /*****************************************************************//**
  * \class AuthAcctLogin_ToBackendMessage
@@ -679,6 +829,27 @@ protected:
 };
 
 
+/*****************************************************************//**
+ * \class Relay_BackendMessage
+ *
+ * A received message of any type, kept whole so that, unlike other received
+ * messages, it can be queued again as it is. Backend services use it for
+ * what a peer service sends back for one of their frontends.
+ */
+class Relay_BackendMessage : public BackendMessage {
+public:
+  // post-receive; the data is always copied
+  Relay_BackendMessage(const uint8_t *inbuf, size_t in_len);
+
+  virtual ~Relay_BackendMessage() { if (m_buf) delete[] m_buf; }
+
+protected:
+  virtual uint32_t fill_type(bool iovs, uint32_t start_at, bool *msg_done,
+        struct iovec *iov, uint32_t iov_ct,
+        uint8_t *buffer, size_t buflen);
+};
+
+
 /*****************************************************************//**
  * \class VaultFetchRefs_ToBackendMessage
  */
@@ -1063,6 +1234,47 @@ public:
          bool become_owner=false);
 };
 
+/*****************************************************************//**
+ * \class TrackStatus_BackendMessage
+ *
+ * A dispatcher's periodic load report. It also serves as a TRACK_PING.
+ */
+class TrackStatus_BackendMessage : public BackendMessage {
+public:
+  // pre-send
+  TrackStatus_BackendMessage(uint32_t id1, uint32_t id2,
+           uint32_t games, uint32_t players, uint32_t clients,
+           uint32_t cpu_percent, uint32_t lag_ms);
+
+  // post-receive
+  TrackStatus_BackendMessage(const uint8_t *inbuf, size_t in_len,
+           bool become_owner=false);
+
+  // accessors
+  // game servers running
+  uint32_t games() const { return le32toh(m_games); }
+  // players in them
+  uint32_t players() const { return le32toh(m_players); }
+  // auth and file clients
+  uint32_t clients() const { return le32toh(m_clients); }
+  // CPU used since the last report, percent of one CPU
+  uint32_t cpu_percent() const { return le32toh(m_cpu); }
+  // the worst game server's average lateness handling timers (ms)
+  uint32_t lag_ms() const { return le32toh(m_lag); }
+
+protected:
+  // all little-endian
+  uint32_t m_games;
+  uint32_t m_players;
+  uint32_t m_clients;
+  uint32_t m_cpu;
+  uint32_t m_lag;
+
+  virtual uint32_t fill_type(bool iovs, uint32_t start_at, bool *msg_done,
+        struct iovec *iov, uint32_t iov_ct,
+        uint8_t *buffer, size_t buflen);
+};
+
 // obsolete
 
 /*****************************************************************//**
@@ -0,0 +1,421 @@
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
+#include <iconv.h>
+
+#include <sys/time.h>
+
+#include <netinet/in.h>
+
+#include <stdexcept>
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+#include <fstream>
+
+#ifdef HAVE_OPENSSL_RC4
+#include <openssl/rc4.h>
+#else
+#include "rc4.h"
+#endif
+
+#include "machine_arch.h"
+#include "exceptions.h"
+#include "typecodes.h"
+#include "constants.h"
+#include "protocol.h"
+#include "msg_typecodes.h"
+#include "backend_typecodes.h"
+#include "util.h"
+#include "UruString.h"
+#include "PlKey.h"
+#include "Buffer.h"
+
+#include "Logger.h"
+#include "SDL.h"
+#include "NetworkMessage.h"
+#include "BackendMessage.h"
+#include "GameMessage.h"
+#include "MessageQueue.h"
+
+#include "moss_serv.h"
+#include "GameState.h"
+#include "AgeCheckpoint.h"
+#include "AgeStateFile.h"
+#include "GameServer.h"
+#include "GameHost.h"
+
+#ifndef FORK_GAME_TOO
+
+GameHost::GameHost(const char *server_dir, struct sockaddr_in &vault_address, in_addr_t connect_ipaddr,
+    in_port_t connect_ipport) :
+      Server(server_dir, true), m_vault_addr(vault_address), m_vault(NULL), m_conns_changed(false), m_load(0),
+      m_new_count(0), m_closed(false), m_fake_signal(0) {
+  m_ipaddr = connect_ipaddr;
+  m_ipport = connect_ipport;
+  if (pthread_mutex_init(&m_new_mutex, NULL)) {
+    throw std::bad_alloc();
+  }
+  set_signal_data(&m_fake_signal, 1, &m_signal_processor);
+}
+
+GameHost::~GameHost() {
+  // the game servers' connections are theirs to delete (the game servers
+  // are deleted by the ThreadManager); ~Server only deletes m_vault
+  m_conns.clear();
+  if (m_vault) {
+    m_conns.push_back(m_vault);
+  }
+  pthread_mutex_destroy(&m_new_mutex);
+}
+
+int32_t GameHost::init() {
+  m_vault = connect_to_backend(&m_vault_addr);
+  if (!m_vault) {
+    // error was already logged
+    return -1;
+  }
+  m_conns.push_back(m_vault);
+  if (!m_vault->in_connect()) {
+    conn_completed(m_vault);
+  }
+  start_servers();
+  return 0;
+}
+
+bool GameHost::shutdown(reason_t reason) {
+  log_info(m_log, "Shutdown started, reason %s\n", reason_c_str(reason));
+  // anything not started yet is just given back
+  pthread_mutex_lock(&m_new_mutex);
+  std::list<GameServer*> never_started;
+  never_started.swap(m_new_servers);
+  m_new_count = 0;
+  // and add_server() refuses anything more
+  m_closed = true;
+  pthread_mutex_unlock(&m_new_mutex);
+  std::list<GameServer*>::iterator n_iter;
+  for (n_iter = never_started.begin(); n_iter != never_started.end(); n_iter++) {
+    (*n_iter)->signal_parent();
+  }
+  m_retiring.clear();
+  while (!m_servers.empty()) {
+    finish(m_servers.begin()->second, reason);
+  }
+  rebuild_conns();
+  return false;
+}
+
+bool GameHost::add_server(GameServer *server) {
+  pthread_mutex_lock(&m_new_mutex);
+  bool added = !m_closed;
+  if (added) {
+    m_new_servers.push_back(server);
+    m_new_count++;
+    m_fake_signal = 1;
+  }
+  pthread_mutex_unlock(&m_new_mutex);
+  return added;
+}
+
+uint32_t GameHost::load() {
+  pthread_mutex_lock(&m_new_mutex);
+  uint32_t load = m_load + m_new_count;
+  pthread_mutex_unlock(&m_new_mutex);
+  return load;
+}
+
+bool GameHost::accepting() {
+  pthread_mutex_lock(&m_new_mutex);
+  bool accepting = !m_closed;
+  pthread_mutex_unlock(&m_new_mutex);
+  return accepting;
+}
+
+void GameHost::start_servers() {
+  if (!m_vault) {
+    // not up yet; init() will do it
+    return;
+  }
+  pthread_mutex_lock(&m_new_mutex);
+  std::list<GameServer*> starting;
+  starting.swap(m_new_servers);
+  pthread_mutex_unlock(&m_new_mutex);
+
+  // they stay in m_new_count until they are in m_load, so the load does
+  // not dip meanwhile
+  uint32_t started = 0;
+
+  std::list<GameServer*>::iterator iter;
+  for (iter = starting.begin(); iter != starting.end(); iter++) {
+    GameServer *server = *iter;
+    server->set_host(this);
+    int32_t ret;
+    log_info(server->log(), "%s startup in %s %08x\n", server->type_name(), type_name(), m_id);
+    try {
+      ret = server->init();
+    } catch (const std::bad_alloc&) {
+      log_err(server->log(), "Cannot allocate memory in init(), shutting down\n");
+      ret = -1;
+    }
+    if (ret) {
+      log_warn(m_log, "Game server %08x failed to start\n", server->m_id);
+      server->signal_parent();
+    } else {
+      m_servers[server->m_id] = server;
+      started++;
+    }
+  }
+  pthread_mutex_lock(&m_new_mutex);
+  m_new_count -= MIN(m_new_count, (uint32_t) starting.size());
+  m_load += started;
+  pthread_mutex_unlock(&m_new_mutex);
+  m_conns_changed = true;
+}
+
+Server::reason_t GameHost::GameHostSignalProcessor::signalled(int32_t *todo, Server *s) {
+  GameHost *host = (GameHost*) s;
+  // clear the flag before looking, so a wake() while looking is not lost
+  todo[0] = 0;
+  host->start_servers();
+  std::map<uint32_t, GameServer*>::iterator iter;
+  for (iter = host->m_servers.begin(); iter != host->m_servers.end(); iter++) {
+    GameServer *server = iter->second;
+    if (server->m_fake_signal) {
+      server->get_queued_connections();
+    }
+  }
+  host->m_conns_changed = true;
+  return NO_SHUTDOWN;
+}
+
+GameServer* GameHost::owner(Connection *conn) const {
+  std::map<Connection*, GameServer*>::const_iterator iter = m_owners.find(conn);
+  if (iter == m_owners.end()) {
+    return NULL;
+  }
+  return iter->second;
+}
+
+void GameHost::forget_conn(GameServer *server) {
+  // drop whatever the game server took out of its own list (and deleted),
+  // the way its own select loop would see it
+  std::list<Connection*> &theirs = server->get_conn_list();
+  std::set<Connection*> still(theirs.begin(), theirs.end());
+  std::list<Connection*>::iterator iter;
+  for (iter = m_conns.begin(); iter != m_conns.end();) {
+    Connection *conn = *iter;
+    std::map<Connection*, GameServer*>::iterator o_iter = m_owners.find(conn);
+    if (o_iter != m_owners.end() && o_iter->second == server && still.find(conn) == still.end()) {
+      m_owners.erase(o_iter);
+      iter = m_conns.erase(iter);
+    } else {
+      iter++;
+    }
+  }
+}
+
+void GameHost::retire(GameServer *server, reason_t why) {
+  std::list<std::pair<GameServer*, reason_t> >::iterator iter;
+  for (iter = m_retiring.begin(); iter != m_retiring.end(); iter++) {
+    if (iter->first == server) {
+      return;
+    }
+  }
+  m_retiring.push_back(std::pair<GameServer*, reason_t>(server, why));
+}
+
+void GameHost::finish(GameServer *server, reason_t why) {
+  log_info(server->log(), "Server shutdown for reason: %s\n", reason_c_str(why));
+  // this deletes all the game server's connections and sends the final
+  // TRACK_GAME_BYE on the shared backend connection
+  server->shutdown(why);
+  m_servers.erase(server->m_id);
+  m_conns_changed = true;
+  // the ThreadManager deletes it
+  server->signal_parent();
+}
+
+void GameHost::rebuild_conns() {
+  m_conns.clear();
+  m_owners.clear();
+  if (m_vault) {
+    m_conns.push_back(m_vault);
+  }
+  uint32_t load = 0;
+  std::map<uint32_t, GameServer*>::iterator s_iter;
+  for (s_iter = m_servers.begin(); s_iter != m_servers.end(); s_iter++) {
+    GameServer *server = s_iter->second;
+    std::list<Connection*> &theirs = server->get_conn_list();
+    std::list<Connection*>::iterator c_iter;
+    for (c_iter = theirs.begin(); c_iter != theirs.end(); c_iter++) {
+      m_conns.push_back(*c_iter);
+      m_owners[*c_iter] = server;
+    }
+    load += 1 + server->m_players.size();
+  }
+  pthread_mutex_lock(&m_new_mutex);
+  m_load = load;
+  pthread_mutex_unlock(&m_new_mutex);
+  m_conns_changed = false;
+}
+
+bool GameHost::loop_pass() {
+  while (!m_retiring.empty()) {
+    std::pair<GameServer*, reason_t> done = m_retiring.front();
+    m_retiring.pop_front();
+    finish(done.first, done.second);
+  }
+  if (m_conns_changed) {
+    rebuild_conns();
+  }
+  bool more = false;
+  std::map<uint32_t, GameServer*>::iterator iter;
+  for (iter = m_servers.begin(); iter != m_servers.end(); iter++) {
+    if (iter->second->loop_pass()) {
+      more = true;
+    }
+  }
+  return more;
+}
+
+Server::reason_t GameHost::message_read(Connection *conn, NetworkMessage *msg) {
+  if (conn != m_vault) {
+    GameServer *server = owner(conn);
+    if (!server) {
+      log_err(m_log, "Message on %d, which belongs to no game server\n", conn->fd());
+      delete msg;
+      return INTERNAL_ERROR;
+    }
+    // a shutdown reason here only closes conn, via conn_shutdown(), or
+    // means the game server let go of it (FORGET_THIS_CONNECTION)
+    reason_t result = server->message_read(conn, msg);
+    forget_conn(server);
+    return result;
+  }
+
+  BackendMessage *in = (BackendMessage*) msg;
+  if (in->type() == -1) {
+    log_err(m_log, "Unrecognized backend message received on connection %d!\n", conn->fd());
+    if (m_log) {
+      m_log->dump_contents(Logger::LOG_ERR, in->buffer(), in->message_len());
+    }
+    delete in;
+    return NO_SHUTDOWN;
+  }
+  std::map<uint32_t, GameServer*>::iterator found = m_servers.find(in->get_id2());
+  if (found == m_servers.end()) {
+    log_debug(m_log, "Dropping backend message type 0x%08x for game server %08x, which is gone\n", in->type(),
+        in->get_id2());
+    delete in;
+    return NO_SHUTDOWN;
+  }
+  reason_t result = found->second->message_read(conn, msg);
+  if (result != NO_SHUTDOWN) {
+    // e.g. TRACK_GAME_BYE; the connection stays up for the others
+    retire(found->second, result);
+  }
+  return NO_SHUTDOWN;
+}
+
+void GameHost::conn_completed(Connection *conn) {
+  conn->set_in_connect(false);
+  if (conn == m_vault) {
+    conn->m_interval = BACKEND_KEEPALIVE_INTERVAL;
+    gettimeofday(&conn->m_timeout, NULL);
+    conn->m_timeout.tv_sec += conn->m_interval;
+    // each game server says hello for itself
+    std::map<uint32_t, GameServer*>::iterator iter;
+    for (iter = m_servers.begin(); iter != m_servers.end(); iter++) {
+      iter->second->conn_completed(conn);
+    }
+  } else {
+    log_warn(m_log, "Unknown outgoing connection (fd %d) completed!\n", conn->fd());
+    conn->set_in_shutdown(true);
+  }
+}
+
+Server::reason_t GameHost::conn_timeout(Connection *conn, reason_t why) {
+  if (conn == m_vault) {
+    // one keepalive does for everyone
+    TrackPing_BackendMessage *msg = new TrackPing_BackendMessage(m_ipaddr, m_id);
+    m_vault->enqueue(msg);
+    m_vault->m_timeout.tv_sec += m_vault->m_interval;
+    return NO_SHUTDOWN;
+  }
+  GameServer *server = owner(conn);
+  if (!server) {
+    log_err(m_log, "Timeout on %d, which belongs to no game server\n", conn->fd());
+    conn->m_interval = 0;
+    return NO_SHUTDOWN;
+  }
+  reason_t result = server->conn_timeout(conn, why);
+  forget_conn(server);
+  if (result != NO_SHUTDOWN) {
+    retire(server, result);
+  }
+  return NO_SHUTDOWN;
+}
+
+Server::reason_t GameHost::conn_shutdown(Connection *conn, reason_t why) {
+  if (conn == m_vault) {
+    // everyone is cut off from the backend, so this is the end
+    log_err(m_log, "Lost shared backend connection: %s\n", reason_c_str(why));
+    if (why != SERVER_SHUTDOWN) {
+      m_vault->m_write_fill = 0;
+      m_vault->msg_queue()->reset_head();
+      m_vault->msg_queue()->clear_queue();
+    }
+    if (why == CLIENT_CLOSE || why == NO_SHUTDOWN) {
+      why = BACKEND_ERROR;
+    }
+    return why;
+  }
+  GameServer *server = owner(conn);
+  if (!server) {
+    log_err(m_log, "Shutdown of %d, which belongs to no game server\n", conn->fd());
+    m_conns.remove(conn);
+    delete conn;
+    return NO_SHUTDOWN;
+  }
+  reason_t result = server->conn_shutdown(conn, why);
+  forget_conn(server);
+  if (result != NO_SHUTDOWN) {
+    retire(server, result);
+  }
+  return NO_SHUTDOWN;
+}
+
+#endif /* !FORK_GAME_TOO */
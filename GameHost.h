@@ -0,0 +1,140 @@
+/* -*- c++ -*- */
+
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * A GameHost runs many game servers in one thread. Normally each game
+ * server has its own thread, select loop and connection to the backend,
+ * which is a lot for the many personal ages that hardly anyone is in.
+ * When the dispatcher is configured with game_host_threads, it starts that
+ * many GameHosts and gives each new game server to the least busy one.
+ *
+ * The GameHost is the Server the select loop sees. Its connection list
+ * has all the connections of its game servers, and it passes each event
+ * on to the game server owning the connection. There is one backend
+ * connection, shared by all the game servers; backend messages go to the
+ * game server whose ID is in the header. When a game server would shut
+ * down the select loop, only that game server is shut down.
+ */
+
+//#include <pthread.h>
+//
+//#include <netinet/in.h>
+//
+//#include <list>
+//#include <map>
+//#include <set>
+//
+//#include "moss_serv.h"
+//#include "GameServer.h"
+
+#ifndef _GAME_HOST_H_
+#define _GAME_HOST_H_
+
+#ifndef FORK_GAME_TOO
+
+class GameHost: public Server {
+public:
+  GameHost(const char *server_dir, struct sockaddr_in &vault_address, in_addr_t connect_ipaddr,
+      in_port_t connect_ipport);
+  virtual ~GameHost();
+
+  int32_t type() const {
+    return TYPE_GAME;
+  }
+  const char* type_name() const {
+    return "game host";
+  }
+
+  int32_t init();
+  bool shutdown(reason_t reason);
+
+  reason_t message_read(Connection *conn, NetworkMessage *msg);
+
+  void conn_completed(Connection *conn);
+
+  reason_t conn_timeout(Connection *conn, reason_t why);
+  reason_t conn_shutdown(Connection *conn, reason_t why);
+  // finishes with game servers that are done, then runs the game servers'
+  // loop_pass()
+  bool loop_pass();
+
+  // Called by the dispatcher to hand over a new game server (not yet
+  // initialized); the GameHost's thread starts it up. The dispatcher
+  // must wake up the thread afterwards. Returns false, and does not take
+  // the game server, if the GameHost has started shutting down.
+  bool add_server(GameServer *server);
+  // called by a game server when the dispatcher has queued a connection
+  // for it
+  void wake() {
+    m_fake_signal = 1;
+  }
+  // how busy the host is: the game servers it has (or is about to have)
+  // plus the players in them; called from the dispatcher's thread
+  uint32_t load();
+  // false once the host has started shutting down
+  bool accepting();
+
+  Connection* vault() const {
+    return m_vault;
+  }
+
+protected:
+  struct sockaddr_in m_vault_addr;
+  Connection *m_vault;
+
+  // the game servers running here, by ID (m_id, which is id2 in backend
+  // messages)
+  std::map<uint32_t, GameServer*> m_servers;
+  // the game server for each connection in m_conns except m_vault
+  std::map<Connection*, GameServer*> m_owners;
+  // m_conns must be made again from the game servers' lists
+  bool m_conns_changed;
+  // game servers that asked to shut down, done in loop_pass()
+  std::list<std::pair<GameServer*, reason_t> > m_retiring;
+
+  // game servers handed over by the dispatcher; m_new_mutex also guards
+  // m_load, m_new_count and m_closed, which the dispatcher reads
+  pthread_mutex_t m_new_mutex;
+  std::list<GameServer*> m_new_servers;
+  uint32_t m_load;
+  uint32_t m_new_count;
+  bool m_closed;
+
+  int32_t m_fake_signal;
+  class GameHostSignalProcessor: public SignalProcessor {
+  public:
+    reason_t signalled(int32_t *todo, Server *s);
+  };
+  GameHostSignalProcessor m_signal_processor;
+
+  // start up any new game servers
+  void start_servers();
+  GameServer* owner(Connection *conn) const;
+  // after the game server may have deleted connections
+  void forget_conn(GameServer *server);
+  void retire(GameServer *server, reason_t why);
+  // shut a game server down and let the dispatcher have it back
+  void finish(GameServer *server, reason_t why);
+  void rebuild_conns();
+};
+
+#endif /* !FORK_GAME_TOO */
+
+#endif /* _GAME_HOST_H_ */
@@ -32,7 +32,10 @@
 #include <sys/uio.h> /* for struct iovec */
 
 #include <stdexcept>
+#include <new>
+#include <deque>
 #include <list>
+#include <map>
 #include <vector>
 #include <string>
 
@@ -52,6 +55,7 @@
 #include "NetworkMessage.h"
 #include "BackendMessage.h"
 #include "GameMessage.h"
+#include "SDLCompressor.h"
 
 NetworkMessage* GameMessage::make_if_enough(const uint8_t *buf, size_t len, int32_t *want_len, bool become_owner) {
   NetworkMessage *in = NULL;
@@ -241,14 +245,121 @@ uint32_t SharedGameMessage::fill_buffer(uint8_t *buffer, size_t len, uint32_t st
 }
 
 void SharedGameMessage::make_own_copy() {
+  if (m_sbuf && !owns_buffer()) {
+    // the old Buffer does not own the data, so it stays put
+    const uint8_t *data = m_sbuf->buffer();
+    set_buffer(m_buflen);
+    memcpy(m_sbuf->buffer(), data, m_buflen);
+  }
+}
+
+void SharedGameMessage::set_buffer(size_t len, const uint8_t *data) {
+  free_buffer();
+  size_t block = sizeof(Buffer) + (data ? 0 : len);
+  uint8_t *mem = (uint8_t*) GameMessagePool::alloc(block);
+  // the Buffer never deletes pooled data
+  m_sbuf = new (mem) Buffer(len, data ? data : mem + sizeof(Buffer), false);
+  m_sbuf_block = block;
+}
+
+void SharedGameMessage::free_buffer() {
   if (m_sbuf) {
-    if (!m_sbuf->is_owned()) {
-      Buffer *oldbuf = m_sbuf;
-      m_sbuf = new Buffer(oldbuf->len());
-      memcpy(m_sbuf->buffer(), oldbuf->buffer(), oldbuf->len());
-      delete oldbuf;
+    if (m_sbuf_block) {
+      m_sbuf->~Buffer();
+      GameMessagePool::release(m_sbuf, m_sbuf_block);
+    } else {
+      delete m_sbuf;
+    }
+    m_sbuf = NULL;
+    m_sbuf_block = 0;
+  }
+}
+
+/*
+ * The pool's free lists, which are freed when the thread exits.
+ */
+typedef struct {
+  // one list for each size class, linked through the first word
+  void *head[GameMessagePool::size_classes];
+  size_t count[GameMessagePool::size_classes];
+} message_pool_t;
+
+static pthread_key_t message_pool_key;
+static pthread_once_t message_pool_key_once = PTHREAD_ONCE_INIT;
+
+static void free_message_pool(void *arg) {
+  message_pool_t *pool = (message_pool_t*) arg;
+  for (uint32_t i = 0; i < GameMessagePool::size_classes; i++) {
+    while (pool->head[i]) {
+      void *block = pool->head[i];
+      pool->head[i] = *(void**) block;
+      ::operator delete(block);
     }
   }
+  delete pool;
+}
+
+static void make_message_pool_key() {
+  pthread_key_create(&message_pool_key, free_message_pool);
+}
+
+static message_pool_t* thread_message_pool() {
+  pthread_once(&message_pool_key_once, make_message_pool_key);
+  message_pool_t *pool = (message_pool_t*) pthread_getspecific(message_pool_key);
+  if (!pool) {
+    pool = new message_pool_t;
+    memset(pool, 0, sizeof(message_pool_t));
+    pthread_setspecific(message_pool_key, pool);
+  }
+  return pool;
+}
+
+// the size class for a block, and the size of its blocks
+static uint32_t message_pool_class(size_t size, size_t *class_size) {
+  uint32_t i = 0;
+  size_t sz = GameMessagePool::min_size;
+  while (sz < size) {
+    sz <<= 1;
+    i++;
+  }
+  *class_size = sz;
+  return i;
+}
+
+void* GameMessagePool::alloc(size_t size) {
+  if (size > max_size) {
+    return ::operator new(size);
+  }
+  size_t class_size;
+  uint32_t i = message_pool_class(size, &class_size);
+  message_pool_t *pool = thread_message_pool();
+  void *block = pool->head[i];
+  if (block) {
+    pool->head[i] = *(void**) block;
+    pool->count[i]--;
+    return block;
+  }
+  return ::operator new(class_size);
+}
+
+void GameMessagePool::release(void *block, size_t size) {
+  if (!block) {
+    return;
+  }
+  if (size > max_size) {
+    ::operator delete(block);
+    return;
+  }
+  size_t class_size;
+  uint32_t i = message_pool_class(size, &class_size);
+  message_pool_t *pool = thread_message_pool();
+  if ((pool->count[i] + 1) * class_size > GAME_POOL_FREE_BYTES) {
+    ::operator delete(block);
+    return;
+  }
+  *(void**) block = pool->head[i];
+  pool->head[i] = block;
+  pool->count[i]++;
 }
 
 NetworkMessage* PropagateBufferMessage::make_if_enough(const uint8_t *buf, size_t len, int32_t *want_len, bool become_owner) {
@@ -379,7 +490,7 @@ PlNetMsgGroupOwner::PlNetMsgGroupOwner(bool is_owner) :
     PropagateBufferMessage() {
   // fixed-length message
   m_buflen = body_offset(HasTimeSent | IsSystemMessage) + 12;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
 
   uint8_t *buf = m_sbuf->buffer();
   uint32_t offset = format_header(plNetMsgGroupOwner, m_buflen, HasTimeSent | IsSystemMessage);
@@ -395,15 +506,19 @@ PlNetMsgGroupOwner::PlNetMsgGroupOwner(bool is_owner) :
   buf[35] = (is_owner ? 1 : 0);
 }
 
-PlNetMsgSDLState::PlNetMsgSDLState(SDLState *sdl, bool is_initial_sdl, bool use_timestamp) :
-    PropagateBufferMessage() {
+PlNetMsgSDLState::PlNetMsgSDLState(SDLState *sdl, bool is_initial_sdl, bool use_timestamp, bool compress_later) :
+    PropagateBufferMessage(), m_zip_at(0), m_ready(true) {
   uint32_t msg_flags = (use_timestamp ? HasTimeSent : 0);
   uint32_t offset = body_offset(msg_flags);
   m_buflen = offset + sdl->send_len() + 3;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
 
   uint8_t *buf = m_sbuf->buffer();
-  int32_t ret = sdl->write_msg(buf + offset, m_buflen - offset);
+  int32_t ret = sdl->write_msg(buf + offset, m_buflen - offset, compress_later);
+  if (ret >= 0 && compress_later && read32(buf, offset + sdl->key().send_len() + 5) > COMPRESS_THRESHOLD) {
+    m_zip_at = offset + sdl->key().send_len();
+    m_ready = false;
+  }
   if (ret < 0) {
     // XXX bug in sdl->send_len() -- serious problem
     // NOTE: sending this empty message crashes the client
@@ -425,11 +540,62 @@ PlNetMsgSDLState::PlNetMsgSDLState(SDLState *sdl, bool is_initial_sdl, bool use_
   }
 }
 
+void PlNetMsgSDLState::compress() {
+  if (m_zip_at) {
+    uint8_t *buf = m_sbuf->buffer();
+    uint32_t len2 = do_message_compression(buf + m_zip_at);
+    if (len2) {
+      // move the flags and "end thing" up to the new end
+      uint32_t offset = m_zip_at + 9 + len2;
+      memmove(buf + offset, buf + m_buflen - 3, 3);
+      m_buflen = offset + 3;
+      format_header(plNetMsgSDLState, m_buflen, read32(buf, 12));
+    }
+    m_zip_at = 0;
+  }
+  pthread_mutex_lock(&m_mutex);
+  m_ready = true;
+  pthread_mutex_unlock(&m_mutex);
+}
+
+void PlNetMsgSDLState::prepare(SDLState *sdl, SDLCompressor *compressor) {
+  if (sdl->cached_msg()) {
+    return;
+  }
+  PlNetMsgSDLState *msg = new PlNetMsgSDLState(sdl, true, true, true);
+  sdl->set_cached_msg(msg);
+  // the compressor gets the caller's reference
+  compressor->compress(msg);
+}
+
+bool PlNetMsgSDLState::ready(SDLState *sdl) {
+  PlNetMsgSDLState *msg = (PlNetMsgSDLState*) sdl->cached_msg();
+  if (!msg) {
+    return true;
+  }
+  pthread_mutex_lock(&msg->m_mutex);
+  bool ready = msg->m_ready;
+  pthread_mutex_unlock(&msg->m_mutex);
+  return ready;
+}
+
+PlNetMsgSDLState* PlNetMsgSDLState::initial(SDLState *sdl) {
+  PlNetMsgSDLState *msg = (PlNetMsgSDLState*) sdl->cached_msg();
+  if (!msg) {
+    msg = new PlNetMsgSDLState(sdl, true);
+    sdl->set_cached_msg(msg);
+  } else if (msg->add_ref() == 2) {
+    // no queue has it any more, so it is safe to change the timestamp
+    msg->set_timestamp();
+  }
+  return msg;
+}
+
 PlNetMsgInitialAgeStateSent::PlNetMsgInitialAgeStateSent(uint32_t howmany) :
     PropagateBufferMessage() {
   // fixed-length message
   m_buflen = body_offset(HasTimeSent) + 4;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
 
   uint8_t *buf = m_sbuf->buffer();
   uint32_t offset = format_header(plNetMsgInitialAgeStateSent, m_buflen, HasTimeSent | IsSystemMessage);
@@ -447,7 +613,7 @@ PlNetMsgMembersMsg::PlNetMsgMembersMsg(kinum_t requester_ki)
 {
   // fixed-length message
   m_buflen = body_offset(HasTimeSent|HasPlayerID|IsSystemMessage) + 2;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
 
   uint8_t *buf = m_sbuf->buffer();
   uint32_t offset = format_header(plNetMsgMembersList, m_buflen,
@@ -493,7 +659,7 @@ void PlNetMsgMembersMsg::finalize(bool list_or_update) {
   } else {
     m_buflen += 1; // for page flag
   }
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
 
   uint8_t *buf = m_sbuf->buffer();
   uint32_t offset = format_header(
@@ -575,7 +741,7 @@ void PlNetMsgGameMessage::build_msg(uint32_t prop_flags, kinum_t prop_ki, const
   for (uint32_t i = 0; i < subobject_count; i++) {
     m_buflen += 1 + subobjects[i]->send_len();
   }
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
 
   uint8_t *buf = m_sbuf->buffer();
   // now, write the uncompressed version of the message
@@ -645,7 +811,7 @@ PlNetMsgLoadClone::PlNetMsgLoadClone(const uint8_t *clonebuf, size_t clonelen,
                                       PlKey &obj_name, kinum_t kinum, bool is_load, uint32_t player) :
     PlNetMsgGameMessage() {
   m_buflen = body_offset(HasTimeSent | HasPlayerID) + clonelen + obj_name.send_len() + 3;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   uint8_t *buf = m_sbuf->buffer();
   uint32_t offset = format_header(plNetMsgLoadClone, m_buflen, HasTimeSent | HasPlayerID, kinum);
   set_timestamp();
@@ -666,7 +832,7 @@ PlNetMsgGameMessageDirected::PlNetMsgGameMessageDirected(TrackMsgForward_Backend
   m_msg->add_ref();
   // m_sbuf is backed by m_msg
   m_buflen = m_msg->fwd_msg_len();
-  m_sbuf = new Buffer(m_buflen, m_msg->fwd_msg(), false);
+  set_buffer(m_buflen, m_msg->fwd_msg());
   set_timestamp();
 }
 
@@ -752,7 +918,7 @@ void GameMgrMessage::clobber_msgtype(uint32_t newtype) {
 GameMgr_Setup_Reply::GameMgr_Setup_Reply(uint32_t gameid, uint32_t reqid, kinum_t clientid, const uint8_t *uuid) :
     GameMgrMessage(0, reqid, 0U) {
   m_buflen = header_len + 12 + UUID_RAW_LEN;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   uint8_t *buf = m_sbuf->buffer();
   uint32_t off = header_len;
   format_header(m_buflen - header_len);
@@ -769,14 +935,14 @@ GameMgr_Setup_Reply::GameMgr_Setup_Reply(uint32_t gameid, uint32_t reqid, kinum_
 GameMgr_Simple_Message::GameMgr_Simple_Message(uint32_t gameid, uint32_t mgr_type) :
     GameMgrMessage(mgr_type, 0, gameid) {
   m_buflen = header_len;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   format_header(0);
 }
 
 GameMgr_OneByte_Message::GameMgr_OneByte_Message(uint32_t gameid, uint32_t mgr_type, uint8_t data) :
     GameMgrMessage(mgr_type, 0, gameid) {
   m_buflen = header_len + 1;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   uint8_t *buf = m_sbuf->buffer();
   buf[header_len] = data;
   format_header(1);
@@ -785,7 +951,7 @@ GameMgr_OneByte_Message::GameMgr_OneByte_Message(uint32_t gameid, uint32_t mgr_t
 GameMgr_FourByte_Message::GameMgr_FourByte_Message(uint32_t gameid, uint32_t mgr_type, uint32_t data) :
     GameMgrMessage(mgr_type, 0, gameid) {
   m_buflen = header_len + 4;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   uint8_t *buf = m_sbuf->buffer();
   write32(buf, header_len, data);
   format_header(4);
@@ -801,7 +967,7 @@ GameMgr_VarSync_VarCreated_Message::GameMgr_VarSync_VarCreated_Message(uint32_t
   // in most cases (unless encryption is disabled) with a custom data
   // structure and fill_buffer()
   m_buflen = header_len + body_len;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   uint8_t *buf = m_sbuf->buffer();
   uint32_t off = header_len;
   format_header(body_len);
@@ -818,7 +984,7 @@ GameMgr_VarSync_VarCreated_Message::GameMgr_VarSync_VarCreated_Message(uint32_t
 GameMgr_Marker_GameCreated_Message::GameMgr_Marker_GameCreated_Message(uint32_t gameid, const uint8_t *uuid) :
     GameMgrMessage(Srv2Cli_Marker_TemplateCreated, 0, gameid) {
   m_buflen = header_len + 160/*:-P*/;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   uint8_t *buf = m_sbuf->buffer() + header_len;
   format_header(160);
   // this is kind of a silly set of hoops to jump through but I'm not in the
@@ -833,7 +999,7 @@ GameMgr_Marker_GameCreated_Message::GameMgr_Marker_GameCreated_Message(uint32_t
 GameMgr_Marker_GameNameChanged_Message::GameMgr_Marker_GameNameChanged_Message(uint32_t gameid, UruString *name) :
     GameMgrMessage(Srv2Cli_Marker_GameNameChanged, 0, gameid) {
   m_buflen = header_len + 512/*:-P*/;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   uint8_t *buf = m_sbuf->buffer() + header_len;
   format_header(512);
   uint32_t off = name->send_len(false, true, true);
@@ -848,7 +1014,7 @@ GameMgr_Marker_MarkerAdded_Message::GameMgr_Marker_MarkerAdded_Message(
     m_data(data), m_marker_name(*name, true), m_age_name(*age, true), m_backing_msg(orig_msg), m_zeros(NULL) {
   orig_msg->add_ref();
   m_buflen = header_len;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   format_header(28 + 512 + 160);
 }
 
@@ -1069,7 +1235,7 @@ uint32_t GameMgr_Marker_MarkerAdded_Message::fill_buffer(uint8_t *buffer, size_t
 GameMgr_Marker_MarkerCaptured_Message::GameMgr_Marker_MarkerCaptured_Message(uint32_t gameid, int32_t marker, char value) :
     GameMgrMessage(Srv2Cli_Marker_MarkerCaptured, 0, gameid) {
   m_buflen = header_len + 5;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   uint8_t *buf = m_sbuf->buffer();
   write32(buf, header_len, marker);
   buf[header_len + 4] = value;
@@ -1080,7 +1246,7 @@ GameMgr_Marker_MarkerNameChanged_Message::GameMgr_Marker_MarkerNameChanged_Messa
     UruString *name) :
     GameMgrMessage(Srv2Cli_Marker_MarkerNameChanged, 0, gameid) {
   m_buflen = header_len + 4 + 512/*:-P*/;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   uint8_t *buf = m_sbuf->buffer() + header_len;
   format_header(516);
   write32(buf, 0, marker);
@@ -1092,7 +1258,7 @@ GameMgr_Marker_MarkerNameChanged_Message::GameMgr_Marker_MarkerNameChanged_Messa
 GameMgr_BlueSpiral_ClothOrder_Message::GameMgr_BlueSpiral_ClothOrder_Message(uint32_t gameid, const uint8_t *order) :
     GameMgrMessage(Srv2Cli_BlueSpiral_ClothOrder, 0, gameid) {
   m_buflen = header_len + 7;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   uint8_t *buf = m_sbuf->buffer() + header_len;
   format_header(7);
   memcpy(buf, order, 7);
@@ -1101,7 +1267,7 @@ GameMgr_BlueSpiral_ClothOrder_Message::GameMgr_BlueSpiral_ClothOrder_Message(uin
 GameMgr_Heek_PlayGame_Message::GameMgr_Heek_PlayGame_Message(uint32_t gameid, bool playing, bool single, bool enable) :
     GameMgrMessage(Srv2Cli_Heek_PlayGame, 0, gameid) {
   m_buflen = header_len + 3;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   uint8_t *buf = m_sbuf->buffer() + header_len;
   format_header(3);
   buf[0] = playing ? 1 : 0;
@@ -1112,7 +1278,7 @@ GameMgr_Heek_PlayGame_Message::GameMgr_Heek_PlayGame_Message(uint32_t gameid, bo
 GameMgr_Heek_Welcome_Message::GameMgr_Heek_Welcome_Message(uint32_t gameid, int32_t score, uint32_t rank, UruString &name) :
     GameMgrMessage(Srv2Cli_Heek_Welcome, 0, gameid) {
   m_buflen = header_len + 8 + 512/*:-P*/;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   uint8_t *buf = m_sbuf->buffer() + header_len;
   format_header(8 + 512);
   write32(buf, 0, score);
@@ -1127,7 +1293,7 @@ GameMgr_Heek_PointUpdate_Message::GameMgr_Heek_PointUpdate_Message(uint32_t game
     uint32_t rank) :
     GameMgrMessage(Srv2Cli_Heek_PointUpdate, 0, gameid) {
   m_buflen = header_len + 9;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   uint8_t *buf = m_sbuf->buffer() + header_len;
   format_header(9);
   buf[0] = send_message ? 1 : 0;
@@ -1138,7 +1304,7 @@ GameMgr_Heek_PointUpdate_Message::GameMgr_Heek_PointUpdate_Message(uint32_t game
 GameMgr_Heek_WinLose_Message::GameMgr_Heek_WinLose_Message(uint32_t gameid, bool win, uint8_t choice) :
     GameMgrMessage(Srv2Cli_Heek_WinLose, 0, gameid) {
   m_buflen = header_len + 2;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   uint8_t *buf = m_sbuf->buffer() + header_len;
   format_header(2);
   buf[0] = win ? 1 : 0;
@@ -1148,7 +1314,7 @@ GameMgr_Heek_WinLose_Message::GameMgr_Heek_WinLose_Message(uint32_t gameid, bool
 GameMgr_Heek_Lights_Message::GameMgr_Heek_Lights_Message(uint32_t gameid, uint32_t light, GameMgr_Heek_Lights_Message::type_t type) :
     GameMgrMessage(Srv2Cli_Heek_LightState, 0, gameid) {
   m_buflen = header_len + 2;
-  m_sbuf = new Buffer(m_buflen);
+  set_buffer(m_buflen);
   uint8_t *buf = m_sbuf->buffer() + header_len;
   format_header(2);
   buf[0] = (uint8_t) light;
@@ -38,6 +38,9 @@
 #ifndef _GAME_MESSAGE_H_
 #define _GAME_MESSAGE_H_
 
+// forward declarations
+class SDLCompressor;
+
 class GameMessage: public NetworkMessage {
 public:
   // want_len should be filled in to the total length of the message, if
@@ -154,17 +157,39 @@ public:
 #endif
 };
 
+/*
+ * SharedGameMessages and their buffers come from per-thread free lists,
+ * one for each power-of-two size class up to max_size (bigger blocks use
+ * plain new). A block freed in another thread than the one that allocated
+ * it just goes on that thread's list. Each list keeps at most
+ * GAME_POOL_FREE_BYTES of free blocks; the rest are deleted.
+ */
+class GameMessagePool {
+public:
+  static void* alloc(size_t size);
+  static void release(void *block, size_t size);
+
+  static const size_t min_size = 64;
+  static const uint32_t size_classes = 8;
+  static const size_t max_size = min_size << (size_classes - 1);
+};
+
 class SharedGameMessage: public GameMessage {
 public:
   static NetworkMessage* make_if_enough(const uint8_t *buf, size_t len, int32_t *want_len, bool become_owner = false);
 
   virtual ~SharedGameMessage() {
-    if (m_sbuf) {
-      delete m_sbuf;
-    }
+    free_buffer();
     pthread_mutex_destroy(&m_mutex);
   }
 
+  static void* operator new(size_t size) {
+    return GameMessagePool::alloc(size);
+  }
+  static void operator delete(void *block, size_t size) {
+    GameMessagePool::release(block, size);
+  }
+
   virtual const uint8_t* buffer() const {
     return (m_sbuf ? m_sbuf->buffer() : NULL);
   }
@@ -206,35 +231,57 @@ public:
 
 protected:
   Buffer *m_sbuf;
+  // if m_sbuf came from the pool, the size of its block (0 if not)
+  size_t m_sbuf_block;
   pthread_mutex_t m_mutex;
   int32_t m_refct;
 
-  SharedGameMessage(int32_t type, const uint8_t *buf, size_t len, bool become_owner) :
-      GameMessage(type), m_sbuf(NULL), m_refct(1) {
+  // If borrow is true (and become_owner is false), the message refers to
+  // the caller's buffer until make_own_copy() is called, instead of
+  // copying it now. That is for messages that are usually handled and
+  // dropped before the read buffer is used again, or else copied once on
+  // their way to other clients.
+  SharedGameMessage(int32_t type, const uint8_t *buf, size_t len, bool become_owner, bool borrow = false) :
+      GameMessage(type), m_sbuf(NULL), m_sbuf_block(0), m_refct(1) {
     if (pthread_mutex_init(&m_mutex, NULL)) {
       throw std::bad_alloc();
     }
-    m_sbuf = new Buffer(len, buf, !become_owner);
-    m_buflen = len;
     if (become_owner) {
+      m_sbuf = new Buffer(len, buf, false);
       m_sbuf->make_owned();
+    } else if (borrow) {
+      set_buffer(len, buf);
+    } else {
+      set_buffer(len);
+      memcpy(m_sbuf->buffer(), buf, len);
     }
+    m_buflen = len;
   }
   // constructor for making new messages server-side
   SharedGameMessage(int32_t type) :
-      GameMessage(type), m_sbuf(NULL), m_refct(1) {
+      GameMessage(type), m_sbuf(NULL), m_sbuf_block(0), m_refct(1) {
     if (pthread_mutex_init(&m_mutex, NULL)) {
       throw std::bad_alloc();
     }
   }
 
+  // Replace m_sbuf (if any) with a Buffer from the pool. The new Buffer
+  // has room for len bytes, or if data is not NULL, it refers to data
+  // without copying it.
+  void set_buffer(size_t len, const uint8_t *data = NULL);
+  void free_buffer();
+  // whether the data in m_sbuf belongs to the message
+  bool owns_buffer() const {
+    return m_sbuf->is_owned() || m_sbuf_block > sizeof(Buffer);
+  }
+
 private:
   SharedGameMessage();
   SharedGameMessage(SharedGameMessage&);
 
 #ifdef DEBUG_ENABLE
 public:
-  virtual bool persistable() const { return (!m_sbuf) || m_sbuf->is_owned(); }
+  virtual bool persistable() const { return (!m_sbuf) || owns_buffer(); }
 #endif
 };
 
@@ -261,8 +308,9 @@ public:
 protected:
   uint16_t m_subtype;
 
+  // the message borrows the read buffer; see SharedGameMessage
   PropagateBufferMessage(uint16_t subtype, const uint8_t *buf, size_t len, bool become_owner) :
-      SharedGameMessage(Cli2Game_PropagateBuffer, buf, len, become_owner), m_subtype(subtype) {
+      SharedGameMessage(Cli2Game_PropagateBuffer, buf, len, become_owner, true), m_subtype(subtype) {
   }
   /*
    * Functions for making new messages server-side
@@ -359,8 +407,31 @@ public:
 
 class PlNetMsgSDLState: public PropagateBufferMessage {
 public:
-  // constructor sets the NetMsg header timestamp if use_timestamp is true
-  PlNetMsgSDLState(SDLState *sdl, bool is_initial_sdl, bool use_timestamp = true);
+  // constructor sets the NetMsg header timestamp if use_timestamp is true;
+  // if compress_later is true, the SDL is not compressed yet and the
+  // message may not be sent until compress() is done
+  PlNetMsgSDLState(SDLState *sdl, bool is_initial_sdl, bool use_timestamp = true, bool compress_later = false);
+
+  // Returns the initial-state message for sdl, with a reference for the
+  // caller. The message is kept in the SDLState, so it is only encoded
+  // (and compressed) again after the state changes.
+  static PlNetMsgSDLState* initial(SDLState *sdl);
+  // Make the initial-state message for sdl ahead of time, if there is not
+  // one already, and have the compressor compress it. Until ready(), the
+  // message must not be sent.
+  static void prepare(SDLState *sdl, SDLCompressor *compressor);
+  static bool ready(SDLState *sdl);
+
+  // Compress the SDL, if that was left for later. This is done by the
+  // compressor's thread, so it touches nothing but the message's own
+  // buffer.
+  void compress();
+
+protected:
+  // where the SDL's compression header is, while compress() is still to
+  // be done, or 0
+  uint32_t m_zip_at;
+  bool m_ready; // protected by m_mutex
 };
 
 class PlNetMsgInitialAgeStateSent: public PropagateBufferMessage {
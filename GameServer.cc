@@ -42,6 +42,8 @@
 #include <stdexcept>
 #include <deque>
 #include <list>
+#include <map>
+#include <set>
 #include <vector>
 #include <iostream>
 #include <fstream>
@@ -73,25 +75,44 @@
 
 #include "moss_serv.h"
 #include "GameState.h"
+#include "AgeCheckpoint.h"
+#include "AgeStateFile.h"
+#include "SDLRegistry.h"
+#include "SDLCompressor.h"
 #include "GameServer.h"
+#include "GameHost.h"
 #include "GameHandler.h"
 
 GameServer::GameServer(const char *server_dir, bool is_a_thread, struct sockaddr_in &vault_address, const uint8_t *uuid,
-    const char *filename, in_addr_t connect_ipaddr, uint16_t connect_ipport, AgeDesc *age, std::list<SDLDesc*> &sdl) :
+    const char *filename, in_addr_t connect_ipaddr, uint16_t connect_ipport, AgeDesc *age, SDLRegistry *sdl,
+    const SDLDescIndex *age_sdl) :
       Server(server_dir, is_a_thread), m_vault_addr(vault_address), m_vault(NULL), m_timed_shutdown(false),
-      m_shutdown_timer(NULL), m_joiners(0), m_client_queue(NULL), m_fake_signal(0), m_filename(NULL),
-      m_age(age), m_group_owner(0) {
+      m_shutdown_timer(NULL), m_checkpoint_due(false), m_tick_ms(0), m_tick_pending(false), m_player_count(0), m_loop_lag(0), m_joiners(0), m_client_queue(NULL), m_fake_signal(0), m_host(NULL),
+      m_bind_pending(false), m_closed(false), m_warm(false), m_filename(NULL),
+      m_age(age), m_sdl(sdl), m_group_owner(0) {
   m_ipaddr = connect_ipaddr;
   m_ipport = connect_ipport;
   if (pthread_mutex_init(&m_client_queue_mutex, NULL)) {
     throw std::bad_alloc();
   }
+  if (pthread_mutex_init(&m_load_mutex, NULL)) {
+    pthread_mutex_destroy(&m_client_queue_mutex);
+    throw std::bad_alloc();
+  }
   m_client_queue = new std::deque<std::pair<GameConnection*, NetworkMessage*> >();
   set_signal_data(&m_fake_signal, 1, &m_signal_processor);
-  memcpy(m_age_uuid, uuid, UUID_RAW_LEN);
+  if (uuid) {
+    memcpy(m_age_uuid, uuid, UUID_RAW_LEN);
+  } else {
+    // a warm game server gets it later
+    memset(m_age_uuid, 0, UUID_RAW_LEN);
+  }
   m_filename = strdup(filename);
-  // copy global SDL list (NOTE the SDLDesc* objects are shared!)
-  m_game_state.m_allsdl.assign(sdl.begin(), sdl.end());
+  // the SDLDescs are shared with other game servers
+  m_sdl->add_ref();
+  m_game_state.m_allsdl = age_sdl;
+  m_tick_at.tv_sec = 0;
+  m_tick_at.tv_usec = 0;
   // set up timeout
   m_timers = new TimerQueue();
   m_conns.push_back(m_timers);
@@ -109,6 +130,7 @@ GameServer::~GameServer() {
   // same for m_timers
   log_debug(m_log, "deleting\n");
   pthread_mutex_destroy(&m_client_queue_mutex);
+  pthread_mutex_destroy(&m_load_mutex);
   std::deque<std::pair<GameConnection*, NetworkMessage*> >::iterator iter;
   for (iter = m_client_queue->begin(); iter != m_client_queue->end(); iter++) {
     GameConnection *c = iter->first;
@@ -127,95 +149,130 @@ GameServer::~GameServer() {
   for (state = m_game_state.m_sdl.begin(); state != m_game_state.m_sdl.end(); state++) {
     delete *state;
   }
-  std::list<SDLDesc*>::iterator sdl;
-  for (sdl = m_agesdl.begin(); sdl != m_agesdl.end(); sdl++) {
-    delete *sdl;
+  m_sdl->del_ref();
+  if (m_game_state.m_compressor) {
+    m_game_state.m_compressor->del_ref();
+  }
+  std::map<kinum_t, NetworkMessage*>::iterator whole;
+  for (whole = m_whole_movement.begin(); whole != m_whole_movement.end(); whole++) {
+    if (whole->second->del_ref() < 1) {
+      delete whole->second;
+    }
+  }
+}
+
+void GameServer::set_compressor(SDLCompressor *compressor) {
+  if (m_game_state.m_compressor) {
+    m_game_state.m_compressor->del_ref();
+  }
+  m_game_state.m_compressor = compressor;
+  if (compressor) {
+    compressor->add_ref();
   }
 }
 
 int32_t GameServer::init() {
+  // the SDL was read in by the dispatcher (the first time the age started)
+  log_debug(m_log, "Using %u SDLDescs\n", (uint32_t) m_game_state.m_allsdl->size());
+
+  if (m_warm) {
+    log_info(m_log, "I'm a warm %s server, internal ID %08x,%08x\n", m_filename, m_ipaddr, m_id);
+    // there is nothing to linger for until there is an age instance
+    cancel_shutdown_timer();
+  } else {
+    load_instance();
+  }
+
+  // set up vault/tracking server connection
+  if (m_host) {
+    // the host's connection; the host says hello for us when it connects
+    m_vault = m_host->vault();
+    if (!m_vault->in_connect()) {
+      conn_completed(m_vault);
+    }
+    return 0;
+  }
+  m_vault = connect_to_backend(&m_vault_addr);
+  if (m_vault) {
+    m_conns.push_back(m_vault);
+    if (!m_vault->in_connect()) {
+      // make sure to send hello
+      conn_completed(m_vault);
+    }
+  } else {
+    // error was already logged
+#ifndef FORK_GAME_TOO
+    pthread_mutex_lock(&m_client_queue_mutex);
+    m_closed = true;
+    pthread_mutex_unlock(&m_client_queue_mutex);
+#endif
+    return -1;
+  }
+  return 0;
+}
+
+void GameServer::load_instance() {
   // log my identity information
   char my_uuid[UUID_STR_LEN];
   format_uuid(m_age_uuid, my_uuid);
   log_info(m_log, "I'm a %s server, UUID %s, internal ID %08x,%08x\n", m_filename, my_uuid, m_ipaddr, m_id);
 
-  // XXX it is hard to open directories and files case-insensitively in
-  // unix. You have to do a directory listing and match filenames case-
-  // insensitively.
-
-  // read in SDL, if present
-  std::string sdldir = std::string(m_serv_dir) + PATH_SEPARATOR + "SDL" + PATH_SEPARATOR + m_filename;
-  log_msgs(m_log, "Looking for filesystem SDLDesc named \"%s\" in \"%s\"\n", m_filename, sdldir.c_str());
-  int32_t ret = SDLDesc::parse_directory(m_log, m_agesdl, sdldir, false, false);
-  if (ret > 0) {
-    // try a single file
-    std::string sdlfile = sdldir + ".sdl";
-    std::ifstream file(sdlfile.c_str(), std::ios_base::in);
-    if (file.fail()) {
-      log_msgs(m_log, "No SDLDesc found for age \"%s\"\n", m_filename);
-      // this is not an error, some ages don't have SDL files
-    } else {
-      try {
-        SDLDesc::parse_file(m_agesdl, file);
-      } catch (const parse_error &e) {
-        log_err(m_log, "SDLDesc Parse error, line %u: \"%s\"\n", e.lineno(), e.what());
-        ret = -1;
+  // read in stored SDLstate if present
+  std::string statedir = std::string(m_serv_dir) + PATH_SEPARATOR + "state" + PATH_SEPARATOR + m_filename + PATH_SEPARATOR
+      + my_uuid;
+  std::string statefile = statedir + PATH_SEPARATOR + "agestate.bin";
+  log_debug(m_log, "Trying to read saved \"%s\" age state from \"%s\"\n",
+      m_filename, statefile.c_str());
+  if (m_state_file.load(statefile.c_str(), m_game_state.m_sdl, *m_game_state.m_allsdl, m_log)) {
+    log_info(m_log, "Loaded %u SDL states for \"%s\" from \"%s\"\n",
+        (uint32_t) m_game_state.m_sdl.size(), m_filename, statefile.c_str());
+  } else {
+    // the old format; it is replaced with agestate.bin at shutdown
+    statefile = statedir + PATH_SEPARATOR + "agestate.moss";
+    std::ifstream savefile(statefile.c_str(), std::ios_base::in);
+    if (!savefile.fail()) {
+      log_debug(m_log, "Trying to read saved \"%s\" age state from \"%s\"\n",
+          m_filename, statefile.c_str());
+      if (!SDLState::load_file(savefile, m_game_state.m_sdl, *m_game_state.m_allsdl, m_log)) {
+        log_warn(m_log, "Error while reading saved \"%s\" age state\n", m_filename);
       }
     }
   }
-  if (ret < 0) {
-    // forge on, but game mechanics will be broken
-    log_warn(m_log, "Error reading SDLDesc for age \"%s\"\n", m_filename);
-  }
-  if (m_agesdl.size() > 0) {
-    // merge into allsdl list
-    std::list<SDLDesc*>::iterator iter;
-    // this loop just finds the place in the list to splice at, after the
-    // most common SDLs
-    for (iter = m_game_state.m_allsdl.begin(); iter != m_game_state.m_allsdl.end(); iter++) {
-      const char *sdlname = (*iter)->name();
-      if (!strcasecmp(sdlname, "physical") || !strcasecmp(sdlname, "avatar")
-      // "avatar" covers "avatarPhysical"
-          || !strcasecmp(sdlname, "Layer") || !strcasecmp(sdlname, "MorphSequence") || !strcasecmp(sdlname, "clothing")) {
-        // go on
-      } else {
-        break;
-      }
-    }
-    std::list<SDLDesc*>::iterator here = iter;
-    for (iter = m_agesdl.begin(); iter != m_agesdl.end(); iter++) {
-      m_game_state.m_allsdl.insert(here, *iter);
-      SDLDesc *d = *iter;
-      log_debug(m_log, "Inserting saved SDLDesc %s-v%d into m_allsdl:\n\t%s\n",
-          d->name(),
-          d->version(),
-          d->str(",\n\t\t\t").c_str());
-    }
+  // everything from the file is saved already
+  std::list<SDLState*>::iterator iter;
+  for (iter = m_game_state.m_sdl.begin(); iter != m_game_state.m_sdl.end(); iter++) {
+    (*iter)->clear_changed();
   }
-
-  // read in stored SDLstate if present
-  std::string statefile = std::string(m_serv_dir) + PATH_SEPARATOR + "state" + PATH_SEPARATOR + m_filename + PATH_SEPARATOR
-      + my_uuid + PATH_SEPARATOR + "agestate.moss";
-  std::ifstream savefile(statefile.c_str(), std::ios_base::in);
-  if (!savefile.fail()) {
-    log_debug(m_log, "Trying to read saved \"%s\" age state from \"%s\"\n",
-        m_filename, statefile.c_str());
-    if (!SDLState::load_file(savefile, m_game_state.m_sdl, m_game_state.m_allsdl, m_log)) {
-      log_warn(m_log, "Error while reading saved \"%s\" age state\n", m_filename);
-    }
+  m_game_state.rebuild_sdl_index();
+  // if the server did not shut down cleanly, the last checkpoint has what
+  // changed after the file was written; those states stay changed so the
+  // next checkpoint still has them
+  std::string deltafile = statedir + PATH_SEPARATOR + "agestate.delta";
+  std::ifstream delta(deltafile.c_str(), std::ios_base::in);
+  if (!delta.fail()) {
+    std::list<SDLState*> newer;
+    if (!SDLState::load_file(delta, newer, *m_game_state.m_allsdl, m_log)) {
+      log_warn(m_log, "Error while reading \"%s\" age state checkpoint\n", m_filename);
+    }
+    log_info(m_log, "Recovering %u SDL states from \"%s\" age state checkpoint\n",
+        (uint32_t) newer.size(), m_filename);
+    m_game_state.merge_sdl(newer);
   }
+  int32_t ret = recursive_mkdir(statedir.c_str(), S_IRWXU | S_IRWXG);
+  if (ret) {
+    log_warn(m_log, "Cannot make directory %s for age state file, err=%d %s\n", statedir.c_str(), ret, strerror(ret));
+  }
+  m_checkpoint.set_file(deltafile, m_log);
   // now, if there is an AgeSDLHook SDLDesc but no SDLState, make a default one
-  std::list<SDLState*>::iterator iter;
   for (iter = m_game_state.m_sdl.begin(); iter != m_game_state.m_sdl.end(); iter++) {
     SDLState *s = *iter;
     if (s->name_equals(m_filename)
-        && s->key().m_name
-        && *(s->key().m_name) == "AgeSDLHook") {
+        && !strcmp(s->key().name(), "AgeSDLHook")) {
       break;
     }
   }
   if (iter == m_game_state.m_sdl.end()) {
-    SDLDesc *d = SDLDesc::find_by_name(m_filename, m_game_state.m_allsdl);
+    SDLDesc *d = m_game_state.m_allsdl->find(m_filename);
     if (d) {
       log_debug(m_log, "Setting up new (default) AgeSDLHook SDLDesc\n");
       SDLState *s = new SDLState(d);
@@ -227,6 +284,7 @@ int32_t GameServer::init() {
           s->get_desc()->version(),
           s->str(",\n\t").c_str());
       m_game_state.m_sdl.push_front(s);
+      m_game_state.index_sdl(s);
     }
   } else {
     SDLState *s = *iter;
@@ -236,43 +294,19 @@ int32_t GameServer::init() {
         s->str(",\n\t").c_str());
   }
   m_game_state.setup_filter();
-
-  // set up vault/tracking server connection
-  m_vault = connect_to_backend(&m_vault_addr);
-  if (m_vault) {
-    m_conns.push_back(m_vault);
-    if (!m_vault->in_connect()) {
-      // make sure to send hello
-      conn_completed(m_vault);
-    }
-  } else {
-    // error was already logged
-    return -1;
-  }
-  return 0;
+  start_checkpoint_timer();
 }
 
 bool GameServer::shutdown(reason_t reason) {
   log_info(m_log, "Shutdown started, reason %s\n", reason_c_str(reason));
 
-  char my_uuid[UUID_STR_LEN];
-  format_uuid(m_age_uuid, my_uuid);
-  std::string statefile = std::string(m_serv_dir) + PATH_SEPARATOR + "state" + PATH_SEPARATOR + m_filename + PATH_SEPARATOR
-      + my_uuid;
-  int32_t ret = recursive_mkdir(statefile.c_str(), S_IRWXU | S_IRWXG);
-  if (ret) {
-    log_warn(m_log, "Cannot make directory %s for age state file, err=%d %s\n", statefile.c_str(), ret, strerror(ret));
-  }
-  statefile = statefile + PATH_SEPARATOR + "agestate.moss";
-  log_msgs(m_log, "Trying to save SDLState to file %s\n", statefile.c_str());
-  std::ofstream savefile(statefile.c_str(), std::ios_base::out | std::ios_base::trunc);
-  if (savefile.fail()) {
-    log_warn(m_log, "Cannot open file %s to save SDLState, err=%d %s\n", statefile.c_str(), errno, strerror(errno));
-  } else {
-    log_debug(m_log, "Trying to save age state %s\n", statefile.c_str());
-    if (!SDLState::save_file(savefile, m_game_state.m_sdl)) {
-      log_warn(m_log, "Error while saving age state %s\n", statefile.c_str());
-    }
+#ifndef FORK_GAME_TOO
+  pthread_mutex_lock(&m_client_queue_mutex);
+  m_closed = true;
+  pthread_mutex_unlock(&m_client_queue_mutex);
+#endif
+  if (!m_warm) {
+    save_instance();
   }
 
   std::list<Connection*>::iterator iter;
@@ -287,6 +321,14 @@ bool GameServer::shutdown(reason_t reason) {
       iter = m_conns.erase(iter);
     }
   }
+  m_clients.clear();
+  m_players.clear();
+  count_players();
+  m_game_state.m_transfers.clear();
+  m_game_state.m_sdl_deltas.clear();
+  m_game_state.m_positions.clear();
+  m_game_state.m_grid.clear();
+  m_game_state.m_far_pending = false;
 
   TrackGameBye_ToBackendMessage *bye = new TrackGameBye_ToBackendMessage(m_ipaddr, m_id, true);
   // tell server we are shutting down
@@ -298,6 +340,41 @@ bool GameServer::shutdown(reason_t reason) {
   return false;
 }
 
+void GameServer::save_instance() {
+  char my_uuid[UUID_STR_LEN];
+  format_uuid(m_age_uuid, my_uuid);
+  std::string statefile = std::string(m_serv_dir) + PATH_SEPARATOR + "state" + PATH_SEPARATOR + m_filename + PATH_SEPARATOR
+      + my_uuid;
+  int32_t ret = recursive_mkdir(statefile.c_str(), S_IRWXU | S_IRWXG);
+  if (ret) {
+    log_warn(m_log, "Cannot make directory %s for age state file, err=%d %s\n", statefile.c_str(), ret, strerror(ret));
+  }
+  std::string statedir = statefile;
+  std::string oldfile = statefile + PATH_SEPARATOR + "agestate.moss";
+  statefile = statefile + PATH_SEPARATOR + "agestate.bin";
+  log_msgs(m_log, "Trying to save SDLState to file %s\n", statefile.c_str());
+  // don't let a checkpoint land after the full state
+  m_checkpoint.wait();
+  // write a new file and rename it, so a failure leaves the old one (this
+  // also leaves the old one mapped for the states still using it)
+  std::string tmpfile = statefile + ".new";
+  if (!AgeStateFile::save(tmpfile.c_str(), m_game_state.m_sdl)) {
+    log_warn(m_log, "Error while saving age state %s, err=%d %s\n", tmpfile.c_str(), errno, strerror(errno));
+    unlink(tmpfile.c_str());
+  } else if (rename(tmpfile.c_str(), statefile.c_str())) {
+    log_warn(m_log, "Cannot rename %s to %s, err=%d %s\n", tmpfile.c_str(), statefile.c_str(), errno, strerror(errno));
+    unlink(tmpfile.c_str());
+  } else if ((ret = sync_directory(statedir.c_str()))) {
+    // until the rename is on disk, the checkpoint may still be needed
+    log_warn(m_log, "Cannot sync directory %s, keeping age state checkpoint, err=%d %s\n", statedir.c_str(), ret,
+        strerror(ret));
+  } else {
+    // agestate.moss, if there was one, is out of date now
+    unlink(oldfile.c_str());
+    m_checkpoint.saved_all();
+  }
+}
+
 NetworkMessage*
 GameServer::GameConnection::make_if_enough(const uint8_t *buf, size_t len, int32_t *want_len, bool become_owner) {
   NetworkMessage *msg = NULL;
@@ -347,6 +424,38 @@ GameServer::GameConnection::make_if_enough(const uint8_t *buf, size_t len, int32
   return msg;
 }
 
+GameServer::GameConnection::~GameConnection() {
+  m_key.delete_name();
+  std::list<std::pair<NetworkMessage*, kinum_t> >::iterator iter;
+  for (iter = m_held.begin(); iter != m_held.end(); iter++) {
+    if (iter->first->del_ref() < 1) {
+      delete iter->first;
+    }
+  }
+}
+
+bool GameServer::GameConnection::drop_movement(kinum_t mover) {
+  std::list<std::pair<NetworkMessage*, kinum_t> >::iterator iter;
+  for (iter = m_held.begin(); iter != m_held.end(); iter++) {
+    if (iter->second == mover) {
+      if (iter->first->del_ref() < 1) {
+        delete iter->first;
+      }
+      m_held.erase(iter);
+      return true;
+    }
+  }
+  return false;
+}
+
+void GameServer::GameConnection::release_held() {
+  std::list<std::pair<NetworkMessage*, kinum_t> >::iterator iter;
+  for (iter = m_held.begin(); iter != m_held.end(); iter++) {
+    Connection::enqueue(iter->first);
+  }
+  m_held.clear();
+}
+
 void GameServer::GameConnection::set_state(state_t s) {
   if (m_state != KILL_AFTER_QUEUE_EMPTY && (m_state != s)) {
     m_state = s;
@@ -356,9 +465,9 @@ void GameServer::GameConnection::set_state(state_t s) {
 void GameServer::GameConnection::set_key(const PlKey &key) {
   m_key.delete_name();
   m_key = key;
-  // copy the name so that if the clone message SDL is replaced or something,
-  // we aren't referring to freed memory
-  m_key.m_name = new UruString(*(key.m_name), true);
+  // hold the name so that if the clone message SDL is replaced or
+  // something, we aren't referring to a freed one
+  m_key.copy_name();
 }
 
 Server::reason_t GameServer::message_read(Connection *conn, NetworkMessage *in) {
@@ -401,16 +510,29 @@ Server::reason_t GameServer::message_read(Connection *conn, NetworkMessage *in)
       log_debug(m_log, "PropogateBufferMessage distributing <0x%x>\"%s\"\n", prop->subtype(),
           plCreatableIndex_c_str(prop->subtype()));
 
-      std::list<Connection*>::iterator c_iter;
+      std::list<GameConnection*>::iterator c_iter;
       // normal message handling
       if (handler->handle_message(prop, &m_game_state, (GameConnection*) conn, m_log)) {
 #ifndef STANDALONE
         // redistribute message to everyone
         bool did_timestamp = false;
-        for (c_iter = m_conns.begin(); c_iter != m_conns.end(); c_iter++) {
-          Connection *c = *c_iter;
-          if (c != conn && c != m_vault && c != m_timers) {
-            GameConnection *gc = (GameConnection*) c;
+        // except a player's movement, with interest management
+        std::set<kinum_t> nearby;
+        kinum_t mover = m_game_state.take_mover();
+        if (mover && !m_game_state.players_near(mover, nearby)) {
+          mover = 0;
+        }
+        if (mover) {
+          new_movement(mover);
+        }
+        for (c_iter = m_clients.begin(); c_iter != m_clients.end(); c_iter++) {
+          GameConnection *gc = *c_iter;
+          if (gc != conn) {
+            if (mover && m_game_state.has_position(gc->kinum()) && nearby.find(gc->kinum()) == nearby.end()) {
+              // it goes out later at the slower rate
+              m_game_state.fell_behind(mover, gc->kinum());
+              continue;
+            }
             if (gc->state() < STATE_REQUESTED) {
               if (prop->subtype() == plNetMsgLoadClone) {
                 // don't forward message, we'll get the clone in the
@@ -435,7 +557,13 @@ Server::reason_t GameServer::message_read(Connection *conn, NetworkMessage *in)
 #ifdef DO_PRIORITIES
             // XXX we need to get the priority from handle_message, I guess
 #endif
-            c->enqueue(prop);
+            if (prop->subtype() == plNetMsgLoadClone) {
+              // not held, so it stays ahead of anything about the clone
+              // that is sent directly (like the unload when they leave)
+              gc->enqueue(prop);
+            } else {
+              broadcast_to(gc, prop, mover);
+            }
           }
         }
 #endif
@@ -448,10 +576,9 @@ Server::reason_t GameServer::message_read(Connection *conn, NetworkMessage *in)
           PlNetMsgMembersMsg *list = new PlNetMsgMembersMsg(prop->kinum());
 #ifndef STANDALONE
           // walk list of connections and add them to the list
-          for (c_iter = m_conns.begin(); c_iter != m_conns.end(); c_iter++) {
-            Connection *c = *c_iter;
-            if (c != conn && c != m_vault && c != m_timers) {
-              GameConnection *gc = (GameConnection*) c;
+          for (c_iter = m_clients.begin(); c_iter != m_clients.end(); c_iter++) {
+            GameConnection *gc = *c_iter;
+            if (gc != conn) {
               if (gc->state() >= JOINED) {
                 // note that if the state is JOINED and not HAVE_CLONE,
                 // a "null" key will be sent (I think this must be right,
@@ -471,26 +598,45 @@ Server::reason_t GameServer::message_read(Connection *conn, NetworkMessage *in)
         }
           break;
 #ifndef STANDALONE
+        case plNetMsgVoice: {
+          // voice has a lane of its own in each client's queue (see
+          // MessageQueue) and is not forwarded to other ages
+          // note, this depends on check_usable to prevent running off
+          // the end of the buffer
+          uint32_t recip_offset = prop->body_offset();
+          const uint8_t *msg_buf = prop->buffer();
+          recip_offset += read16(msg_buf, recip_offset + 2);
+          recip_offset += 4;
+          uint32_t recip_ct = msg_buf[recip_offset++];
+
+          bool did_timestamp = false;
+          for (uint32_t recip = 0; recip < recip_ct; recip++) {
+            GameConnection *gc = find_player(read32(msg_buf, recip_offset));
+            recip_offset += 4;
+            // reduce link-in bandwidth a bit by not sending voice to
+            // anyone not in the game yet
+            if (gc && gc != conn && gc->state() >= IN_GAME) {
+              if (!did_timestamp) {
+                prop->make_own_copy();
+                prop->set_timestamp();
+                did_timestamp = true;
+              }
+              prop->add_ref();
+              gc->enqueue(prop, MessageQueue::VOICE);
+            }
+          }
+        }
+          break;
         case plNetMsgGameMessageDirected:
-        case plNetMsgVoice:
           // subset
         {
-          MessageQueue::priority_t pri = MessageQueue::NORMAL;
-          if (prop->subtype() == plNetMsgVoice) {
-            pri = MessageQueue::VOICE;
-          }
           bool someone_missing = false;
           // note, this depends on check_usable to prevent running off
           // the end of the buffer
           uint32_t recip_offset = prop->body_offset();
           const uint8_t *msg_buf = prop->buffer();
-          if (pri == MessageQueue::VOICE) {
-            recip_offset += read16(msg_buf, recip_offset + 2);
-            recip_offset += 4;
-          } else {
-            recip_offset += read32(msg_buf, recip_offset + 5);
-            recip_offset += 10;
-          }
+          recip_offset += read32(msg_buf, recip_offset + 5);
+          recip_offset += 10;
           uint32_t start_recips = recip_offset;
           uint32_t recip_ct = msg_buf[recip_offset++];
           // now we are at the recipients
@@ -501,37 +647,24 @@ Server::reason_t GameServer::message_read(Connection *conn, NetworkMessage *in)
             recip_offset += 4;
 
             // look for that recipient
-            for (c_iter = m_conns.begin(); c_iter != m_conns.end(); c_iter++) {
-              Connection *c = *c_iter;
-              if (c != conn && c != m_vault && c != m_timers) {
-                GameConnection *gc = (GameConnection*) c;
-                if (gc->kinum() == recip_ki) {
-                  // send to this one
-                  if (pri == MessageQueue::VOICE && (gc->state() < IN_GAME)) {
-                    // except let's reduce link-in bandwidth a bit here
-                    break;
-                  }
-                  // note we only exclude voice, let chat go through so
-                  // it will be seen later
-
-                  if (!did_timestamp) {
-                    prop->make_own_copy();
-                    prop->set_timestamp();
-                    did_timestamp = true;
-                  }
-                  prop->add_ref();
-                  c->enqueue(prop, pri);
-                  break;
-                }
+            GameConnection *gc = find_player(recip_ki);
+            if (gc && gc != conn) {
+              // send to this one (unlike voice, chat goes even to players
+              // linking in, so it will be seen later)
+              if (!did_timestamp) {
+                prop->make_own_copy();
+                prop->set_timestamp();
+                did_timestamp = true;
               }
-            } // for
-            if (!someone_missing && c_iter == m_conns.end()) {
+              prop->add_ref();
+              gc->enqueue(prop);
+            } else {
               // recipient not present in the current age
               someone_missing = true;
             }
           }
 
-          if (someone_missing && pri != MessageQueue::VOICE) {
+          if (someone_missing) {
             // Technically I believe that the message should only be
             // forwarded if the interage flag is set, yet I know the
             // UU servers forwarded all chat traffic regardless,
@@ -704,21 +837,13 @@ Server::reason_t GameServer::backend_message(Connection *vault, BackendMessage *
       break;
     }
     kinum_t kill_this_un = msg->kinum();
-    std::list<Connection*>::iterator c_iter;
-    for (c_iter = m_conns.begin(); c_iter != m_conns.end(); c_iter++) {
-      Connection *c = *c_iter;
-      if (c != m_vault && c != m_timers) {
-        GameConnection *gc = (GameConnection*) c;
-        if (gc->kinum() == kill_this_un) {
-          log_debug(m_log, "Force-dropping player kinum=%u on %d at direction of tracking\n",
-              kill_this_un, c->fd());
-          gc->set_in_shutdown(true);
-          gc->set_state(KILL_AFTER_QUEUE_EMPTY);
-          break;
-        }
-      }
-    }
-    if (c_iter == m_conns.end() && m_log && m_log->would_log_at(Logger::LOG_DEBUG)) {
+    GameConnection *gc = find_player(kill_this_un);
+    if (gc) {
+      log_debug(m_log, "Force-dropping player kinum=%u on %d at direction of tracking\n",
+          kill_this_un, gc->fd());
+      gc->set_in_shutdown(true);
+      gc->set_state(KILL_AFTER_QUEUE_EMPTY);
+    } else if (m_log && m_log->would_log_at(Logger::LOG_DEBUG)) {
       log_debug(m_log, "Tracking told us to drop player kinum=%u but no such player is connected\n",
           kill_this_un);
     }
@@ -777,8 +902,7 @@ Server::reason_t GameServer::backend_message(Connection *vault, BackendMessage *
     for (iter = m_game_state.m_sdl.begin(); iter != m_game_state.m_sdl.end(); iter++) {
       SDLState *s = *iter;
       if (s->name_equals(m_filename)
-          && s->key().m_name
-          && *(s->key().m_name) == "AgeSDLHook") {
+          && !strcmp(s->key().name(), "AgeSDLHook")) {
         current = s;
         break;
       }
@@ -805,7 +929,7 @@ Server::reason_t GameServer::backend_message(Connection *vault, BackendMessage *
     SDLState *new_sdl = new SDLState();
     bool error = false;
     try {
-      if (new_sdl->read_in(msg->sdl_buf() + 2, msg->sdl_len() - 2, m_game_state.m_allsdl) < 0) {
+      if (new_sdl->read_in(msg->sdl_buf() + 2, msg->sdl_len() - 2, *m_game_state.m_allsdl) < 0) {
         // unrecognized, but we should never get here (bad version?)
         log_warn(m_log, "Unrecognized %s vault SDLState received\n", ustring);
         error = true;
@@ -831,23 +955,15 @@ Server::reason_t GameServer::backend_message(Connection *vault, BackendMessage *
         // of doing things and then swap pointers to clean up
         log_msgs(m_log, "Incorporating %s vault SDLState\n", ustring);
         new_sdl->update_from(current, false/*swipe structure*/, true/*use timestamps*/, true/*age load*/);
-        std::list<SDLState*>::iterator iter;
-        for (iter = m_game_state.m_sdl.begin(); iter != m_game_state.m_sdl.end(); iter++) {
-          if (*iter == current) {
-            // put the new_sdl object in the list instead
-            m_game_state.m_sdl.insert(iter, new_sdl);
-            m_game_state.m_sdl.erase(iter);
-
-            log_debug(m_log, "Updated(replaced) GameServer SDLState: %s-v%d:\n\t%s\n",
-                new_sdl->get_desc()->name(),
-                new_sdl->get_desc()->version(),
-                new_sdl->str(",\n\t").c_str());
-
-            new_sdl = current; // so the right object is deleted
-            SDLState *s = *iter;
-            break;
-          }
-        }
+        // put the new_sdl object in the list instead
+        m_game_state.replace_sdl(current, new_sdl);
+
+        log_debug(m_log, "Updated(replaced) GameServer SDLState: %s-v%d:\n\t%s\n",
+            new_sdl->get_desc()->name(),
+            new_sdl->get_desc()->version(),
+            new_sdl->str(",\n\t").c_str());
+
+        new_sdl = current; // so the right object is deleted
       } else { // SDL_UPDATE, GLOBAL_UPDATE or GLOBAL_INIT
         // when any vault SDL is updated (global or player), only records
         // that are both newer and different ought to be forwarded to clients;
@@ -863,15 +979,12 @@ Server::reason_t GameServer::backend_message(Connection *vault, BackendMessage *
             current->str(",\n\t").c_str());
 
         // and forward to any players
-        if (m_conns.size() > 2) {
+        if (!m_clients.empty()) {
           PlNetMsgSDLState *new_msg = new PlNetMsgSDLState(new_sdl, false);
-          std::list<Connection*>::iterator c_iter;
-          for (c_iter = m_conns.begin(); c_iter != m_conns.end(); c_iter++) {
-            Connection *c = *c_iter;
-            if (c != m_vault && c != m_timers) {
-              new_msg->add_ref();
-              c->enqueue(new_msg);
-            }
+          std::list<GameConnection*>::iterator c_iter;
+          for (c_iter = m_clients.begin(); c_iter != m_clients.end(); c_iter++) {
+            new_msg->add_ref();
+            (*c_iter)->enqueue(new_msg);
           }
           if (new_msg->del_ref() < 1) {
             delete new_msg;
@@ -949,19 +1062,12 @@ Server::reason_t GameServer::backend_message(Connection *vault, BackendMessage *
         recip_ct--;
 
         // look for that recipient
-        std::list<Connection*>::iterator c_iter;
-        for (c_iter = m_conns.begin(); c_iter != m_conns.end(); c_iter++) {
-          Connection *c = *c_iter;
-          if (c != m_vault && c != m_timers) {
-            GameConnection *gc = (GameConnection*) c;
-            if (gc->kinum() == recip_ki) {
-              // send to this one
-              fwd->add_ref();
-              c->enqueue(fwd);
-              break;
-            }
-          }
-        } // for
+        GameConnection *gc = find_player(recip_ki);
+        if (gc) {
+          // send to this one
+          fwd->add_ref();
+          gc->enqueue(fwd);
+        }
       } // while
     }
     if (in->del_ref() >= 1) {
@@ -1005,15 +1111,21 @@ void GameServer::conn_completed(Connection *conn) {
 
     Hello_BackendMessage *hello = new Hello_BackendMessage(m_ipaddr, m_id, type());
     conn->enqueue(hello);
-    TrackGameHello_BackendMessage *gamehello = new TrackGameHello_BackendMessage(m_ipaddr, m_id, m_age_uuid, m_id,
-        htole32(ntohl(m_ipaddr)));
-    conn->enqueue(gamehello);
+    if (!m_warm) {
+      send_game_hello();
+    }
   } else {
     log_warn(m_log, "Unknown outgoing connection (fd %d) completed!\n", conn->fd());
     conn->set_in_shutdown(true);
   }
 }
 
+void GameServer::send_game_hello() {
+  TrackGameHello_BackendMessage *gamehello = new TrackGameHello_BackendMessage(m_ipaddr, m_id, m_age_uuid, m_id,
+      htole32(ntohl(m_ipaddr)));
+  m_vault->enqueue(gamehello);
+}
+
 Server::reason_t GameServer::conn_timeout(Connection *conn, Server::reason_t why) {
   if (conn == m_vault) {
     TrackPing_BackendMessage *msg = new TrackPing_BackendMessage(m_ipaddr, m_id);
@@ -1022,7 +1134,21 @@ Server::reason_t GameServer::conn_timeout(Connection *conn, Server::reason_t why
   } else if (conn == m_timers) {
     struct timeval now;
     gettimeofday(&now, NULL);
+    uint32_t late = 0;
+    if (timeval_lessthan(m_timers->m_timeout, now)) {
+      struct timeval diff;
+      timeval_difference(now, m_timers->m_timeout, diff);
+      late = (diff.tv_sec * 1000) + (diff.tv_usec / 1000);
+    }
+    pthread_mutex_lock(&m_load_mutex);
+    m_loop_lag = ((m_loop_lag * 7) + late) / 8;
+    pthread_mutex_unlock(&m_load_mutex);
     m_timers->handle_timeout(now);
+    if (m_checkpoint_due) {
+      m_checkpoint_due = false;
+      m_checkpoint.checkpoint(m_game_state.m_sdl);
+      start_checkpoint_timer();
+    }
     if (m_timed_shutdown) {
       log_info(m_log, "Since I'm alone, and sad, I'm going to kill myself\n");
       // try to do a shutdown, but new arrivals could be on the way, so 
@@ -1057,6 +1183,177 @@ Server::reason_t GameServer::conn_timeout(Connection *conn, Server::reason_t why
   return NO_SHUTDOWN;
 }
 
+bool GameServer::loop_pass() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  if (m_game_state.sdl_flush_due(now)) {
+    send_sdl_deltas();
+  }
+  if (m_game_state.far_flush_due(now)) {
+    send_far_movement();
+  }
+  if (m_tick_pending && !timeval_lessthan(now, m_tick_at)) {
+    send_tick();
+  }
+  return m_game_state.send_state(m_log);
+}
+
+void GameServer::send_sdl_deltas() {
+  std::map<SDLState*, GameState::sdl_delta_t>::iterator iter;
+  for (iter = m_game_state.m_sdl_deltas.begin(); iter != m_game_state.m_sdl_deltas.end(); iter++) {
+    GameState::sdl_delta_t &delta = iter->second;
+    SDLState *changed = iter->first->partial(delta.vars, delta.structs);
+    PlNetMsgSDLState *msg = new PlNetMsgSDLState(changed, false);
+    delete changed;
+    std::set<kinum_t> nearby;
+    kinum_t mover = 0;
+    if (m_game_state.managing_interest()) {
+      mover = m_game_state.avatar_owner(iter->first);
+      if (mover && !m_game_state.players_near(mover, nearby)) {
+        mover = 0;
+      }
+      if (mover) {
+        new_movement(mover);
+      }
+    }
+    std::list<GameConnection*>::iterator c_iter;
+    for (c_iter = m_clients.begin(); c_iter != m_clients.end(); c_iter++) {
+      GameConnection *gc = *c_iter;
+      if (!delta.mixed && gc->kinum() == delta.from_who) {
+        // the sender already has it
+        continue;
+      }
+      if (mover && gc->kinum() != mover && m_game_state.has_position(gc->kinum())
+          && nearby.find(gc->kinum()) == nearby.end()) {
+        m_game_state.fell_behind(mover, gc->kinum());
+        continue;
+      }
+      msg->add_ref();
+      broadcast_to(gc, msg, mover);
+    }
+    if (msg->del_ref() < 1) {
+      delete msg;
+    }
+  }
+  m_game_state.m_sdl_deltas.clear();
+}
+
+void GameServer::send_far_movement() {
+  m_game_state.m_far_pending = false;
+  std::map<kinum_t, GameState::position_t>::iterator iter;
+  for (iter = m_game_state.m_positions.begin(); iter != m_game_state.m_positions.end(); iter++) {
+    GameState::position_t &where = iter->second;
+    if (where.behind.empty()) {
+      continue;
+    }
+    // the whole state, since what was skipped is not known
+    PlNetMsgSDLState *msg = new PlNetMsgSDLState(where.avphys, false);
+    new_movement(iter->first);
+    std::set<kinum_t>::iterator b_iter;
+    for (b_iter = where.behind.begin(); b_iter != where.behind.end(); b_iter++) {
+      GameConnection *gc = find_player(*b_iter);
+      if (gc) {
+        msg->add_ref();
+        broadcast_to(gc, msg, iter->first);
+      }
+    }
+    if (msg->del_ref() < 1) {
+      delete msg;
+    }
+    where.behind.clear();
+  }
+}
+
+void GameServer::set_tick_rate(uint32_t hz) {
+  if (hz == 0) {
+    m_tick_ms = 0;
+    return;
+  }
+  if (hz < GAME_TICK_MIN_RATE) {
+    hz = GAME_TICK_MIN_RATE;
+  } else if (hz > GAME_TICK_MAX_RATE) {
+    hz = GAME_TICK_MAX_RATE;
+  }
+  m_tick_ms = 1000 / hz;
+}
+
+void GameServer::broadcast_to(GameConnection *gc, NetworkMessage *msg, kinum_t mover) {
+  if (!m_tick_ms) {
+    gc->enqueue(msg);
+    return;
+  }
+  if (mover) {
+    NetworkMessage *whole = whole_movement(mover);
+    if (whole && gc->drop_movement(mover)) {
+      // the new one goes at the end so it is still after anything held
+      // since the one it replaces
+      if (msg->del_ref() < 1) {
+        delete msg;
+      }
+      whole->add_ref();
+      msg = whole;
+    }
+  }
+  gc->hold(msg, mover);
+  start_tick();
+}
+
+NetworkMessage* GameServer::whole_movement(kinum_t mover) {
+  std::map<kinum_t, NetworkMessage*>::iterator found = m_whole_movement.find(mover);
+  if (found != m_whole_movement.end()) {
+    return found->second;
+  }
+  std::map<kinum_t, GameState::position_t>::iterator where = m_game_state.m_positions.find(mover);
+  if (where == m_game_state.m_positions.end()) {
+    return NULL;
+  }
+  NetworkMessage *msg = new PlNetMsgSDLState(where->second.avphys, false);
+  m_whole_movement[mover] = msg;
+  return msg;
+}
+
+void GameServer::new_movement(kinum_t mover) {
+  std::map<kinum_t, NetworkMessage*>::iterator found = m_whole_movement.find(mover);
+  if (found != m_whole_movement.end()) {
+    if (found->second->del_ref() < 1) {
+      delete found->second;
+    }
+    m_whole_movement.erase(found);
+  }
+}
+
+void GameServer::start_tick() {
+  if (m_tick_pending) {
+    return;
+  }
+  m_tick_pending = true;
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  if (timeval_lessthan(m_tick_at, now)) {
+    // nothing was sent for a whole tick, so don't wait
+    m_tick_at = now;
+  }
+  m_timers->insert(new TickTimer(m_tick_at));
+}
+
+void GameServer::send_tick() {
+  m_tick_pending = false;
+  std::list<GameConnection*>::iterator c_iter;
+  for (c_iter = m_clients.begin(); c_iter != m_clients.end(); c_iter++) {
+    (*c_iter)->release_held();
+  }
+  std::map<kinum_t, NetworkMessage*>::iterator iter;
+  for (iter = m_whole_movement.begin(); iter != m_whole_movement.end(); iter++) {
+    if (iter->second->del_ref() < 1) {
+      delete iter->second;
+    }
+  }
+  m_whole_movement.clear();
+  m_tick_at.tv_usec += m_tick_ms * 1000;
+  m_tick_at.tv_sec += m_tick_at.tv_usec / 1000000;
+  m_tick_at.tv_usec %= 1000000;
+}
+
 Server::reason_t GameServer::conn_shutdown(Connection *conn, Server::reason_t why) {
   if (conn == m_vault) {
     // XXX this is only recoverable in very particular circumstances,
@@ -1081,17 +1378,13 @@ Server::reason_t GameServer::conn_shutdown(Connection *conn, Server::reason_t wh
     // client shutdown
     GameConnection *gconn = (GameConnection*) conn;
     kinum_t kinum = gconn->kinum();
-    std::list<Connection*>::iterator c_iter;
+    std::list<GameConnection*>::iterator c_iter;
 
     // if there's no KI number set, they did not get through join, and
     // we should not do most of the following
     if (!kinum) {
-      for (c_iter = m_conns.begin(); c_iter != m_conns.end(); c_iter++) {
-        if (conn == *c_iter) {
-          m_conns.erase(c_iter);
-          break;
-        }
-      }
+      m_conns.remove(conn);
+      remove_client(gconn);
       delete conn;
 
       // if the last client just left us, set up the shutdown timer
@@ -1102,20 +1395,17 @@ Server::reason_t GameServer::conn_shutdown(Connection *conn, Server::reason_t wh
 
     // change GroupOwner
     if (kinum == m_group_owner) {
-      for (c_iter = m_conns.begin(); c_iter != m_conns.end(); c_iter++) {
-        Connection *c = *c_iter;
-        if (c != conn && c != m_vault && c != m_timers) {
-          GameConnection *gc = (GameConnection*) c;
-          if (gc->state() >= JOINED) {
-            // we found one
-            PlNetMsgGroupOwner *owner = new PlNetMsgGroupOwner(true);
-            c->enqueue(owner);
-            m_group_owner = ((GameConnection*) c)->kinum();
-            break;
-          }
+      for (c_iter = m_clients.begin(); c_iter != m_clients.end(); c_iter++) {
+        GameConnection *gc = *c_iter;
+        if (gc != conn && gc->state() >= JOINED) {
+          // we found one
+          PlNetMsgGroupOwner *owner = new PlNetMsgGroupOwner(true);
+          gc->enqueue(owner);
+          m_group_owner = gc->kinum();
+          break;
         }
       }
-      if (c_iter == m_conns.end()) {
+      if (c_iter == m_clients.end()) {
         // no other player found
         m_group_owner = 0;
       }
@@ -1161,7 +1451,7 @@ Server::reason_t GameServer::conn_shutdown(Connection *conn, Server::reason_t wh
           // this special case is for object clones, which have
           // physical SDL (not avatarPhysical)
           log_debug(m_log, "SDL cleanup: Keeping SDL %s(%u:%u) because it's physical SDL\n",
-              key.m_name->c_str(), key.m_cloneplayerid, key.m_cloneid);
+              key.name(), key.m_cloneplayerid, key.m_cloneid);
           iter++;
           continue;
         }
@@ -1180,10 +1470,10 @@ Server::reason_t GameServer::conn_shutdown(Connection *conn, Server::reason_t wh
 
               // I don't like these special casing the fireflies but I don't
               // know what else to do
-              if ((submsg_type == plLoadAvatarMsg && is_player) || (*(key.m_name) == "BugFlockingEmitTest")) {
+              if ((submsg_type == plLoadAvatarMsg && is_player) || !strcmp(key.name(), "BugFlockingEmitTest")) {
                 // player avatar and bugs
                 // prepare to send unload to other clients
-                log_debug(m_log, "SDL cleanup: Unloading %s (%u)\n", key.m_name->c_str(), key.m_cloneplayerid);
+                log_debug(m_log, "SDL cleanup: Unloading %s (%u)\n", key.name(), key.m_cloneplayerid);
                 unload_msg = new PlNetMsgLoadClone(sdl_buf + 5, clone_len, key, kinum, false, is_player);
                 unload_msgs.push_back(unload_msg);
               } else if (submsg_type == plLoadAvatarMsg) {
@@ -1191,14 +1481,14 @@ Server::reason_t GameServer::conn_shutdown(Connection *conn, Server::reason_t wh
                 // keep around, but only if there are other players
                 // in the age (necessary for quabs)
                 if (m_group_owner) {
-                  log_debug(m_log, "SDL cleanup: Keeping avatar %s(%u:%u)\n", key.m_name->c_str(), key.m_cloneplayerid, key.m_cloneid);
+                  log_debug(m_log, "SDL cleanup: Keeping avatar %s(%u:%u)\n", key.name(), key.m_cloneplayerid, key.m_cloneid);
                   iter++;
                   continue;
                 }
               } else {
                 // keep object clones around
                 log_debug(m_log, "SDL cleanup: Keeping object clone "
-                    "%s(%u:%u)\n", key.m_name->c_str(), key.m_cloneplayerid, key.m_cloneid);
+                    "%s(%u:%u)\n", key.name(), key.m_cloneplayerid, key.m_cloneid);
                 iter++;
                 continue;
               }
@@ -1212,7 +1502,7 @@ Server::reason_t GameServer::conn_shutdown(Connection *conn, Server::reason_t wh
         // literally see no possible way to do this except by special-casing
         // it, because avatarPhysical messages have nothing to distinguish
         // player avatars and NPC avatars.
-        else if (*(key.m_name) == "Quab") {
+        else if (!strcmp(key.name(), "Quab")) {
           if (m_group_owner) {
             log_debug(m_log, "SDL cleanup: Keeping Quab physical\n");
             iter++;
@@ -1220,9 +1510,9 @@ Server::reason_t GameServer::conn_shutdown(Connection *conn, Server::reason_t wh
           }
         }
         log_debug(m_log, "SDL cleanup: dropping %s SDL %s(%u:%u)\n",
-            s->get_desc()->name(), key.m_name->c_str(), key.m_cloneplayerid, key.m_cloneid);
+            s->get_desc()->name(), key.name(), key.m_cloneplayerid, key.m_cloneid);
 #endif
-        iter = m_game_state.m_sdl.erase(iter);
+        iter = m_game_state.erase_sdl(iter);
         delete s;
       } else {
         iter++;
@@ -1236,34 +1526,25 @@ Server::reason_t GameServer::conn_shutdown(Connection *conn, Server::reason_t wh
     member_msg->finalize(false);
 #endif
 
-    for (c_iter = m_conns.begin(); c_iter != m_conns.end();) {
-      Connection *c = *c_iter;
-      if (conn == c) {
-        c_iter = m_conns.erase(c_iter);
-#ifdef STANDALONE
-        break;
-#endif
-      } else {
+    m_conns.remove(conn);
+    remove_client(gconn);
 #ifndef STANDALONE
-        if (c != m_vault && c != m_timers) {
-          // tell other clients this one is leaving
-          GameConnection *gc = (GameConnection*) c;
-          if (gc->state() >= STATE_REQUESTED && unload_msg) {
-            for (uint32_t i = 0; i < unload_msgs.size(); i++) {
-              unload_msg = unload_msgs[i];
-              unload_msg->add_ref();
-              c->enqueue(unload_msg);
-            }
-          }
-          if (gc->state() >= MEMBERS_REQUESTED) {
-            member_msg->add_ref();
-            c->enqueue(member_msg);
-          }
+    for (c_iter = m_clients.begin(); c_iter != m_clients.end(); c_iter++) {
+      // tell other clients this one is leaving
+      GameConnection *gc = *c_iter;
+      if (gc->state() >= STATE_REQUESTED && unload_msg) {
+        for (uint32_t i = 0; i < unload_msgs.size(); i++) {
+          unload_msg = unload_msgs[i];
+          unload_msg->add_ref();
+          gc->enqueue(unload_msg);
         }
-#endif
-        c_iter++;
+      }
+      if (gc->state() >= MEMBERS_REQUESTED) {
+        member_msg->add_ref();
+        gc->enqueue(member_msg);
       }
     }
+#endif
 
 #ifndef STANDALONE
     if (unload_msg) {
@@ -1417,9 +1698,50 @@ void GameServer::queue_client_connection(GameConnection *conn, NetworkMessage *m
   pthread_mutex_lock(&m_client_queue_mutex);
   m_client_queue->push_back(std::pair<GameConnection*, NetworkMessage*>(conn, msg));
   m_fake_signal = 1;
+  if (m_host) {
+    m_host->wake();
+  }
   pthread_mutex_unlock(&m_client_queue_mutex);
 }
 
+bool GameServer::bind_instance(const uint8_t *uuid, const std::string &log_file) {
+  pthread_mutex_lock(&m_client_queue_mutex);
+  bool ok = !m_closed && !m_bind_pending;
+  if (ok) {
+    memcpy(m_bind_uuid, uuid, UUID_RAW_LEN);
+    m_bind_log = log_file;
+    m_bind_pending = true;
+    m_fake_signal = 1;
+  }
+  pthread_mutex_unlock(&m_client_queue_mutex);
+  return ok;
+}
+
+void GameServer::get_queued_instance() {
+  pthread_mutex_lock(&m_client_queue_mutex);
+  if (!m_bind_pending) {
+    pthread_mutex_unlock(&m_client_queue_mutex);
+    return;
+  }
+  m_bind_pending = false;
+  memcpy(m_age_uuid, m_bind_uuid, UUID_RAW_LEN);
+  std::string log_file = m_bind_log;
+  pthread_mutex_unlock(&m_client_queue_mutex);
+
+  if (!log_file.empty() && m_log) {
+    log_info(m_log, "Switching to log file %s\n", log_file.c_str());
+    m_log->reopen(log_file.c_str());
+  }
+  m_warm = false;
+  load_instance();
+  // the server may have been waiting longer than LingerTime
+  maybe_start_shutdown_timer();
+  if (m_vault && !m_vault->in_connect()) {
+    // otherwise conn_completed() sends it
+    send_game_hello();
+  }
+}
+
 void GameServer::get_queued_connections() {
   // swap queues so as to not hold the mutex, blocking the dispatcher
   std::deque<std::pair<GameConnection*, NetworkMessage*> > *new_queue, *newconns;
@@ -1446,6 +1768,7 @@ void GameServer::get_queued_connections() {
     if (c_iter == m_conns.end()) {
       // normal code path
       m_conns.push_back(conn);
+      m_clients.push_back(conn);
     }
 
     Server::reason_t result;
@@ -1561,20 +1884,11 @@ Server::reason_t GameServer::handle_join_request(Connection *conn, NetworkMessag
   // see if we're in the bad state where we failed to notice the player
   // left from a previous visit already
   if (result == NO_ERROR) {
-    std::list<Connection*>::iterator c_iter;
-    for (c_iter = m_conns.begin(); c_iter != m_conns.end(); c_iter++) {
-      Connection *c = *c_iter;
-      if (c != conn && c != m_vault && c != m_timers) {
-        GameConnection *gc = (GameConnection*) c;
-        if (gc->kinum() == join->kinum()) {
-          // bleah.
-          log_warn(m_log, "Player kinum %u is arriving, but already present\n", join->kinum());
-          conn_shutdown(c, PEER_SHUTDOWN);
-          // c_iter invalidated by conn_shutdown (besides, this very code
-          // should ensure we don't have > 1 "old" player)
-          break;
-        }
-      }
+    GameConnection *gc = find_player(join->kinum());
+    if (gc && gc != conn) {
+      // bleah.
+      log_warn(m_log, "Player kinum %u is arriving, but already present\n", join->kinum());
+      conn_shutdown(gc, PEER_SHUTDOWN);
     }
   }
 
@@ -1590,6 +1904,8 @@ Server::reason_t GameServer::handle_join_request(Connection *conn, NetworkMessag
     gconn->set_state(JOINED);
     gconn->set_logger(m_log);
     gconn->set_kinum(join->kinum());
+    m_players[join->kinum()] = gconn;
+    count_players();
     gconn->set_uuid(join->uuid());
     gconn->player_name() = player_name;
 
@@ -1633,18 +1949,17 @@ Server::reason_t GameServer::handle_join_request(Connection *conn, NetworkMessag
     PlNetMsgMembersMsg *member_msg = new PlNetMsgMembersMsg(join->kinum());
     member_msg->addMember(join->kinum(), &(gconn->player_name()), &(gconn->plKey()), true);
     member_msg->finalize(false);
-    std::list<Connection*>::iterator c_iter;
-    for (c_iter = m_conns.begin(); c_iter != m_conns.end(); c_iter++) {
-      Connection *c = *c_iter;
-      if (c != conn && c != m_vault && c != m_timers) {
-        GameConnection *gc = (GameConnection*) c;
+    std::list<GameConnection*>::iterator c_iter;
+    for (c_iter = m_clients.begin(); c_iter != m_clients.end(); c_iter++) {
+      GameConnection *gc = *c_iter;
+      if (gc != conn) {
         if (gc->state() < MEMBERS_REQUESTED) {
           // don't forward message, we'll get the member in the
           // MemberListReq
           continue;
         }
         member_msg->add_ref();
-        c->enqueue(member_msg);
+        gc->enqueue(member_msg);
       }
     }
     if (member_msg->del_ref() < 1) {
@@ -1677,6 +1992,8 @@ GameServer::DispatcherConnection::forward_conn(GameConnection *game_conn) {
 
 Server::reason_t GameServer::GameSignalProcessor::signalled(int32_t *todo, Server *s) {
   GameServer *gs = (GameServer*) s;
+  // a bound instance comes before any client for it
+  gs->get_queued_instance();
   gs->get_queued_connections();
   return NO_SHUTDOWN;
 }
@@ -1696,7 +2013,7 @@ void GameServer::cancel_shutdown_timer() {
 }
 
 void GameServer::maybe_start_shutdown_timer() {
-  if (m_conns.size() == 2 && m_joiners == 0) {
+  if (m_clients.empty() && m_joiners == 0) {
     if (m_shutdown_timer) {
       if (m_timed_shutdown) {
         log_debug(m_log, "Maybe start shutdown timer arrived, but we have already started shutdown\n");
@@ -1712,21 +2029,66 @@ void GameServer::maybe_start_shutdown_timer() {
   }
 }
 
+void GameServer::start_checkpoint_timer() {
+  struct timeval when;
+  gettimeofday(&when, NULL);
+  when.tv_sec += AGESTATE_CHECKPOINT_INTERVAL;
+  m_timers->insert(new CheckpointTimer(when, m_checkpoint_due));
+}
+
 bool GameServer::send_to_ki(kinum_t kinum, NetworkMessage *msg) {
   GameMgrMessage *gmm = (GameMgrMessage*) msg;
-  std::list<Connection*>::iterator c_iter;
-  for (c_iter = m_conns.begin(); c_iter != m_conns.end(); c_iter++) {
-    Connection *c = *c_iter;
-    if (c != m_vault && c != m_timers) {
-      GameConnection *gc = (GameConnection*) c;
-      if (gc->kinum() == kinum) {
-        gmm->add_ref();
-        c->enqueue(gmm);
-        return true;
-      }
-    }
+  GameConnection *gc = find_player(kinum);
+  if (!gc) {
+    return false;
   }
-  return false;
+  gmm->add_ref();
+  gc->enqueue(gmm);
+  return true;
+}
+
+GameServer::GameConnection* GameServer::find_player(kinum_t kinum) const {
+  std::map<kinum_t, GameConnection*>::const_iterator iter = m_players.find(kinum);
+  if (iter == m_players.end()) {
+    return NULL;
+  }
+  return iter->second;
+}
+
+void GameServer::remove_client(GameConnection *conn) {
+  const MessageQueue::voice_stats_t &voice = conn->msg_queue()->voice_stats();
+  if (voice.sent || voice.dropped) {
+    log_msgs(m_log, "Voice to kinum=%u: %u relayed, %u dropped, waited %u ms on average, %u ms at most\n",
+        conn->kinum(), voice.sent, voice.dropped,
+        voice.sent ? (uint32_t) (voice.wait_total / voice.sent / 1000) : 0, voice.wait_max / 1000);
+  }
+  m_clients.remove(conn);
+  m_game_state.end_state_transfer(conn);
+  std::map<kinum_t, GameConnection*>::iterator iter = m_players.find(conn->kinum());
+  if (iter != m_players.end() && iter->second == conn) {
+    m_players.erase(iter);
+    count_players();
+  }
+}
+
+void GameServer::count_players() {
+  pthread_mutex_lock(&m_load_mutex);
+  m_player_count = m_players.size();
+  pthread_mutex_unlock(&m_load_mutex);
+}
+
+uint32_t GameServer::player_count() {
+  pthread_mutex_lock(&m_load_mutex);
+  uint32_t count = m_player_count;
+  pthread_mutex_unlock(&m_load_mutex);
+  return count;
+}
+
+uint32_t GameServer::loop_lag() {
+  pthread_mutex_lock(&m_load_mutex);
+  uint32_t lag = m_loop_lag;
+  pthread_mutex_unlock(&m_load_mutex);
+  return lag;
 }
 
 bool GameServer::send_to_vault(BackendMessage *msg) {
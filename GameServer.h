@@ -33,6 +33,7 @@
 //
 //#include <deque>
 //#include <list>
+//#include <string>
 //
 //#include "Buffer.h"
 //
@@ -43,11 +44,19 @@
 //
 //#include "moss_serv.h"
 //#include "GameState.h"
+//#include "AgeCheckpoint.h"
+//#include "AgeStateFile.h"
+
+class GameHost;
+class SDLRegistry;
+class SDLCompressor;
 
 class GameServer: public Server {
+  friend class GameHost;
 public:
   GameServer(const char *server_dir, bool is_a_thread, struct sockaddr_in &vault_address, const uint8_t *uuid,
-      const char *filename, in_addr_t connect_ipaddr, in_port_t connect_ipport, AgeDesc *age, std::list<SDLDesc*> &sdl);
+      const char *filename, in_addr_t connect_ipaddr, in_port_t connect_ipport, AgeDesc *age, SDLRegistry *sdl,
+      const SDLDescIndex *age_sdl);
   virtual ~GameServer();
 
   int32_t type() const {
@@ -66,6 +75,59 @@ public:
 
   reason_t conn_timeout(Connection *conn, reason_t why);
   reason_t conn_shutdown(Connection *conn, reason_t why);
+  // sends the next batch of initial age state, merged SDL changes, and
+  // movement held back from players far away
+  bool loop_pass();
+
+  // collect SDL changes for this many ms and send them together (0 to
+  // forward every update as it comes)
+  void set_sdl_merge_ms(uint32_t ms) {
+    m_game_state.m_sdl_merge_ms = ms;
+  }
+  // send avatar movement right away only to players within this many feet
+  // (0 to send it to everyone)
+  void set_interest_radius(uint32_t feet) {
+    m_game_state.m_interest_radius = feet;
+  }
+  // hold broadcast messages and send each client everything for it at most
+  // this many times a second, instead of as each message comes (0 to send
+  // right away); the rate is kept within GAME_TICK_MIN_RATE and
+  // GAME_TICK_MAX_RATE
+  void set_tick_rate(uint32_t hz);
+  // for the dispatcher's load reports, from its thread: the players here,
+  // and a moving average of how late timers are handled (ms)
+  uint32_t player_count();
+  uint32_t loop_lag();
+  // compress initial age state in the compressor's thread (the game server
+  // keeps a reference)
+  void set_compressor(SDLCompressor *compressor);
+#ifndef FORK_GAME_TOO
+  // run in a GameHost's thread, sharing its backend connection, instead of
+  // our own (call before init())
+  void set_host(GameHost *host) {
+    m_host = host;
+  }
+  // Make this a warm game server, started before there is an age instance
+  // for it (call before init(), with a NULL UUID). Its init() only connects
+  // to the backend and says hello; the age state is loaded, and the backend
+  // told which instance this is, when the dispatcher binds it.
+  void set_warm() {
+    m_warm = true;
+  }
+  // Called by the dispatcher to give a running warm game server its age
+  // instance; the game server's thread loads the age state, switches to
+  // the instance's log file, and tells the backend it is up. The dispatcher
+  // must wake up the thread afterwards. Returns false, and the game server
+  // stays unbound, if it has started shutting down.
+  bool bind_instance(const uint8_t *uuid, const std::string &log_file);
+  // the address clients are sent to (network order)
+  in_addr_t ipaddr() const {
+    return m_ipaddr;
+  }
+  in_port_t ipport() const {
+    return m_ipport;
+  }
+#endif
 
   // protocol info
   typedef enum {
@@ -106,9 +168,7 @@ public:
       memset(m_client_uuid, 0, UUID_RAW_LEN);
       m_key.make_null();
     }
-    virtual ~GameConnection() {
-      m_key.delete_name();
-    }
+    virtual ~GameConnection();
     state_t state() const {
       return m_state;
     }
@@ -142,8 +202,28 @@ public:
     }
     void set_key(const PlKey &key);
 
+    // hold a broadcast message (with a reference already added) for the
+    // next tick; mover is the player whose movement it is, or 0
+    void hold(NetworkMessage *msg, kinum_t mover) {
+      m_held.push_back(std::pair<NetworkMessage*, kinum_t>(msg, mover));
+    }
+    // let go of the held movement of mover; returns false if there is none
+    bool drop_movement(kinum_t mover);
+    // queue the held messages, in order
+    void release_held();
+    // a message sent straight to the client must not overtake earlier
+    // broadcasts held for the next tick, so those go first; voice is out of
+    // order anyway (it has its own lane), so it leaves them held
+    void enqueue(NetworkMessage *msg, MessageQueue::priority_t p = MessageQueue::NORMAL) {
+      if (p != MessageQueue::VOICE) {
+        release_held();
+      }
+      Connection::enqueue(msg, p);
+    }
+
   protected:
     state_t m_state;
+    std::list<std::pair<NetworkMessage*, kinum_t> > m_held;
 
     uint8_t m_client_uuid[UUID_RAW_LEN];
     kinum_t m_kinum;
@@ -166,6 +246,8 @@ public:
   void queue_client_connection(GameConnection *conn, NetworkMessage *msg);
   // this is called by the GameSignalProcessor to complete the handoff
   void get_queued_connections();
+  // this is called by the GameSignalProcessor to finish bind_instance()
+  void get_queued_instance();
 #else
   // this connection is used for both ends of the socket-based protocol
   // between the dispatcher and game servers, which is why it's defined
@@ -201,8 +283,31 @@ protected:
   struct sockaddr_in m_vault_addr;
   Connection *m_vault;
 
+  /*
+   * client connections
+   */
+  // the game clients in m_conns (everything but m_vault and m_timers)
+  std::list<GameConnection*> m_clients;
+  // the joined clients by KI number
+  std::map<kinum_t, GameConnection*> m_players;
+  // returns NULL if the player is not here
+  GameConnection* find_player(kinum_t kinum) const;
+  // call when removing a client from m_conns
+  void remove_client(GameConnection *conn);
+
   reason_t backend_message(Connection *conn, BackendMessage *msg);
 
+  // send the SDL changes collected in m_game_state
+  void send_sdl_deltas();
+  // send the latest movement to players who were not sent it because they
+  // were far away
+  void send_far_movement();
+  // queue a broadcast message to gc, or hold it for the next tick; mover
+  // is the player whose movement it is, or 0; does not add a reference
+  void broadcast_to(GameConnection *gc, NetworkMessage *msg, kinum_t mover);
+  // queue every client's held messages
+  void send_tick();
+
   /*
    * timers
    */
@@ -211,7 +316,9 @@ protected:
   public:
     typedef enum {
       SHUTDOWN = 0,
-      CLIENT_JOIN = 1
+      CLIENT_JOIN = 1,
+      CHECKPOINT = 2,
+      TICK = 3
     } timer_type_t;
     GameTimer(struct timeval &when, timer_type_t type) :
         Timer(when), m_type(type) {
@@ -245,6 +352,63 @@ protected:
   void cancel_shutdown_timer();
   void maybe_start_shutdown_timer();
 
+  // the CheckpointTimer says it's time to checkpoint the age state; the
+  // checkpoint is taken after the timers are run, since that inserts the
+  // next timer
+  AgeCheckpoint m_checkpoint;
+  // the loaded age state; the SDL states from it use its memory
+  AgeStateFile m_state_file;
+  bool m_checkpoint_due;
+  class CheckpointTimer: public GameTimer {
+  public:
+    CheckpointTimer(struct timeval &when, bool &due) :
+        GameTimer(when, CHECKPOINT), m_due(due) {
+    }
+    void callback() {
+      m_due = true;
+    }
+  protected:
+    bool &m_due;
+  };
+  void start_checkpoint_timer();
+  // read in the age instance's saved state, and start checkpointing it
+  void load_instance();
+  // write out the age instance's state at shutdown
+  void save_instance();
+  // tell the backend which age instance this is
+  void send_game_hello();
+
+  // with a tick rate, broadcast messages are held by each GameConnection
+  // and sent at m_tick_at, which is at least m_tick_ms after the last
+  // tick; the TickTimer only wakes up the select loop, and loop_pass()
+  // sends them
+  uint32_t m_tick_ms;
+  bool m_tick_pending;
+  struct timeval m_tick_at;
+  // copies of m_players.size() and the timer lateness for the dispatcher,
+  // guarded by m_load_mutex
+  pthread_mutex_t m_load_mutex;
+  uint32_t m_player_count;
+  uint32_t m_loop_lag;
+  // call after changing m_players
+  void count_players();
+  class TickTimer: public GameTimer {
+  public:
+    TickTimer(struct timeval &when) :
+        GameTimer(when, TICK) {
+    }
+    void callback() { }
+  };
+  // call when a message is held, to make sure the next tick is coming
+  void start_tick();
+  // When a client already holds a player's movement, both are replaced by
+  // their whole avatarPhysical state, since either may be only some of
+  // the variables. These are those whole states, made once per update
+  // for all the clients; call new_movement() before sending each update.
+  std::map<kinum_t, NetworkMessage*> m_whole_movement;
+  NetworkMessage* whole_movement(kinum_t mover);
+  void new_movement(kinum_t mover);
+
   /*
    * new connection state tracking
    */
@@ -291,7 +455,18 @@ protected:
     reason_t signalled(int32_t *todo, Server *s);
   };
   GameSignalProcessor m_signal_processor;
+  // NULL unless run by a GameHost; m_vault is the host's then, and is not
+  // in m_conns
+  GameHost *m_host;
+  // the instance from bind_instance(), also guarded by m_client_queue_mutex;
+  // m_closed is set once the game server cannot take one any more
+  bool m_bind_pending;
+  uint8_t m_bind_uuid[UUID_RAW_LEN];
+  std::string m_bind_log;
+  bool m_closed;
 #endif /* !FORK_GAME_TOO */
+  // true until a warm game server has its age instance
+  bool m_warm;
 
   /*
    * per-age data
@@ -299,7 +474,8 @@ protected:
   uint8_t m_age_uuid[16];
   char *m_filename;
   AgeDesc *m_age;
-  std::list<SDLDesc*> m_agesdl;
+  // holds on to the SDLDescs in m_game_state.m_allsdl
+  SDLRegistry *m_sdl;
 
   // dynamic per-age data
   kinum_t m_group_owner;
@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
@@ -37,8 +39,12 @@
 #include <netinet/in.h>
 
 #include <stdexcept>
+#include <algorithm>
 #include <deque>
 #include <list>
+#include <map>
+#include <set>
+#include <string>
 #include <vector>
 
 #ifdef HAVE_OPENSSL_RC4
@@ -68,6 +74,8 @@
 
 #include "moss_serv.h"
 #include "GameState.h"
+#include "AgeCheckpoint.h"
+#include "AgeStateFile.h"
 #include "GameServer.h"
 #include "GameHandler.h"
 
@@ -100,22 +108,18 @@ static const uint8_t TicTacToe_UUID[] = { 0x29, 0x65, 0x23, 0xa7, 0xd8, 0x11,
            0x59, 0xcb, 0x43, 0x44, 0x5a, 0x83 };
 
 GameState::~GameState() {
-  // Note, be careful with the locks: if there are any pending ClearLockTimers
-  // they'll access memory freed here. The GameServer object should not be
-  // deleted if that's true (and the m_conns (thus Timers) should be deleted
-  // before the embedded GameState member), so we should be good. But to be
-  // certain we don't write to the freed space, even if everything else has
-  // gone wrong, bump the lockseq before deleting. (We'd still read from the
-  // freed memory, but if the memory has been reallocated, that's okay while
-  // writing is not okay. There is still a problem in the unlikely chance the
-  // reallocated memory has data there that matches the new lockseq but this
-  // is all not supposed to happen in multiple ways already.)
-  std::list<ObjectLock*>::iterator l_iter;
-  for (l_iter = m_locks.begin(); l_iter != m_locks.end(); l_iter++) {
-    ObjectLock *lock = *l_iter;
-    lock->lockseq++;
-    delete lock;
+  // The GameServer's TimerQueue is deleted after this (by ~Server), so take
+  // out any lock timers still in it.
+  for (uint32_t i = 0; m_lock_table && i <= m_lock_mask; i++) {
+    ObjectLock *lock = m_lock_table[i];
+    if (lock) {
+      if (lock->expiry.queued()) {
+        m_timers->remove(&lock->expiry);
+      }
+      delete lock;
+    }
   }
+  delete[] m_lock_table;
 
   // GameMgrs
   std::list<GameMgr*>::iterator g_iter;
@@ -128,11 +132,37 @@ GameState::~GameState() {
   }
 }
 
+uint32_t GameState::sdl_hash(SDLState *sdl) {
+  // the descriptor name is compared case-insensitively, so fold case here
+  uint32_t h = sdl->key().hash();
+  for (const char *c = sdl->get_desc()->name(); *c; c++) {
+    h = (h ^ (uint8_t)tolower(*c)) * 16777619U;
+  }
+  return h;
+}
+
+void GameState::index_sdl(SDLState *sdl) {
+  m_sdl_index.insert(std::pair<uint32_t, SDLState*>(sdl_hash(sdl), sdl));
+}
+
+void GameState::unindex_sdl(SDLState *sdl) {
+  std::pair<std::multimap<uint32_t, SDLState*>::iterator, std::multimap<uint32_t, SDLState*>::iterator> range =
+      m_sdl_index.equal_range(sdl_hash(sdl));
+  for (std::multimap<uint32_t, SDLState*>::iterator iter = range.first; iter != range.second; iter++) {
+    if (iter->second == sdl) {
+      m_sdl_index.erase(iter);
+      break;
+    }
+  }
+}
+
 SDLState* GameState::find_sdl_like(SDLState *new_sdl) const {
   const char *new_name = new_sdl->get_desc()->name();
-  std::list<SDLState*>::const_iterator iter;
-  for (iter = m_sdl.begin(); iter != m_sdl.end(); iter++) {
-    SDLState *sdl = *iter;
+  std::pair<std::multimap<uint32_t, SDLState*>::const_iterator, std::multimap<uint32_t, SDLState*>::const_iterator> range =
+      m_sdl_index.equal_range(sdl_hash(new_sdl));
+  std::multimap<uint32_t, SDLState*>::const_iterator iter;
+  for (iter = range.first; iter != range.second; iter++) {
+    SDLState *sdl = iter->second;
     if (sdl->key() == new_sdl->key() && sdl->name_equals(new_name)) {
       return sdl;
     }
@@ -143,6 +173,373 @@ SDLState* GameState::find_sdl_like(SDLState *new_sdl) const {
 void GameState::add_sdl(SDLState *new_sdl) {
   new_sdl->expand();
   m_sdl.push_back(new_sdl);
+  index_sdl(new_sdl);
+}
+
+void GameState::rebuild_sdl_index() {
+  m_sdl_index.clear();
+  std::list<SDLState*>::const_iterator iter;
+  for (iter = m_sdl.begin(); iter != m_sdl.end(); iter++) {
+    index_sdl(*iter);
+  }
+}
+
+void GameState::replace_sdl(SDLState *old_sdl, SDLState *new_sdl) {
+  std::list<SDLState*>::iterator iter;
+  for (iter = m_sdl.begin(); iter != m_sdl.end(); iter++) {
+    if (*iter == old_sdl) {
+      *iter = new_sdl;
+      unindex_sdl(old_sdl);
+      index_sdl(new_sdl);
+      break;
+    }
+  }
+  // the new state is forwarded whole
+  m_sdl_deltas.erase(old_sdl);
+  kinum_t owner = avatar_owner(old_sdl);
+  if (owner) {
+    m_positions[owner].avphys = new_sdl;
+  }
+  std::list<StateTransfer>::iterator t_iter;
+  for (t_iter = m_transfers.begin(); t_iter != m_transfers.end(); t_iter++) {
+    std::replace(t_iter->pending.begin(), t_iter->pending.end(), old_sdl, new_sdl);
+  }
+}
+
+void GameState::merge_sdl(std::list<SDLState*> &newer) {
+  std::list<SDLState*>::iterator iter;
+  for (iter = newer.begin(); iter != newer.end(); iter++) {
+    SDLState *sdl = *iter;
+    SDLState *old = find_sdl_like(sdl);
+    if (old) {
+      replace_sdl(old, sdl);
+      delete old;
+    } else {
+      m_sdl.push_back(sdl);
+      index_sdl(sdl);
+    }
+  }
+  newer.clear();
+}
+
+std::list<SDLState*>::iterator GameState::erase_sdl(std::list<SDLState*>::iterator iter) {
+  SDLState *sdl = *iter;
+  unindex_sdl(sdl);
+  // a kickable's filter must not outlive its master
+  std::pair<std::multimap<uint32_t, std::list<sdl_filter_t>::iterator>::iterator,
+      std::multimap<uint32_t, std::list<sdl_filter_t>::iterator>::iterator> range =
+      m_physicals_index.equal_range(sdl->key().hash());
+  for (std::multimap<uint32_t, std::list<sdl_filter_t>::iterator>::iterator f_iter = range.first; f_iter != range.second;
+      f_iter++) {
+    if (f_iter->second->master == sdl) {
+      m_physicals.erase(f_iter->second);
+      m_physicals_index.erase(f_iter);
+      break;
+    }
+  }
+  m_sdl_deltas.erase(sdl);
+  kinum_t owner = avatar_owner(sdl);
+  if (owner) {
+    forget_position(owner);
+  }
+  // nor should it be sent to anyone joining
+  std::list<StateTransfer>::iterator t_iter;
+  for (t_iter = m_transfers.begin(); t_iter != m_transfers.end(); t_iter++) {
+    t_iter->pending.erase(std::remove(t_iter->pending.begin(), t_iter->pending.end(), sdl), t_iter->pending.end());
+  }
+  return m_sdl.erase(iter);
+}
+
+void GameState::start_state_transfer(Server::Connection *conn, kinum_t ki, uint32_t pages, const uint32_t *pageids,
+    Logger *log) {
+  m_transfers.push_back(StateTransfer());
+  StateTransfer &job = m_transfers.back();
+  job.conn = conn;
+  job.ki = ki;
+  job.all = (pageids == NULL);
+  job.sent = 0;
+
+  std::deque<SDLState*> rest, physicals;
+  std::list<SDLState*>::const_iterator iter;
+  for (iter = m_sdl.begin(); iter != m_sdl.end(); iter++) {
+    SDLState *sdl = *iter;
+    PlKey &key = sdl->key();
+    if (!job.all) {
+      // send only that which matches the requested pages
+      uint32_t i;
+      for (i = 0; i < pages; i++) {
+        if (key.m_locsequencenumber == pageids[i]) {
+          break;
+        }
+      }
+      if (i == pages) {
+        continue;
+      }
+    }
+#ifdef STANDALONE
+    // just send everything that hasn't got a client ID in the key (gets
+    // around clone ordering, Yeesha avatar, firefly clones, etc. issues)
+    if (job.all && (key.m_contents & PlKey::HasCloneIDs)) {
+      continue;
+    }
+#endif
+    if (sdl->name_equals("CloneMessage")) {
+      if (job.all) {
+        const uint8_t *sdl_buf = sdl->vars()[0]->m_value[0].v_creatable;
+        if (sdl_buf && sdl_buf[4] && key.m_cloneplayerid == ki) {
+          // the client loads the clone before asking for the age state,
+          // so don't send the player's own clone back
+          continue;
+        }
+      }
+      // clones have to be sent before SDL that pertains to them
+      job.pending.push_back(sdl);
+    } else if (!strcmp(key.name(), "AgeSDLHook")) {
+      job.pending.push_back(sdl);
+    } else if (sdl->name_equals("physical") || sdl->name_equals("avatarPhysical")) {
+      physicals.push_back(sdl);
+    } else {
+      rest.push_back(sdl);
+    }
+  }
+  job.pending.insert(job.pending.end(), rest.begin(), rest.end());
+  job.pending.insert(job.pending.end(), physicals.begin(), physicals.end());
+  log_debug(log, "Queued %u SDL states for GameStateRequest (kinum=%u)\n", (uint32_t) job.pending.size(), ki);
+}
+
+bool GameState::send_state(Logger *log) {
+  bool more = false;
+  std::list<StateTransfer>::iterator t_iter;
+  for (t_iter = m_transfers.begin(); t_iter != m_transfers.end();) {
+    StateTransfer &job = *t_iter;
+    if (job.conn->queue_size() >= STATE_TRANSFER_BATCH) {
+      // wait until the client has taken some of what it has already
+      t_iter++;
+      continue;
+    }
+    bool waiting = false;
+    if (m_compressor) {
+      // get the compressor started on what is coming up
+      for (uint32_t i = 0; i < job.pending.size() && i < STATE_TRANSFER_BATCH * 2; i++) {
+        SDLState *sdl = job.pending[i];
+        if (!(job.all && sdl->name_equals("CloneMessage"))) {
+          PlNetMsgSDLState::prepare(sdl, m_compressor);
+        }
+      }
+    }
+    uint32_t batch = 0;
+    while (batch < STATE_TRANSFER_BATCH && !job.pending.empty()) {
+      SDLState *sdl = job.pending.front();
+      if (m_compressor && !PlNetMsgSDLState::ready(sdl)) {
+        // the states have to go in order
+        waiting = true;
+        break;
+      }
+      job.pending.pop_front();
+      PlKey &key = sdl->key();
+      if (job.all && sdl->name_equals("CloneMessage")) {
+        // clones are handled differently
+        const uint8_t *sdl_buf = sdl->vars()[0]->m_value[0].v_creatable;
+        if (!sdl_buf) {
+          log_err(log, "CloneMessage SDL is missing its data!\n");
+          // well, throw that one away, it's useless
+          continue;
+        }
+        uint32_t clone_len = read32(sdl_buf, 0);
+        uint8_t is_player = sdl_buf[4];
+        // quabs arrive with "is_player" zero, but the MOUL server
+        // sent them to new arrivals with the value as 1
+        // (perhaps this flag is actually "hidden")
+        // how do I know what to do without this special case?
+        if (!strcmp(key.name(), "Quab")) {
+          is_player = 1;
+        }
+        job.conn->enqueue(new PlNetMsgLoadClone(sdl_buf + 5, clone_len, key, key.m_cloneplayerid, true, is_player));
+      } else {
+        job.conn->enqueue(PlNetMsgSDLState::initial(sdl));
+      }
+      job.sent++;
+      batch++;
+    }
+    if (waiting) {
+      // there is no way for the compressor to wake up the select loop, so
+      // the loop polls until it is done
+      more = true;
+      t_iter++;
+    } else if (job.pending.empty()) {
+      // send the message saying how many state messages were sent
+      log_msgs(log, "Sent %u initial state messages (kinum=%u)\n", job.sent, job.ki);
+      job.conn->enqueue(new PlNetMsgInitialAgeStateSent(job.sent));
+      t_iter = m_transfers.erase(t_iter);
+    } else {
+      more = true;
+      t_iter++;
+    }
+  }
+  return more;
+}
+
+void GameState::note_sdl_delta(SDLState *master, SDLState *update, kinum_t ki) {
+  if (m_sdl_deltas.empty()) {
+    gettimeofday(&m_sdl_flush_at, NULL);
+    m_sdl_flush_at.tv_usec += m_sdl_merge_ms * 1000;
+    m_sdl_flush_at.tv_sec += m_sdl_flush_at.tv_usec / 1000000;
+    m_sdl_flush_at.tv_usec %= 1000000;
+    m_timers->insert(new SDLFlushTimer(m_sdl_flush_at));
+  }
+  std::map<SDLState*, sdl_delta_t>::iterator found = m_sdl_deltas.find(master);
+  if (found == m_sdl_deltas.end()) {
+    sdl_delta_t &delta = m_sdl_deltas[master];
+    delta.vars.resize(master->get_desc()->vars().size(), false);
+    delta.structs.resize(master->get_desc()->structs().size(), false);
+    delta.from_who = ki;
+    delta.mixed = false;
+    found = m_sdl_deltas.find(master);
+  }
+  sdl_delta_t &delta = found->second;
+  if (delta.from_who != ki) {
+    delta.mixed = true;
+  }
+  // these are what update_from() applies
+  std::vector<SDLState::Variable*>::const_iterator v_iter;
+  for (v_iter = update->vars().begin(); v_iter != update->vars().end(); v_iter++) {
+    SDLState::Variable *v = *v_iter;
+    if (v && (v->m_flags & SDLState::HasDirtyFlag) && v->m_index < delta.vars.size()) {
+      delta.vars[v->m_index] = true;
+    }
+  }
+  std::vector<SDLState::Struct*>::const_iterator s_iter;
+  for (s_iter = update->structs().begin(); s_iter != update->structs().end(); s_iter++) {
+    SDLState::Struct *st = *s_iter;
+    if (st && st->m_index < delta.structs.size()) {
+      delta.structs[st->m_index] = true;
+    }
+  }
+}
+
+bool GameState::avatar_moved(SDLState *avphys, kinum_t ki, const PlKey &avatar) {
+  if (!(avphys->key() == avatar)) {
+    // an NPC, or the player's avatar before the clone arrived
+    return false;
+  }
+  const std::vector<SDLDesc::Variable*> &descvars = avphys->get_desc()->vars();
+  const std::vector<SDLState::Variable*> &vars = avphys->vars();
+  uint32_t i;
+  for (i = 0; i < descvars.size() && i < vars.size(); i++) {
+    if (descvars[i]->m_type == SDLDesc::Variable::Point3 && !strcmp(descvars[i]->m_name, "position")) {
+      break;
+    }
+  }
+  if (i >= descvars.size() || i >= vars.size() || !vars[i] || !vars[i]->m_value) {
+    return false;
+  }
+  const float *pos = vars[i]->m_value[0].v_point3;
+  grid_cell_t cell = grid_cell(pos);
+  std::map<kinum_t, position_t>::iterator found = m_positions.find(ki);
+  if (found == m_positions.end()) {
+    position_t &where = m_positions[ki];
+    where.cell = cell;
+    m_grid.insert(std::pair<grid_cell_t, kinum_t>(cell, ki));
+    found = m_positions.find(ki);
+  } else if (found->second.cell != cell) {
+    std::pair<std::multimap<grid_cell_t, kinum_t>::iterator, std::multimap<grid_cell_t, kinum_t>::iterator> range =
+        m_grid.equal_range(found->second.cell);
+    for (std::multimap<grid_cell_t, kinum_t>::iterator g_iter = range.first; g_iter != range.second; g_iter++) {
+      if (g_iter->second == ki) {
+        m_grid.erase(g_iter);
+        break;
+      }
+    }
+    found->second.cell = cell;
+    m_grid.insert(std::pair<grid_cell_t, kinum_t>(cell, ki));
+  }
+  position_t &where = found->second;
+  where.avphys = avphys;
+  memcpy(where.pos, pos, sizeof(where.pos));
+  return true;
+}
+
+kinum_t GameState::avatar_owner(SDLState *avphys) const {
+  std::map<kinum_t, position_t>::const_iterator iter;
+  for (iter = m_positions.begin(); iter != m_positions.end(); iter++) {
+    if (iter->second.avphys == avphys) {
+      return iter->first;
+    }
+  }
+  return 0;
+}
+
+bool GameState::players_near(kinum_t ki, std::set<kinum_t> &near) const {
+  std::map<kinum_t, position_t>::const_iterator found = m_positions.find(ki);
+  if (found == m_positions.end()) {
+    return false;
+  }
+  const position_t &where = found->second;
+  float limit = m_interest_radius * m_interest_radius;
+  // the radius is one cell, so only the neighboring cells need looking at
+  for (int32_t x = where.cell.first - 1; x <= where.cell.first + 1; x++) {
+    for (int32_t y = where.cell.second - 1; y <= where.cell.second + 1; y++) {
+      std::pair<std::multimap<grid_cell_t, kinum_t>::const_iterator, std::multimap<grid_cell_t, kinum_t>::const_iterator>
+          range = m_grid.equal_range(grid_cell_t(x, y));
+      std::multimap<grid_cell_t, kinum_t>::const_iterator g_iter;
+      for (g_iter = range.first; g_iter != range.second; g_iter++) {
+        const position_t &other = m_positions.find(g_iter->second)->second;
+        float dx = other.pos[0] - where.pos[0];
+        float dy = other.pos[1] - where.pos[1];
+        float dz = other.pos[2] - where.pos[2];
+        if (dx*dx + dy*dy + dz*dz <= limit) {
+          near.insert(g_iter->second);
+        }
+      }
+    }
+  }
+  return true;
+}
+
+void GameState::fell_behind(kinum_t ki, kinum_t to) {
+  std::map<kinum_t, position_t>::iterator found = m_positions.find(ki);
+  if (found == m_positions.end()) {
+    return;
+  }
+  found->second.behind.insert(to);
+  if (!m_far_pending) {
+    m_far_pending = true;
+    gettimeofday(&m_far_flush_at, NULL);
+    m_far_flush_at.tv_usec += INTEREST_FAR_INTERVAL * 1000;
+    m_far_flush_at.tv_sec += m_far_flush_at.tv_usec / 1000000;
+    m_far_flush_at.tv_usec %= 1000000;
+    m_timers->insert(new SDLFlushTimer(m_far_flush_at));
+  }
+}
+
+GameState::grid_cell_t GameState::grid_cell(const float *pos) const {
+  return grid_cell_t((int32_t) floorf(pos[0] / m_interest_radius), (int32_t) floorf(pos[1] / m_interest_radius));
+}
+
+void GameState::forget_position(kinum_t ki) {
+  std::map<kinum_t, position_t>::iterator found = m_positions.find(ki);
+  if (found == m_positions.end()) {
+    return;
+  }
+  std::pair<std::multimap<grid_cell_t, kinum_t>::iterator, std::multimap<grid_cell_t, kinum_t>::iterator> range =
+      m_grid.equal_range(found->second.cell);
+  for (std::multimap<grid_cell_t, kinum_t>::iterator g_iter = range.first; g_iter != range.second; g_iter++) {
+    if (g_iter->second == ki) {
+      m_grid.erase(g_iter);
+      break;
+    }
+  }
+  m_positions.erase(found);
+}
+
+void GameState::end_state_transfer(Server::Connection *conn) {
+  std::list<StateTransfer>::iterator t_iter;
+  for (t_iter = m_transfers.begin(); t_iter != m_transfers.end(); t_iter++) {
+    if (t_iter->conn == conn) {
+      m_transfers.erase(t_iter);
+      break;
+    }
+  }
 }
 
 void GameState::setup_filter() {
@@ -157,6 +554,8 @@ void GameState::setup_filter() {
       filter.switch_at.tv_usec = 0;
       filter.from_who = 0;
       m_physicals.push_back(filter);
+      m_physicals_index.insert(std::pair<uint32_t, std::list<sdl_filter_t>::iterator>(sdl->key().hash(),
+          --m_physicals.end()));
     }
   }
 }
@@ -164,10 +563,13 @@ void GameState::setup_filter() {
 static struct timeval sdl_filter_timeout = {
 SDL_FILTER_TIME_SECS, SDL_FILTER_TIME_USECS };
 GameState::sdl_filter_t& GameState::get_filter(SDLState *new_sdl) {
-  std::list<sdl_filter_t>::iterator iter;
-  for (iter = m_physicals.begin(); iter != m_physicals.end(); iter++) {
-    if (iter->master->key() == new_sdl->key()) {
-      return *iter;
+  uint32_t hash = new_sdl->key().hash();
+  std::pair<std::multimap<uint32_t, std::list<sdl_filter_t>::iterator>::iterator,
+      std::multimap<uint32_t, std::list<sdl_filter_t>::iterator>::iterator> range = m_physicals_index.equal_range(hash);
+  std::multimap<uint32_t, std::list<sdl_filter_t>::iterator>::iterator iter;
+  for (iter = range.first; iter != range.second; iter++) {
+    if (iter->second->master->key() == new_sdl->key()) {
+      return *(iter->second);
     }
   }
   // need to make a new one
@@ -178,41 +580,69 @@ GameState::sdl_filter_t& GameState::get_filter(SDLState *new_sdl) {
   filter.switch_at.tv_usec = 0;
   filter.from_who = 0;
   m_physicals.push_front(filter);
+  m_physicals_index.insert(std::pair<uint32_t, std::list<sdl_filter_t>::iterator>(hash, m_physicals.begin()));
   return m_physicals.front();
 }
 
-GameState::ObjectLock::ObjectLock(PlKey &plkey) :
-    who(0), lockseq(0) {
-  key = plkey; // will do a struct copy
-  if (key.m_name) {
-    // we must make our own UruString here, copying the pointer is no good
-    key.m_name = new UruString(*key.m_name);
+GameState::ObjectLock::ObjectLock(PlKey &plkey, uint32_t keyhash) :
+    key(plkey), hash(keyhash), who(0), expiry(this) {
+  key.copy_name();
+}
+
+GameState::ObjectLock * GameState::find_lock(PlKey &key, bool create) {
+  uint32_t hash = key.hash();
+  if (m_lock_table) {
+    for (uint32_t i = hash & m_lock_mask; m_lock_table[i]; i = (i + 1) & m_lock_mask) {
+      ObjectLock *lock = m_lock_table[i];
+      if (lock->hash == hash && key == lock->key) {
+        return lock;
+      }
+    }
   }
+  if (!create) {
+    return NULL;
+  }
+
+  // keep the table no more than 3/4 full
+  if (!m_lock_table || (m_lock_count + 1) * 4 > (m_lock_mask + 1) * 3) {
+    uint32_t new_size = m_lock_table ? (m_lock_mask + 1) * 2 : 64;
+    ObjectLock **new_table = new ObjectLock*[new_size];
+    memset(new_table, 0, new_size * sizeof(ObjectLock*));
+    for (uint32_t i = 0; m_lock_table && i <= m_lock_mask; i++) {
+      ObjectLock *lock = m_lock_table[i];
+      if (lock) {
+        uint32_t j = lock->hash & (new_size - 1);
+        while (new_table[j]) {
+          j = (j + 1) & (new_size - 1);
+        }
+        new_table[j] = lock;
+      }
+    }
+    delete[] m_lock_table;
+    m_lock_table = new_table;
+    m_lock_mask = new_size - 1;
+  }
+  ObjectLock *lock = new ObjectLock(key, hash);
+  uint32_t i = hash & m_lock_mask;
+  while (m_lock_table[i]) {
+    i = (i + 1) & m_lock_mask;
+  }
+  m_lock_table[i] = lock;
+  m_lock_count++;
+  return lock;
 }
 
 #define GRANT_ALL_FOOTSTEPS
 
 bool GameState::try_lock(PlKey &key, kinum_t ki) {
 #ifdef GRANT_ALL_FOOTSTEPS
-  if (key.m_name && strstr(key.m_name->c_str(), "Footstep")) {
+  if (strstr(key.name(), "Footstep")) {
     return true;
   }
 #endif
 
-  ObjectLock *thelock = NULL;
-  std::list<ObjectLock*>::iterator l_iter;
-  for (l_iter = m_locks.begin(); l_iter != m_locks.end(); l_iter++) {
-    ObjectLock *lock = *l_iter;
-    if (key == lock->key) {
-      thelock = lock;
-      break;
-    }
-  }
-  if (!thelock) {
-    // the lock has not been created yet; create it now
-    thelock = new ObjectLock(key);
-    m_locks.push_back(thelock);
-  }
+  // the lock is created if it has not been seen before
+  ObjectLock *thelock = find_lock(key, true);
 
   // now test the lock
   if (thelock->who) {
@@ -221,13 +651,12 @@ bool GameState::try_lock(PlKey &key, kinum_t ki) {
   } else {
     // grant lock
     thelock->who = ki;
-    thelock->lockseq++;
     // and set timeout
     struct timeval timeout;
     gettimeofday(&timeout, NULL);
     timeout.tv_sec += MAX_LOCK_TIME;
-    ClearLockTimer *timer = new ClearLockTimer(timeout, thelock);
-    m_timers->insert(timer);
+    thelock->expiry.set_when(timeout);
+    m_timers->insert(&thelock->expiry);
     // success!
     return true;
   }
@@ -235,34 +664,30 @@ bool GameState::try_lock(PlKey &key, kinum_t ki) {
 
 bool GameState::clear_lock(PlKey &key, kinum_t ki) {
 #ifdef GRANT_ALL_FOOTSTEPS
-  if (key.m_name && strstr(key.m_name->c_str(), "Footstep")) {
+  if (strstr(key.name(), "Footstep")) {
     return true;
   }
 #endif
 
-  std::list<ObjectLock*>::iterator l_iter;
-  for (l_iter = m_locks.begin(); l_iter != m_locks.end(); l_iter++) {
-    ObjectLock *lock = *l_iter;
-    if (key == lock->key) {
-      if (lock->who == ki) {
-        lock->who = 0;
-        return true;
-      } else {
-        // unlocking someone else's lock
-        return false;
-      }
-    }
+  ObjectLock *lock = find_lock(key, false);
+  if (!lock) {
+    // we haven't even heard of this lock before, so it's certainly not held
+    return false;
+  }
+  if (lock->who == ki) {
+    lock->who = 0;
+    m_timers->remove(&lock->expiry);
+    return true;
+  } else {
+    // unlocking someone else's lock
+    return false;
   }
-  // if we got here, we haven't even heard of this lock before, so it's
-  // certainly not held
-  return false;
 }
 
 void GameState::ClearLockTimer::callback() {
-  if (m_lock->who && m_lock->lockseq == m_lockseq) {
-    // this means the timeout happened before the lock was released
-    m_lock->who = 0;
-  }
+  // the timer is only queued while the lock is held, so this means the
+  // timeout happened before the lock was released
+  m_lock->who = 0;
 }
 
 /*
@@ -348,69 +773,16 @@ static bool state_request_handler(PropagateBufferMessage *msg, GameState *state,
     Logger *log) {
   log_msgs(log, "plNetMsgGameStateRequest (kinum=%u)\n", conn->kinum());
   conn->set_state(GameServer::STATE_REQUESTED);
-  // this message needs to queue all relevant game state on conn
-  uint32_t state_count = 0;
+  // this message needs to queue all relevant game state on conn; it is
+  // sent a batch at a time, so a big age does not hold up everyone else
+  // (and PlNetMsgInitialAgeStateSent goes after the last of it)
 
   const uint8_t *buf = msg->buffer();
   uint32_t offset = msg->body_offset();
   uint32_t pages = read32(buf, offset);
   if (pages == 0) {
     // send all
-    std::list<SDLState*>::const_iterator iter;
-    for (iter = state->sdl_begin(); iter != state->sdl_end(); iter++) {
-      SDLState *sdl = *iter;
-      PlKey &key = sdl->key();
-      // NOTE we have to make sure to send clones before SDL that pertains
-      // to them
-#ifdef STANDALONE
-      // just send everything that hasn't got a client ID in the key (gets
-      // around clone ordering, Yeesha avatar, firefly clones, etc. issues)
-      if (key.m_contents & PlKey::HasCloneIDs) {
-  continue;
-      }
-#else
-      // filter needs to be more discriminating in multiplayer
-      if (sdl->name_equals("CloneMessage")) {
-        // clones are handled differently
-        const uint8_t *sdl_buf = sdl->vars()[0]->m_value[0].v_creatable;
-        if (!sdl_buf) {
-          log_err(log, "CloneMessage SDL is missing its data!\n");
-          // well, throw that one away, it's useless
-        } else {
-          uint32_t clone_len = read32(sdl_buf, 0);
-          uint8_t is_player = sdl_buf[4];
-          if (is_player && key.m_cloneplayerid == conn->kinum()) {
-            // the client loads the clone before asking for the age state,
-            // so don't send the player's own clone back
-            continue;
-          } else {
-            // quabs arrive with "is_player" zero, but the MOUL server
-            // sent them to new arrivals with the value as 1
-            // (perhaps this flag is actually "hidden")
-            // how do I know what to do without this special case?
-            if (*(key.m_name) == "Quab") {
-              is_player = 1;
-            }
-            PlNetMsgLoadClone *load_msg = new PlNetMsgLoadClone(sdl_buf + 5, clone_len, key, key.m_cloneplayerid, true,
-                is_player);
-            conn->enqueue(load_msg);
-            state_count++;
-          }
-        }
-        continue;
-      }
-#endif
-      conn->enqueue(new PlNetMsgSDLState(sdl, true));
-      state_count++;
-
-      // XXX For scalability there should be a cap on how many messages are
-      // sent, and a timer set to send more after other processing has
-      // been allowed to happen.
-      // Once we have that, we shuld send all the avatarPhysicals last, and
-      // not send any new ones received until that time (to cut link-in
-      // downloads). Or, we should send them all even later in the
-      // link-in process if possible.
-    }
+    state->start_state_transfer(conn, conn->kinum(), 0, NULL, log);
   } else {
     // send only that which matches the following pages
     offset += 4;
@@ -437,21 +809,8 @@ static bool state_request_handler(PropagateBufferMessage *msg, GameState *state,
       uint16_t str_len = read16(buf, offset);
       offset += 2 + (str_len & 0x0FFF);
     }
-
-    std::list<SDLState*>::const_iterator iter;
-    for (iter = state->sdl_begin(); iter != state->sdl_end(); iter++) {
-      SDLState *sdl = *iter;
-      for (uint32_t i = 0; i < top; i++) {
-        if (sdl->key().m_locsequencenumber == pageids[i]) {
-          conn->enqueue(new PlNetMsgSDLState(sdl, true));
-          state_count++;
-        }
-      }
-    }
+    state->start_state_transfer(conn, conn->kinum(), top, pageids, log);
   }
-
-  // send the message saying how many state messages were sent
-  conn->enqueue(new PlNetMsgInitialAgeStateSent(state_count));
   return false;
 }
 static propagate_handler ph_state_request = { msg_is_handled, state_request_check_useable, state_request_handler };
@@ -462,15 +821,16 @@ static bool test_and_set_handler(PropagateBufferMessage *msg, GameState *state,
   uint32_t offset = msg->body_offset();
   uint32_t buflen = msg->message_len();
   PlKey key;
+  key.m_name = NULL;
   try {
     offset += key.read_in(buf + offset, buflen - offset);
-  } catch (const parse_error &e) {
+  } catch (const truncated_message &e) {
     // message truncated
     log_warn(log, "plNetMsgTestAndSet message too short (kinum=%u)\n", ki);
     key.delete_name();
     return false;
   }
-  const char *lockname = (key.m_name ? key.m_name->c_str() : "");
+  const char *lockname = key.name();
   const char *action = NULL;
 
   // now there is a bunch more, make sure not to read off end of message
@@ -625,7 +985,7 @@ static bool sdl_handler(PropagateBufferMessage *msg, GameState *state, GameServe
         snprintf(tmpstr, 25, "(%u:%u)", sdl->key().m_cloneplayerid, sdl->key().m_cloneid);
       }
       log_msgs(log, "plNetMsgSDLState%s %s %s%s (kinum=%u)\n", bcast ? "BCast" : "", sdl->get_desc()->name(),
-          sdl->key().m_name ? sdl->key().m_name->c_str() : "(noname)", tmpstr, ki);
+          sdl->key().m_name ? sdl->key().name() : "(noname)", tmpstr, ki);
     }
 #ifndef STANDALONE
     if (sdl->name_equals("physical")) {
@@ -641,18 +1001,17 @@ static bool sdl_handler(PropagateBufferMessage *msg, GameState *state, GameServe
         // this is the first message for this object, so the SDL object was
         // put in the list, so don't delete the SDL here
         sdl = NULL;
-      } else if (filter.from_who == ki) {
-        filter.switch_at = now;
-        timeval_add(filter.switch_at, sdl_filter_timeout);
-        filter.master->update_from(sdl);
-        // leave retval true
-      } else if (timeval_lessthan(filter.switch_at, now)) {
-        // use this one instead of waiting more
+      } else if (filter.from_who == ki || timeval_lessthan(filter.switch_at, now)) {
+        // the second case means use this one instead of waiting more
         filter.from_who = ki;
         filter.switch_at = now;
         timeval_add(filter.switch_at, sdl_filter_timeout);
+        if (bcast && state->merging_sdl()) {
+          state->note_sdl_delta(filter.master, sdl, ki);
+          retval = false;
+        }
         filter.master->update_from(sdl);
-        // leave retval true
+        // otherwise leave retval true
       } else {
         // not time to use someone else's yet
         retval = false;
@@ -662,11 +1021,21 @@ static bool sdl_handler(PropagateBufferMessage *msg, GameState *state, GameServe
       // all other messages we take as they come
       SDLState *master = state->find_sdl_like(sdl);
       if (master) {
+        if (bcast && state->merging_sdl()) {
+          state->note_sdl_delta(master, sdl, ki);
+          retval = false;
+        }
         master->update_from(sdl);
       } else {
         state->add_sdl(sdl);
+        master = sdl;
         sdl = NULL; // don't delete it
       }
+      if (state->managing_interest() && master->name_equals("avatarPhysical")
+          && state->avatar_moved(master, ki, conn->plKey()) && retval && bcast && sdl) {
+        // GameServer sends it to those nearby (a new state goes to everyone)
+        state->set_mover(ki);
+      }
       // leave retval true
 #ifdef STANDALONE
       (void)sdl_filter_timeout; // make compiler happy
@@ -756,6 +1125,7 @@ static bool load_clone_check_useable(PropagateBufferMessage *msg) {
   // submessage length
   offset += 10 + read32(buf, offset + 5); // 10 includes submessage "end thing"
   PlKey obj;
+  obj.m_name = NULL;
   try {
     offset += obj.read_in(buf + offset, msg_len - offset);
     obj.delete_name();
@@ -780,7 +1150,7 @@ static bool load_clone_handler(PropagateBufferMessage *msg, GameState *state, Ga
   // okay, it looks like we can keep this submessage wholesale, we don't
   // even need to parse it
 
-  const SDLDesc *clone_desc = SDLDesc::find_by_name("CloneMessage", state->sdl_descs());
+  const SDLDesc *clone_desc = state->sdl_descs().find("CloneMessage");
   if (!clone_desc) {
     // we have a serious problem
     log_err(log, "No CloneMessage SDL found! Clones will be very broken\n");
@@ -2971,6 +3341,7 @@ GameMgr* GameState::get_manager_by_id(uint32_t game_id) {
 }
 
 void GameState::player_left(kinum_t player) {
+  forget_position(player);
   std::list<GameMgr*>::iterator iter;
   for (iter = m_marker_games.begin(); iter != m_marker_games.end();) {
     MarkerGameMgr *mmgr = (MarkerGameMgr*) *iter;
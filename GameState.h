@@ -28,7 +28,11 @@
 
 //#include <sys/time.h>
 //
+//#include <deque>
 //#include <list>
+//#include <map>
+//#include <set>
+//#include <vector>
 //
 //#include "PlKey.h"
 //
@@ -38,6 +42,7 @@
 
 // forward declarations
 class GameMgr;
+class SDLCompressor;
 
 /*
  * There is one of these per game server. Nearly all the dynamic state from
@@ -47,18 +52,91 @@ class GameState {
   friend class GameServer;
 
 public:
-  GameState() { }
+  GameState() : m_allsdl(NULL), m_compressor(NULL), m_sdl_merge_ms(0), m_interest_radius(0), m_far_pending(false), m_mover(0),
+      m_lock_table(NULL), m_lock_mask(0), m_lock_count(0) { }
   ~GameState();
 
   /*
    * SDL
    */
-  const std::list<SDLDesc*> & sdl_descs() const { return m_allsdl; }
+  const SDLDescIndex & sdl_descs() const { return *m_allsdl; }
   std::list<SDLState*>::const_iterator sdl_begin() { return m_sdl.begin(); }
   std::list<SDLState*>::const_iterator sdl_end() { return m_sdl.end(); }
   // returns NULL if not found
   SDLState * find_sdl_like(SDLState *new_sdl) const;
   void add_sdl(SDLState *new_sdl);
+  // GameServer changes m_sdl directly when loading the age and when
+  // players leave, so it must keep the index up to date with these
+  void rebuild_sdl_index();
+  void replace_sdl(SDLState *old_sdl, SDLState *new_sdl);
+  std::list<SDLState*>::iterator erase_sdl(std::list<SDLState*>::iterator iter);
+  // take the states from newer, replacing any matching ones (which are
+  // deleted)
+  void merge_sdl(std::list<SDLState*> &newer);
+
+  /*
+   * Initial age state (GameStateRequest)
+   */
+  // queue the age state for a client that asked for it (pageids, if not
+  // NULL, limit it to those pages); it is sent a batch at a time by
+  // send_state()
+  void start_state_transfer(Server::Connection *conn, kinum_t ki, uint32_t pages, const uint32_t *pageids, Logger *log);
+  // send the next batch to each client receiving the age state; returns
+  // true if there is more that can be sent right away, or soon (when
+  // waiting for m_compressor)
+  bool send_state(Logger *log);
+  // the client is gone
+  void end_state_transfer(Server::Connection *conn);
+
+  /*
+   * SDL update merging: when m_sdl_merge_ms is nonzero, updates to existing
+   * states are not forwarded as they come, but the variables they change
+   * are collected, and at most every m_sdl_merge_ms one message per state
+   * with just those variables is sent
+   */
+  bool merging_sdl() const { return m_sdl_merge_ms != 0; }
+  // record the variables update changes in master (call before applying it)
+  void note_sdl_delta(SDLState *master, SDLState *update, kinum_t ki);
+  // whether the collected changes should be sent now
+  bool sdl_flush_due(const struct timeval &now) const {
+    return !m_sdl_deltas.empty() && !timeval_lessthan(now, m_sdl_flush_at);
+  }
+
+  /*
+   * Interest management: when m_interest_radius is nonzero, each player's
+   * position is followed from their avatar's avatarPhysical SDL, and
+   * changes to it are forwarded right away only to players within the
+   * radius (and those whose position is not known); the rest are sent the
+   * latest state every INTEREST_FAR_INTERVAL ms
+   */
+  bool managing_interest() const { return m_interest_radius > 0; }
+  // call after an avatarPhysical state is updated by player ki, whose
+  // avatar is avatar; returns true if it is that player's avatar
+  bool avatar_moved(SDLState *avphys, kinum_t ki, const PlKey &avatar);
+  // the player whose movement the SDL handler last passed on to be sent
+  // to those nearby, or 0 (take_mover() clears it)
+  void set_mover(kinum_t ki) {
+    m_mover = ki;
+  }
+  kinum_t take_mover() {
+    kinum_t ki = m_mover;
+    m_mover = 0;
+    return ki;
+  }
+  // the player owning an avatarPhysical state, if it is followed, or 0
+  kinum_t avatar_owner(SDLState *avphys) const;
+  // fills in the players within the radius of ki; returns false if ki's
+  // position is not known
+  bool players_near(kinum_t ki, std::set<kinum_t> &near) const;
+  bool has_position(kinum_t ki) const {
+    return m_positions.find(ki) != m_positions.end();
+  }
+  // player to was not sent ki's latest movement
+  void fell_behind(kinum_t ki, kinum_t to);
+  // whether it is time to send the latest movement to those far away
+  bool far_flush_due(const struct timeval &now) const {
+    return m_far_pending && !timeval_lessthan(now, m_far_flush_at);
+  }
 
   /*
    * Kickables
@@ -98,35 +176,110 @@ public:
   void player_left(kinum_t player);
 
 protected:
-  std::list<SDLDesc*> m_allsdl; // do not delete contents!
+  const SDLDescIndex *m_allsdl; // shared with other game servers
   std::list<SDLState*> m_sdl; // do not delete contents!
+  // m_sdl indexed by the hash of the key and descriptor name, so incoming
+  // SDL can be matched without comparing against every state in the age
+  std::multimap<uint32_t, SDLState*> m_sdl_index;
+  static uint32_t sdl_hash(SDLState *sdl);
+  void index_sdl(SDLState *sdl);
+  void unindex_sdl(SDLState *sdl);
+
+  /*
+   * Age state still to be sent to clients that joined. Clones and the
+   * AgeSDLHook go first and physicals last, and the states are sent as
+   * they are when their turn comes, so any that are replaced are sent as
+   * the new one and any that go away are not sent.
+   */
+  class StateTransfer {
+  public:
+    Server::Connection *conn;
+    kinum_t ki;
+    bool all; // send clones as LoadClone (not when sending pages)
+    uint32_t sent;
+    std::deque<SDLState*> pending;
+  };
+  std::list<StateTransfer> m_transfers;
+  // if not NULL, the messages are compressed by this in another thread,
+  // up to two batches ahead of the state being sent
+  SDLCompressor *m_compressor;
+
+  /*
+   * SDL changes not yet sent (see merging_sdl())
+   */
+  uint32_t m_sdl_merge_ms;
+  typedef struct {
+    std::vector<bool> vars;
+    std::vector<bool> structs;
+    kinum_t from_who; // sent back to this player only if others changed it too
+    bool mixed;
+  } sdl_delta_t;
+  std::map<SDLState*, sdl_delta_t> m_sdl_deltas;
+  struct timeval m_sdl_flush_at;
+  // this timer is only there so the select loop wakes up in time;
+  // GameServer::loop_pass() sends the changes
+  class SDLFlushTimer : public Server::TimerQueue::Timer {
+  public:
+    SDLFlushTimer(struct timeval &when) : Timer(when) { }
+    void callback() { }
+  };
+
+  /*
+   * Player positions (see managing_interest()); the grid cells are
+   * m_interest_radius on a side, in the horizontal plane
+   */
+  float m_interest_radius;
+  typedef std::pair<int32_t, int32_t> grid_cell_t;
+  typedef struct {
+    SDLState *avphys;
+    float pos[3];
+    grid_cell_t cell;
+    std::set<kinum_t> behind; // players not yet sent the latest state
+  } position_t;
+  std::map<kinum_t, position_t> m_positions;
+  std::multimap<grid_cell_t, kinum_t> m_grid;
+  bool m_far_pending; // some position_t has players behind
+  struct timeval m_far_flush_at;
+  kinum_t m_mover;
+  grid_cell_t grid_cell(const float *pos) const;
+  void forget_position(kinum_t ki);
 
   /*
    * Keep extra information for kickables so we can do filtering
    */
   std::list<sdl_filter_t> m_physicals;
+  // by the hash of the master's key
+  std::multimap<uint32_t, std::list<sdl_filter_t>::iterator> m_physicals_index;
 
   /*
    * Manage region/object locks (plNetMsgTestAndSet)
    */
-  class ObjectLock {
-  public:
-    PlKey key;
-    kinum_t who;
-    uint32_t lockseq;
-    ObjectLock(PlKey &plkey);
-    ~ObjectLock() { key.delete_name(); }
-  };
-  std::list<ObjectLock*> m_locks;
+  class ObjectLock;
+  // each lock has its own timer, queued only while the lock is held
   class ClearLockTimer : public Server::TimerQueue::Timer {
   public:
-    ClearLockTimer(struct timeval &when, ObjectLock *lock)
-      : Timer(when), m_lock(lock), m_lockseq(lock->lockseq) { }
+    ClearLockTimer(ObjectLock *lock)
+      : Timer(timeval(), false), m_lock(lock) { }
     void callback();
   protected:
     ObjectLock *m_lock;
-    uint32_t m_lockseq;
   };
+  class ObjectLock {
+  public:
+    PlKey key;
+    uint32_t hash; // key.hash()
+    kinum_t who;
+    ClearLockTimer expiry;
+    ObjectLock(PlKey &plkey, uint32_t keyhash);
+    ~ObjectLock() { key.delete_name(); }
+  };
+  // Open addressing (linear probing) by key hash. Locks are never removed,
+  // so there is no need for tombstones.
+  ObjectLock **m_lock_table;
+  uint32_t m_lock_mask; // table size - 1
+  uint32_t m_lock_count;
+  // returns NULL if there is no lock for the key and create is false
+  ObjectLock * find_lock(PlKey &key, bool create);
   // GameServer's timer queue
   Server::TimerQueue *m_timers; // do not delete!
 
@@ -182,6 +182,24 @@ void Logger::release_lock() {
   pthread_mutex_unlock(m_mutex);
 }
 
+bool Logger::reopen(const char *filename) {
+  if (!m_mutex) {
+    return false;
+  }
+  FILE *newf = fopen(filename, "a+");
+  if (!newf) {
+    return false;
+  }
+  pthread_mutex_lock(m_mutex);
+  FILE *oldf = m_logf;
+  m_logf = newf;
+  pthread_mutex_unlock(m_mutex);
+  if (oldf) {
+    fclose(oldf);
+  }
+  return true;
+}
+
 void Logger::dump_contents(level_t level, const uint8_t *buf, size_t len) {
   uint32_t i;
 
@@ -94,6 +94,13 @@ public:
   const char* get_prefix(level_t level);
   void release_lock();
 
+  /*
+   * Log to a different file from now on. This is only for a Logger that
+   * is not shared. If the new file cannot be opened, logging goes on to
+   * the old one and false is returned.
+   */
+  bool reopen(const char *filename);
+
   /*
    * Utility function: dump buffer contents.
    */
@@ -29,6 +29,7 @@
 #include <stdarg.h>
 #include <pthread.h>
 
+#include <sys/time.h>
 #include <sys/uio.h> /* for struct iovec */
 
 #include <stdexcept>
@@ -52,12 +53,73 @@ void MessageQueue::enqueue(NetworkMessage *msg, priority_t p) {
   if (p == FRONT) {
     m_queue.push_front(e);
   }
+  else if (p == VOICE) {
+    add_voice(e);
+  }
   else {
     m_queue.push_back(e);
   }
 }
 
+void MessageQueue::add_voice(Entry &e) {
+  gettimeofday(&e.queued, NULL);
+  if (m_voice.size() >= VOICE_QUEUE_FRAMES) {
+    if (m_voice.front().msg->del_ref() < 1) {
+      delete m_voice.front().msg;
+    }
+    m_voice.pop_front();
+    m_voice_stats.dropped++;
+  }
+  m_voice.push_back(e);
+}
+
+void MessageQueue::promote_voice() {
+  if (m_voice.empty()) {
+    return;
+  }
+  // skip a message partly written, then voice moved up before
+  std::deque<Entry>::iterator iter = m_queue.begin();
+  if (iter != m_queue.end() && iter->so_far != 0) {
+    iter++;
+  }
+  uint32_t ahead = 0;
+  while (iter != m_queue.end() && iter->voice) {
+    iter++;
+    ahead++;
+  }
+  while (!m_voice.empty() && ahead + m_voice.size() > VOICE_QUEUE_FRAMES) {
+    if (m_voice.front().msg->del_ref() < 1) {
+      delete m_voice.front().msg;
+    }
+    m_voice.pop_front();
+    m_voice_stats.dropped++;
+  }
+  m_queue.insert(iter, m_voice.begin(), m_voice.end());
+  m_voice.clear();
+}
+
+void MessageQueue::voice_done(const Entry &e) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  int64_t waited = (int64_t)(now.tv_sec - e.queued.tv_sec) * 1000000 + (now.tv_usec - e.queued.tv_usec);
+  if (waited < 0) {
+    waited = 0;
+  }
+  m_voice_stats.sent++;
+  m_voice_stats.wait_total += waited;
+  if (waited > m_voice_stats.wait_max) {
+    m_voice_stats.wait_max = (uint32_t) waited;
+  }
+}
+
 void MessageQueue::clear_queue() {
+  std::deque<Entry>::iterator v_iter;
+  for (v_iter = m_voice.begin(); v_iter != m_voice.end(); v_iter++) {
+    if (v_iter->msg->del_ref() < 1) {
+      delete v_iter->msg;
+    }
+  }
+  m_voice.clear();
   if (m_queue.size() == 0) {
     return;
   }
@@ -88,6 +150,7 @@ void MessageQueue::reset_head() {
 }
 
 uint32_t MessageQueue::fill_iovecs(struct iovec *iov, uint32_t iov_ct) {
+  promote_voice();
   uint32_t how_many = 0;
   std::deque<Entry>::iterator iter = m_queue.begin();
 
@@ -120,6 +183,9 @@ void MessageQueue::iovecs_written_bytes(uint32_t byte_ct) {
               &msg_done);
     if (msg_done) {
       byte_ct = bytes;
+      if (iter->voice) {
+        voice_done(*iter);
+      }
       if (iter->msg->del_ref() < 1) {
   delete iter->msg;
       }
@@ -143,6 +209,7 @@ void MessageQueue::iovecs_written_bytes(uint32_t byte_ct) {
 }
 
 uint32_t MessageQueue::fill_buffer(uint8_t *buf, uint32_t buflen) {
+  promote_voice();
   uint32_t how_many = 0;
   std::deque<Entry>::iterator iter = m_queue.begin();
 
@@ -161,6 +228,9 @@ uint32_t MessageQueue::fill_buffer(uint8_t *buf, uint32_t buflen) {
     }
 #endif
     if (msg_done) {
+      if (iter->voice) {
+        voice_done(*iter);
+      }
       if (iter->msg->del_ref() < 1) {
   delete iter->msg;
       }
@@ -196,6 +266,9 @@ void MultiWriterMessageQueue::enqueue(NetworkMessage *msg, priority_t p) {
     if (p == FRONT) {
       m_queue.push_front(e);
     }
+    else if (p == VOICE) {
+      add_voice(e);
+    }
     else {
       m_queue.push_back(e);
     }
@@ -220,7 +293,7 @@ size_t MultiWriterMessageQueue::size() {
   assert(pthread_self() == m_owner_tid);
 #endif
   pthread_mutex_lock(&m_mutex);
-  sz = m_queue.size();
+  sz = m_queue.size() + m_voice.size();
   pthread_mutex_unlock(&m_mutex);
   return sz;
 }
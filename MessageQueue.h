@@ -26,8 +26,16 @@
  * messages can be queued (vs. dropped due to bandwidth/client slowness). The
  * knowledge about the connection would be in the queue, not the Server, so
  * that any message addition is subject to the same management.
+ *
+ * VOICE messages are the exception to FIFO order. They wait in a short
+ * queue of their own, where a new frame pushes out the oldest once there
+ * are VOICE_QUEUE_FRAMES, and each time the socket is written they are
+ * moved ahead of everything not yet started, so voice is not stuck behind
+ * a big batch of age state. Late voice is no use, so it is dropped rather
+ * than left to build up.
  */
 
+//#include <sys/time.h>
 //#include <sys/uio.h> /* for struct iovec */
 //
 //#include <deque>
@@ -48,12 +56,19 @@ public:
     FRONT // special priority that means: force to front of queue
   } priority_t;
 
-  MessageQueue() { }
+  MessageQueue() {
+    memset(&m_voice_stats, 0, sizeof(m_voice_stats));
+  }
 
   virtual ~MessageQueue() {
     std::deque<Entry>::iterator iter = m_queue.begin();
     for ( ; iter != m_queue.end(); iter++) {
       if (iter->msg->del_ref() < 1) {
+  delete iter->msg;
+      }
+    }
+    for (iter = m_voice.begin(); iter != m_voice.end(); iter++) {
+      if (iter->msg->del_ref() < 1) {
   delete iter->msg;
       }
     }
@@ -64,7 +79,7 @@ public:
    * remove the first message if has been partially written.
    */
   virtual void enqueue(NetworkMessage *msg, priority_t p = NORMAL);
-  virtual size_t size() const { return m_queue.size(); }
+  virtual size_t size() const { return m_queue.size() + m_voice.size(); }
   virtual void clear_queue();
   virtual void reset_head();
 
@@ -79,6 +94,19 @@ public:
   virtual void iovecs_written_bytes(uint32_t byte_ct);
   virtual uint32_t fill_buffer(uint8_t *buf, uint32_t buflen);
 
+  /*
+   * Voice relay counters, for the owner to read. Wait times are from
+   * enqueue() until the frame is all written (or handed to the caller of
+   * fill_buffer()), in microseconds.
+   */
+  typedef struct {
+    uint32_t sent;
+    uint32_t dropped;
+    uint64_t wait_total;
+    uint32_t wait_max;
+  } voice_stats_t;
+  const voice_stats_t & voice_stats() const { return m_voice_stats; }
+
 protected:
 
   class Entry {
@@ -88,7 +116,7 @@ protected:
 #ifdef DO_PRIORITIES
   priority(p),
 #endif
-  so_far(0) { }
+  so_far(0), voice(p == VOICE) { }
 
     MessageQueue::priority_t get_priority() const {
 #ifdef DO_PRIORITIES
@@ -100,6 +128,8 @@ protected:
 
     NetworkMessage *msg;
     uint32_t so_far;
+    bool voice;
+    struct timeval queued; // only set for voice
 
 #ifdef DO_PRIORITIES
     MessageQueue::priority_t priority;
@@ -107,6 +137,17 @@ protected:
   };
 
   std::deque<Entry> m_queue;
+
+  // voice not yet moved into m_queue, oldest first
+  std::deque<Entry> m_voice;
+  voice_stats_t m_voice_stats;
+  // add a VOICE entry to m_voice, dropping the oldest if it is full
+  void add_voice(Entry &e);
+  // move the waiting voice ahead of everything in m_queue that has not
+  // been started, keeping no more than VOICE_QUEUE_FRAMES there
+  void promote_voice();
+  // a voice entry is done being written
+  void voice_done(const Entry &e);
 };
 
 /*
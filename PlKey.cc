@@ -26,14 +26,137 @@
 
 #include <iconv.h>
 
+#include <pthread.h>
+
 #include <stdexcept>
+#include <map>
 
 #include "machine_arch.h"
 #include "exceptions.h"
+#include "constants.h"
 
-#include "UruString.h"
 #include "PlKey.h"
 
+// all the names there are, by hash
+static std::multimap<uint64_t, PlKey::Name*> s_names;
+// lookups of names already there (nearly all of them) only take it for
+// reading, so game threads do not wait on each other
+static pthread_rwlock_t s_names_lock = PTHREAD_RWLOCK_INITIALIZER;
+// guards the names' reference counts; a count only goes to zero with
+// s_names_lock held for writing, so a name being looked up is not freed
+static pthread_mutex_t s_refs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+PlKey::Name::Name(const char *str, size_t len, uint64_t hash) :
+    m_len(len), m_hash(hash), m_refs(1) {
+  m_cstr = new char[len + 1];
+  memcpy(m_cstr, str, len);
+  m_cstr[len] = '\0';
+  m_wire[0] = new uint8_t[len + 2];
+  m_wire[1] = new uint8_t[len + 2];
+  write16(m_wire[0], 0, len);
+  write16(m_wire[1], 0, len | 0xF000);
+  for (size_t i = 0; i < len; i++) {
+    m_wire[0][i + 2] = str[i];
+    m_wire[1][i + 2] = ~str[i];
+  }
+}
+
+PlKey::Name::~Name() {
+  delete[] m_cstr;
+  delete[] m_wire[0];
+  delete[] m_wire[1];
+}
+
+uint64_t PlKey::Name::hash_of(const char *str, size_t len) {
+  if (len == 0) {
+    return 0;
+  }
+  // FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)str[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+PlKey::Name* PlKey::Name::find(const char *str, size_t len, uint64_t hash) {
+  std::pair<std::multimap<uint64_t, Name*>::iterator, std::multimap<uint64_t, Name*>::iterator> range =
+      s_names.equal_range(hash);
+  for (std::multimap<uint64_t, Name*>::iterator iter = range.first; iter != range.second; iter++) {
+    Name *name = iter->second;
+    if (name->m_len == len && !memcmp(name->m_cstr, str, len)) {
+      return name;
+    }
+  }
+  return NULL;
+}
+
+const PlKey::Name* PlKey::Name::intern(const char *str, size_t len) {
+  uint64_t hash = hash_of(str, len);
+  pthread_rwlock_rdlock(&s_names_lock);
+  Name *name = find(str, len, hash);
+  if (name) {
+    name->add_ref();
+  }
+  pthread_rwlock_unlock(&s_names_lock);
+  if (name) {
+    return name;
+  }
+
+  pthread_rwlock_wrlock(&s_names_lock);
+  // someone else may have added it meanwhile
+  name = find(str, len, hash);
+  if (name) {
+    name->add_ref();
+  } else {
+    name = new Name(str, len, hash);
+    s_names.insert(std::pair<uint64_t, Name*>(hash, name));
+  }
+  pthread_rwlock_unlock(&s_names_lock);
+  return name;
+}
+
+void PlKey::Name::add_ref() const {
+  pthread_mutex_lock(&s_refs_mutex);
+  m_refs++;
+  pthread_mutex_unlock(&s_refs_mutex);
+}
+
+void PlKey::Name::release(const Name *name) {
+  pthread_mutex_lock(&s_refs_mutex);
+  if (name->m_refs > 1) {
+    name->m_refs--;
+    pthread_mutex_unlock(&s_refs_mutex);
+    return;
+  }
+  pthread_mutex_unlock(&s_refs_mutex);
+
+  // this is the last reference, unless someone looks the name up while
+  // waiting for the table
+  pthread_rwlock_wrlock(&s_names_lock);
+  pthread_mutex_lock(&s_refs_mutex);
+  bool last = (--name->m_refs == 0);
+  pthread_mutex_unlock(&s_refs_mutex);
+  if (last) {
+    std::pair<std::multimap<uint64_t, Name*>::iterator, std::multimap<uint64_t, Name*>::iterator> range =
+        s_names.equal_range(name->m_hash);
+    for (std::multimap<uint64_t, Name*>::iterator iter = range.first; iter != range.second; iter++) {
+      if (iter->second == name) {
+        s_names.erase(iter);
+        break;
+      }
+    }
+  }
+  pthread_rwlock_unlock(&s_names_lock);
+  if (last) {
+    delete name;
+  }
+}
+
+const PlKey::Name* PlKey::Name::intern(const char *str) {
+  return intern(str, strlen(str));
+}
+
 uint32_t PlKey::read_in(const uint8_t *buf, size_t buflen) {
   // corresponds to CWE plUoid.cpp plUoid::Read()
   if (buflen < 1) {
@@ -64,9 +187,25 @@ uint32_t PlKey::read_in(const uint8_t *buf, size_t buflen) {
   offset += 2;
   m_objectid = read32(buf, offset);
   offset += 4;
-  // NOTE: we are not calling delete_name()
-  m_name = new UruString(buf + offset, buflen - offset, true, false);
-  offset += m_name->arrival_len();
+  // the name has a 2-byte length, with 0xF000 set if the characters are
+  // bitflipped (the room for the length is in needlen)
+  uint32_t namelen = read16(buf, offset);
+  bool flipped = ((namelen & 0xF000) == 0xF000);
+  namelen &= 0x0FFF;
+  offset += 2;
+  if (buflen < offset + namelen) {
+    throw truncated_message("Buffer too short for plKey");
+  }
+  char namebuf[0x1000];
+  for (uint32_t i = 0; i < namelen; i++) {
+    namebuf[i] = (flipped ? ~buf[offset + i] : buf[offset + i]);
+  }
+  offset += namelen;
+  if (namelen > 0 && namebuf[namelen - 1] == '\0') {
+    // the length counted a null terminator
+    namelen--;
+  }
+  m_name = Name::intern(namebuf, namelen);
 
   if ((m_contents & HasCloneIDs) && (buflen < offset + 8)) {
     throw truncated_message("Buffer too short for plKey");
@@ -95,10 +234,9 @@ uint32_t PlKey::send_len() const {
   if (m_contents & HasCloneIDs) {
     len += 8;
   }
+  len += 2;
   if (m_name) {
-    len += m_name->send_len(true, false, false);
-  } else {
-    len += 2;
+    len += m_name->len();
   }
   return len;
 }
@@ -129,8 +267,8 @@ uint32_t PlKey::write_out(uint8_t *buf, size_t buflen, bool bitflip) const {
    * ORed with 0xf000.
    */
   if (m_name) {
-    uint32_t l = m_name->send_len(true, false, false);
-    memcpy(buf + offset, m_name->get_str(true, false, false, bitflip), l);
+    uint32_t l = 2 + m_name->len();
+    memcpy(buf + offset, m_name->wire(bitflip), l);
     offset += l;
   } else {
     write16(buf, offset, /* len | */ 0xf000);
@@ -206,18 +344,28 @@ bool PlKey::operator==(const PlKey &other) const {
       || m_cloneplayerid != other.m_cloneplayerid) {
     return false;
   }
-  if (m_name) {
-    if (other.m_name) {
-      return (*m_name == *other.m_name);
-    } else {
-      return (strlen(m_name->c_str()) == 0);
-    }
-  } else if (other.m_name) {
-    return (strlen(other.m_name->c_str()) == 0);
-  } else {
-    // both strings are NULL
+  // names are interned, so only an empty name can be the same as a
+  // different pointer (NULL)
+  if (m_name == other.m_name) {
     return true;
   }
+  return ((m_name ? m_name->len() : 0) == 0 && (other.m_name ? other.m_name->len() : 0) == 0);
+}
+
+uint32_t PlKey::hash() const {
+  // FNV-1a over everything operator== compares, with the name's own hash
+  // standing in for its characters; a NULL name is the same as an empty one
+  uint32_t h = 2166136261U;
+  uint32_t fields[] = { m_contents, m_qualitycapability, m_locsequencenumber, m_locflags,
+                        m_classtype, m_objectid, m_cloneid, m_cloneplayerid };
+  for (uint32_t i = 0; i < sizeof(fields)/sizeof(uint32_t); i++) {
+    h = (h ^ fields[i]) * 16777619U;
+  }
+  if (m_name && m_name->hash()) {
+    h = (h ^ (uint32_t)m_name->hash()) * 16777619U;
+    h = (h ^ (uint32_t)(m_name->hash() >> 32)) * 16777619U;
+  }
+  return h;
 }
 
 void PlKey::make_null() {
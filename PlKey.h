@@ -27,12 +27,60 @@
 #define _PLKEY_H_
 
 //#include "machine_arch.h"
-//
-//#include "UruString.h"
 
 class PlKey {
 public:
 
+  /*
+   * Object names are interned: each distinct name in use is kept once, and
+   * every key with that name points to the same Name. So keys compare
+   * names by pointer, and copying a key copies no string. Names never
+   * change once made, so keys may be passed between threads freely.
+   *
+   * Each key holds a reference to its name, and the name is freed when the
+   * last one is let go, so names made up by clients do not pile up.
+   */
+  class Name {
+  public:
+    // look up the name, adding it if it is new; the caller gets a
+    // reference to it
+    static const Name* intern(const char *str, size_t len);
+    static const Name* intern(const char *str);
+    void add_ref() const;
+    // let go of a reference, freeing the name if it was the last one
+    static void release(const Name *name);
+
+    const char* c_str() const {
+      return m_cstr;
+    }
+    size_t len() const {
+      return m_len;
+    }
+    // the empty name hashes to 0
+    uint64_t hash() const {
+      return m_hash;
+    }
+    // the name as written in a plKey (2-byte length, then the characters)
+    const uint8_t* wire(bool bitflip) const {
+      return m_wire[bitflip ? 1 : 0];
+    }
+
+  protected:
+    // Names are only deleted by release()
+    Name(const char *str, size_t len, uint64_t hash);
+    ~Name();
+
+    char *m_cstr;
+    size_t m_len;
+    uint64_t m_hash;
+    uint8_t *m_wire[2];
+    mutable uint32_t m_refs;
+
+    static uint64_t hash_of(const char *str, size_t len);
+    // call with the table locked
+    static Name* find(const char *str, size_t len, uint64_t hash);
+  };
+
   // Enums come from CWE pnKeyedObject/pnUoid.h
 
   enum Contents_e {
@@ -64,18 +112,37 @@ public:
     kInvalidLocIdx =               0xffffffff
 };
   // read a plKey into the object from the contents of the buffer,
-  // returning how many bytes were read
+  // returning how many bytes were read; the key did not have a name
+  // before (if it throws, it may have one now)
   // throws truncated_message
   uint32_t read_in(const uint8_t *buf, size_t buflen);
 
   uint32_t send_len() const;
   uint32_t write_out(uint8_t *buf, size_t buflen, bool bitflip = true) const;
 
+  // the object name ("" if there is none)
+  const char* name() const {
+    return (m_name ? m_name->c_str() : "");
+  }
+  void set_name(const char *name) {
+    delete_name();
+    m_name = Name::intern(name);
+  }
+
   // since I wanted to put this class in a union, I can't have a
-  // destructor so I must depend on calling code to clean up
+  // constructor or destructor so I must depend on calling code to manage
+  // the name's reference: a key made by a struct copy calls copy_name(),
+  // and every key calls delete_name() when it is done with it
+  void copy_name() {
+    if (m_name) {
+      m_name->add_ref();
+    }
+  }
   void delete_name() {
-    if (m_name)
-      delete m_name;
+    if (m_name) {
+      Name::release(m_name);
+      m_name = NULL;
+    }
   }
 
   // format plKey for logging
@@ -87,6 +154,9 @@ public:
   bool operator!=(const PlKey &other) {
     return !(*this == other);
   }
+  // keys that are == have the same hash (for indexing keys in maps); this
+  // does not look at the name's characters
+  uint32_t hash() const;
 
   // "null" keys show up in a few places
   void make_null();
@@ -103,7 +173,8 @@ public:
   uint32_t m_objectid;
   uint32_t m_cloneid;
   uint32_t m_cloneplayerid;
-  UruString *m_name;
+  // a NULL name is the same as an empty one
+  const Name *m_name;
 };
 
 #endif /* _PLKEY_H_ */
@@ -29,6 +29,7 @@
 #include <ctype.h> /* for tolower() */
 
 #include <stdarg.h>
+#include <pthread.h>
 #include <iconv.h>
 
 #include <sys/time.h>
@@ -36,6 +37,7 @@
 
 #include <stdexcept>
 #include <list>
+#include <map>
 #include <vector>
 #include <string>
 #include <sstream>
@@ -44,6 +46,7 @@
 #include <iterator>
 #include <ctime>
 
+#include <sys/uio.h>
 #include <zlib.h>
 
 #include "machine_arch.h"
@@ -56,10 +59,11 @@
 #include "PlKey.h"
 
 #include "Logger.h"
+#include "NetworkMessage.h"
 #include "SDL.h"
 
 SDLDesc::SDLDesc(const std::string &name) :
-    m_name(NULL), m_version(0), m_chars(NULL), m_string("") {
+    m_name(NULL), m_version(0), m_value_count(0), m_chars(NULL), m_string("") {
   m_name = new char[name.length() + 1];
   memcpy(m_name, name.c_str(), name.length() + 1);
 }
@@ -97,6 +101,38 @@ SDLDesc* SDLDesc::find_by_name(const char *name, const std::list<SDLDesc*> &l, u
   return ret;
 }
 
+bool SDLDescIndex::name_less::operator()(const char *a, const char *b) const {
+  return strcasecmp(a, b) < 0;
+}
+
+void SDLDescIndex::assign(const std::list<SDLDesc*> &descs) {
+  m_descs = descs;
+  m_index.clear();
+  std::list<SDLDesc*>::const_iterator iter;
+  for (iter = m_descs.begin(); iter != m_descs.end(); iter++) {
+    SDLDesc *desc = *iter;
+    std::map<uint32_t, SDLDesc*> &versions = m_index[desc->name()];
+    if (versions.find(desc->version()) == versions.end()) {
+      versions[desc->version()] = desc;
+    }
+  }
+}
+
+SDLDesc* SDLDescIndex::find(const char *name, uint32_t version) const {
+  std::map<const char*, std::map<uint32_t, SDLDesc*>, name_less>::const_iterator iter = m_index.find(name);
+  if (iter == m_index.end()) {
+    return NULL;
+  }
+  if (!version) {
+    return iter->second.rbegin()->second;
+  }
+  std::map<uint32_t, SDLDesc*>::const_iterator v_iter = iter->second.find(version);
+  if (v_iter == iter->second.end()) {
+    return NULL;
+  }
+  return v_iter->second;
+}
+
 void SDLDesc::parse_file(std::list<SDLDesc*> &sdls, std::ifstream &file) {
   std::list<SDLDesc*> these;
   uint32_t lineno = 0;
@@ -769,6 +805,47 @@ uint32_t SDLDesc::name_and_count(std::string &namestr, uint32_t lineno) {
   return val;
 }
 
+SDLDesc::Variable::Variable(sdl_vartype_t type) :
+    DescObj(), m_type(type), m_dispoptions(0), m_offset(0), m_wire_size(0), m_words(0) {
+  memset(&m_default, 0, sizeof(m_default));
+  switch (type) {
+  case Int:
+  case Float:
+    m_words = 1;
+    break;
+  case Vector3:
+  case Point3:
+    m_words = 3;
+    break;
+  case Quaternion:
+    m_words = 4;
+    break;
+  case Bool:
+  case Byte:
+    m_wire_size = 1;
+    break;
+  case Short:
+    m_wire_size = 2;
+    break;
+  case RGB8:
+    m_wire_size = 3;
+    break;
+  case Time:
+  case AgeTimeOfDay:
+    m_wire_size = 8;
+    break;
+  case String32:
+    m_wire_size = 32;
+    break;
+  default:
+    // Key, Creatable, and types the server does not read
+    break;
+  }
+  if (m_words) {
+    m_wire_size = m_words * 4;
+  }
+}
+
 SDLDesc::Variable::~Variable() {
   if (m_dispoptions) {
     delete[] m_dispoptions;
@@ -925,6 +1002,72 @@ const char* SDLDesc::c_str(const char *sep) {
 }
 
 // utility functions
+/*
+ * Setting up a zlib stream is not cheap, so each thread compressing SDL
+ * keeps one, along with the buffer to compress into, and resets them for
+ * each message. They are freed when the thread exits.
+ */
+typedef struct {
+  z_stream zs;
+  int32_t level;
+  uint8_t *buf;
+  uint32_t buflen;
+} compress_state_t;
+
+static pthread_key_t compress_key;
+static pthread_once_t compress_key_once = PTHREAD_ONCE_INIT;
+static volatile int32_t compress_level = Z_DEFAULT_COMPRESSION;
+
+static void free_compress_state(void *arg) {
+  compress_state_t *state = (compress_state_t*) arg;
+  deflateEnd(&state->zs);
+  if (state->buf) {
+    delete[] state->buf;
+  }
+  delete state;
+}
+
+static void make_compress_key() {
+  pthread_key_create(&compress_key, free_compress_state);
+}
+
+// returns NULL if zlib could not be set up
+static compress_state_t* thread_compress_state() {
+  pthread_once(&compress_key_once, make_compress_key);
+  compress_state_t *state = (compress_state_t*) pthread_getspecific(compress_key);
+  int32_t level = compress_level;
+  if (state && state->level != level) {
+    // the level was changed
+    deflateEnd(&state->zs);
+    if (deflateInit(&state->zs, level) != Z_OK) {
+      pthread_setspecific(compress_key, NULL);
+      if (state->buf) {
+        delete[] state->buf;
+      }
+      delete state;
+      return NULL;
+    }
+    state->level = level;
+  }
+  if (!state) {
+    state = new compress_state_t;
+    memset(&state->zs, 0, sizeof(state->zs));
+    if (deflateInit(&state->zs, level) != Z_OK) {
+      delete state;
+      return NULL;
+    }
+    state->level = level;
+    state->buf = NULL;
+    state->buflen = 0;
+    pthread_setspecific(compress_key, state);
+  }
+  return state;
+}
+
+void set_message_compression_level(int32_t level) {
+  compress_level = ((level >= 1 && level <= 9) ? level : Z_DEFAULT_COMPRESSION);
+}
+
 uint32_t do_message_compression(uint8_t *buf) {
   uint32_t ret = 0;
 
@@ -933,29 +1076,43 @@ uint32_t do_message_compression(uint8_t *buf) {
   }
   uint32_t len = read32(buf, 5);
   if (len > COMPRESS_THRESHOLD) {
-    /* the zlib man page says the destination must be at least 0.1% larger
-     than the source buffer + 12 bytes */
-    unsigned long destlen = len + (len / 1000) + 13;
-    uint8_t *buf2 = new uint8_t[destlen];
+    compress_state_t *state = thread_compress_state();
+    if (!state) {
+      buf[4] = CompressionFailed;
+      return 0;
+    }
+    uint32_t bound = deflateBound(&state->zs, len - 2);
+    if (state->buflen < bound) {
+      if (state->buf) {
+        delete[] state->buf;
+      }
+      state->buf = new uint8_t[bound];
+      state->buflen = bound;
+    }
+    deflateReset(&state->zs);
+    state->zs.next_in = buf + 11;
+    state->zs.avail_in = len - 2;
+    state->zs.next_out = state->buf;
+    state->zs.avail_out = state->buflen;
 
-    int32_t zlib_ret = compress(buf2, &destlen, buf + 11, len - 2);
-    if (zlib_ret == Z_OK && destlen < len - 2) {
+    int32_t zlib_ret = deflate(&state->zs, Z_FINISH);
+    uint32_t destlen = state->zs.total_out;
+    if (zlib_ret == Z_STREAM_END && destlen < len - 2) {
       ret = destlen + 2;
       write32(buf, 0, len);
       buf[4] = CompressionZlib;
       write32(buf, 5, ret);
-      memcpy(buf + 11, buf2, destlen);
-    } else if (zlib_ret != Z_OK) {
+      memcpy(buf + 11, state->buf, destlen);
+    } else if (zlib_ret != Z_STREAM_END) {
       buf[4] = CompressionFailed;
     }
-    delete[] buf2;
   }
 
   return ret;
 }
 
 SDLState::SDLState(const SDLDesc *desc) :
-    m_flag(0), m_desc(NULL), m_saving_to_file(false) {
+    m_flag(0), m_desc(NULL), m_saving_to_file(false), m_changed(true), m_cached_msg(NULL), m_borrowed(false), m_values(NULL), m_raw(NULL), m_raw_len(0), m_raw_body(0), m_raw_log(NULL) {
   if (desc) {
     set_desc(desc);
   }
@@ -963,7 +1120,14 @@ SDLState::SDLState(const SDLDesc *desc) :
 }
 
 SDLState::~SDLState() {
+  set_cached_msg(NULL);
   m_key.delete_name();
+  if (m_values) {
+    m_values->del_ref();
+  }
+  if (m_borrowed) {
+    return;
+  }
   std::vector<Variable*>::iterator vi;
   for (vi = m_vars.begin(); vi != m_vars.end(); vi++) {
     if (*vi) {
@@ -978,7 +1142,7 @@ SDLState::~SDLState() {
   }
 }
 
-int32_t SDLState::read_msg(const uint8_t *buf, size_t bufsize, const std::list<SDLDesc*> &descs) {
+int32_t SDLState::read_msg(const uint8_t *buf, size_t bufsize, const SDLDescIndex &descs) {
   uint32_t offset = m_key.read_in(buf, bufsize);
   if (bufsize < offset + 11) {
     throw truncated_message("SDL message ends in in-between stuff");
@@ -1045,6 +1209,9 @@ uint32_t SDLState::send_len() const {
     // XXX programmer error
     return 0;
   }
+  if (m_raw) {
+    return m_raw_len;
+  }
   uint32_t len = 11; // for compression/length info, 0x8000
   len += m_key.send_len();
   len += body_len();
@@ -1053,6 +1220,20 @@ uint32_t SDLState::send_len() const {
 
 int32_t SDLState::write_msg(uint8_t *buf, size_t bufsize, bool no_compress) {
   uint32_t len, wrote, offset;
+  if (m_raw) {
+    if (bufsize < m_raw_len) {
+      return -1;
+    }
+    memcpy(buf, m_raw, m_raw_len);
+    if (!no_compress) {
+      // the compression/length info is just before the body
+      uint32_t len2 = do_message_compression(buf + m_raw_body - 11);
+      if (len2) {
+        return m_raw_body - 2 + len2;
+      }
+    }
+    return m_raw_len;
+  }
   len = m_key.send_len();
   if (bufsize < len + 11) {
     return -1;
@@ -1095,7 +1276,64 @@ void SDLState::set_desc(const SDLDesc *desc) {
   m_desc = desc;
 }
 
-int32_t SDLState::read_in(const uint8_t *buf, size_t bufsize, const std::list<SDLDesc*> &descs) {
+bool SDLState::attach(const uint8_t *msg, uint32_t len, const SDLDesc *desc, Logger *log) {
+  if (m_desc != NULL) {
+    // programmer error
+    throw std::logic_error("An SDLState's type cannot be changed");
+  }
+  try {
+    uint32_t offset = m_key.read_in(msg, len);
+    if (len < offset + 11 || msg[offset + 4] != CompressionNone) {
+      return false;
+    }
+    // the length includes the 0x8000
+    uint32_t body_len = read32(msg, offset + 5) - 2;
+    offset += 11;
+    if (len != offset + body_len) {
+      return false;
+    }
+    UruString name(msg + offset, body_len, true, false, false);
+    uint32_t flag_at = offset + name.arrival_len() + 2;
+    if (len < flag_at + 2) {
+      return false;
+    }
+    m_flag = read16(msg, flag_at);
+    m_raw_body = offset;
+  } catch (const truncated_message &e) {
+    return false;
+  } catch (const parse_error &e) {
+    return false;
+  }
+  m_desc = desc;
+  m_raw = msg;
+  m_raw_len = len;
+  m_raw_log = log;
+  return true;
+}
+
+void SDLState::parse_raw() {
+  if (!m_raw) {
+    return;
+  }
+  const uint8_t *body = m_raw + m_raw_body;
+  uint32_t body_len = m_raw_len - m_raw_body;
+  m_raw = NULL;
+  // the name and version were already checked
+  UruString name(body, body_len, true, false, false);
+  uint32_t offset = name.arrival_len() + 2;
+  // we wrote it so this should not happen; whatever was not read will be
+  // the defaults
+  try {
+    recursive_parse(body + offset, body_len - offset);
+  } catch (const truncated_message &e) {
+    log_err(m_raw_log, "Saved %s SDL state is truncated (%s); using defaults for the rest\n", m_desc->name(), e.what());
+  } catch (const parse_error &e) {
+    log_err(m_raw_log, "Saved %s SDL state is corrupt (%s); using defaults for the rest\n", m_desc->name(), e.what());
+  }
+  expand();
+}
+
+int32_t SDLState::read_in(const uint8_t *buf, size_t bufsize, const SDLDescIndex &descs) {
   UruString name(buf, (int32_t) bufsize, true, false, false);
   uint32_t offset = name.arrival_len();
   if (bufsize < offset + 2) {
@@ -1103,7 +1341,7 @@ int32_t SDLState::read_in(const uint8_t *buf, size_t bufsize, const std::list<SD
   }
   uint16_t version = read16(buf, offset);
   offset += 2;
-  m_desc = SDLDesc::find_by_name(name.c_str(), descs, version);
+  m_desc = descs.find(name.c_str(), version);
   if (!m_desc) {
     // unrecognized SDL: caller should log & ignore it
     return -1;
@@ -1118,6 +1356,44 @@ int32_t SDLState::read_in(const uint8_t *buf, size_t bufsize, const std::list<SD
   }
 }
 
+/*
+ * Int, Float, Vector3, Point3 and Quaternion values are all 32-bit
+ * little-endian words, and in a data_t the words are at the start. On a
+ * little-endian host each value is copied as it is.
+ */
+static void read_words(SDLDesc::Variable::data_t *values, uint32_t count, uint32_t words, const uint8_t *buf) {
+#ifdef WORDS_BIGENDIAN
+  for (uint32_t j = 0; j < count; j++) {
+    uint8_t *where = (uint8_t*) &(values[j]);
+    for (uint32_t k = 0; k < words; k++) {
+      uint32_t val = read32(buf, ((j * words) + k) * 4);
+      memcpy(where + (k * 4), &val, 4);
+    }
+  }
+#else
+  for (uint32_t j = 0; j < count; j++) {
+    memcpy(&(values[j]), buf + (j * words * 4), words * 4);
+  }
+#endif
+}
+
+static void write_words(uint8_t *buf, const SDLDesc::Variable::data_t *values, uint32_t count, uint32_t words) {
+#ifdef WORDS_BIGENDIAN
+  for (uint32_t j = 0; j < count; j++) {
+    const uint8_t *where = (const uint8_t*) &(values[j]);
+    for (uint32_t k = 0; k < words; k++) {
+      uint32_t val;
+      memcpy(&val, where + (k * 4), 4);
+      write32(buf, ((j * words) + k) * 4, val);
+    }
+  }
+#else
+  for (uint32_t j = 0; j < count; j++) {
+    memcpy(buf + (j * words * 4), &(values[j]), words * 4);
+  }
+#endif
+}
+
 int32_t SDLState::recursive_parse(const uint8_t *buf, size_t bufsize) {
   if (bufsize < 4) {
     throw truncated_message("SDL message too short for first fields");
@@ -1189,43 +1465,24 @@ int32_t SDLState::recursive_parse(const uint8_t *buf, size_t bufsize) {
       v->m_count = read32(buf, offset);
       offset += 4;
     }
-    v->m_value = new SDLDesc::Variable::data_t[v->m_count];
+    alloc_value(v);
+    if (bufsize < offset + (v->m_count * d_var->m_wire_size)) {
+      throw truncated_message("SDL message too short");
+    }
+    if (d_var->m_words) {
+      read_words(v->m_value, v->m_count, d_var->m_words, buf + offset);
+      offset += v->m_count * d_var->m_wire_size;
+      continue;
+    }
     switch (d_var->m_type) {
 
-    case SDLDesc::Variable::Int:
-      if (bufsize < offset + (v->m_count * 4)) {
-        throw truncated_message("SDL message too short");
-      }
-      for (uint32_t j = 0; j < v->m_count; j++) {
-        v->m_value[j].v_int = read32(buf, offset);
-        offset += 4;
-      }
-      break;
-
-    case SDLDesc::Variable::Float:
-      if (bufsize < offset + (v->m_count * 4)) {
-        throw truncated_message("SDL message too short");
-      }
-      for (uint32_t j = 0; j < v->m_count; j++) {
-        uint32_t val = read32(buf, offset);
-        memcpy(&(v->m_value[j].v_float), &val, 4);
-        offset += 4;
-      }
-      break;
-
     case SDLDesc::Variable::Bool:
-      if (bufsize < offset + (v->m_count)) {
-        throw truncated_message("SDL message too short");
-      }
       for (uint32_t j = 0; j < v->m_count; j++) {
         v->m_value[j].v_bool = (buf[offset++] ? true : false);
       }
       break;
 
     case SDLDesc::Variable::String32:
-      if (bufsize < offset + (v->m_count * 32)) {
-        throw truncated_message("SDL message too short");
-      }
       for (uint32_t j = 0; j < v->m_count; j++) {
         memcpy(v->m_value[j].v_string, buf + offset, 32);
         offset += 32;
@@ -1244,9 +1501,6 @@ int32_t SDLState::recursive_parse(const uint8_t *buf, size_t bufsize) {
       throw parse_error(idx, std::string("Creatable cannot be transmitted"));
 
     case SDLDesc::Variable::Time:
-      if (bufsize < offset + (v->m_count * 8)) {
-        throw truncated_message("SDL message too short");
-      }
       for (uint32_t j = 0; j < v->m_count; j++) {
         v->m_value[j].v_time.tv_sec = read32(buf, offset);
         v->m_value[j].v_time.tv_usec = read32(buf, offset + 4);
@@ -1255,18 +1509,12 @@ int32_t SDLState::recursive_parse(const uint8_t *buf, size_t bufsize) {
       break;
 
     case SDLDesc::Variable::Byte:
-      if (bufsize < offset + (v->m_count)) {
-        throw truncated_message("SDL message too short");
-      }
       for (uint32_t j = 0; j < v->m_count; j++) {
         v->m_value[j].v_byte = buf[offset++];
       }
       break;
 
     case SDLDesc::Variable::Short:
-      if (bufsize < offset + (v->m_count * 2)) {
-        throw truncated_message("SDL message too short");
-      }
       for (uint32_t j = 0; j < v->m_count; j++) {
         v->m_value[j].v_short = read16(buf, offset);
         offset += 2;
@@ -1274,9 +1522,6 @@ int32_t SDLState::recursive_parse(const uint8_t *buf, size_t bufsize) {
       break;
 
     case SDLDesc::Variable::AgeTimeOfDay:
-      if (bufsize < offset + (v->m_count * 8)) {
-        throw truncated_message("SDL message too short");
-      }
       for (uint32_t j = 0; j < v->m_count; j++) {
         v->m_value[j].v_agetime.tv_sec = read32(buf, offset);
         v->m_value[j].v_agetime.tv_usec = read32(buf, offset + 4);
@@ -1284,42 +1529,10 @@ int32_t SDLState::recursive_parse(const uint8_t *buf, size_t bufsize) {
       }
       break;
 
-    case SDLDesc::Variable::Vector3:
-    case SDLDesc::Variable::Point3:
-      if (bufsize < offset + (v->m_count * 12)) {
-        throw truncated_message("SDL message too short");
-      }
-      for (uint32_t j = 0; j < v->m_count; j++) {
-        float *where = (d_var->m_type == SDLDesc::Variable::Vector3 ? v->m_value[j].v_vector3 : v->m_value[j].v_point3);
-        for (uint32_t k = 0; k < 3; k++) {
-          uint32_t val = read32(buf, offset);
-          memcpy(where + k, &val, 4);
-          offset += 4;
-        }
-      }
-      break;
-
-    case SDLDesc::Variable::Quaternion:
-      if (bufsize < offset + (v->m_count * 16)) {
-        throw truncated_message("SDL message too short");
-      }
-      for (uint32_t j = 0; j < v->m_count; j++) {
-        for (uint32_t k = 0; k < 4; k++) {
-          uint32_t val = read32(buf, offset);
-          memcpy((v->m_value[j].v_quaternion) + k, &val, 4);
-          offset += 4;
-        }
-      }
-      break;
-
     case SDLDesc::Variable::RGB8:
-      if (bufsize < offset + (v->m_count * 3)) {
-        throw truncated_message("SDL message too short");
-      }
       for (uint32_t j = 0; j < v->m_count; j++) {
-        for (uint32_t k = 0; k < 3; k++) {
-          v->m_value[j].v_rgb8[k] = buf[offset++];
-        }
+        memcpy(v->m_value[j].v_rgb8, buf + offset, 3);
+        offset += 3;
       }
       break;
 
@@ -1419,6 +1632,13 @@ int32_t SDLState::write_out(uint8_t *buf, size_t bufsize) const {
     // XXX programmer error
     return -1;
   }
+  if (m_raw) {
+    if (bufsize < m_raw_len - m_raw_body) {
+      return -1;
+    }
+    memcpy(buf, m_raw + m_raw_body, m_raw_len - m_raw_body);
+    return m_raw_len - m_raw_body;
+  }
   UruString name(m_desc->name());
   uint32_t offset = name.send_len(true, false, false);
   if (bufsize < offset + 2) {
@@ -1500,43 +1720,23 @@ int32_t SDLState::recursive_write(uint8_t *buf, size_t bufsize) const {
       write32(buf, offset, v->m_count);
       offset += 4;
     }
+    if (bufsize < offset + (v->m_count * d_var->m_wire_size)) {
+      return -1;
+    }
+    if (d_var->m_words) {
+      write_words(buf + offset, v->m_value, v->m_count, d_var->m_words);
+      offset += v->m_count * d_var->m_wire_size;
+      continue;
+    }
     switch (d_var->m_type) {
 
-    case SDLDesc::Variable::Int:
-      if (bufsize < offset + (v->m_count * 4)) {
-        return -1;
-      }
-      for (uint32_t j = 0; j < v->m_count; j++) {
-        write32(buf, offset, v->m_value[j].v_int);
-        offset += 4;
-      }
-      break;
-
-    case SDLDesc::Variable::Float:
-      if (bufsize < offset + (v->m_count * 4)) {
-        return -1;
-      }
-      for (uint32_t j = 0; j < v->m_count; j++) {
-        uint32_t val;
-        memcpy(&val, &(v->m_value[j].v_float), 4);
-        write32(buf, offset, val);
-        offset += 4;
-      }
-      break;
-
     case SDLDesc::Variable::Bool:
-      if (bufsize < offset + (v->m_count)) {
-        return -1;
-      }
       for (uint32_t j = 0; j < v->m_count; j++) {
         buf[offset++] = (v->m_value[j].v_bool ? 1 : 0);
       }
       break;
 
     case SDLDesc::Variable::String32:
-      if (bufsize < offset + (v->m_count * 32)) {
-        return -1;
-      }
       for (uint32_t j = 0; j < v->m_count; j++) {
         memcpy(buf + offset, v->m_value[j].v_string, 32);
         offset += 32;
@@ -1556,14 +1756,14 @@ int32_t SDLState::recursive_write(uint8_t *buf, size_t bufsize) const {
 
     case SDLDesc::Variable::Creatable:
       // writing these values is not supported
+      if (bufsize < offset + 4) {
+        return -1;
+      }
       write32(buf, offset, 0);
       offset += 4;
       break;
 
     case SDLDesc::Variable::Time:
-      if (bufsize < offset + (v->m_count * 8)) {
-        return -1;
-      }
       for (uint32_t j = 0; j < v->m_count; j++) {
         write32(buf, offset, v->m_value[j].v_time.tv_sec);
         write32(buf, offset + 4, v->m_value[j].v_time.tv_usec);
@@ -1572,18 +1772,12 @@ int32_t SDLState::recursive_write(uint8_t *buf, size_t bufsize) const {
       break;
 
     case SDLDesc::Variable::Byte:
-      if (bufsize < offset + (v->m_count)) {
-        return -1;
-      }
       for (uint32_t j = 0; j < v->m_count; j++) {
         buf[offset++] = v->m_value[j].v_byte;
       }
       break;
 
     case SDLDesc::Variable::Short:
-      if (bufsize < offset + (v->m_count * 2)) {
-        return -1;
-      }
       for (uint32_t j = 0; j < v->m_count; j++) {
         write16(buf, offset, v->m_value[j].v_short);
         offset += 2;
@@ -1591,9 +1785,6 @@ int32_t SDLState::recursive_write(uint8_t *buf, size_t bufsize) const {
       break;
 
     case SDLDesc::Variable::AgeTimeOfDay:
-      if (bufsize < offset + (v->m_count * 8)) {
-        return -1;
-      }
       for (uint32_t j = 0; j < v->m_count; j++) {
         write32(buf, offset, v->m_value[j].v_agetime.tv_sec);
         write32(buf, offset + 4, v->m_value[j].v_agetime.tv_usec);
@@ -1601,44 +1792,10 @@ int32_t SDLState::recursive_write(uint8_t *buf, size_t bufsize) const {
       }
       break;
 
-    case SDLDesc::Variable::Vector3:
-    case SDLDesc::Variable::Point3:
-      if (bufsize < offset + (v->m_count * 12)) {
-        return -1;
-      }
-      for (uint32_t j = 0; j < v->m_count; j++) {
-        float *where = (d_var->m_type == SDLDesc::Variable::Vector3 ? v->m_value[j].v_vector3 : v->m_value[j].v_point3);
-        for (uint32_t k = 0; k < 3; k++) {
-          uint32_t val;
-          memcpy(&val, where + k, 4);
-          write32(buf, offset, val);
-          offset += 4;
-        }
-      }
-      break;
-
-    case SDLDesc::Variable::Quaternion:
-      if (bufsize < offset + (v->m_count * 16)) {
-        return -1;
-      }
-      for (uint32_t j = 0; j < v->m_count; j++) {
-        for (uint32_t k = 0; k < 4; k++) {
-          uint32_t val;
-          memcpy(&val, (v->m_value[j].v_quaternion) + k, 4);
-          write32(buf, offset, val);
-          offset += 4;
-        }
-      }
-      break;
-
     case SDLDesc::Variable::RGB8:
-      if (bufsize < offset + (v->m_count * 3)) {
-        return -1;
-      }
       for (uint32_t j = 0; j < v->m_count; j++) {
-        for (uint32_t k = 0; k < 3; k++) {
-          buf[offset++] = v->m_value[j].v_rgb8[k];
-        }
+        memcpy(buf + offset, v->m_value[j].v_rgb8, 3);
+        offset += 3;
       }
       break;
 
@@ -1722,6 +1879,9 @@ uint32_t SDLState::body_len() const {
     // XXX programmer error
     return 0;
   }
+  if (m_raw) {
+    return m_raw_len - m_raw_body;
+  }
   UruString name(m_desc->name());
   uint32_t total = name.send_len(true, false, false);
   total += 2; // version
@@ -1761,48 +1921,16 @@ uint32_t SDLState::recursive_len() const {
     if (d_var->m_count == 0) {
       total += 4;
     }
-    switch (d_var->m_type) {
-    case SDLDesc::Variable::Int:
-    case SDLDesc::Variable::Float:
-      total += (v->m_count * 4);
-      break;
-    case SDLDesc::Variable::Bool:
-    case SDLDesc::Variable::Byte:
-      total += v->m_count;
-      break;
-    case SDLDesc::Variable::String32:
-      total += (v->m_count * 32);
-      break;
-    case SDLDesc::Variable::Key:
+    if (d_var->m_type == SDLDesc::Variable::Key) {
       for (uint32_t j = 0; j < v->m_count; j++) {
         PlKey *key = &(v->m_value[j].v_plkey);
         total += key->send_len();
       }
-      break;
-    case SDLDesc::Variable::Creatable:
+    } else if (d_var->m_type == SDLDesc::Variable::Creatable) {
       // writing these values is not supported
       total += 4;
-      break;
-    case SDLDesc::Variable::Time:
-    case SDLDesc::Variable::AgeTimeOfDay:
-      total += (v->m_count * 8);
-      break;
-    case SDLDesc::Variable::Short:
-      total += (v->m_count * 2);
-      break;
-    case SDLDesc::Variable::Vector3:
-    case SDLDesc::Variable::Point3:
-      total += (v->m_count * 12);
-      break;
-    case SDLDesc::Variable::Quaternion:
-      total += (v->m_count * 16);
-      break;
-    case SDLDesc::Variable::RGB8:
-      total += (v->m_count * 3);
-      break;
-    default:
-      // can't happen
-      break;
+    } else {
+      total += (v->m_count * d_var->m_wire_size);
     }
   } // for (i)
 
@@ -1852,7 +1980,7 @@ void SDLState::invent_age_key(uint32_t pageid) {
   m_key.m_locflags = 0x0008;
   m_key.m_classtype = plSceneObject;
   m_key.m_objectid = 1;
-  m_key.m_name = new UruString("AgeSDLHook", false);
+  m_key.set_name("AgeSDLHook");
 }
 
 void SDLState::expand() {
@@ -1860,6 +1988,11 @@ void SDLState::expand() {
     // XXX programmer error
     return;
   }
+  if (m_raw) {
+    // parse_raw() expands when it is done
+    parse_raw();
+    return;
+  }
   /**
    * Expand the state "value" vectors to match the SDLDesc specification
    * All NULL vars are populated with new Variable()s.
@@ -1934,57 +2067,94 @@ void SDLState::expand() {
   }
 }
 
-bool SDLState::save_file(std::ofstream &file, std::list<SDLState*> &save) {
-  uint32_t buflen = 4096;
-  uint8_t *buf = new uint8_t[buflen];
+void SDLState::set_cached_msg(NetworkMessage *msg) {
+  if (m_cached_msg && m_cached_msg->del_ref() < 1) {
+    delete m_cached_msg;
+  }
+  m_cached_msg = msg;
+  if (msg) {
+    msg->add_ref();
+  }
+}
+
+SDLState* SDLState::partial(const std::vector<bool> &vars, const std::vector<bool> &structs) {
+  parse_raw();
+  SDLState *part = new SDLState();
+  part->m_desc = m_desc;
+  part->m_flag = m_flag;
+  part->m_key = m_key;
+  part->m_key.copy_name();
+  part->m_borrowed = true;
+  part->m_vars.resize(m_vars.size(), NULL);
+  for (uint32_t i = 0; i < m_vars.size() && i < vars.size(); i++) {
+    if (vars[i]) {
+      part->m_vars[i] = m_vars[i];
+    }
+  }
+  part->m_structs.resize(m_structs.size(), NULL);
+  for (uint32_t i = 0; i < m_structs.size() && i < structs.size(); i++) {
+    if (structs[i]) {
+      part->m_structs[i] = m_structs[i];
+    }
+  }
+  return part;
+}
+
+bool SDLState::persistent() const {
+  // m_flag & Volatile is not sufficient for determining whether an object should
+  // be discarded from the persistent state: there are objects without this
+  // flag set which should not be persistent, the KI light being the big
+  // one. So if the plKey has a client ID, it's avatar-related SDL, or a
+  // clone, so don't save it either.
+  // note this also discards object clones -- if that is changed, the
+  // Creatable handling must be updated so that when reading a file a flag
+  // is passed in saying whether it is okay to allow a Creatable (it must
+  // *only* be allowed reading in the state file)
+  return !((m_flag & Volatile) || (m_key.m_contents & HasUoid));
+}
 
+bool SDLState::write_file_record(std::string &out) {
+  m_saving_to_file = true;
+  uint32_t len = send_len();
+  // XXX make sure this number isn't ridiculously large
+  uint8_t *buf = new uint8_t[len + 4];
+  // we don't compress in the save file
+  int32_t wrote = write_msg(buf + 4, len, true);
+  m_saving_to_file = false;
+  if (wrote <= 0) {
+    delete[] buf;
+    return false;
+  }
+  write32(buf, 0, wrote);
+  out.append((const char*) buf, wrote + 4);
+  delete[] buf;
+  return true;
+}
+
+bool SDLState::save_file(std::ofstream &file, std::list<SDLState*> &save) {
+  std::string record;
   std::list<SDLState*>::iterator iter;
   for (iter = save.begin(); iter != save.end(); iter++) {
     SDLState *s = *iter;
-    // m_flag & Volatile is not sufficient for determining whether an object should
-    // be discarded from the persistent state: there are objects without this
-    // flag set which should not be persistent, the KI light being the big
-    // one. So if the plKey has a client ID, it's avatar-related SDL, or a
-    // clone, so don't save it either.
-    // note this also discards object clones -- if that is changed, the
-    // Creatable handling must be updated so that when reading a file a flag
-    // is passed in saying whether it is okay to allow a Creatable (it must
-    // *only* be allowed reading in the state file)
-    if ((s->m_flag & Volatile) || (s->key().m_contents & HasUoid)) {
+    if (!s->persistent()) {
       continue;
     }
-
-    s->m_saving_to_file = true;
-    uint32_t len = s->send_len();
-    if (buflen < len + 4) {
-      // XXX make sure this number isn't ridiculously large
-      delete[] buf;
-      buflen = len + 4;
-      buf = new uint8_t[buflen];
-    }
-    // we don't compress in the save file
-    int32_t wrote = s->write_msg(buf + 4, buflen - 4, true);
-    s->m_saving_to_file = false;
-    if (wrote > 0) {
-      write32(buf, 0, wrote);
-      // write to file
-      file.write((char*) buf, wrote + 4);
-      if (file.bad()) {
-        // XXX need to log or something
-        delete[] buf;
-        return false;
-      }
-    } else {
+    record.clear();
+    if (!s->write_file_record(record)) {
       // XXX something went wrong
-      delete[] buf;
+      return false;
+    }
+    // write to file
+    file.write(record.data(), record.size());
+    if (file.bad()) {
+      // XXX need to log or something
       return false;
     }
   }
-  delete[] buf;
   return true;
 }
 
-bool SDLState::load_file(std::ifstream &file, std::list<SDLState*> &load, std::list<SDLDesc*> &descs, Logger *log) {
+bool SDLState::load_file(std::ifstream &file, std::list<SDLState*> &load, const SDLDescIndex &descs, Logger *log) {
   uint32_t buflen = 4096;
   uint8_t buf[buflen];
   uint32_t offset, fill = 0;
@@ -2087,6 +2257,11 @@ void SDLState::update_from(SDLState *newer, bool vault, bool global, bool age_lo
     // XXX programmer error
     return;
   }
+  parse_raw();
+  newer->parse_raw();
+  m_changed = true;
+  // joiners need a new message
+  set_cached_msg(NULL);
   struct timeval now;
   gettimeofday(&now, NULL);
   if (m_vars.size() < m_desc->vars().size()
@@ -2097,18 +2272,14 @@ void SDLState::update_from(SDLState *newer, bool vault, bool global, bool age_lo
   if (age_load) {
     if (!m_key.m_name) {
       m_key = newer->m_key;
-      if (newer->m_key.m_name) {
-        m_key.m_name = new UruString(*newer->m_key.m_name, true);
-      }
+      m_key.copy_name();
     }
   } else if (vault) {
     // the SDL will be forwarded to clients, potentially; make sure the key
     // is set properly
     if (!newer->m_key.m_name) {
       newer->m_key = m_key;
-      if (m_key.m_name) {
-        newer->m_key.m_name = new UruString(*m_key.m_name, true);
-      }
+      newer->m_key.copy_name();
     }
   }
   for (uint32_t i = 0; i < newer->m_vars.size(); i++) {
@@ -2162,26 +2333,29 @@ void SDLState::update_from(SDLState *newer, bool vault, bool global, bool age_lo
       }
     }
     if (!vault) {
-      // if it's not coming from the vault, we can swipe the data in
-      // the newer state
-      if (to) {
-        delete to;
+      // if it's not coming from the vault, the newer state is done with, but
+      // its Variable is not swiped: its value is in the newer state's block,
+      // which would then stay around as long as the Variable does, so copy
+      // the value into our own space instead
+      if (!to) {
+        to = new Variable(from->m_index, from->m_type);
+        m_vars[from->m_index] = to;
       }
-      m_vars[from->m_index] = from;
-      newer->m_vars[i] = NULL;
+      copy_value(to, from);
       // make sure there's a timestamp; if it's age load we definitely
       // don't want to modify the timestamps!
-      if (!age_load || !(from->m_flags & HasTimeStamp)) {
-        from->m_flags |= HasTimeStamp;
-        from->m_ts = now;
+      if (!age_load || !(to->m_flags & HasTimeStamp)) {
+        to->m_flags |= HasTimeStamp;
+        to->m_ts = now;
       }
     } else {
       // if it's from the vault, we have to be more careful: we need to leave
       // the data in the newer state object, so we have to copy it to this one
       if (!to) {
         to = new Variable(from->m_index, from->m_type);
+        m_vars[from->m_index] = to;
       }
-      *to = *from;
+      copy_value(to, from);
       // make sure there's a timestamp if there wasn't one already
       if (!age_load || !(to->m_flags & HasTimeStamp)) {
         to->m_flags |= HasTimeStamp;
@@ -2298,6 +2472,7 @@ const char* SDLState::Variable::c_str() {
 }
 
 std::string SDLState::str(const char *sep) {
+  parse_raw();
   std::ostringstream out;
   std::vector<SDLState::Variable*>::const_iterator vi;
   std::vector<SDLState::Struct*>::const_iterator si;
@@ -2507,7 +2682,63 @@ bool SDLState::Variable::operator==(const SDLState::Variable &other) {
   return true;
 }
 
+SDLState::ValueBlock::ValueBlock(const SDLDesc *desc) :
+    m_desc(desc), m_refs(1) {
+  m_values = new SDLDesc::Variable::data_t[desc->value_count()];
+  // zeroed so that a Key whose value was never read in has no name
+  memset(m_values, 0, desc->value_count() * sizeof(SDLDesc::Variable::data_t));
+  m_taken = new bool[desc->vars().size()];
+  memset(m_taken, 0, desc->vars().size() * sizeof(bool));
+}
+
+SDLDesc::Variable::data_t* SDLState::ValueBlock::take(uint32_t index) {
+  if (index >= m_desc->vars().size() || m_taken[index]) {
+    return NULL;
+  }
+  m_taken[index] = true;
+  return m_values + m_desc->vars()[index]->m_offset;
+}
+
+void SDLState::ValueBlock::give_back(uint32_t index) {
+  if (index < m_desc->vars().size()) {
+    m_taken[index] = false;
+  }
+}
+
+void SDLState::alloc_value(Variable *v) {
+  const SDLDesc::Variable *d_var = m_desc->vars()[v->m_index];
+  if (d_var->m_count != 0 && v->m_count == d_var->m_count) {
+    if (!m_values) {
+      m_values = new ValueBlock(m_desc);
+    }
+    v->m_value = m_values->take(v->m_index);
+    if (v->m_value) {
+      v->m_block = m_values;
+      m_values->add_ref();
+      return;
+    }
+    // the same variable twice in one message; the second one is on its own
+  }
+  v->m_value = new SDLDesc::Variable::data_t[v->m_count];
+  memset(v->m_value, 0, v->m_count * sizeof(SDLDesc::Variable::data_t));
+}
+
+void SDLState::copy_value(Variable *to, const Variable *from) {
+  if (!to->m_value && !(from->m_flags & SameAsDefault)) {
+    to->m_count = from->m_count;
+    alloc_value(to);
+  }
+  *to = *from;
+}
+
 SDLState::Variable::~Variable() {
+  free_value();
+}
+
+void SDLState::Variable::clear_value() {
+  if (!m_value) {
+    return;
+  }
   if (m_type == SDLDesc::Variable::Key) {
     for (uint32_t j = 0; j < m_count; j++) {
       m_value[j].v_plkey.delete_name();
@@ -2519,7 +2750,18 @@ SDLState::Variable::~Variable() {
       m_value[0].v_creatable = NULL;
     }
   }
-  delete[] m_value;
+}
+
+void SDLState::Variable::free_value() {
+  clear_value();
+  if (m_block) {
+    m_block->give_back(m_index);
+    m_block->del_ref();
+    m_block = NULL;
+  } else {
+    delete[] m_value;
+  }
+  m_value = NULL;
 }
 
 SDLState::Variable&
@@ -2529,8 +2771,13 @@ SDLState::Variable::operator=(const SDLState::Variable &other) {
     if ((!(other.m_flags & SameAsDefault)
          || (m_count < other.m_count))
         && (!(m_flags & SameAsDefault))) {
-      delete[] m_value;
-      m_value = NULL;
+      if (m_value && m_count == other.m_count
+          && !(other.m_flags & SameAsDefault)) {
+        // the new value fits in the same space, which may be in a block
+        clear_value();
+      } else {
+        free_value();
+      }
     }
     if (!(other.m_flags & SameAsDefault) && !m_value) {
       m_value = new SDLDesc::Variable::data_t[other.m_count];
@@ -2543,10 +2790,10 @@ SDLState::Variable::operator=(const SDLState::Variable &other) {
       memcpy(m_value, other.m_value, sizeof(SDLDesc::Variable::data_t) * m_count);
     }
     m_type = other.m_type;
-    if (m_type == SDLDesc::Variable::Key) {
+    if (m_type == SDLDesc::Variable::Key && !(m_flags & SameAsDefault)) {
       for (uint32_t j = 0; j < m_count; j++) {
-        // the pointer was copied, make a new string
-        m_value[j].v_plkey.m_name = new UruString(*other.m_value[j].v_plkey.m_name, true);
+        // the pointer was copied, hold the name too
+        m_value[j].v_plkey.copy_name();
       }
     }
     if (m_type == SDLDesc::Variable::Creatable) {
@@ -2677,6 +2924,9 @@ AgeDesc* AgeDesc::parse_file(std::ifstream &file) {
         num >> age->m_seq_prefix;
       } else if (token == "ReleaseVersion") {
         num >> age->m_release;
+      } else if (token == "TickRate") {
+        // not in the client's files; see GameServer::set_tick_rate()
+        num >> age->m_tick_rate;
       } else {
         delete age;
         throw parse_error(lineno, std::string("unrecognized field '") + token + "'");
@@ -40,6 +40,7 @@
 //#include <sys/time.h>
 //
 //#include <list>
+//#include <map>
 //#include <vector>
 //
 //#include <iostream>
@@ -51,6 +52,10 @@
 //#include <stdio.h>
 //
 //#include "Logger.h"
+
+// forward declarations
+class NetworkMessage;
+
 class SDLDesc {
 public:
   /*
@@ -127,15 +132,22 @@ public:
       uint8_t v_rgb8[3];
     } data_t;
 
-    Variable(sdl_vartype_t type) :
-        DescObj(), m_type(type), m_dispoptions(0) {
-      memset(&m_default, 0, sizeof(m_default));
-    }
+    Variable(sdl_vartype_t type);
     ~Variable();
 
     sdl_vartype_t m_type;
     char* m_dispoptions;
     data_t m_default;
+    // where the values go in an SDLState's value block (fixed-size
+    // variables only)
+    uint32_t m_offset;
+    // How the values are sent, worked out once from the type so that
+    // reading and writing SDL does not have to: each value is m_wire_size
+    // bytes (0 for keys, whose size varies, and creatables), and for the
+    // types whose values are only 32-bit words (Int, Float, Vector3, Point3,
+    // Quaternion), it is m_words words at the start of the data_t.
+    uint32_t m_wire_size;
+    uint32_t m_words;
 
     static char* c_str(char *buf, size_t buflen, sdl_vartype_t t, SDLDesc::Variable::data_t &d); // helper function
     static std::string str(sdl_vartype_t t, SDLDesc::Variable::data_t &d); // helper function
@@ -190,6 +202,10 @@ public:
   const std::vector<Struct*>& structs() const {
     return m_structs;
   }
+  // how many values all the fixed-size variables have together
+  uint32_t value_count() const {
+    return m_value_count;
+  }
 
   // throws parse_error
   static void parse_file(std::list<SDLDesc*> &sdls, std::ifstream &file);
@@ -206,12 +222,15 @@ protected:
 
   std::vector<Variable*> m_vars;
   std::vector<Struct*> m_structs;
+  uint32_t m_value_count;
 
   static SDLDesc* read_desc(std::ifstream &file, uint32_t &lineno, std::list<SDLDesc*> &descs);
   void set_version(uint32_t v) {
     m_version = v;
   }
   void add_var(Variable *v) {
+    v->m_offset = m_value_count;
+    m_value_count += v->m_count;
     m_vars.push_back(v);
   }
   void add_struct(Struct *s) {
@@ -228,8 +247,49 @@ private:
   static uint32_t name_and_count(std::string &namestr, uint32_t lineno);
 };
 
+/**
+ * A list of SDLDescs (searched in order) with an index by name and version,
+ * so that looking one up, which happens for every SDL message read, is not
+ * a walk down the whole list. find() gives the same answer as
+ * SDLDesc::find_by_name() on the list. The SDLDescs are not owned.
+ */
+class SDLDescIndex {
+public:
+  SDLDescIndex() { }
+  SDLDescIndex(const std::list<SDLDesc*> &descs) {
+    assign(descs);
+  }
+
+  void assign(const std::list<SDLDesc*> &descs);
+  const std::list<SDLDesc*>& descs() const {
+    return m_descs;
+  }
+  size_t size() const {
+    return m_descs.size();
+  }
+  // version 0 means the newest one
+  SDLDesc* find(const char *name, uint32_t version = 0) const;
+
+protected:
+  struct name_less {
+    bool operator()(const char *a, const char *b) const;
+  };
+  std::list<SDLDesc*> m_descs;
+  // the names point into the SDLDescs; for each name and version, the first
+  // SDLDesc in m_descs
+  std::map<const char*, std::map<uint32_t, SDLDesc*>, name_less> m_index;
+};
+
 // utility functions
+// Compress the SDL message in buf (which starts at the 11-byte compression
+// header) in place, if it is big enough and compressing makes it smaller.
+// Returns the new length of what follows the first 9 bytes of the header,
+// or 0 if it was left alone. Each thread keeps its own zlib stream and
+// buffer for this.
 uint32_t do_message_compression(uint8_t *buf);
+// the zlib level do_message_compression() uses, 1-9, or 0 for zlib's
+// default
+void set_message_compression_level(int32_t level);
 
 class SDLState {
 public:
@@ -280,13 +340,59 @@ public:
     std::string m_string;
   };
 
+  /*
+   * The values of a state's fixed-size variables are kept in one block,
+   * laid out by SDLDesc::Variable::m_offset, rather than allocated one
+   * variable at a time. update_from() copies values into the updated
+   * state's own space rather than taking the newer state's Variables, so a
+   * long-lived state never holds on to a message's block. Each Variable
+   * using the block holds a reference to it, as does the state, so the
+   * order they are deleted in does not matter.
+   */
+  class ValueBlock {
+  public:
+    ValueBlock(const SDLDesc *desc);
+
+    // returns NULL if the variable's space was already handed out
+    SDLDesc::Variable::data_t* take(uint32_t index);
+    // the variable's space may be handed out again
+    void give_back(uint32_t index);
+
+    void add_ref() {
+      m_refs++;
+    }
+    void del_ref() {
+      if (--m_refs == 0) {
+        delete this;
+      }
+    }
+
+  protected:
+    ~ValueBlock() {
+      delete[] m_values;
+      delete[] m_taken;
+    }
+
+    const SDLDesc *m_desc;
+    uint32_t m_refs;
+    SDLDesc::Variable::data_t *m_values;
+    bool *m_taken;
+
+  private:
+    ValueBlock();
+    ValueBlock(ValueBlock&);
+    ValueBlock& operator=(const ValueBlock&);
+  };
+
   class Variable: public StateObj {
   public:
     SDLDesc::sdl_vartype_t m_type;
+    // if m_block is NULL, m_value was allocated with new[]
     SDLDesc::Variable::data_t *m_value;
+    ValueBlock *m_block;
 
     Variable(uint32_t index, const SDLDesc::sdl_vartype_t type) :
-        StateObj(index), m_type(type), m_value(NULL) {
+        StateObj(index), m_type(type), m_value(NULL), m_block(NULL) {
     }
     ~Variable();
     // == excludes the timestamp! (both the flag and the actual ts value)
@@ -298,6 +404,11 @@ public:
   private:
     Variable();
     Variable(Variable&);
+
+    // let go of the keys' names or delete the creatable buffer in the value
+    void clear_value();
+    // clear the value and give back its space
+    void free_value();
   };
 
   class Struct: public StateObj {
@@ -330,7 +441,7 @@ public:
   /// Read in a full SDL message. Returns the number of bytes used, or
   // -(bytes used) if the SDL is not recognized.
   // throws parse_error, truncated_message
-  int32_t read_msg(const uint8_t *buf, size_t bufsize, const std::list<SDLDesc*> &descs);
+  int32_t read_msg(const uint8_t *buf, size_t bufsize, const SDLDescIndex &descs);
   /// Returns how many (uncompressed) bytes the entire message requires.
   // When written the message may be smaller due to compression.
   uint32_t send_len() const;
@@ -338,10 +449,18 @@ public:
   int32_t write_msg(uint8_t *buf, size_t bufsize, bool no_compress = false);
   /// set the SDLDesc that goes with the SDLState being created
   void set_desc(const SDLDesc *desc);
+  /// Use an uncompressed SDL message (as write_msg(..., true) makes) in
+  // place, for state loaded from an age state snapshot. Only the key and
+  // flags are read now; the rest is parsed when the state is changed or
+  // its contents are looked at, and until then it is sent as-is, so the
+  // message must stay valid as long as the state exists. Returns false
+  // if the message cannot be used. If the rest turns out to be bad when
+  // it is parsed, that is logged to log.
+  bool attach(const uint8_t *msg, uint32_t len, const SDLDesc *desc, Logger *log = NULL);
   /// Returns < 0 if the SDL is not recognized. Otherwise returns how many
   // bytes were read.
   // throws truncated_message
-  int32_t read_in(const uint8_t *buf, size_t bufsize, const std::list<SDLDesc*> &descs);
+  int32_t read_in(const uint8_t *buf, size_t bufsize, const SDLDescIndex &descs);
   /// Returns how many (uncompressed) bytes the body of the message requires
   // (not including the plKey or the lengths/compression flag).
   uint32_t body_len() const;
@@ -359,10 +478,37 @@ public:
   /// update this, the master copy
   void update_from(SDLState *newer, bool vault = false, bool global = true, bool age_load = false);
 
+  /// whether this belongs in the age state file
+  bool persistent() const;
+  /// append the age state file encoding (length and uncompressed message)
+  // to out; returns false if it could not be encoded
+  bool write_file_record(std::string &out);
+  /// whether the state has changed since clear_changed(); new states start
+  // out changed
+  bool changed() const {
+    return m_changed;
+  }
+  void clear_changed() {
+    m_changed = false;
+  }
+
+  /// The initial-state message made from this state, which everyone joining
+  // can share until the state changes (see PlNetMsgSDLState::initial()).
+  // The SDLState holds a reference while it is cached.
+  NetworkMessage* cached_msg() const {
+    return m_cached_msg;
+  }
+  void set_cached_msg(NetworkMessage *msg);
+
+  /// Make a state with only the given (top-level) variables and structs of
+  // this one, for sending what changed. The new state shares them with this
+  // one, so it must be deleted before this one changes.
+  SDLState* partial(const std::vector<bool> &vars, const std::vector<bool> &structs);
+
   /// write encoded form to a file
   static bool save_file(std::ofstream &file, std::list<SDLState*> &save);
   /// read encoded form from a file
-  static bool load_file(std::ifstream &file, std::list<SDLState*> &load, std::list<SDLDesc*> &descs, Logger *log);
+  static bool load_file(std::ifstream &file, std::list<SDLState*> &load, const SDLDescIndex &descs, Logger *log);
 
   static char* sdl_flag_c_str_alloc(uint32_t t);
 
@@ -388,10 +534,12 @@ public:
   PlKey& key() {
     return m_key;
   }
-  const std::vector<Variable*>& vars() const {
+  const std::vector<Variable*>& vars() {
+    parse_raw();
     return m_vars;
   }
-  const std::vector<Struct*>& structs() const {
+  const std::vector<Struct*>& structs() {
+    parse_raw();
     return m_structs;
   }
 
@@ -400,6 +548,18 @@ protected:
   uint16_t m_flag;
   const SDLDesc *m_desc;
   bool m_saving_to_file;
+  bool m_changed; // for age state checkpoints
+  NetworkMessage *m_cached_msg;
+  bool m_borrowed; // m_vars and m_structs belong to another state
+  ValueBlock *m_values; // made by the first alloc_value()
+
+  // the unparsed message from attach(), and where its body starts (the
+  // descriptor name)
+  const uint8_t *m_raw;
+  uint32_t m_raw_len;
+  uint32_t m_raw_body;
+  Logger *m_raw_log;
+  void parse_raw();
 
   std::vector<Variable*> m_vars;
   std::vector<Struct*> m_structs;
@@ -408,6 +568,10 @@ protected:
   std::string m_string;
 
 private:
+  // give the Variable space for its m_count values, from m_values if it can
+  void alloc_value(Variable *v);
+  // *to = *from, with any space to needs coming from this state
+  void copy_value(Variable *to, const Variable *from);
   int32_t recursive_parse(const uint8_t *buf, size_t bufsize);
   int32_t recursive_write(uint8_t *buf, size_t bufsize) const;
   uint32_t recursive_len() const;
@@ -449,6 +613,10 @@ public:
   int32_t seq_prefix() const {
     return m_seq_prefix;
   }
+  // the server-only TickRate field, or -1 if the file does not have one
+  int32_t tick_rate() const {
+    return m_tick_rate;
+  }
 
   const char* c_str();
   std::string str();
@@ -461,10 +629,11 @@ protected:
   uint32_t m_linger;
   int32_t m_seq_prefix;
   int32_t m_release;
+  int32_t m_tick_rate;
 
   AgeDesc() :
       m_linger(180/*default*/), m_chars(NULL), m_start_date_time(0), m_daylen(0.0),
-      m_capacity(0), m_seq_prefix(0), m_release(0) {
+      m_capacity(0), m_seq_prefix(0), m_release(0), m_tick_rate(-1) {
   };
 
   const char *m_chars;
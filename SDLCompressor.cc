@@ -0,0 +1,158 @@
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <stdarg.h>
+#include <pthread.h>
+#include <iconv.h>
+
+#include <sys/time.h>
+#include <sys/uio.h> /* for struct iovec */
+
+#include <stdexcept>
+#include <deque>
+#include <list>
+#include <map>
+#include <vector>
+#include <string>
+
+#include "machine_arch.h"
+#include "exceptions.h"
+#include "typecodes.h"
+#include "constants.h"
+#include "protocol.h"
+#include "msg_typecodes.h"
+#include "util.h"
+#include "UruString.h"
+#include "PlKey.h"
+#include "Buffer.h"
+
+#include "Logger.h"
+#include "SDL.h"
+#include "NetworkMessage.h"
+#include "BackendMessage.h"
+#include "GameMessage.h"
+
+#include "SDLCompressor.h"
+
+SDLCompressor::SDLCompressor() :
+    m_refs(1), m_stop(false), m_have_thread(false) {
+  if (pthread_mutex_init(&m_mutex, NULL)) {
+    throw std::bad_alloc();
+  }
+  if (pthread_cond_init(&m_cond, NULL)) {
+    pthread_mutex_destroy(&m_mutex);
+    throw std::bad_alloc();
+  }
+}
+
+SDLCompressor::~SDLCompressor() {
+  pthread_mutex_lock(&m_mutex);
+  m_stop = true;
+  pthread_cond_signal(&m_cond);
+  pthread_mutex_unlock(&m_mutex);
+  if (m_have_thread) {
+    pthread_join(m_thread, NULL);
+  }
+  // the thread finishes the queue before stopping, but if there never was
+  // one, messages may still be here
+  while (!m_queue.empty()) {
+    finish(m_queue.front());
+    m_queue.pop_front();
+  }
+  pthread_cond_destroy(&m_cond);
+  pthread_mutex_destroy(&m_mutex);
+}
+
+int32_t SDLCompressor::start() {
+  pthread_mutex_lock(&m_mutex);
+  int32_t ret = 0;
+  if (!m_have_thread) {
+    ret = pthread_create(&m_thread, NULL, worker, this);
+    if (!ret) {
+      m_have_thread = true;
+    }
+  }
+  pthread_mutex_unlock(&m_mutex);
+  return ret;
+}
+
+void SDLCompressor::add_ref() {
+  pthread_mutex_lock(&m_mutex);
+  m_refs++;
+  pthread_mutex_unlock(&m_mutex);
+}
+
+void SDLCompressor::del_ref() {
+  pthread_mutex_lock(&m_mutex);
+  uint32_t left = --m_refs;
+  pthread_mutex_unlock(&m_mutex);
+  if (left == 0) {
+    delete this;
+  }
+}
+
+void SDLCompressor::compress(PlNetMsgSDLState *msg) {
+  pthread_mutex_lock(&m_mutex);
+  if (m_have_thread) {
+    m_queue.push_back(msg);
+    pthread_cond_signal(&m_cond);
+    msg = NULL;
+  }
+  pthread_mutex_unlock(&m_mutex);
+  if (msg) {
+    finish(msg);
+  }
+}
+
+void SDLCompressor::finish(PlNetMsgSDLState *msg) {
+  msg->compress();
+  if (msg->del_ref() < 1) {
+    // the state changed, or went away, before it was sent
+    delete msg;
+  }
+}
+
+void* SDLCompressor::worker(void *arg) {
+  SDLCompressor *zipper = (SDLCompressor*) arg;
+
+  pthread_mutex_lock(&zipper->m_mutex);
+  while (1) {
+    if (zipper->m_queue.empty()) {
+      if (zipper->m_stop) {
+        break;
+      }
+      pthread_cond_wait(&zipper->m_cond, &zipper->m_mutex);
+      continue;
+    }
+    PlNetMsgSDLState *msg = zipper->m_queue.front();
+    zipper->m_queue.pop_front();
+    pthread_mutex_unlock(&zipper->m_mutex);
+    finish(msg);
+    pthread_mutex_lock(&zipper->m_mutex);
+  }
+  pthread_mutex_unlock(&zipper->m_mutex);
+  return NULL;
+}
@@ -0,0 +1,76 @@
+/* -*- c++ -*- */
+
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The SDLCompressor compresses initial age state messages in its own
+ * thread, so a game server sending a big age's state to someone who just
+ * linked in does not stop to compress it (everyone else in the age would
+ * see the hitch). The game server prepares each message uncompressed and
+ * hands it over, and sends it once it is ready; see
+ * PlNetMsgSDLState::prepare().
+ *
+ * There is one for all the game servers, made by the dispatcher when it is
+ * configured with game_async_compress. Each game server holds a reference,
+ * and the thread stops when the last one is dropped.
+ */
+
+//#include <pthread.h>
+//
+//#include <deque>
+
+#ifndef _SDL_COMPRESSOR_H_
+#define _SDL_COMPRESSOR_H_
+
+// forward declarations
+class PlNetMsgSDLState;
+
+class SDLCompressor {
+public:
+  SDLCompressor();
+
+  // start the thread; returns non-zero (an errno value) if it can't
+  int32_t start();
+
+  // Compress the message, taking over the caller's reference to it. If
+  // the thread is not running, it is done right away.
+  void compress(PlNetMsgSDLState *msg);
+
+  void add_ref();
+  // deletes the compressor, once anything queued is done, when the last
+  // reference is gone
+  void del_ref();
+
+protected:
+  ~SDLCompressor();
+
+  pthread_mutex_t m_mutex;
+  pthread_cond_t m_cond;
+  // everything below is protected by m_mutex
+  std::deque<PlNetMsgSDLState*> m_queue;
+  uint32_t m_refs;
+  bool m_stop;
+  bool m_have_thread;
+  pthread_t m_thread;
+
+  static void* worker(void *arg);
+  static void finish(PlNetMsgSDLState *msg);
+};
+
+#endif /* _SDL_COMPRESSOR_H_ */
@@ -0,0 +1,170 @@
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <stdarg.h>
+#include <pthread.h>
+#include <iconv.h>
+
+#include <sys/time.h>
+
+#include <stdexcept>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+
+#include "machine_arch.h"
+#include "exceptions.h"
+#include "protocol.h"
+#include "util.h"
+#include "UruString.h"
+#include "PlKey.h"
+
+#include "Logger.h"
+#include "SDL.h"
+
+#include "SDLRegistry.h"
+
+SDLRegistry::SDLRegistry(const char *game_dir, Logger *log) :
+    m_game_dir(game_dir), m_log(log), m_refs(1) {
+  if (pthread_mutex_init(&m_ref_mutex, NULL)) {
+    throw std::bad_alloc();
+  }
+}
+
+SDLRegistry::~SDLRegistry() {
+  std::map<std::string, AgeSDL*>::iterator a_iter;
+  for (a_iter = m_ages.begin(); a_iter != m_ages.end(); a_iter++) {
+    std::list<SDLDesc*>::iterator iter;
+    for (iter = a_iter->second->m_own.begin(); iter != a_iter->second->m_own.end(); iter++) {
+      delete *iter;
+    }
+    delete a_iter->second;
+  }
+  std::list<SDLDesc*>::iterator iter;
+  for (iter = m_common.begin(); iter != m_common.end(); iter++) {
+    delete *iter;
+  }
+  pthread_mutex_destroy(&m_ref_mutex);
+}
+
+void SDLRegistry::add_ref() {
+  pthread_mutex_lock(&m_ref_mutex);
+  m_refs++;
+  pthread_mutex_unlock(&m_ref_mutex);
+}
+
+void SDLRegistry::del_ref() {
+  pthread_mutex_lock(&m_ref_mutex);
+  uint32_t left = --m_refs;
+  pthread_mutex_unlock(&m_ref_mutex);
+  if (left == 0) {
+    delete this;
+  }
+}
+
+int32_t SDLRegistry::load_common() {
+  std::string directory = m_game_dir + PATH_SEPARATOR + "SDL" + PATH_SEPARATOR + "common";
+  int32_t ret = SDLDesc::parse_directory(m_log, m_common, directory, true, true);
+  if (ret) {
+    std::list<SDLDesc*>::iterator iter;
+    for (iter = m_common.begin(); iter != m_common.end(); iter++) {
+      delete *iter;
+    }
+    m_common.clear();
+  }
+  return ret;
+}
+
+void SDLRegistry::read_age_sdl(const char *filename, std::list<SDLDesc*> &sdls) {
+  // XXX it is hard to open directories and files case-insensitively in
+  // unix. You have to do a directory listing and match filenames case-
+  // insensitively.
+  std::string sdldir = m_game_dir + PATH_SEPARATOR + "SDL" + PATH_SEPARATOR + filename;
+  log_msgs(m_log, "Looking for filesystem SDLDesc named \"%s\" in \"%s\"\n", filename, sdldir.c_str());
+  int32_t ret = SDLDesc::parse_directory(m_log, sdls, sdldir, false, false);
+  if (ret > 0) {
+    // try a single file
+    std::string sdlfile = sdldir + ".sdl";
+    std::ifstream file(sdlfile.c_str(), std::ios_base::in);
+    if (file.fail()) {
+      log_msgs(m_log, "No SDLDesc found for age \"%s\"\n", filename);
+      // this is not an error, some ages don't have SDL files
+    } else {
+      try {
+        SDLDesc::parse_file(sdls, file);
+      } catch (const parse_error &e) {
+        log_err(m_log, "SDLDesc Parse error, line %u: \"%s\"\n", e.lineno(), e.what());
+        ret = -1;
+      }
+    }
+  }
+  if (ret < 0) {
+    // forge on, but game mechanics will be broken
+    log_warn(m_log, "Error reading SDLDesc for age \"%s\"\n", filename);
+  }
+}
+
+const SDLDescIndex* SDLRegistry::age_sdl(const char *filename) {
+  std::map<std::string, AgeSDL*>::iterator found = m_ages.find(filename);
+  if (found != m_ages.end()) {
+    return &found->second->m_descs;
+  }
+
+  AgeSDL *age = new AgeSDL();
+  read_age_sdl(filename, age->m_own);
+  std::list<SDLDesc*> all(m_common);
+  if (age->m_own.size() > 0) {
+    std::list<SDLDesc*>::iterator iter;
+    // this loop just finds the place in the list to splice at, after the
+    // most common SDLs
+    for (iter = all.begin(); iter != all.end(); iter++) {
+      const char *sdlname = (*iter)->name();
+      if (!strcasecmp(sdlname, "physical") || !strcasecmp(sdlname, "avatar")
+      // "avatar" covers "avatarPhysical"
+          || !strcasecmp(sdlname, "Layer") || !strcasecmp(sdlname, "MorphSequence") || !strcasecmp(sdlname, "clothing")) {
+        // go on
+      } else {
+        break;
+      }
+    }
+    std::list<SDLDesc*>::iterator here = iter;
+    for (iter = age->m_own.begin(); iter != age->m_own.end(); iter++) {
+      all.insert(here, *iter);
+      SDLDesc *d = *iter;
+      log_debug(m_log, "Inserting saved SDLDesc %s-v%d for \"%s\":\n\t%s\n",
+          d->name(),
+          d->version(),
+          filename,
+          d->str(",\n\t\t\t").c_str());
+    }
+  }
+  age->m_descs.assign(all);
+  m_ages[filename] = age;
+  return &age->m_descs;
+}
@@ -0,0 +1,85 @@
+/* -*- c++ -*- */
+
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * The SDLRegistry holds the SDL descriptors for all the game servers in the
+ * process: the common SDL, and each age's own SDL, which is read from the
+ * game directory the first time that age is started and kept for the next
+ * time. Once read, an age's descriptors never change, so game servers in
+ * other threads use them without locking.
+ *
+ * The dispatcher drops its registry when the config is reloaded, and makes
+ * a new one for the next game server. Each game server holds a reference
+ * to the registry it started with, so that one stays around until the last
+ * of its game servers is gone.
+ */
+
+//#include <pthread.h>
+//
+//#include <list>
+//#include <map>
+//#include <string>
+//
+//#include "Logger.h"
+//#include "SDL.h"
+
+#ifndef _SDL_REGISTRY_H_
+#define _SDL_REGISTRY_H_
+
+class SDLRegistry {
+public:
+  // the Logger is only used by the thread calling load_common() and
+  // age_sdl()
+  SDLRegistry(const char *game_dir, Logger *log);
+
+  // Read the common SDL. Returns non-zero for an error, as
+  // SDLDesc::parse_directory() does.
+  int32_t load_common();
+  // The descriptors a game server for the age uses: the age's own SDL ahead
+  // of the common SDL, except that the most-used common SDL stays in front.
+  // The age's SDL is read in the first time. Only the dispatcher thread may
+  // call this.
+  const SDLDescIndex* age_sdl(const char *filename);
+
+  void add_ref();
+  // deletes the registry when the last reference is gone
+  void del_ref();
+
+protected:
+  ~SDLRegistry();
+
+  std::string m_game_dir;
+  Logger *m_log;
+
+  std::list<SDLDesc*> m_common;
+  struct AgeSDL {
+    std::list<SDLDesc*> m_own;
+    SDLDescIndex m_descs;
+  };
+  std::map<std::string, AgeSDL*> m_ages;
+
+  pthread_mutex_t m_ref_mutex;
+  uint32_t m_refs;
+
+  // read in the age's own SDL; errors are logged
+  void read_age_sdl(const char *filename, std::list<SDLDesc*> &sdls);
+};
+
+#endif /* _SDL_REGISTRY_H_ */
@@ -30,9 +30,7 @@
 //#include <signal.h>
 //
 //#include <map>
-//#ifdef ENABLE_FORK
 //#include <list>
-//#endif
 //
 //#include "machine_arch.h"
 //
@@ -63,11 +61,42 @@ public:
       m_id_to_ptr[id] = (void*) server;
     }
   }
+  // A server run in another server's thread (a game server in a GameHost)
+  // instead of its own. It is deleted when done, or along with its host.
+  void new_hosted(Server *server, Server *host, uint32_t id = 0) {
+    m_hosted[server] = host;
+    if (id != 0) {
+      m_id_to_ptr[id] = (void*) server;
+    }
+  }
+  // the servers in their own threads and hosted ones (GameHosts and their
+  // game servers both), for load reports
+  void get_servers(std::list<Server*> &servers) const {
+    std::map<Server*, pthread_t>::const_iterator iter;
+    for (iter = m_threads.begin(); iter != m_threads.end(); iter++) {
+      servers.push_back(iter->first);
+    }
+    std::map<Server*, Server*>::const_iterator h_iter;
+    for (h_iter = m_hosted.begin(); h_iter != m_hosted.end(); h_iter++) {
+      servers.push_back(h_iter->first);
+    }
+  }
   void thread_join() {
+    // hosted servers have no thread to join
+    std::map<Server*, Server*>::iterator h_iter = m_hosted.begin();
+    while (h_iter != m_hosted.end()) {
+      Server *s = h_iter->first;
+      if (s->shutdown_done()) {
+        forget_id(s);
+        m_hosted.erase(h_iter++);
+        delete s;
+      } else {
+        h_iter++;
+      }
+    }
     // do cleanup -- I don't know how better to do this, since there is no
     // wait(-1, status, WNOHANG) equivalent for pthreads
     std::map<Server*, pthread_t>::iterator this_one, iter = m_threads.begin();
-    std::map<uint32_t, void*>::iterator id;
     while (iter != m_threads.end()) {
       Server *s = iter->first;
       if (s->shutdown_done()) {
@@ -77,10 +106,16 @@ public:
           log_warn(s->log(), "pthread_join failed: %s\n", strerror(errno));
         }
         m_threads.erase(this_one);
-        for (id = m_id_to_ptr.begin(); id != m_id_to_ptr.end(); id++) {
-          if (id->second == (void*) s) {
-            m_id_to_ptr.erase(id);
-            break;
+        forget_id(s);
+        // anything it was still hosting goes with it
+        h_iter = m_hosted.begin();
+        while (h_iter != m_hosted.end()) {
+          if (h_iter->second == s) {
+            forget_id(h_iter->first);
+            delete h_iter->first;
+            m_hosted.erase(h_iter++);
+          } else {
+            h_iter++;
           }
         }
         delete s;
@@ -90,6 +125,10 @@ public:
     }
   }
   void signal_thread(Server *server, int32_t signal) {
+    std::map<Server*, Server*>::iterator h_iter = m_hosted.find(server);
+    if (h_iter != m_hosted.end()) {
+      server = h_iter->second;
+    }
     std::map<Server*, pthread_t>::iterator iter = m_threads.find(server);
     if (iter != m_threads.end()) {
       pthread_kill(iter->second, signal);
@@ -149,6 +188,10 @@ public:
       pthread_join(iter->second, NULL);
       delete s;
     }
+    std::map<Server*, Server*>::iterator h_iter;
+    for (h_iter = m_hosted.begin(); h_iter != m_hosted.end(); h_iter++) {
+      delete h_iter->first;
+    }
 #ifdef FORK_ENABLE
     std::map<pid_t,Server::Connection*>::iterator l_iter;
     for (l_iter = m_children.begin(); l_iter != m_children.end(); l_iter++) {
@@ -163,12 +206,23 @@ public:
 
 private:
   std::map<Server*, pthread_t> m_threads;
+  std::map<Server*, Server*> m_hosted; // hosted server -> host
 #ifdef FORK_ENABLE
   std::map<pid_t,Server::Connection*> m_children;
 #endif
   // this map goes from the opaque random 32-bit "id2" to a pointer,
   // either Server* or Server::Connection*
   std::map<uint32_t, void*> m_id_to_ptr;
+
+  void forget_id(Server *s) {
+    std::map<uint32_t, void*>::iterator id;
+    for (id = m_id_to_ptr.begin(); id != m_id_to_ptr.end(); id++) {
+      if (id->second == (void*) s) {
+        m_id_to_ptr.erase(id);
+        break;
+      }
+    }
+  }
 };
 
 #endif /* _THREAD_MANAGER_H_ */
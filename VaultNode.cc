@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/uio.h> /* for struct iovec */
 
 #include <stdexcept>
@@ -640,6 +641,73 @@ const uint8_t* VaultNode::const_data_ptr(vault_bitfield_t bit) const {
   return NULL;
 }
 
+VaultNode::datatype_t VaultNode::datatype_for(vault_bitfield_t bit) {
+  for (uint32_t i = 0; i < 32; i++) {
+    if (colspecs[i].bit == bit) {
+      return colspecs[i].type;
+    }
+  }
+  // can't happen, all 32 bits are in colspecs
+  return UInt;
+}
+
+void VaultNode::copy_field(const VaultNode &from, vault_bitfield_t bit) {
+  switch (datatype_for(bit)) {
+  case Int:
+  case UInt:
+    num_ref(bit) = htole32(from.num_val(bit));
+    break;
+  case UUID:
+    memcpy(uuid_ptr(bit), from.const_uuid_ptr(bit), UUID_RAW_LEN);
+    break;
+  case String:
+  case Blob: {
+    const uint8_t *data = from.const_data_ptr(bit);
+    uint32_t len = read32(data, 0);
+    memcpy(data_ptr(bit, len), data + 4, len);
+  }
+    break;
+  default:
+    break;
+  }
+}
+
+bool VaultNode::field_equals(const VaultNode &other, vault_bitfield_t bit, bool ignore_case) const {
+  switch (datatype_for(bit)) {
+  case Int:
+  case UInt:
+    return num_val(bit) == other.num_val(bit);
+  case UUID:
+    return !memcmp(const_uuid_ptr(bit), other.const_uuid_ptr(bit), UUID_RAW_LEN);
+  case String:
+  case Blob: {
+    const uint8_t *mine = const_data_ptr(bit);
+    const uint8_t *theirs = other.const_data_ptr(bit);
+    uint32_t len = read32(mine, 0);
+    if (len != read32(theirs, 0)) {
+      return false;
+    }
+    if (!ignore_case) {
+      return !memcmp(mine + 4, theirs + 4, len);
+    }
+    // UTF-16LE; only ASCII letters are folded
+    for (uint32_t i = 0; i + 1 < len; i += 2) {
+      uint16_t a = read16(mine, 4 + i), b = read16(theirs, 4 + i);
+      if (a < 0x80 && b < 0x80) {
+        a = tolower(a);
+        b = tolower(b);
+      }
+      if (a != b) {
+        return false;
+      }
+    }
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
 const char* VaultNode::tablename_for_type(vault_nodetype_t type) {
   switch (type) {
   case CCRNode:            return "ccr";
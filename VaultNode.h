@@ -118,6 +118,14 @@ public:
   // the returned buffer includes the length as the first four bytes
   const uint8_t* const_data_ptr(vault_bitfield_t bit) const;
 
+  // the wire type of a field, whatever the node type
+  static datatype_t datatype_for(vault_bitfield_t bit);
+  // copy one field that is present in from into this node
+  void copy_field(const VaultNode &from, vault_bitfield_t bit);
+  // whether a field present in both nodes has the same value; when
+  // ignore_case is set strings are compared case-insensitively
+  bool field_equals(const VaultNode &other, vault_bitfield_t bit, bool ignore_case = false) const;
+
   // accessors
   vault_nodetype_t type() const;
   uint32_t bitfield1() const {
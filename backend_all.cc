@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
@@ -39,6 +40,7 @@
 #include <exception>
 #include <map>
 #include <list>
+#include <set>
 #include <vector>
 #include <deque>
 #include <string>
@@ -83,11 +85,220 @@
 #include "BackendMessage.h"
 #include "MessageQueue.h"
 #include "VaultNode.h"
+#include "backend_stats.h"
+#include "backend_capture.h"
+#include "vault_store.h"
 
 #include "moss_serv.h"
 #include "moss_backend.h"
 #include "db_requests.h"
 
+#ifdef USE_PQXX
+template<class T> void BackendServer::db_perform(const T &transactor) {
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  try {
+    my->C->perform(transactor);
+  } catch (...) {
+    m_stats.db_done(transactor.Name(), start);
+    throw;
+  }
+  m_stats.db_done(transactor.Name(), start);
+}
+#endif
+
+/*
+ * The PostgreSQL vault store. Without USE_PQXX there is no DB, and these
+ * just leave the results alone, as the handlers always did.
+ */
+void BackendServer::PostgresVaultStore::fetch_node(uint32_t nodeid, status_code_t &result, VaultNode &node) {
+#ifdef USE_PQXX
+  m_server->db_perform(VaultFetchNode_Request(nodeid, result, node, m_server->m_log));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::fetch_nodes(const std::vector<uint32_t> &nodeids, status_code_t &result,
+    std::map<uint32_t, VaultNode*> &nodes) {
+#ifdef USE_PQXX
+  m_server->db_perform(VaultFetchNodes_Request(nodeids, result, nodes, m_server->m_log));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::fetch_refs(uint32_t nodeid, status_code_t &result,
+    std::vector<VaultFetchRefs_VaultRef> &refs) {
+#ifdef USE_PQXX
+  m_server->db_perform(VaultFetchRefs_Request(nodeid, result, refs));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::find_playerinfo(uint32_t player, status_code_t &result, uint32_t &nodeid) {
+#ifdef USE_PQXX
+  m_server->db_perform(VaultFindNode_Request(player, result, nodeid));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::find_nodes(const VaultNode *templ, status_code_t &result,
+    std::vector<uint32_t> &found) {
+#ifdef USE_PQXX
+  m_server->db_perform(VaultFindNode_Generic(templ, result, found, m_server->m_log, true));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::save_node(uint32_t nodeid, const VaultNode *node, status_code_t &result) {
+#ifdef USE_PQXX
+  m_server->db_perform(VaultSaveNode_Request(nodeid, node, result, m_server->m_log));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::create_node(const VaultNode *node, const uint8_t *acctid, kinum_t creator,
+    uint32_t &nodeid) {
+#ifdef USE_PQXX
+  m_server->db_perform(VaultCreateNode_Request(node, acctid, creator, nodeid, m_server->m_log));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::add_ref(uint32_t parent, uint32_t child, uint32_t owner,
+    status_code_t &result) {
+#ifdef USE_PQXX
+  m_server->db_perform(VaultAddRef_Request(parent, child, owner, result));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::remove_ref(uint32_t parent, uint32_t child, int32_t &removed) {
+#ifdef USE_PQXX
+  int node_ct = 0;
+  m_server->db_perform(VaultRemoveRef_Request(parent, child, node_ct));
+  removed = node_ct;
+#endif
+}
+
+void BackendServer::PostgresVaultStore::dump(std::map<uint32_t, VaultNode*> &nodes,
+    std::vector<VaultFetchRefs_VaultRef> &refs) {
+#ifdef USE_PQXX
+  std::vector<uint32_t> nodeids;
+  m_server->db_perform(VaultAllNodes_Request(nodeids, refs));
+  // fetch the nodes in batches so no one query is huge
+  std::vector<uint32_t> batch;
+  for (size_t i = 0; i < nodeids.size(); i++) {
+    batch.push_back(nodeids[i]);
+    if (batch.size() >= 1000 || i + 1 == nodeids.size()) {
+      status_code_t result = ERROR_INTERNAL;
+      m_server->db_perform(VaultFetchNodes_Request(batch, result, nodes, m_server->m_log));
+      batch.clear();
+    }
+  }
+#endif
+}
+
+void BackendServer::PostgresVaultStore::acct_players(const uint8_t *acctid,
+    std::list<AuthAcctLogin_PlayerQuery_Player> &players) {
+#ifdef USE_PQXX
+  m_server->db_perform(AuthAcctLogin_PlayerQuery((uint8_t*) acctid, players));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::validate_ki(const uint8_t *acctid, kinum_t kinum, status_code_t &result,
+    UruString &name) {
+#ifdef USE_PQXX
+  m_server->db_perform(AuthValidateKI(acctid, kinum, result, name));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::player_connected(kinum_t kinum, status_code_t &result) {
+#ifdef USE_PQXX
+  m_server->db_perform(SetPlayerConnected(kinum, result));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::player_offline(kinum_t kinum, bool &was_online, uint32_t &info_node,
+    status_code_t &result) {
+#ifdef USE_PQXX
+  m_server->db_perform(SetPlayerOffline(kinum, was_online, info_node, result));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::create_player(const uint8_t *acctid, const char *name, const char *gender,
+    AuthAcctLogin_PlayerQuery_Player &player, uint32_t &neighbors_list, uint32_t &info_node) {
+#ifdef USE_PQXX
+  m_server->db_perform(VaultPlayerCreate_Request(acctid, name, gender, player, neighbors_list, info_node));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::delete_player(kinum_t kinum, status_code_t &result,
+    std::multimap<kinum_t, uint32_t> &tell_who, uint32_t &info_node) {
+#ifdef USE_PQXX
+  m_server->db_perform(VaultPlayerDelete_Request(kinum, result, tell_who, info_node));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::create_age(const char *filename, const char *instance, const char *user_defined,
+    const char *display, const uint8_t *createuuid, const uint8_t *parentuuid, uint32_t &age_node,
+    uint32_t &age_info_node, status_code_t &result) {
+#ifdef USE_PQXX
+  m_server->db_perform(VaultCreateAge_Request(filename, instance, user_defined, display, createuuid, parentuuid,
+      age_node, age_info_node, result));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::age_list(UruString &filename, status_code_t &result,
+    std::vector<VaultAgeList_AgeInfo> &ages) {
+#ifdef USE_PQXX
+  m_server->db_perform(VaultAgeList_Request(filename, result, ages));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::set_age_public(uint32_t age_info_node, bool to_public, status_code_t &result) {
+#ifdef USE_PQXX
+  m_server->db_perform(VaultSetAgePublic_Request(age_info_node, to_public, result));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::age_by_uuid(const uint8_t *uuid, uint32_t &age_node, uint32_t &age_info_node,
+    UruString &filename, status_code_t &result) {
+#ifdef USE_PQXX
+  m_server->db_perform(VaultGetAgeByUUID(uuid, age_node, age_info_node, filename, result));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::delete_age(uint32_t age_info_node, status_code_t &result) {
+#ifdef USE_PQXX
+  m_server->db_perform(DeleteAge(age_info_node, result));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::age_sdl(uint32_t age_info_node, UruString &filename, uint8_t **outbuf,
+    uint32_t &buflen, status_code_t &result) {
+#ifdef USE_PQXX
+  m_server->db_perform(GetVaultSDL(age_info_node, filename, outbuf, buflen, result));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::global_sdl(UruString &filename, uint8_t **outbuf, uint32_t &buflen,
+    status_code_t &result) {
+#ifdef USE_PQXX
+  m_server->db_perform(GetGlobalSDL(filename, outbuf, buflen, result));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::age_uuid_for(uint32_t sdl_node, uint8_t *uuid, status_code_t &result) {
+#ifdef USE_PQXX
+  m_server->db_perform(GetAgeUUIDFor(sdl_node, uuid, result));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::players_referring_to(uint32_t nodeid, status_code_t &result,
+    std::vector<kinum_t> &players) {
+#ifdef USE_PQXX
+  m_server->db_perform(PlayersReferringTo(nodeid, result, players));
+#endif
+}
+
+void BackendServer::PostgresVaultStore::age_referring_to(uint32_t nodeid, uint8_t *uuid, status_code_t &result) {
+#ifdef USE_PQXX
+  m_server->db_perform(AgeReferringTo(nodeid, uuid, result));
+#endif
+}
+
 Server::reason_t BackendServer::handle_auth(Connection *c, BackendMessage *in) {
   switch (in->type()) {
 
@@ -104,12 +315,12 @@ Server::reason_t BackendServer::handle_auth(Connection *c, BackendMessage *in) {
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(AuthAcctLogin_AcctQuery(msg->name()->c_str(), login_result));
+        db_perform(AuthAcctLogin_AcctQuery(msg->name()->c_str(), login_result));
       } catch (const pqxx::in_doubt_error &e) {
         // retry once (read-only operation)
         // XXX consider using a nontransaction in read-only cases like this
         log_warn(m_log, "in_doubt in AuthAcctLogin_AcctQuery; retrying\n");
-        my->C->perform(AuthAcctLogin_AcctQuery(msg->name()->c_str(), login_result));
+        db_perform(AuthAcctLogin_AcctQuery(msg->name()->c_str(), login_result));
       }
     } catch (const pqxx::in_doubt_error &e) {
       log_warn(m_log, "in_doubt again in AuthAcctLogin_AcctQuery; "
@@ -205,12 +416,13 @@ Server::reason_t BackendServer::handle_auth(Connection *c, BackendMessage *in) {
         // XXX if entity already has a non-zero UUID, verify UUIDs match
       }
       entity->set_uuid(login_result.uuid);
+      share_entity(key, entity, AdminPeerEntity_BackendMessage::ACCT_UUID);
 
       // now we need the avatar messages
       std::list<AuthAcctLogin_PlayerQuery_Player> plist;
 #ifdef USE_PQXX
       try {
-        my->C->perform(AuthAcctLogin_PlayerQuery(login_result.uuid, plist));
+        m_store->acct_players(login_result.uuid, plist);
       } catch (const pqxx::broken_connection &e) {
         // pretty much fatal -- need to shut down or something
         log_err(m_log, "Connection to DB failed!\n");
@@ -271,7 +483,7 @@ Server::reason_t BackendServer::handle_auth(Connection *c, BackendMessage *in) {
 
 #ifdef USE_PQXX
     try {
-      my->C->perform(AuthValidateKI(msg->acct_uuid(), msg->kinum(), ki_result, player_name));
+      m_store->validate_ki(msg->acct_uuid(), msg->kinum(), ki_result, player_name);
     } catch (const pqxx::broken_connection &e) {
       // pretty much fatal -- need to shut down or something
       log_err(m_log, "Connection to DB failed!\n");
@@ -325,16 +537,17 @@ Server::reason_t BackendServer::handle_auth(Connection *c, BackendMessage *in) {
         // XXX verify UUIDs match
         entity->set_kinum(msg->kinum());
         entity->name() = player_name;
+        share_entity(key, entity, AdminPeerEntity_BackendMessage::PLAYER);
       }
 
 #ifdef USE_PQXX
       status_code_t spc = ERROR_INTERNAL;
       try {
         try {
-          my->C->perform(SetPlayerConnected(msg->kinum(), spc));
+          m_store->player_connected(msg->kinum(), spc);
         } catch (const pqxx::in_doubt_error &e) {
           log_warn(m_log, "in_doubt in SetPlayerConnected; retrying\n");
-          my->C->perform(SetPlayerConnected(msg->kinum(), spc));
+          m_store->player_connected(msg->kinum(), spc);
         }
       } catch (const pqxx::in_doubt_error &e) {
         log_err(m_log, "in_doubt again in SetPlayerConnected; "
@@ -362,6 +575,7 @@ Server::reason_t BackendServer::handle_auth(Connection *c, BackendMessage *in) {
       if (entity) {
         entity->set_kinum(0);
         entity->name() = "";
+        share_entity(HashKey(in->get_id1(), in->get_id2()), entity, AdminPeerEntity_BackendMessage::PLAYER);
       }
 #endif
 
@@ -387,11 +601,11 @@ Server::reason_t BackendServer::handle_auth(Connection *c, BackendMessage *in) {
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(AuthChangePassword(msg->acct_uuid(), msg->name()->c_str(), text_version, change_result));
+        db_perform(AuthChangePassword(msg->acct_uuid(), msg->name()->c_str(), text_version, change_result));
       } catch (const pqxx::in_doubt_error &e) {
         // we can check the DB to see if the new hash is present
         log_warn(m_log, "in_doubt in AuthChangePassword; checking result\n");
-        my->C->perform(AuthVerifyPassword(msg->acct_uuid(), msg->name()->c_str(), text_version, change_result));
+        db_perform(AuthVerifyPassword(msg->acct_uuid(), msg->name()->c_str(), text_version, change_result));
         if (change_result == ERROR_BAD_PASSWD) {
           // the change failed
           change_result = ERROR_INTERNAL;
@@ -448,21 +662,19 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(
-            VaultPlayerCreate_Request(msg->acct_uuid(), msg->name()->c_str(), msg->gender()->c_str(), player, neighbors_list,
-                pinfo));
+        m_store->create_player(msg->acct_uuid(), msg->name()->c_str(), msg->gender()->c_str(), player, neighbors_list,
+            pinfo);
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in VaultPlayerCreate; attempting to recover\n");
         // let us see if the create happened
-        my->C->perform(VaultPlayerRequest_Verify(msg->acct_uuid(), msg->name()->c_str(), player));
+        db_perform(VaultPlayerRequest_Verify(msg->acct_uuid(), msg->name()->c_str(), player));
         if (player.kinum == ERROR_PLAYER_NOT_FOUND) {
           // Either the create did happen but failed because the avatar
           // name already existed (or similar), or it did not get
           // committed. Either way, try again; if it's the former it will
           // fail again and we'll propagate that back.
-          my->C->perform(
-              VaultPlayerCreate_Request(msg->acct_uuid(), msg->name()->c_str(), msg->gender()->c_str(), player, neighbors_list,
-                  pinfo));
+          m_store->create_player(msg->acct_uuid(), msg->name()->c_str(), msg->gender()->c_str(), player, neighbors_list,
+              pinfo);
         } else {
           // The create went through, and we have now filled in the
           // necessary info, or we had some other bad error that gets
@@ -517,7 +729,7 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
 
 #ifdef USE_PQXX
     try {
-      my->C->perform(VaultPlayerDelete_Request(msg->kinum(), del_result, notifies, pinfo));
+      m_store->delete_player(msg->kinum(), del_result, notifies, pinfo);
     } catch (const pqxx::in_doubt_error &e) {
       log_warn(m_log, "in_doubt in VaultPlayerDelete\n");
     } catch (const pqxx::broken_connection &e) {
@@ -550,7 +762,7 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
 
 #ifdef USE_PQXX
     try {
-      my->C->perform(VaultFetchRefs_Request(msg->node_id(), refs_result, refs_list));
+      m_store->fetch_refs(msg->node_id(), refs_result, refs_list);
     } catch (const pqxx::broken_connection &e) {
       // pretty much fatal -- need to shut down or something
       log_err(m_log, "Connection to DB failed!\n");
@@ -578,6 +790,17 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
     VaultPassthrough_BackendMessage *reply = new VaultPassthrough_BackendMessage(in->get_id1(), in->get_id2(), refs_buf, ref_at,
         false, true);
     c->enqueue(reply);
+
+    if (m_vault_prefetch && refs_result == NO_ERROR && refs_list.size() > 0) {
+      // the client is going to fetch every one of these next
+      std::vector<uint32_t> children;
+      children.reserve(refs_list.size());
+      for (std::vector<VaultFetchRefs_VaultRef>::const_iterator ref_el = refs_list.begin(); ref_el != refs_list.end();
+          ref_el++) {
+        children.push_back(ref_el->child);
+      }
+      prefetch_nodes(children);
+    }
   }
     break;
 
@@ -594,7 +817,7 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
       uint32_t node_id = findnode->num_val(UInt32_1);
 #ifdef USE_PQXX
       try {
-        my->C->perform(VaultFindNode_Request(node_id, find_result, find_val));
+        m_store->find_playerinfo(node_id, find_result, find_val);
       } catch (const pqxx::broken_connection &e) {
         // pretty much fatal -- need to shut down or something
         log_err(m_log, "Connection to DB failed!\n");
@@ -608,7 +831,7 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
       // use general-purpose find
 #ifdef USE_PQXX
       try {
-        my->C->perform(VaultFindNode_Generic(findnode, find_result, find_list, m_log, true));
+        m_store->find_nodes(findnode, find_result, find_list);
       } catch (const pqxx::broken_connection &e) {
         // pretty much fatal -- need to shut down or something
         log_err(m_log, "Connection to DB failed!\n");
@@ -665,20 +888,25 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
   case VAULT_FETCH: {
     VaultNodeFetch_ToBackendMessage *msg = (VaultNodeFetch_ToBackendMessage*) in;
 
-    VaultNode *f_node = new VaultNode();
+    VaultNode *f_node = take_prefetched(msg->node_id());
     status_code_t f_result = ERROR_INTERNAL;
 
+    if (f_node) {
+      f_result = NO_ERROR;
+    } else {
+      f_node = new VaultNode();
 #ifdef USE_PQXX
-    try {
-      my->C->perform(VaultFetchNode_Request(msg->node_id(), f_result, *f_node, m_log));
-    } catch (const pqxx::broken_connection &e) {
-      // pretty much fatal -- need to shut down or something
-      log_err(m_log, "Connection to DB failed!\n");
-      f_result = ERROR_DB_TIMEOUT;
-    } catch (const pqxx::sql_error &e) {
-      log_warn(m_log, "SQL error in VaultFetchNode: %s\n", e.what());
-    }
+      try {
+        m_store->fetch_node(msg->node_id(), f_result, *f_node);
+      } catch (const pqxx::broken_connection &e) {
+        // pretty much fatal -- need to shut down or something
+        log_err(m_log, "Connection to DB failed!\n");
+        f_result = ERROR_DB_TIMEOUT;
+      } catch (const pqxx::sql_error &e) {
+        log_warn(m_log, "SQL error in VaultFetchNode: %s\n", e.what());
+      }
 #endif
+    }
 
     if (f_result != NO_ERROR) {
       log_err(m_log, "Error fetching vault node %u (reqid %u)\n", msg->node_id(), msg->reqid());
@@ -701,15 +929,16 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
     VaultNode_ToBackendMessage *msg = (VaultNode_ToBackendMessage*) in;
 
     status_code_t save_result = ERROR_INTERNAL;
+    forget_prefetched(msg->node_id());
 
     // XXX check, for the purposes of logging, whether bitfield2 is zero
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(VaultSaveNode_Request(msg->node_id(), msg->data(), save_result, m_log));
+        m_store->save_node(msg->node_id(), msg->data(), save_result);
       } catch (const pqxx::in_doubt_error &e) {
         // just retry, it does not hurt to save with the same data
-        my->C->perform(VaultSaveNode_Request(msg->node_id(), msg->data(), save_result, m_log));
+        m_store->save_node(msg->node_id(), msg->data(), save_result);
       }
     } catch (const pqxx::in_doubt_error &e) {
       log_warn(m_log, "in_doubt again in VaultSaveNode; is something badly wrong with the DB?\n");
@@ -802,7 +1031,7 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
 #ifdef USE_PQXX
             uint8_t ageuuid[UUID_RAW_LEN];
             try {
-              my->C->perform(GetAgeUUIDFor(msg->node_id(), ageuuid, getuuid_result));
+              m_store->age_uuid_for(msg->node_id(), ageuuid, getuuid_result);
             } catch (const pqxx::in_doubt_error &e) {
               log_warn(m_log, "in_doubt in GetAgeUUIDFor\n");
             } catch (const pqxx::broken_connection &e) {
@@ -863,13 +1092,13 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(VaultCreateNode_Request(msg->data(), entity->uuid(), entity->kinum(), c_node, m_log));
+        m_store->create_node(msg->data(), entity->uuid(), entity->kinum(), c_node);
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in VaultCreateNode; creating a new "
             "node\n");
         // well, we may have made a node, but there's nothing pointing at
         // it, so just make another one (leaves trash in the vault)
-        my->C->perform(VaultCreateNode_Request(msg->data(), entity->uuid(), entity->kinum(), c_node, m_log));
+        m_store->create_node(msg->data(), entity->uuid(), entity->kinum(), c_node);
       }
     } catch (const pqxx::in_doubt_error &e) {
       log_warn(m_log, "in_doubt again in VaultCreateNode; is something badly wrong with the DB?\n");
@@ -912,10 +1141,10 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(VaultAddRef_Request(msg->parent(), msg->child(), msg->owner(), add_result));
+        m_store->add_ref(msg->parent(), msg->child(), msg->owner(), add_result);
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in VaultAddRef; retrying\n");
-        my->C->perform(VaultAddRef_Request(msg->parent(), msg->child(), msg->owner(), add_result));
+        m_store->add_ref(msg->parent(), msg->child(), msg->owner(), add_result);
         if (add_result == ERROR_INVALID_DATA) {
           add_result = NO_ERROR;
         }
@@ -977,10 +1206,10 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(VaultRemoveRef_Request(msg->parent(), msg->child(), removed));
+        m_store->remove_ref(msg->parent(), msg->child(), removed);
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in VaultRemoveRef; retrying\n");
-        my->C->perform(VaultRemoveRef_Request(msg->parent(), msg->child(), removed));
+        m_store->remove_ref(msg->parent(), msg->child(), removed);
         if (removed == 0) {
           // this could have been a request error instead of the
           // previous attempt succeeding, but oh well
@@ -1051,15 +1280,14 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
 
 #ifdef USE_PQXX
     try {
-      my->C->perform(
-          VaultCreateAge_Request(
-              msg->age_filename()->c_str(),
-              msg->instance_name()->c_str(),
-              msg->user_defined_name()->c_str(),
-              msg->display_name()->c_str(),
-              msg->create_uuid(),
-              msg->parent_uuid(),
-              age_node, age_info_node, init_result));
+      m_store->create_age(
+          msg->age_filename()->c_str(),
+          msg->instance_name()->c_str(),
+          msg->user_defined_name()->c_str(),
+          msg->display_name()->c_str(),
+          msg->create_uuid(),
+          msg->parent_uuid(),
+          age_node, age_info_node, init_result);
     } catch (const pqxx::in_doubt_error &e) {
       log_warn(m_log, "in_doubt in CreateAge\n");
       // this one, we really can't do much about, the client needs to
@@ -1101,7 +1329,7 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
 
 #ifdef USE_PQXX
     try {
-      my->C->perform(VaultAgeList_Request(filename, list_result, age_list));
+      m_store->age_list(filename, list_result, age_list);
     } catch (const pqxx::broken_connection &e) {
       // pretty much fatal -- need to shut down or something
       log_err(m_log, "Connection to DB failed!\n");
@@ -1181,13 +1409,14 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
     VaultSetAgePublic_BackendMessage *msg = (VaultSetAgePublic_BackendMessage*) in;
 
     status_code_t public_result = ERROR_INTERNAL;
+    forget_prefetched(msg->age_nodeid());
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(VaultSetAgePublic_Request(msg->age_nodeid(), msg->set_public(), public_result));
+        m_store->set_age_public(msg->age_nodeid(), msg->set_public(), public_result);
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in VaultSetAgePublic; retrying\n");
-        my->C->perform(VaultSetAgePublic_Request(msg->age_nodeid(), msg->set_public(), public_result));
+        m_store->set_age_public(msg->age_nodeid(), msg->set_public(), public_result);
       }
     } catch (const pqxx::in_doubt_error &e) {
       log_warn(m_log, "in_doubt again in VaultSetAgePublic; "
@@ -1235,11 +1464,11 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(
+        db_perform(
             VaultGetScore_Request(msg->holder(), msg->score_name(), sget_id, sget_time, sget_type, sget_value, sget_result));
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in VaultGetScore; retrying\n");
-        my->C->perform(
+        db_perform(
             VaultGetScore_Request(msg->holder(), msg->score_name(), sget_id, sget_time, sget_type, sget_value, sget_result));
       }
     } catch (const pqxx::in_doubt_error &e) {
@@ -1277,7 +1506,7 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(
+        db_perform(
             VaultCreateScore_Request(
                 msg->holder(),
                 msg->score_name(),
@@ -1286,7 +1515,7 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
                 scr_id, scr_time, scr_result));
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in VaultCreateScore; retrying\n");
-        my->C->perform(
+        db_perform(
             VaultCreateScore_Request(
                 msg->holder(),
                 msg->score_name(),
@@ -1301,7 +1530,7 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
           scr_result = ERROR_INTERNAL;
           uint32_t sget_type = 0;
           int32_t sget_value = 0;
-          my->C->perform(
+          db_perform(
               VaultGetScore_Request(msg->holder(), msg->score_name(), scr_id, scr_time, sget_type, sget_value, scr_result));
         }
       }
@@ -1347,7 +1576,7 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
     status_code_t sadd_result = ERROR_INTERNAL;
 #ifdef USE_PQXX
     try {
-      my->C->perform(VaultAddToScore_Request(msg->score_id(), msg->delta(), sadd_result));
+      db_perform(VaultAddToScore_Request(msg->score_id(), msg->delta(), sadd_result));
     } catch (const pqxx::in_doubt_error &e) {
       log_warn(m_log, "in_doubt in VaultAddToScore\n");
     } catch (const pqxx::broken_connection &e) {
@@ -1379,7 +1608,7 @@ Server::reason_t BackendServer::handle_vault(Connection *c, BackendMessage *in)
     status_code_t sxfer_result = ERROR_INTERNAL;
 #ifdef USE_PQXX
     try {
-      my->C->perform(VaultTransferScore_Request(msg->score_id(), msg->dest_id(), msg->delta(), sxfer_result));
+      db_perform(VaultTransferScore_Request(msg->score_id(), msg->dest_id(), msg->delta(), sxfer_result));
     } catch (const pqxx::in_doubt_error &e) {
       log_warn(m_log, "in_doubt in VaultTransferScore\n");
     } catch (const pqxx::broken_connection &e) {
@@ -1467,6 +1696,10 @@ Server::reason_t BackendServer::handle_admin(Connection *c, BackendMessage *in)
           log_err(m_log, "And we already had a peer of type %d!\n", entity->type());
           return PROTOCOL_ERROR;
         }
+        if (entity->is_replica()) {
+          // a peer service told us about it first
+          entity->adopt(c);
+        }
       } else {
         entity = new ConnectionEntity(c, peer_type);
         m_hash_table[key] = entity;
@@ -1478,6 +1711,51 @@ Server::reason_t BackendServer::handle_admin(Connection *c, BackendMessage *in)
     c->enqueue(msg);
   }
     break;
+
+  case ADMIN_PEER_ENTITY:
+    apply_peer_entity(c, (AdminPeerEntity_BackendMessage*) in);
+    break;
+
+  case ADMIN_STATS: {
+    AdminStats_BackendMessage *msg = (AdminStats_BackendMessage*) in;
+    std::vector<std::string> lines;
+    m_stats.report(lines);
+    std::string report;
+    for (std::vector<std::string>::iterator iter = lines.begin(); iter != lines.end(); iter++) {
+      report += *iter;
+      report += '\n';
+    }
+    AdminStats_BackendMessage *reply = new AdminStats_BackendMessage(in->get_id1(), in->get_id2(), report);
+    c->enqueue(reply);
+    if (msg->reset()) {
+      m_stats.reset();
+    }
+  }
+    break;
+
+  case ADMIN_PEER_PROPAGATE: {
+    AdminPeerPropagate_BackendMessage *msg = (AdminPeerPropagate_BackendMessage*) in;
+    if (!serves(CLASS_VAULT)) {
+      // every peer gets these; only the vault acts on them
+      break;
+    }
+    log_debug(m_log, "ADMIN_PEER_PROPAGATE node=%u child=%u\n", msg->nodeid(), msg->child());
+    switch (msg->change()) {
+    case AdminPeerPropagate_BackendMessage::CHANGED:
+      propagate_change_to_interested(msg->nodeid(), msg->transuuid(), msg->check_age());
+      break;
+    case AdminPeerPropagate_BackendMessage::ADDED:
+      propagate_add_to_interested(msg->nodeid(), msg->child(), msg->ownerid(), msg->check_age());
+      break;
+    case AdminPeerPropagate_BackendMessage::REMOVED:
+      propagate_remove_to_interested(msg->nodeid(), msg->child(), msg->check_age());
+      break;
+    default:
+      log_warn(m_log, "ADMIN_PEER_PROPAGATE with unknown change type %u\n", msg->change());
+    }
+  }
+    break;
+
   default:
     // unknown type
     log_warn(m_log, "Unknown message type 0x%08x\n", in->type());
@@ -1493,6 +1771,32 @@ Server::reason_t BackendServer::handle_track(Connection *c, BackendMessage *in)
     c->m_timeout.tv_sec += c->m_interval;
     break;
 
+  case TRACK_STATUS: {
+    TrackStatus_BackendMessage *msg = (TrackStatus_BackendMessage*) in;
+    gettimeofday(&c->m_timeout, NULL);
+    c->m_timeout.tv_sec += c->m_interval;
+
+    std::vector<DispatcherInfo*>::iterator iter;
+    for (iter = m_dispatchers.begin(); iter != m_dispatchers.end(); iter++) {
+      DispatcherInfo *disp = *iter;
+      if (disp->m_id1 == in->get_id1() && disp->m_id2 == in->get_id2()) {
+        disp->m_games = msg->games();
+        disp->m_players = msg->players();
+        disp->m_clients = msg->clients();
+        disp->m_cpu = msg->cpu_percent();
+        disp->m_lag = msg->lag_ms();
+        // anything we sent its way before is in the counts now
+        disp->m_starting = 0;
+        disp->m_sent = 0;
+        log_debug(m_log, "TRACK_STATUS: %08x,%08x games: %u players: %u "
+            "clients: %u CPU: %u%% lag: %ums load: %u\n", disp->m_id1, disp->m_id2,
+            disp->m_games, disp->m_players, disp->m_clients, disp->m_cpu, disp->m_lag, disp->load());
+        break;
+      }
+    }
+  }
+    break;
+
   case TRACK_SERVICE_TYPES: {
     TrackServiceTypes_BackendMessage *msg = (TrackServiceTypes_BackendMessage*) in;
     log_debug(m_log, "TRACK_SERVICE_TYPES: %08x,%08x accepts%s%s%s\n",
@@ -1587,58 +1891,23 @@ Server::reason_t BackendServer::handle_track(Connection *c, BackendMessage *in)
         in->get_id2(),
         msg->wants_file() ? "file" : "auth");
 
-    bool got_one = false;
-    DispatcherInfo *disp = NULL;
     TrackFindService_FromBackendMessage *reply;
-    if (m_dispatchers.size() > 0) {
-      if (msg->wants_file()) {
-        if (m_next_file >= m_dispatchers.size()) {
-          m_next_file = 0;
-        }
-        uint32_t stop_at = MIN(m_next_file, m_dispatchers.size());
-        do {
-          if (m_dispatchers[m_next_file]->m_handles_file_service) {
-            disp = m_dispatchers[m_next_file];
-            got_one = true;
-            break;
-          }
-          m_next_file++;
-          if (m_next_file >= m_dispatchers.size()) {
-            m_next_file = 0;
-          }
-        } while (m_next_file != stop_at);
-      } else {
-        if (m_next_auth >= m_dispatchers.size()) {
-          m_next_auth = 0;
-        }
-        uint32_t stop_at = MIN(m_next_auth, m_dispatchers.size());
-        do {
-          if (m_dispatchers[m_next_auth]->m_handles_auth_service) {
-            disp = m_dispatchers[m_next_auth];
-            got_one = true;
-            break;
-          }
-          m_next_auth++;
-          if (m_next_auth >= m_dispatchers.size()) {
-            m_next_auth = 0;
-          }
-        } while (m_next_auth != stop_at);
-      }
+    DispatcherInfo *disp;
+    if (msg->wants_file()) {
+      disp = pick_dispatcher(FILE_SERVICE, m_next_file);
+    } else {
+      disp = pick_dispatcher(AUTH_SERVICE, m_next_auth);
     }
 
-    if (!got_one) {
+    if (!disp) {
       // no server available
       log_warn(m_log, "TRACK_FIND_SERVICE: Telling %08x,%08x there is currently no %s service!\n",
           in->get_id1(), in->get_id2(),
           msg->wants_file() ? "file" : "auth");
       reply = new TrackFindService_FromBackendMessage(in->get_id1(), in->get_id2(), msg->reqid(), msg->reqid2(), msg->wants_file());
     } else {
-      // go to next one, since this one was just used
-      if (msg->wants_file()) {
-        m_next_file++;
-      } else {
-        m_next_auth++;
-      }
+      // count the client until the next TRACK_STATUS does
+      disp->m_sent++;
       char addrbuf[INET_ADDRSTRLEN + sizeof(":12345")];
       if (disp->m_use_fa_hostname) {
         log_msgs(m_log, "Telling %08x,%08x to get %s from %08x,%08x (%s:%d)\n", in->get_id1(), in->get_id2(),
@@ -1679,6 +1948,7 @@ Server::reason_t BackendServer::handle_track(Connection *c, BackendMessage *in)
 
     if (msg->problem() != TrackStartAge_ToBackendMessage::NONE) {
       // the dispatcher says the game server cannot be started
+      m_age_dispatcher.erase(std::string((const char*) msg->age_uuid(), UUID_RAW_LEN));
       std::deque<TimerQueue::Timer*>::const_iterator w_iter;
       for (w_iter = m_timers->begin(); w_iter != m_timers->end(); w_iter++) {
         Waiter *w = (Waiter*) (*w_iter);
@@ -1729,6 +1999,7 @@ Server::reason_t BackendServer::handle_track(Connection *c, BackendMessage *in)
     server->set_uuid(msg->age_uuid());
     server->set_server_id(msg->server_id());
     server->set_ipaddr(msg->ipaddr());
+    share_entity(game, server, AdminPeerEntity_BackendMessage::ACCT_UUID | AdminPeerEntity_BackendMessage::LOCATION);
 
     // send all vault SDL if present
     status_code_t db_result = ERROR_INTERNAL;
@@ -1737,7 +2008,7 @@ Server::reason_t BackendServer::handle_track(Connection *c, BackendMessage *in)
     UruString age_fname;
 #ifdef USE_PQXX
     try {
-      my->C->perform(VaultGetAgeByUUID(msg->age_uuid(), age_node, age_info, age_fname, db_result));
+      m_store->age_by_uuid(msg->age_uuid(), age_node, age_info, age_fname, db_result);
     } catch (const pqxx::in_doubt_error &e) {
       log_warn(m_log, "in_doubt getting age by UUID\n");
     } catch (const pqxx::broken_connection &e) {
@@ -1764,7 +2035,7 @@ Server::reason_t BackendServer::handle_track(Connection *c, BackendMessage *in)
       // global SDL.
 #ifdef USE_PQXX
       try {
-        my->C->perform(GetVaultSDL(age_info, age_fname, &sdlbuf, sdllen, db_result));
+        m_store->age_sdl(age_info, age_fname, &sdlbuf, sdllen, db_result);
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt getting age SDL\n");
       } catch (const pqxx::broken_connection &e) {
@@ -1807,7 +2078,7 @@ Server::reason_t BackendServer::handle_track(Connection *c, BackendMessage *in)
       sdllen = 0;
 #ifdef USE_PQXX
       try {
-        my->C->perform(GetGlobalSDL(age_fname, &sdlbuf, sdllen, db_result));
+        m_store->global_sdl(age_fname, &sdlbuf, sdllen, db_result);
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt getting global SDL\n");
       } catch (const pqxx::broken_connection &e) {
@@ -1893,6 +2164,7 @@ Server::reason_t BackendServer::handle_track(Connection *c, BackendMessage *in)
       if (!msg->final()) {
         // we have to not send new AddPlayer requests to that server
         server->set_in_shutdown();
+        share_entity(game, server, AdminPeerEntity_BackendMessage::IN_SHUTDOWN);
 
         // we must send a message back so that the game server knows when
         // it has drained the queue from us (tracking)
@@ -1910,9 +2182,21 @@ Server::reason_t BackendServer::handle_track(Connection *c, BackendMessage *in)
         // writes to the age's log file but that's an okay risk, because it
         // won't break anything.
 
-        // XXX note that if we ever have multiple ConnectionEntities sharing
-        // a single Connection this is *wrong*
-        return PEER_SHUTDOWN;
+        // A game host's game servers share a single Connection, so only
+        // close it when the last of them is gone.
+        bool shared = false;
+        std::map<HashKey, ConnectionEntity*>::iterator iter;
+        for (iter = m_hash_table.begin(); iter != m_hash_table.end(); iter++) {
+          if (iter->second != server && iter->second->conn() == c && !iter->second->is_replica()) {
+            shared = true;
+            break;
+          }
+        }
+        if (!shared) {
+          return PEER_SHUTDOWN;
+        }
+        m_hash_table.erase(game);
+        entity_left(game, server);
       }
     }
   }
@@ -2044,7 +2328,8 @@ Server::reason_t BackendServer::handle_track(Connection *c, BackendMessage *in)
       if (auth) {
         // found it, update local info
         if (msg->present()) {
-          if (!(m_egg_mask & (1 << 1))) {
+          // the egg is made by the DB, so only for a vault in the DB
+          if (!(m_egg_mask & (1 << 1)) && m_store == m_db_store) {
             if (auth->egg1(auth->ipaddr() == msg->get_id1() && auth->server_id() == msg->get_id2())) {
               // so it's a link to the same age -- in-game this can only
               // be Personal (with adminKI/CCR it could be a different age,
@@ -2054,7 +2339,7 @@ Server::reason_t BackendServer::handle_track(Connection *c, BackendMessage *in)
               status_code_t egg_status = ERROR_INTERNAL;
 #ifdef USE_PQXX
               try {
-                my->C->perform(Egg1(msg->kinum(), parent, child, egg_status));
+                db_perform(Egg1(msg->kinum(), parent, child, egg_status));
               } catch (const pqxx::in_doubt_error &e) {
                 log_warn(m_log, "in_doubt in Egg1\n");
                 // oh well
@@ -2090,9 +2375,16 @@ Server::reason_t BackendServer::handle_track(Connection *c, BackendMessage *in)
           server->bump_count();
           auth->set_ipaddr(msg->get_id1());
           auth->set_server_id(msg->get_id2());
+          for (std::map<HashKey, ConnectionEntity*>::iterator iter = m_hash_table.begin(); iter != m_hash_table.end(); iter++) {
+            if (iter->second == auth) {
+              share_entity(iter->first, auth, AdminPeerEntity_BackendMessage::LOCATION);
+              break;
+            }
+          }
         } else {
           server->drop_count();
         }
+        share_entity(game, server, AdminPeerEntity_BackendMessage::PLAYERS);
       }
     }
   }
@@ -2189,7 +2481,7 @@ Server::reason_t BackendServer::handle_marker(Connection *c, BackendMessage *in)
     if (msg->exists()) {
 #ifdef USE_PQXX
       try {
-        my->C->perform(MarkerGameFind_Request(msg->template_uuid(), game_name, internal_id, game_type, mget_result));
+        db_perform(MarkerGameFind_Request(msg->template_uuid(), game_name, internal_id, game_type, mget_result));
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in MarkerGameFind_Request\n");
         // this is relatively harmless; if we do nothing I believe
@@ -2227,7 +2519,7 @@ Server::reason_t BackendServer::handle_marker(Connection *c, BackendMessage *in)
         mget_result = ERROR_INTERNAL;
 #ifdef USE_PQXX
         try {
-          my->C->perform(MarkerGameMarkers_Request(internal_id, mget_result, allmarkers));
+          db_perform(MarkerGameMarkers_Request(internal_id, mget_result, allmarkers));
         } catch (const pqxx::in_doubt_error &e) {
           log_warn(m_log, "in_doubt in MarkerGameMarkers_Request\n");
           // XXX if we do nothing, the client will be told there are
@@ -2267,7 +2559,7 @@ Server::reason_t BackendServer::handle_marker(Connection *c, BackendMessage *in)
           mget_result = ERROR_INTERNAL;
 #ifdef USE_PQXX
           try {
-            my->C->perform(MarkerGameCaptured_Request(internal_id, msg->player(), mget_result, captured));
+            db_perform(MarkerGameCaptured_Request(internal_id, msg->player(), mget_result, captured));
           } catch (const pqxx::in_doubt_error &e) {
             log_warn(m_log, "in_doubt in MarkerGameCaptured_Request\n");
             // XXX if we do nothing, the client will be told there are
@@ -2301,7 +2593,7 @@ Server::reason_t BackendServer::handle_marker(Connection *c, BackendMessage *in)
       uint8_t game_uuid[UUID_RAW_LEN];
 #ifdef USE_PQXX
       try {
-        my->C->perform(
+        db_perform(
             MarkerGameCreate_Request(msg->player(), msg->name(), internal_id, msg->game_type(), game_uuid, mget_result));
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in MarkerGameCreate_Request\n");
@@ -2345,7 +2637,7 @@ Server::reason_t BackendServer::handle_marker(Connection *c, BackendMessage *in)
     z = letohdouble(z);
 #ifdef USE_PQXX
     try {
-      my->C->perform(
+      db_perform(
           MarkerGameAddMarker_Request(msg->localid(), x, y, z, msg->name(), msg->agename(), marker_num, madd_result));
     } catch (const pqxx::in_doubt_error &e) {
       log_warn(m_log, "in_doubt in MarkerGameAddMarker_Request\n");
@@ -2388,11 +2680,11 @@ Server::reason_t BackendServer::handle_marker(Connection *c, BackendMessage *in)
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(MarkerGameRename_Request(msg->localid(), msg->name(), rename_result));
+        db_perform(MarkerGameRename_Request(msg->localid(), msg->name(), rename_result));
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in MarkerGameRename_Request\n");
         // this is completely harmless to retry
-        my->C->perform(MarkerGameRename_Request(msg->localid(), msg->name(), rename_result));
+        db_perform(MarkerGameRename_Request(msg->localid(), msg->name(), rename_result));
       }
     } catch (const pqxx::in_doubt_error &e) {
       log_warn(m_log, "in_doubt again in MarkerGameRename_Request; "
@@ -2424,10 +2716,10 @@ Server::reason_t BackendServer::handle_marker(Connection *c, BackendMessage *in)
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(MarkerGameDelete_Request(msg->localid(), delete_result));
+        db_perform(MarkerGameDelete_Request(msg->localid(), delete_result));
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in MarkerGameDelete_Request\n");
-        my->C->perform(MarkerGameDelete_Request(msg->localid(), delete_result));
+        db_perform(MarkerGameDelete_Request(msg->localid(), delete_result));
         if (delete_result == ERROR_NODE_NOT_FOUND) {
           // assume the last attempt succeeded
           delete_result = NO_ERROR;
@@ -2466,11 +2758,11 @@ Server::reason_t BackendServer::handle_marker(Connection *c, BackendMessage *in)
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(MarkerGameRenameMarker_Request(msg->localid(), msg->number(), msg->name(), mrename_result));
+        db_perform(MarkerGameRenameMarker_Request(msg->localid(), msg->number(), msg->name(), mrename_result));
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in MarkerGameRenameMarker_Request\n");
         // this is completely harmless to retry
-        my->C->perform(MarkerGameRenameMarker_Request(msg->localid(), msg->number(), msg->name(), mrename_result));
+        db_perform(MarkerGameRenameMarker_Request(msg->localid(), msg->number(), msg->name(), mrename_result));
       }
     } catch (const pqxx::in_doubt_error &e) {
       log_warn(m_log, "in_doubt again in MarkerGameRenameMarker_Request; "
@@ -2506,10 +2798,10 @@ Server::reason_t BackendServer::handle_marker(Connection *c, BackendMessage *in)
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(MarkerGameDeleteMarker_Request(msg->localid(), msg->number(), mdelete_result));
+        db_perform(MarkerGameDeleteMarker_Request(msg->localid(), msg->number(), mdelete_result));
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in MarkerGameDeleteMarker_Request\n");
-        my->C->perform(MarkerGameDeleteMarker_Request(msg->localid(), msg->number(), mdelete_result));
+        db_perform(MarkerGameDeleteMarker_Request(msg->localid(), msg->number(), mdelete_result));
         if (mdelete_result == ERROR_NODE_NOT_FOUND) {
           // assume the last attempt succeeded
           mdelete_result = NO_ERROR;
@@ -2549,13 +2841,13 @@ Server::reason_t BackendServer::handle_marker(Connection *c, BackendMessage *in)
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(MarkerGameCaptureMarker_Request(msg->localid(), msg->player(), msg->number(), msg->value(), cap_result));
+        db_perform(MarkerGameCaptureMarker_Request(msg->localid(), msg->player(), msg->number(), msg->value(), cap_result));
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in MarkerGameCaptureMarker_Request\n");
         // this is safe to retry, at worst we send a spurious captured
         // message to the client for the case where the marker was already
         // captured
-        my->C->perform(MarkerGameCaptureMarker_Request(msg->localid(), msg->player(), msg->number(), msg->value(), cap_result));
+        db_perform(MarkerGameCaptureMarker_Request(msg->localid(), msg->player(), msg->number(), msg->value(), cap_result));
         if (cap_result == ERROR_SCORE_EXISTS) {
           // assume the last attempt succeeded
           cap_result = NO_ERROR;
@@ -2599,11 +2891,11 @@ Server::reason_t BackendServer::handle_marker(Connection *c, BackendMessage *in)
 #ifdef USE_PQXX
     try {
       try {
-        my->C->perform(MarkerGameStop_Request(msg->localid(), msg->player(), stop_result));
+        db_perform(MarkerGameStop_Request(msg->localid(), msg->player(), stop_result));
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in MarkerGameStop_Request\n");
         // this is safe to retry
-        my->C->perform(MarkerGameStop_Request(msg->localid(), msg->player(), stop_result));
+        db_perform(MarkerGameStop_Request(msg->localid(), msg->player(), stop_result));
       }
     } catch (const pqxx::in_doubt_error &e) {
       log_warn(m_log, "in_doubt again in MarkerGameStop_Request; "
@@ -2629,6 +2921,8 @@ Server::reason_t BackendServer::handle_marker(Connection *c, BackendMessage *in)
 int32_t BackendServer::init() {
   m_timers = new TimerQueue();
   m_conns.push_back(m_timers);
+  m_held_timers = new TimerQueue();
+  m_conns.push_back(m_held_timers);
   try {
     my = new BackendObj(m_log, m_db_addr, m_db_port, m_db_params, m_db_user, m_db_passwd, m_db_name);
     if (my->connection_failed) {
@@ -2643,12 +2937,12 @@ int32_t BackendServer::init() {
   }
   try {
     try {
-      my->C->perform(Call_initvault());
+      db_perform(Call_initvault());
     } catch (const pqxx::in_doubt_error &e) {
       // retry once; this is okay because if the previous one did succeed,
       // it will be detected and initvault() won't be run again
       log_warn(m_log, "in_doubt in Call_initvault; retrying\n");
-      my->C->perform(Call_initvault());
+      db_perform(Call_initvault());
     }
   } catch (const pqxx::in_doubt_error &e) {
     log_warn(m_log, "in_doubt again in Call_initvault; "
@@ -2662,6 +2956,55 @@ int32_t BackendServer::init() {
     return -1;
   }
 #endif
+  m_db_store = new PostgresVaultStore(this);
+  if (!m_storage || !strcasecmp(m_storage, "postgres")) {
+    m_store = m_db_store;
+  } else if (!strcasecmp(m_storage, "memory")) {
+    if (!m_peers.empty()) {
+      // peers would go on using the vault in the DB
+      log_err(m_log, "vault_storage \"memory\" cannot be used with peers\n");
+      return -1;
+    }
+    MemoryVaultStore *mem = new MemoryVaultStore(m_log, m_storage_dir);
+    m_store = mem;
+    int err = 0;
+    try {
+      // with no snapshot, the memory store starts with a copy of the DB's
+      err = mem->open(m_db_store);
+    }
+#ifdef USE_PQXX
+    catch (const pqxx::sql_error &e) {
+      log_err(m_log, "SQL error copying the vault from the DB: %s\n", e.what());
+      return -1;
+    } catch (const pqxx::broken_connection &e) {
+      log_err(m_log, "DB connection failure: %s\n", e.what());
+      return -1;
+    }
+#endif
+    catch (const std::exception &e) {
+      log_err(m_log, "Error copying the vault from the DB: %s\n", e.what());
+      return -1;
+    }
+    if (err) {
+      log_err(m_log, "Cannot open vault storage in %s: %s\n", m_storage_dir, strerror(err));
+      return -1;
+    }
+  } else {
+    log_err(m_log, "Unknown vault_storage \"%s\"\n", m_storage);
+    return -1;
+  }
+  log_info(m_log, "Vault nodes are stored in %s\n", m_store->name());
+  if (m_capture_fname && m_capture_fname[0] != '\0') {
+    int err = m_capture.open_write(m_capture_fname);
+    if (err) {
+      log_err(m_log, "Cannot open capture file %s: %s\n", m_capture_fname, strerror(err));
+      return -1;
+    }
+    log_info(m_log, "Capturing backend messages to %s\n", m_capture_fname);
+  }
+  for (std::vector<PeerLink*>::iterator iter = m_peers.begin(); iter != m_peers.end(); iter++) {
+    connect_peer(*iter);
+  }
   return 0;
 }
 
@@ -2681,11 +3024,26 @@ Server::reason_t BackendServer::message_read(Server::Connection *c, NetworkMessa
   Server::reason_t ret;
   BackendMessage *in = (BackendMessage*) msg;
 
-  char *m = in->backend_msgtype_c_str_alloc(msg->type());
-  log_debug(m_log, "received <0x%08x>\"%s\"\n", msg->type(), m);
-  free(m);
+  if (m_log && m_log->would_log_at(Logger::LOG_DEBUG)) {
+    char *m = BackendMessage::backend_msgtype_c_str_alloc(msg_type);
+    log_debug(m_log, "received <0x%08x>\"%s\"\n", msg_type, m);
+    free(m);
+  }
+  m_stats.start_message(msg_type, msg->message_len(), c->m_lastread);
 
-  if (msg_type & CLASS_AUTH) {
+  if (msg_type & FROM_SERVER) {
+    // only a peer service sends these, for us to pass on to a frontend
+    relay_from_peer(in);
+    ret = NO_SHUTDOWN;
+  } else if ((msg_type & (CLASS_AUTH | CLASS_VAULT | CLASS_TRACK | CLASS_MARKER)) && !serves(msg_type)
+      && msg_type != TRACK_PING && msg_type != TRACK_STATUS) {
+    log_err(m_log, "Message 0x%08x from %08x,%08x is for a service not provided by this backend\n",
+        msg_type, in->get_id1(), in->get_id2());
+    ret = NO_SHUTDOWN;
+  } else if (hold_for_entity(c, in)) {
+    // handled once a peer service says who the client is
+    ret = NO_SHUTDOWN;
+  } else if (msg_type & CLASS_AUTH) {
     ret = handle_auth(c, in);
   } else if (msg_type & CLASS_VAULT) {
     ret = handle_vault(c, in);
@@ -2702,14 +3060,25 @@ Server::reason_t BackendServer::message_read(Server::Connection *c, NetworkMessa
   if (in->del_ref() < 1) {
     delete in;
   }
+
+  struct timeval now;
+  m_stats.end_message(&now);
+  if (m_stats_interval > 0 && now.tv_sec - m_stats.since() >= m_stats_interval) {
+    m_stats.log_report(m_log);
+    m_stats.reset();
+  }
   return ret;
 }
 
 Server::reason_t BackendServer::conn_timeout(Server::Connection *c, Server::reason_t why) {
-  if (c == m_timers) {
+  if (c == m_timers || c == m_held_timers) {
     struct timeval now;
     gettimeofday(&now, NULL);
-    m_timers->handle_timeout(now);
+    if (c == m_timers) {
+      m_timers->handle_timeout(now);
+    } else {
+      m_held_timers->handle_timeout(now);
+    }
     return NO_SHUTDOWN;
   } else {
     log_warn(m_log, "Connection on %d timed out\n", c->fd());
@@ -2717,114 +3086,160 @@ Server::reason_t BackendServer::conn_timeout(Server::Connection *c, Server::reas
   }
 }
 
+void BackendServer::entity_left(const HashKey &key, ConnectionEntity *leaver) {
+  // a warm game server that never had an age instance has no UUID, and
+  // nothing to clean up
+  static const uint8_t no_age[UUID_RAW_LEN] = { 0 };
+  if (leaver->type() == TYPE_GAME && memcmp(leaver->uuid(), no_age, UUID_RAW_LEN)) {
+    m_age_dispatcher.erase(std::string((const char*) leaver->uuid(), UUID_RAW_LEN));
+    // if there are any Waiters for this server, start a new one as this
+    // one just shut down -- note that we have removed leaver from the list,
+    // so handle_age_request won't just re-find the server that's gone
+    std::deque<TimerQueue::Timer*>::const_iterator w_iter;
+    for (w_iter = m_timers->begin(); w_iter != m_timers->end(); w_iter++) {
+      Waiter *w = (Waiter*) (*w_iter);
+      if (w->cancelled()) {
+        continue;
+      }
+      if (!memcmp(w->m_ageuuid, leaver->uuid(), UUID_RAW_LEN)) {
+        KillClient_BackendMessage::kill_reason_t why = handle_age_request(leaver->uuid(), NULL, true, w->m_id1, w->m_id2,
+            w->m_reqid);
+        if (why == KillClient_BackendMessage::UNKNOWN) {
+          // only need one
+          break;
+        }
+      }
+    }
+    // if this age is a dynamically-created Bahro cave (eww!), delete it
+    uint32_t age_node;
+    uint32_t age_info;
+    UruString age_fname;
+    // use something not used by the DB routines
+    status_code_t db_result = ERROR_NAME_LOOKUP;
+#ifdef USE_PQXX
+    try {
+      m_store->age_by_uuid(leaver->uuid(), age_node, age_info, age_fname, db_result);
+      if (db_result == NO_ERROR) {
+        if (age_fname == "BahroCave" || age_fname == "LiveBahroCaves") {
+          if (m_log && m_log->would_log_at(Logger::LOG_DEBUG)) {
+            char uuid[UUID_STR_LEN];
+            format_uuid(leaver->uuid(), uuid);
+            log_debug(m_log, "Trying to delete age %s, UUID %s\n", age_fname.c_str(), uuid);
+          }
+          db_result = ERROR_NAME_LOOKUP;
+          m_store->delete_age(age_info, db_result);
+        }
+      }
+    } catch (const pqxx::in_doubt_error &e) {
+      log_warn(m_log, "in_doubt checking for/deleting Bahro cave\n");
+    } catch (const pqxx::broken_connection &e) {
+      // pretty much fatal -- need to shut down or something
+      log_err(m_log, "Connection to DB failed!\n");
+    } catch (const pqxx::sql_error &e) {
+      log_warn(m_log, "SQL error checking for/deleting Bahro cave: %s\n", e.what());
+    }
+#endif
+    // if db_result is still ERROR_NAME_LOOKUP, we just logged the
+    // problem in the catch statements
+    if (db_result != NO_ERROR && db_result != ERROR_NAME_LOOKUP) {
+      log_warn(m_log, "Error code %u checking for/deleting Bahro cave\n", db_result);
+    }
+  } else if (leaver->type() == TYPE_AUTH) {
+    // cancel any waiters there might be for this server
+    std::deque<TimerQueue::Timer*>::const_iterator w_iter;
+    for (w_iter = m_timers->begin(); w_iter != m_timers->end(); w_iter++) {
+      Waiter *w = (Waiter*) (*w_iter);
+      if (w->cancelled()) {
+        continue;
+      }
+      if (w->m_kinum == leaver->kinum()) {
+        w->cancel();
+      }
+    }
+    // kinum is 0 in StartUp
+    if (leaver->kinum() != 0) {
+      // if the client is connected to any game server, tell the game
+      // server to drop the player (when split up, tracking sees the
+      // auth server go away too and does this, and auth does the rest)
+      if (serves(CLASS_TRACK) && (leaver->server_id() != 0 || leaver->ipaddr() != 0)) {
+        HashKey key(leaver->ipaddr(), leaver->server_id());
+        if (m_hash_table.find(key) != m_hash_table.end()) {
+          ConnectionEntity *gameserver = m_hash_table[key];
+          if (gameserver->type() == TYPE_GAME) {
+            KillClient_BackendMessage *killit = new KillClient_BackendMessage(leaver->ipaddr(), leaver->server_id(),
+                KillClient_BackendMessage::AUTH_DISCONNECT, leaver->kinum());
+            gameserver->conn()->enqueue(killit);
+          }
+        }
+      }
+      // and mark the player offline in the vault
+      if (serves(CLASS_AUTH)) {
+        set_player_offline(leaver->kinum(), "disconnect");
+      }
+      log_debug(m_log, "Client kinum=%u has left the premises\n", leaver->kinum());
+    }
+  }
+  share_entity(key, leaver, AdminPeerEntity_BackendMessage::GONE);
+  delete leaver;
+}
+
 Server::reason_t BackendServer::conn_shutdown(Server::Connection *c, Server::reason_t why) {
-  if (c == m_timers) {
+  if (c == m_timers || c == m_held_timers) {
     // hmm, this shouldn't happen
     // we must be shutting down the whole server or something
     return NO_SHUTDOWN;
   }
 
+  if (m_capture.is_open()) {
+    CaptureConnection *cap = dynamic_cast<CaptureConnection*>(c);
+    if (cap) {
+      m_capture.record_close(cap->m_stream);
+    }
+  }
   for (std::vector<DispatcherInfo*>::iterator d_iter = m_dispatchers.begin(); d_iter != m_dispatchers.end(); d_iter++) {
     DispatcherInfo *disp = *d_iter;
     if (disp->m_conn == c) {
+      std::map<std::string, DispatcherInfo*>::iterator a_iter = m_age_dispatcher.begin();
+      while (a_iter != m_age_dispatcher.end()) {
+        if (a_iter->second == disp) {
+          m_age_dispatcher.erase(a_iter++);
+        } else {
+          a_iter++;
+        }
+      }
       m_dispatchers.erase(d_iter);
       delete disp;
       break;
     }
   }
-  // XXX not efficient!
-  for (std::map<HashKey, ConnectionEntity*>::iterator iter = m_hash_table.begin(); iter != m_hash_table.end(); iter++) {
+  for (std::vector<PeerLink*>::iterator p_iter = m_peers.begin(); p_iter != m_peers.end(); p_iter++) {
+    if ((*p_iter)->m_conn == c) {
+      log_warn(m_log, "Lost connection to peer service on %d\n", c->fd());
+      (*p_iter)->m_conn = NULL;
+      break;
+    }
+  }
+  drop_held_requests(NULL, c);
+  // forget everything a peer service on the other end told us about
+  std::map<HashKey, ConnectionEntity*>::iterator r_iter = m_hash_table.begin();
+  while (r_iter != m_hash_table.end()) {
+    if (r_iter->second->is_replica() && r_iter->second->conn() == c) {
+      delete r_iter->second;
+      m_hash_table.erase(r_iter++);
+    } else {
+      r_iter++;
+    }
+  }
+  // a game host's connection carries many game servers (XXX not efficient!)
+  std::map<HashKey, ConnectionEntity*>::iterator iter = m_hash_table.begin();
+  while (iter != m_hash_table.end()) {
     ConnectionEntity *leaver = iter->second;
     if (leaver->conn() == c) {
-      m_hash_table.erase(iter);
-
-      if (leaver->type() == TYPE_GAME) {
-        // if there are any Waiters for this server, start a new one as this
-        // one just shut down -- note that we have removed leaver from the list,
-        // so handle_age_request won't just re-find the server that's gone
-        std::deque<TimerQueue::Timer*>::const_iterator w_iter;
-        for (w_iter = m_timers->begin(); w_iter != m_timers->end(); w_iter++) {
-          Waiter *w = (Waiter*) (*w_iter);
-          if (w->cancelled()) {
-            continue;
-          }
-          if (!memcmp(w->m_ageuuid, leaver->uuid(), UUID_RAW_LEN)) {
-            KillClient_BackendMessage::kill_reason_t why = handle_age_request(leaver->uuid(), NULL, true, w->m_id1, w->m_id2,
-                w->m_reqid);
-            if (why == KillClient_BackendMessage::UNKNOWN) {
-              // only need one
-              break;
-            }
-          }
-        }
-        // if this age is a dynamically-created Bahro cave (eww!), delete it
-        uint32_t age_node;
-        uint32_t age_info;
-        UruString age_fname;
-        // use something not used by the DB routines
-        status_code_t db_result = ERROR_NAME_LOOKUP;
-#ifdef USE_PQXX
-        try {
-          my->C->perform(VaultGetAgeByUUID(leaver->uuid(), age_node, age_info, age_fname, db_result));
-          if (db_result == NO_ERROR) {
-            if (age_fname == "BahroCave" || age_fname == "LiveBahroCaves") {
-              if (m_log && m_log->would_log_at(Logger::LOG_DEBUG)) {
-                char uuid[UUID_STR_LEN];
-                format_uuid(leaver->uuid(), uuid);
-                log_debug(m_log, "Trying to delete age %s, UUID %s\n", age_fname.c_str(), uuid);
-              }
-              db_result = ERROR_NAME_LOOKUP;
-              my->C->perform(DeleteAge(age_info, db_result));
-            }
-          }
-        } catch (const pqxx::in_doubt_error &e) {
-          log_warn(m_log, "in_doubt checking for/deleting Bahro cave\n");
-        } catch (const pqxx::broken_connection &e) {
-          // pretty much fatal -- need to shut down or something
-          log_err(m_log, "Connection to DB failed!\n");
-        } catch (const pqxx::sql_error &e) {
-          log_warn(m_log, "SQL error checking for/deleting Bahro cave: %s\n", e.what());
-        }
-#endif
-        // if db_result is still ERROR_NAME_LOOKUP, we just logged the
-        // problem in the catch statements
-        if (db_result != NO_ERROR && db_result != ERROR_NAME_LOOKUP) {
-          log_warn(m_log, "Error code %u checking for/deleting Bahro cave\n", db_result);
-        }
-      } else if (leaver->type() == TYPE_AUTH) {
-        // cancel any waiters there might be for this server
-        std::deque<TimerQueue::Timer*>::const_iterator w_iter;
-        for (w_iter = m_timers->begin(); w_iter != m_timers->end(); w_iter++) {
-          Waiter *w = (Waiter*) (*w_iter);
-          if (w->cancelled()) {
-            continue;
-          }
-          if (w->m_kinum == leaver->kinum()) {
-            w->cancel();
-          }
-        }
-        // kinum is 0 in StartUp
-        if (leaver->kinum() != 0) {
-          // if the client is connected to any game server, tell the game
-          // server to drop the player
-          if (leaver->server_id() != 0 || leaver->ipaddr() != 0) {
-            HashKey key(leaver->ipaddr(), leaver->server_id());
-            if (m_hash_table.find(key) != m_hash_table.end()) {
-              ConnectionEntity *gameserver = m_hash_table[key];
-              if (gameserver->type() == TYPE_GAME) {
-                KillClient_BackendMessage *killit = new KillClient_BackendMessage(leaver->ipaddr(), leaver->server_id(),
-                    KillClient_BackendMessage::AUTH_DISCONNECT, leaver->kinum());
-                gameserver->conn()->enqueue(killit);
-              }
-            }
-          }
-          // and mark the player offline in the vault
-          set_player_offline(leaver->kinum(), "disconnect");
-          log_debug(m_log, "Client kinum=%u has left the premises\n", leaver->kinum());
-        }
-      }
-      delete leaver;
-      break;
+      HashKey key = iter->first;
+      m_hash_table.erase(iter++);
+      entity_left(key, leaver);
+    } else {
+      iter++;
     }
   }
   for (std::list<Connection*>::iterator c_iter = m_conns.begin(); c_iter != m_conns.end(); c_iter++) {
@@ -2839,12 +3254,27 @@ Server::reason_t BackendServer::conn_shutdown(Server::Connection *c, Server::rea
 }
 
 BackendServer::~BackendServer() {
+  // the memory store writes its snapshot as it goes
+  if (m_store && m_store != m_db_store) {
+    delete m_store;
+  }
+  if (m_db_store) {
+    delete m_db_store;
+  }
   if (my) {
     delete my;
   }
+  for (std::map<uint32_t, PrefetchedNode>::iterator iter = m_prefetched.begin(); iter != m_prefetched.end(); iter++) {
+    delete iter->second.m_node;
+  }
+  drop_held_requests(NULL, NULL);
   for (std::map<HashKey, ConnectionEntity*>::iterator iter = m_hash_table.begin(); iter != m_hash_table.end(); iter++) {
     delete iter->second;
   }
+  // the peer Connections are in m_conns and deleted in ~Server
+  for (std::vector<PeerLink*>::iterator iter = m_peers.begin(); iter != m_peers.end(); iter++) {
+    delete *iter;
+  }
 }
 
 bool BackendServer::shutdown(Server::reason_t reason) {
@@ -2853,12 +3283,29 @@ bool BackendServer::shutdown(Server::reason_t reason) {
 }
 
 void BackendServer::add_client_conn(int32_t fd, uint8_t first) {
-  BackendConnection *conn = new BackendConnection(fd);
+  BackendConnection *conn;
+  if (m_capture.is_open()) {
+    conn = new CaptureConnection(fd, &m_capture, m_next_stream++);
+  } else {
+    conn = new BackendConnection(fd);
+  }
   m_conns.push_back(conn);
   conn->m_readbuf->buffer()[0] = first;
   conn->m_read_fill = 1;
 }
 
+NetworkMessage* BackendServer::CaptureConnection::make_if_enough(const uint8_t *buf, size_t len, int32_t *want_len,
+    bool become_owner) {
+  // record the message before BackendMessage takes the buffer over
+  if (len >= 4 && m_capture->is_open()) {
+    uint32_t msg_len = read32(buf, 0);
+    if (msg_len >= 16 && msg_len <= len) {
+      m_capture->record(m_stream, buf, msg_len);
+    }
+  }
+  return BackendConnection::make_if_enough(buf, len, want_len, become_owner);
+}
+
 void BackendServer::Waiter::callback() {
   // game server did not reply in time
   HashKey key(m_id1, m_id2);
@@ -2895,7 +3342,7 @@ KillClient_BackendMessage::kill_reason_t BackendServer::handle_age_request(const
   status_code_t db_result = ERROR_INTERNAL;
 #ifdef USE_PQXX
   try {
-    my->C->perform(VaultGetAgeByUUID(age_uuid, age_node, age_info_node, age_fname, db_result));
+    m_store->age_by_uuid(age_uuid, age_node, age_info_node, age_fname, db_result);
   } catch (const pqxx::broken_connection &e) {
     // pretty much fatal -- need to shut down or something
     log_err(m_log, "Connection to DB failed!\n");
@@ -2912,7 +3359,7 @@ KillClient_BackendMessage::kill_reason_t BackendServer::handle_age_request(const
       // in response to the client sending a request with a random UUID
 #ifdef USE_PQXX
       try {
-        my->C->perform(VaultCreateAge_Request(fname, fname, fname, fname, age_uuid, NULL, age_node, age_info_node, db_result));
+        m_store->create_age(fname, fname, fname, fname, age_uuid, NULL, age_node, age_info_node, db_result);
       } catch (const pqxx::in_doubt_error &e) {
         log_warn(m_log, "in_doubt in CreateAge for Bahro cave\n");
         // this one, we really can't do much about
@@ -3021,38 +3468,24 @@ KillClient_BackendMessage::kill_reason_t BackendServer::handle_age_request(const
       return result;
     }
     // here, we do indeed need to ask for a new server
-    bool got_one = false;
-    if (m_dispatchers.size() > 0) {
-      if (m_next_dispatcher >= m_dispatchers.size()) {
-        m_next_dispatcher = 0;
-      }
-      uint32_t stop_at = MIN(m_next_dispatcher, m_dispatchers.size());
-      do {
-        if (m_dispatchers[m_next_dispatcher]->m_accepting_new_game_servers) {
-          DispatcherInfo *disp = m_dispatchers[m_next_dispatcher];
-          // send a request to the dispatcher to start a new server, and
-          // register the client's info with it
-          log_debug(m_log, "Telling dispatcher %08x,%08x to start a new %s server\n", disp->m_id1, disp->m_id2,
-              age_fname.c_str());
-          TrackStartAge_FromBackendMessage *start = new TrackStartAge_FromBackendMessage(disp->m_id1, disp->m_id2,
-              new UruString(age_fname), age_uuid);
-          disp->m_conn->enqueue(start);
-          // and set a timeout
-          if (!force_new) {
-            Waiter *w = new Waiter(timeout, this, user_id1, user_id2, reqid, user->kinum(), user->name(), user->uuid(),
-                age_uuid, age_node);
-            m_timers->insert(w);
-          }
-          got_one = true;
-          break;
+    DispatcherInfo *disp = pick_dispatcher(GAME_SERVICE, m_next_dispatcher);
+    if (disp) {
+      // keep related instances together (a neighborhood and its members'
+      // Reltos, say): if the dispatcher running the age the player is in
+      // now is not much busier, use it
+      HashKey here(user->ipaddr(), user->server_id());
+      std::map<HashKey, ConnectionEntity*>::iterator game = m_hash_table.find(here);
+      if (game != m_hash_table.end() && game->second->type() == TYPE_GAME) {
+        std::map<std::string, DispatcherInfo*>::iterator a_iter
+          = m_age_dispatcher.find(std::string((const char*) game->second->uuid(), UUID_RAW_LEN));
+        if (a_iter != m_age_dispatcher.end() && a_iter->second != disp
+            && a_iter->second->m_accepting_new_game_servers
+            && a_iter->second->load() <= disp->load() + TRACK_AFFINITY_SLACK) {
+          disp = a_iter->second;
         }
-        m_next_dispatcher++;
-        if (m_next_dispatcher >= m_dispatchers.size()) {
-          m_next_dispatcher = 0;
-        }
-      } while (m_next_dispatcher != stop_at);
+      }
     }
-    if (!got_one) {
+    if (!disp) {
       // no dispatchers available
       log_warn(m_log, "Telling client connection (kinum=%u) there "
           "are no game servers to be had\n", user->kinum());
@@ -3060,13 +3493,61 @@ KillClient_BackendMessage::kill_reason_t BackendServer::handle_age_request(const
           ERROR_AGE_NOT_FOUND);
       user->conn()->enqueue(none);
     } else {
-      // go to next one, since this one was just used
-      m_next_dispatcher++;
+      // send a request to the dispatcher to start a new server, and
+      // register the client's info with it
+      log_debug(m_log, "Telling dispatcher %08x,%08x (load %u) to start a new %s server\n", disp->m_id1, disp->m_id2,
+          disp->load(), age_fname.c_str());
+      TrackStartAge_FromBackendMessage *start = new TrackStartAge_FromBackendMessage(disp->m_id1, disp->m_id2,
+          new UruString(age_fname), age_uuid);
+      disp->m_conn->enqueue(start);
+      // count the game server until the next TRACK_STATUS does
+      disp->m_starting++;
+      m_age_dispatcher[std::string((const char*) age_uuid, UUID_RAW_LEN)] = disp;
+      // and set a timeout
+      if (!force_new) {
+        Waiter *w = new Waiter(timeout, this, user_id1, user_id2, reqid, user->kinum(), user->name(), user->uuid(),
+            age_uuid, age_node);
+        m_timers->insert(w);
+      }
     }
   }
   return result;
 }
 
+BackendServer::DispatcherInfo* BackendServer::pick_dispatcher(service_t service, uint32_t &next) {
+  DispatcherInfo *best = NULL;
+  uint32_t best_load = 0;
+  uint32_t count = m_dispatchers.size();
+  if (next >= count) {
+    next = 0;
+  }
+  // start after the last one picked, so that among equally loaded
+  // dispatchers (including ones that have not sent TRACK_STATUS) we go
+  // round-robin
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t at = (next + i) % count;
+    DispatcherInfo *disp = m_dispatchers[at];
+    bool offers;
+    switch (service) {
+    case GAME_SERVICE:
+      offers = disp->m_accepting_new_game_servers;
+      break;
+    case FILE_SERVICE:
+      offers = disp->m_handles_file_service;
+      break;
+    default:
+      offers = disp->m_handles_auth_service;
+      break;
+    }
+    if (offers && (!best || disp->load() < best_load)) {
+      best = disp;
+      best_load = disp->load();
+      next = at + 1;
+    }
+  }
+  return best;
+}
+
 status_code_t BackendServer::set_player_offline(kinum_t ki, const char *why) {
   status_code_t offline = ERROR_INTERNAL;
   bool was_online = false;
@@ -3074,10 +3555,10 @@ status_code_t BackendServer::set_player_offline(kinum_t ki, const char *why) {
 #ifdef USE_PQXX
   try {
     try {
-      my->C->perform(SetPlayerOffline(ki, was_online, player_node, offline));
+      m_store->player_offline(ki, was_online, player_node, offline);
     } catch (const pqxx::in_doubt_error &e) {
       log_warn(m_log, "in_doubt in SetPlayerOffline for %s; retrying\n", why);
-      my->C->perform(SetPlayerOffline(ki, was_online, player_node, offline));
+      m_store->player_offline(ki, was_online, player_node, offline);
     }
   } catch (const pqxx::in_doubt_error &e) {
     log_err(m_log, "in_doubt again in SetPlayerOffline; "
@@ -3089,6 +3570,9 @@ status_code_t BackendServer::set_player_offline(kinum_t ki, const char *why) {
     log_warn(m_log, "SQL error in SetPlayerOffline for %s: %s\n", why, e.what());
   }
 #endif
+  if (player_node != 0) {
+    forget_prefetched(player_node);
+  }
 #ifndef STANDALONE
   // we need to tell subscribers the node changed, but only
   // if it changed; the player could already have been
@@ -3109,12 +3593,23 @@ void BackendServer::propagate_to_interested(BackendServer::prop_type_t t, uint32
   // count messages sent
   size_t list_size = 0;
 
+  if (!serves(CLASS_VAULT)) {
+    // the vault service knows who is interested; prop_type_t and change_t
+    // have the same values
+    send_to_peers(new AdminPeerPropagate_BackendMessage(0, 0, (AdminPeerPropagate_BackendMessage::change_t) t, nodeid, child,
+        ownerid, transuuid, check_age));
+    return;
+  }
+  if (t == CHANGED) {
+    forget_prefetched(nodeid);
+  }
+
   status_code_t refer = ERROR_INTERNAL;
   std::vector<kinum_t> who;
 #ifdef USE_PQXX
   // check if it's a player-related node
   try {
-    my->C->perform(PlayersReferringTo(nodeid, refer, who));
+    m_store->players_referring_to(nodeid, refer, who);
   } catch (const pqxx::in_doubt_error &e) {
     log_err(m_log, "in_doubt in PlayersReferringTo\n");
   } catch (const pqxx::broken_connection &e) {
@@ -3137,7 +3632,7 @@ void BackendServer::propagate_to_interested(BackendServer::prop_type_t t, uint32
   // check if it's an age-related node
   if (check_age) {
     try {
-      my->C->perform(AgeReferringTo(nodeid, age_uuid, age));
+      m_store->age_referring_to(nodeid, age_uuid, age);
     } catch (const pqxx::in_doubt_error &e) {
       log_err(m_log, "in_doubt in AgeReferringTo\n");
     } catch (const pqxx::broken_connection &e) {
@@ -3289,6 +3784,373 @@ void BackendServer::propagate_player_delete_to_interested(std::multimap<kinum_t,
 #undef stlcrud
 }
 
+void BackendServer::prefetch_nodes(const std::vector<uint32_t> &nodeids) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  expire_prefetched(now.tv_sec);
+
+  // don't bother fetching what we already have
+  std::vector<uint32_t> wanted;
+  wanted.reserve(MIN(nodeids.size(), (size_t) VAULT_PREFETCH_MAX));
+  for (std::vector<uint32_t>::const_iterator iter = nodeids.begin(); iter != nodeids.end(); iter++) {
+    if (wanted.size() >= VAULT_PREFETCH_MAX) {
+      break;
+    }
+    if (m_prefetched.find(*iter) == m_prefetched.end()) {
+      wanted.push_back(*iter);
+    }
+  }
+  if (wanted.size() == 0) {
+    return;
+  }
+
+  status_code_t pre_result = ERROR_INTERNAL;
+  std::map<uint32_t, VaultNode*> nodes;
+#ifdef USE_PQXX
+  try {
+    m_store->fetch_nodes(wanted, pre_result, nodes);
+  } catch (const pqxx::broken_connection &e) {
+    // pretty much fatal -- need to shut down or something
+    log_err(m_log, "Connection to DB failed!\n");
+    pre_result = ERROR_DB_TIMEOUT;
+  } catch (const pqxx::sql_error &e) {
+    log_warn(m_log, "SQL error in VaultFetchNodes: %s\n", e.what());
+  }
+#endif
+
+  if (pre_result != NO_ERROR) {
+    // the client's own fetches will go to the DB as usual
+    for (std::map<uint32_t, VaultNode*>::iterator iter = nodes.begin(); iter != nodes.end(); iter++) {
+      delete iter->second;
+    }
+    return;
+  }
+  for (std::map<uint32_t, VaultNode*>::iterator iter = nodes.begin(); iter != nodes.end(); iter++) {
+    std::map<uint32_t, PrefetchedNode>::iterator have = m_prefetched.find(iter->first);
+    if (have != m_prefetched.end()) {
+      delete have->second.m_node;
+      m_prefetched.erase(have);
+    }
+    m_prefetched.insert(std::pair<uint32_t, PrefetchedNode>(iter->first, PrefetchedNode(iter->second, now.tv_sec)));
+  }
+  log_debug(m_log, "Prefetched %u of %u vault nodes (%u cached)\n", (uint32_t) nodes.size(),
+      (uint32_t) wanted.size(), (uint32_t) m_prefetched.size());
+}
+
+VaultNode* BackendServer::take_prefetched(uint32_t nodeid) {
+  std::map<uint32_t, PrefetchedNode>::iterator iter = m_prefetched.find(nodeid);
+  if (iter == m_prefetched.end()) {
+    return NULL;
+  }
+  VaultNode *node = iter->second.m_node;
+  time_t when = iter->second.m_when;
+  m_prefetched.erase(iter);
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  if (now.tv_sec - when > VAULT_PREFETCH_LIFETIME) {
+    delete node;
+    return NULL;
+  }
+  return node;
+}
+
+void BackendServer::forget_prefetched(uint32_t nodeid) {
+  std::map<uint32_t, PrefetchedNode>::iterator iter = m_prefetched.find(nodeid);
+  if (iter != m_prefetched.end()) {
+    delete iter->second.m_node;
+    m_prefetched.erase(iter);
+  }
+}
+
+void BackendServer::expire_prefetched(time_t now) {
+  std::map<uint32_t, PrefetchedNode>::iterator iter = m_prefetched.begin();
+  while (iter != m_prefetched.end()) {
+    if (now - iter->second.m_when > VAULT_PREFETCH_LIFETIME) {
+      delete iter->second.m_node;
+      m_prefetched.erase(iter++);
+    } else {
+      iter++;
+    }
+  }
+}
+
+void BackendServer::conn_completed(Connection *conn) {
+  conn->set_in_connect(false);
+  for (std::vector<PeerLink*>::iterator p_iter = m_peers.begin(); p_iter != m_peers.end(); p_iter++) {
+    if ((*p_iter)->m_conn == conn) {
+      char addr[INET_ADDRSTRLEN + sizeof(":12345")];
+      inaddr_c_str(addr, sizeof(addr), (*p_iter)->m_addr.sin_addr.s_addr, (*p_iter)->m_addr.sin_port, 0);
+      log_info(m_log, "Connected to peer service at %s\n", addr);
+      // the peer may be new or may have restarted, so it gets everything
+      for (std::map<HashKey, ConnectionEntity*>::iterator iter = m_hash_table.begin(); iter != m_hash_table.end(); iter++) {
+        ConnectionEntity *entity = iter->second;
+        uint32_t fields = owned_fields(entity);
+        if (fields && !entity->is_replica()) {
+          AdminPeerEntity_BackendMessage *msg = new AdminPeerEntity_BackendMessage(iter->first.id1(), iter->first.id2(),
+              entity->type(), fields, entity->uuid(), entity->kinum(), &entity->name(), entity->ipaddr(), entity->server_id(),
+              entity->player_count());
+          conn->enqueue(msg);
+        }
+      }
+      return;
+    }
+  }
+  log_warn(m_log, "Unknown outgoing connection (fd %d) completed!\n", conn->fd());
+}
+
+void BackendServer::connect_peer(PeerLink *peer) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  peer->m_next_try = now.tv_sec + BACKEND_PEER_RETRY;
+
+  peer->m_conn = connect_to_backend(&peer->m_addr, new PeerConnection());
+  if (peer->m_conn) {
+    m_conns.push_back(peer->m_conn);
+    if (!peer->m_conn->in_connect()) {
+      conn_completed(peer->m_conn);
+    }
+  }
+  // otherwise the error was already logged, and we will try again later
+}
+
+void BackendServer::send_to_peers(BackendMessage *msg) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  for (std::vector<PeerLink*>::iterator iter = m_peers.begin(); iter != m_peers.end(); iter++) {
+    PeerLink *peer = *iter;
+    if (!peer->m_conn && now.tv_sec >= peer->m_next_try) {
+      connect_peer(peer);
+    }
+    if (peer->m_conn) {
+      msg->add_ref();
+      peer->m_conn->enqueue(msg);
+    } else {
+      log_debug(m_log, "Peer service unreachable, not sending it <0x%08x>\n", msg->type());
+    }
+  }
+  if (msg->del_ref() < 1) {
+    delete msg;
+  }
+}
+
+uint32_t BackendServer::owned_fields(const ConnectionEntity *entity) const {
+  uint32_t fields = 0;
+  if (entity->type() == TYPE_AUTH) {
+    if (serves(CLASS_AUTH)) {
+      fields |= AdminPeerEntity_BackendMessage::ACCT_UUID | AdminPeerEntity_BackendMessage::PLAYER;
+    }
+    if (serves(CLASS_TRACK)) {
+      fields |= AdminPeerEntity_BackendMessage::LOCATION;
+    }
+  } else if (entity->type() == TYPE_GAME) {
+    if (serves(CLASS_TRACK)) {
+      fields |= AdminPeerEntity_BackendMessage::ACCT_UUID | AdminPeerEntity_BackendMessage::LOCATION
+          | AdminPeerEntity_BackendMessage::PLAYERS;
+      if (entity->in_shutdown()) {
+        fields |= AdminPeerEntity_BackendMessage::IN_SHUTDOWN;
+      }
+    }
+  }
+  return fields;
+}
+
+void BackendServer::share_entity(const HashKey &key, ConnectionEntity *entity, uint32_t fields) {
+  if (m_peers.empty() || entity->is_replica()) {
+    return;
+  }
+  if (entity->type() != TYPE_AUTH && entity->type() != TYPE_GAME) {
+    // nobody else needs to know about dispatchers and gatekeepers
+    return;
+  }
+  if (!(fields & AdminPeerEntity_BackendMessage::GONE)) {
+    fields &= owned_fields(entity);
+    if (!fields) {
+      return;
+    }
+  }
+  send_to_peers(new AdminPeerEntity_BackendMessage(key.id1(), key.id2(), entity->type(), fields, entity->uuid(),
+      entity->kinum(), &entity->name(), entity->ipaddr(), entity->server_id(), entity->player_count()));
+}
+
+void BackendServer::apply_peer_entity(Connection *c, AdminPeerEntity_BackendMessage *msg) {
+  HashKey key(msg->get_id1(), msg->get_id2());
+  uint32_t fields = msg->fields();
+
+  ConnectionEntity *entity = NULL;
+  std::map<HashKey, ConnectionEntity*>::iterator iter = m_hash_table.find(key);
+  if (iter != m_hash_table.end()) {
+    entity = iter->second;
+    if (entity->type() != msg->entity_type()) {
+      log_warn(m_log, "ADMIN_PEER_ENTITY for %08x,%08x type %u, but we have it as type %u\n", msg->get_id1(),
+          msg->get_id2(), msg->entity_type(), entity->type());
+      return;
+    }
+  }
+  log_debug(m_log, "ADMIN_PEER_ENTITY for %08x,%08x type %u fields 0x%02x%s\n", msg->get_id1(), msg->get_id2(),
+      msg->entity_type(), fields, entity ? "" : " (new)");
+
+  if (fields & AdminPeerEntity_BackendMessage::GONE) {
+    // if the frontend is connected to us too, we find out when it closes
+    if (entity && entity->is_replica()) {
+      m_hash_table.erase(iter);
+      delete entity;
+    }
+    drop_held_requests(&key, NULL);
+    return;
+  }
+  if (!entity) {
+    entity = new ConnectionEntity(c, msg->entity_type(), true);
+    m_hash_table[key] = entity;
+  }
+  if (fields & AdminPeerEntity_BackendMessage::ACCT_UUID) {
+    entity->set_uuid(msg->uuid());
+  }
+  if (fields & AdminPeerEntity_BackendMessage::PLAYER) {
+    entity->set_kinum(msg->kinum());
+    entity->name() = *msg->name();
+  }
+  if (fields & AdminPeerEntity_BackendMessage::LOCATION) {
+    entity->set_ipaddr(msg->ipaddr());
+    entity->set_server_id(msg->server_id());
+  }
+  if (fields & AdminPeerEntity_BackendMessage::PLAYERS) {
+    entity->set_player_count(msg->players());
+  }
+  if (fields & AdminPeerEntity_BackendMessage::IN_SHUTDOWN) {
+    entity->set_in_shutdown();
+  }
+  if (entity->kinum() != 0 && !m_held_requests.empty()) {
+    release_held_requests(&key, 0);
+  }
+}
+
+void BackendServer::relay_from_peer(BackendMessage *msg) {
+  HashKey key(msg->get_id1(), msg->get_id2());
+  std::map<HashKey, ConnectionEntity*>::iterator iter = m_hash_table.find(key);
+  if (iter == m_hash_table.end() || iter->second->is_replica()) {
+    log_net(m_log, "Dropping <0x%08x> from a peer service for unknown connection %08x,%08x\n", msg->type(),
+        msg->get_id1(), msg->get_id2());
+    return;
+  }
+  // other received messages are not safe to queue again
+  Relay_BackendMessage *relay = dynamic_cast<Relay_BackendMessage*>(msg);
+  if (!relay) {
+    log_warn(m_log, "Dropping <0x%08x> for %08x,%08x, which did not come from a peer service\n", msg->type(),
+        msg->get_id1(), msg->get_id2());
+    return;
+  }
+  relay->add_ref();
+  iter->second->conn()->enqueue(relay);
+}
+
+NetworkMessage* BackendServer::PeerConnection::make_if_enough(const uint8_t *buf, size_t len, int32_t *want_len,
+    bool become_owner) {
+  if (len >= 16 && (read32(buf, 4) & FROM_SERVER)) {
+    *want_len = read32(buf, 0);
+    if (*want_len >= 16) {
+      if (*want_len > (int32_t) len) {
+        return NULL;
+      }
+      NetworkMessage *msg = new Relay_BackendMessage(buf, *want_len);
+      if (become_owner) {
+        delete[] buf;
+      }
+      return msg;
+    }
+  }
+  return BackendConnection::make_if_enough(buf, len, want_len, become_owner);
+}
+
+bool BackendServer::hold_for_entity(Connection *c, BackendMessage *in) {
+  if (serves(CLASS_AUTH) || m_peers.empty()) {
+    // we know who the client is as soon as anyone does
+    return false;
+  }
+  if (in->type() == VAULT_SAVENODE) {
+    // only saved SDL is forwarded to a game server, which needs the player
+    if (((VaultNode_ToBackendMessage*) in)->data()->type() != VaultNode::SDLNode) {
+      return false;
+    }
+  } else if (in->type() != TRACK_FIND_GAME && in->type() != VAULT_CREATENODE) {
+    return false;
+  }
+  HashKey key(in->get_id1(), in->get_id2());
+  std::map<HashKey, ConnectionEntity*>::iterator iter = m_hash_table.find(key);
+  if (iter != m_hash_table.end() && iter->second->kinum() != 0) {
+    return false;
+  }
+  log_debug(m_log, "Holding <0x%08x> for %08x,%08x until a peer service says who it is\n", in->type(),
+      in->get_id1(), in->get_id2());
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  in->add_ref();
+  m_held_requests.insert(std::pair<HashKey, HeldRequest>(key, HeldRequest(c, in, now.tv_sec)));
+  now.tv_sec += BACKEND_PEER_ENTITY_WAIT;
+  m_held_timers->insert(new HeldExpiry(now, this));
+  return true;
+}
+
+void BackendServer::HeldExpiry::callback() {
+  if (!m_server->m_held_requests.empty()) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    m_server->release_held_requests(NULL, now.tv_sec - BACKEND_PEER_ENTITY_WAIT);
+  }
+}
+
+void BackendServer::release_held_requests(const HashKey *key, time_t when) {
+  // take them out first: handling them may change m_held_requests
+  std::vector<HeldRequest> ready;
+  std::multimap<HashKey, HeldRequest>::iterator iter, last;
+  if (key) {
+    iter = m_held_requests.lower_bound(*key);
+    last = m_held_requests.upper_bound(*key);
+  } else {
+    iter = m_held_requests.begin();
+    last = m_held_requests.end();
+  }
+  while (iter != last) {
+    if (key || iter->second.m_when <= when) {
+      ready.push_back(iter->second);
+      m_held_requests.erase(iter++);
+    } else {
+      iter++;
+    }
+  }
+  for (std::vector<HeldRequest>::iterator r_iter = ready.begin(); r_iter != ready.end(); r_iter++) {
+    BackendMessage *in = r_iter->m_msg;
+    log_debug(m_log, "Handling held <0x%08x> for %08x,%08x\n", in->type(), in->get_id1(), in->get_id2());
+    Server::reason_t ret;
+    if (in->type() & CLASS_VAULT) {
+      ret = handle_vault(r_iter->m_conn, in);
+    } else {
+      ret = handle_track(r_iter->m_conn, in);
+    }
+    if (ret != NO_SHUTDOWN) {
+      log_warn(m_log, "Held <0x%08x> for %08x,%08x failed (%d)\n", in->type(), in->get_id1(), in->get_id2(), ret);
+    }
+    if (in->del_ref() < 1) {
+      delete in;
+    }
+  }
+}
+
+void BackendServer::drop_held_requests(const HashKey *key, const Connection *conn) {
+  std::multimap<HashKey, HeldRequest>::iterator iter = m_held_requests.begin();
+  while (iter != m_held_requests.end()) {
+    if ((!key && !conn) || (key && !(iter->first < *key) && !(*key < iter->first)) || iter->second.m_conn == conn) {
+      BackendMessage *in = iter->second.m_msg;
+      if (in->del_ref() < 1) {
+        delete in;
+      }
+      m_held_requests.erase(iter++);
+    } else {
+      iter++;
+    }
+  }
+}
+
 BackendServer::ConnectionEntity*
 BackendServer::find_by_kinum(kinum_t ki, uint32_t type) {
   std::map<HashKey, ConnectionEntity*>::iterator iter;
@@ -0,0 +1,125 @@
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/time.h>
+
+#include "machine_arch.h"
+#include "constants.h"
+
+#include "backend_capture.h"
+
+int BackendCapture::open_write(const char *fname) {
+  close();
+  m_file = fopen(fname, "wb");
+  if (!m_file) {
+    return errno;
+  }
+  // messages are small and frequent, so buffer generously
+  setvbuf(m_file, NULL, _IOFBF, 65536);
+
+  uint32_t version = htole32(BACKEND_CAPTURE_VERSION);
+  if (fwrite(BACKEND_CAPTURE_MAGIC, 8, 1, m_file) != 1 || fwrite(&version, 4, 1, m_file) != 1) {
+    int err = errno;
+    close();
+    return err;
+  }
+  return 0;
+}
+
+int BackendCapture::open_read(const char *fname) {
+  close();
+  m_file = fopen(fname, "rb");
+  if (!m_file) {
+    return errno;
+  }
+
+  char magic[8];
+  uint32_t version;
+  if (fread(magic, 8, 1, m_file) != 1 || fread(&version, 4, 1, m_file) != 1) {
+    close();
+    return EINVAL;
+  }
+  if (memcmp(magic, BACKEND_CAPTURE_MAGIC, 8) || le32toh(version) != BACKEND_CAPTURE_VERSION) {
+    close();
+    return EINVAL;
+  }
+  return 0;
+}
+
+void BackendCapture::close() {
+  if (m_file) {
+    fclose(m_file);
+    m_file = NULL;
+  }
+}
+
+bool BackendCapture::record(uint32_t stream, const uint8_t *buf, uint32_t len) {
+  if (!m_file) {
+    return false;
+  }
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  uint32_t header[4];
+  header[0] = htole32((uint32_t) now.tv_sec);
+  header[1] = htole32((uint32_t) now.tv_usec);
+  header[2] = htole32(stream);
+  header[3] = htole32(len);
+  if (fwrite(header, sizeof(header), 1, m_file) != 1 || (len > 0 && fwrite(buf, len, 1, m_file) != 1)) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+bool BackendCapture::read_record(struct timeval *when, uint32_t *stream, uint8_t **buf, uint32_t *len) {
+  if (!m_file) {
+    return false;
+  }
+  uint32_t header[4];
+  if (fread(header, sizeof(header), 1, m_file) != 1) {
+    return false;
+  }
+  when->tv_sec = le32toh(header[0]);
+  when->tv_usec = le32toh(header[1]);
+  *stream = le32toh(header[2]);
+  *len = le32toh(header[3]);
+  *buf = NULL;
+  if (*len > 0) {
+    if (*len < 16) {
+      // not even a backend message header
+      return false;
+    }
+    *buf = new uint8_t[*len];
+    if (fread(*buf, *len, 1, m_file) != 1) {
+      delete[] *buf;
+      *buf = NULL;
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,75 @@
+/* -*- c++ -*- */
+
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * A BackendCapture file holds the messages the backend server received,
+ * exactly as they arrived, so that test/backend_replay can send them to
+ * a backend again.
+ *
+ * The file starts with BACKEND_CAPTURE_MAGIC and a version number. Then
+ * each record is a header of four little-endian 32-bit values, the time
+ * the message was read (seconds, microseconds), the stream (one per
+ * frontend connection, numbered from 1 in the order they were accepted)
+ * and the message length, followed by the message. A record with length
+ * 0 means the stream was closed.
+ */
+
+//#include <stdio.h>
+//#include <sys/time.h>
+
+#ifndef _BACKEND_CAPTURE_H_
+#define _BACKEND_CAPTURE_H_
+
+#define BACKEND_CAPTURE_MAGIC "MOSSBCAP"
+#define BACKEND_CAPTURE_VERSION 1
+
+class BackendCapture {
+public:
+  BackendCapture() :
+      m_file(NULL) {
+  }
+  ~BackendCapture() {
+    close();
+  }
+
+  // returns 0 for success, otherwise errno
+  int open_write(const char *fname);
+  int open_read(const char *fname);
+  void close();
+
+  // returns false if the write failed (the capture is then closed)
+  bool record(uint32_t stream, const uint8_t *buf, uint32_t len);
+  bool record_close(uint32_t stream) {
+    return record(stream, NULL, 0);
+  }
+
+  // reads the next record; *buf is allocated with new[] (NULL if *len is
+  // 0); returns false at the end of the file or if it is corrupt
+  bool read_record(struct timeval *when, uint32_t *stream, uint8_t **buf, uint32_t *len);
+
+  bool is_open() const {
+    return m_file != NULL;
+  }
+
+protected:
+  FILE *m_file;
+};
+
+#endif /* _BACKEND_CAPTURE_H_ */
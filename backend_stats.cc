@@ -0,0 +1,246 @@
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <stdarg.h>
+#include <pthread.h>
+#include <iconv.h>
+
+#include <sys/time.h>
+#include <sys/uio.h> /* for struct iovec */
+#include <netinet/in.h>
+
+#ifdef DEBUG_ENABLE
+#include <stdexcept>
+#endif
+#include <map>
+#include <string>
+#include <vector>
+
+#include "machine_arch.h"
+#include "constants.h"
+#include "protocol.h"
+#include "backend_typecodes.h"
+#include "util.h"
+#include "UruString.h"
+
+#include "Logger.h"
+#include "NetworkMessage.h"
+#include "BackendMessage.h"
+
+#include "backend_stats.h"
+
+void LatencyHistogram::record(uint32_t usecs) {
+  m_counts[bucket_for(usecs)]++;
+  m_count++;
+  m_total += usecs;
+  if (usecs > m_max) {
+    m_max = usecs;
+  }
+}
+
+uint32_t LatencyHistogram::percentile(double p) const {
+  if (m_count == 0) {
+    return 0;
+  }
+  uint64_t want = (uint64_t) (p * m_count + 0.5);
+  if (want < 1) {
+    want = 1;
+  }
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < HIST_BUCKETS; i++) {
+    seen += m_counts[i];
+    if (seen >= want) {
+      uint32_t top = bucket_top(i);
+      return (top > m_max ? m_max : top);
+    }
+  }
+  return m_max;
+}
+
+void LatencyHistogram::reset() {
+  memset(m_counts, 0, sizeof(m_counts));
+  m_count = 0;
+  m_total = 0;
+  m_max = 0;
+}
+
+uint32_t LatencyHistogram::bucket_for(uint32_t usecs) {
+  if (usecs < HIST_SUB_BUCKETS) {
+    return usecs;
+  }
+  uint32_t magnitude = HIST_SUB_BITS;
+  while (magnitude < 31 && (usecs >> (magnitude + 1))) {
+    magnitude++;
+  }
+  uint32_t sub = (usecs >> (magnitude - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+  return ((magnitude - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS) + sub;
+}
+
+uint32_t LatencyHistogram::bucket_top(uint32_t bucket) {
+  if (bucket < HIST_SUB_BUCKETS) {
+    return bucket;
+  }
+  uint32_t magnitude = (bucket / HIST_SUB_BUCKETS) + HIST_SUB_BITS - 1;
+  uint32_t sub = bucket % HIST_SUB_BUCKETS;
+  uint32_t shift = magnitude - HIST_SUB_BITS;
+  uint64_t bottom = ((uint64_t) (HIST_SUB_BUCKETS + sub)) << shift;
+  uint64_t top = bottom + (((uint64_t) 1) << shift) - 1;
+  return (top > 0xffffffff ? 0xffffffff : (uint32_t) top);
+}
+
+BackendStats::BackendStats() :
+    m_cur(NULL), m_cur_db(0) {
+  gettimeofday(&m_since, NULL);
+  memset(&m_cur_start, 0, sizeof(struct timeval));
+}
+
+BackendStats::~BackendStats() {
+  for (std::map<int32_t, TypeStats*>::iterator iter = m_types.begin(); iter != m_types.end(); iter++) {
+    delete iter->second;
+  }
+  for (std::map<std::string, LatencyHistogram*>::iterator iter = m_transactors.begin(); iter != m_transactors.end();
+      iter++) {
+    delete iter->second;
+  }
+}
+
+uint32_t BackendStats::usecs_since(const struct timeval &start, const struct timeval &now) {
+  if (timeval_lessthan(now, start)) {
+    // clock went backwards
+    return 0;
+  }
+  uint64_t usecs = ((uint64_t) (now.tv_sec - start.tv_sec) * 1000000) + now.tv_usec - start.tv_usec;
+  return (usecs > 0xffffffff ? 0xffffffff : (uint32_t) usecs);
+}
+
+void BackendStats::start_message(int32_t type, size_t len, const struct timeval &read_time) {
+  gettimeofday(&m_cur_start, NULL);
+
+  std::map<int32_t, TypeStats*>::iterator iter = m_types.find(type);
+  if (iter == m_types.end()) {
+    m_cur = new TypeStats();
+    m_types[type] = m_cur;
+  } else {
+    m_cur = iter->second;
+  }
+  m_cur->m_bytes += len;
+  m_cur->m_queued.record(usecs_since(read_time, m_cur_start));
+  m_cur_db = 0;
+}
+
+void BackendStats::end_message(struct timeval *now) {
+  gettimeofday(now, NULL);
+  if (!m_cur) {
+    // stats were reset while handling the message
+    return;
+  }
+  m_cur->m_handled.record(usecs_since(m_cur_start, *now));
+  m_cur->m_db.record(m_cur_db);
+  m_cur = NULL;
+}
+
+void BackendStats::db_done(const std::string &name, const struct timeval &start) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  uint32_t usecs = usecs_since(start, now);
+
+  LatencyHistogram *hist;
+  std::map<std::string, LatencyHistogram*>::iterator iter = m_transactors.find(name);
+  if (iter == m_transactors.end()) {
+    hist = new LatencyHistogram();
+    m_transactors[name] = hist;
+  } else {
+    hist = iter->second;
+  }
+  hist->record(usecs);
+  if (m_cur) {
+    m_cur_db += usecs;
+  }
+}
+
+void BackendStats::format_histogram(std::string &line, const char *label, const LatencyHistogram &hist) {
+  char buf[160];
+  snprintf(buf, sizeof(buf), " %s(us) mean=%u p50=%u p90=%u p99=%u max=%u", label,
+      hist.count() ? (uint32_t) (hist.total() / hist.count()) : 0, hist.percentile(0.5), hist.percentile(0.9),
+      hist.percentile(0.99), hist.max());
+  line += buf;
+}
+
+void BackendStats::report(std::vector<std::string> &lines) const {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  char buf[200];
+
+  snprintf(buf, sizeof(buf), "Backend statistics for the last %u seconds", (uint32_t) (now.tv_sec - m_since.tv_sec));
+  lines.push_back(buf);
+  for (std::map<int32_t, TypeStats*>::const_iterator iter = m_types.begin(); iter != m_types.end(); iter++) {
+    const TypeStats *ts = iter->second;
+    char *name = BackendMessage::backend_msgtype_c_str_alloc(iter->first);
+    snprintf(buf, sizeof(buf), "<0x%08x>%s n=%u bytes=%llu db_total(ms)=%llu", iter->first, name ? name : "",
+        ts->m_handled.count(), (unsigned long long) ts->m_bytes, (unsigned long long) (ts->m_db.total() / 1000));
+    if (name) {
+      free(name);
+    }
+    std::string line(buf);
+    format_histogram(line, "queued", ts->m_queued);
+    format_histogram(line, "handled", ts->m_handled);
+    format_histogram(line, "db", ts->m_db);
+    lines.push_back(line);
+  }
+  for (std::map<std::string, LatencyHistogram*>::const_iterator iter = m_transactors.begin();
+      iter != m_transactors.end(); iter++) {
+    snprintf(buf, sizeof(buf), "DB %s n=%u total(ms)=%llu", iter->first.c_str(), iter->second->count(),
+        (unsigned long long) (iter->second->total() / 1000));
+    std::string line(buf);
+    format_histogram(line, "time", *iter->second);
+    lines.push_back(line);
+  }
+}
+
+void BackendStats::log_report(Logger *log) const {
+  if (!log || !log->would_log_at(Logger::LOG_INFO)) {
+    return;
+  }
+  std::vector<std::string> lines;
+  report(lines);
+  for (std::vector<std::string>::iterator iter = lines.begin(); iter != lines.end(); iter++) {
+    log_info(log, "%s\n", iter->c_str());
+  }
+}
+
+void BackendStats::reset() {
+  for (std::map<int32_t, TypeStats*>::iterator iter = m_types.begin(); iter != m_types.end(); iter++) {
+    delete iter->second;
+  }
+  m_types.clear();
+  for (std::map<std::string, LatencyHistogram*>::iterator iter = m_transactors.begin(); iter != m_transactors.end();
+      iter++) {
+    delete iter->second;
+  }
+  m_transactors.clear();
+  m_cur = NULL;
+  gettimeofday(&m_since, NULL);
+}
@@ -0,0 +1,129 @@
+/* -*- c++ -*- */
+
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * BackendStats keeps track of where the backend server's time goes. For
+ * each message type it counts messages and bytes, and records how long
+ * each message sat after its data was read (messages read at the same time
+ * are handled in order), how long handling it took, and how much of that
+ * was spent in the DB. DB transactors are also timed individually, by name.
+ *
+ * The times are kept in fixed-size histograms with logarithmic buckets,
+ * each power of two split in HIST_SUB_BUCKETS linear steps (like HDR
+ * histograms), so percentiles are good to about 6% from a microsecond up
+ * to over an hour.
+ */
+
+//#include <sys/time.h>
+//
+//#include <map>
+//#include <string>
+//#include <vector>
+//
+//#include "Logger.h"
+
+#ifndef _BACKEND_STATS_H_
+#define _BACKEND_STATS_H_
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((32 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+class LatencyHistogram {
+public:
+  LatencyHistogram() {
+    reset();
+  }
+
+  // times are in microseconds
+  void record(uint32_t usecs);
+  uint32_t count() const {
+    return m_count;
+  }
+  uint64_t total() const {
+    return m_total;
+  }
+  uint32_t max() const {
+    return m_max;
+  }
+  // the value below which the fraction p of the recorded values fall (the
+  // top of the bucket holding it, so it is rounded up)
+  uint32_t percentile(double p) const;
+
+  void reset();
+
+protected:
+  uint32_t m_counts[HIST_BUCKETS];
+  uint32_t m_count;
+  uint64_t m_total;
+  uint32_t m_max;
+
+  static uint32_t bucket_for(uint32_t usecs);
+  static uint32_t bucket_top(uint32_t bucket);
+};
+
+class BackendStats {
+public:
+  BackendStats();
+  ~BackendStats();
+
+  // called around the handling of each message; read_time is when the
+  // data for it was read from the socket, and end_message() also tells
+  // the caller what time it is
+  void start_message(int32_t type, size_t len, const struct timeval &read_time);
+  void end_message(struct timeval *now);
+
+  // a DB transactor that was started at start has finished
+  void db_done(const std::string &name, const struct timeval &start);
+
+  // one line per message type and transactor, plus a header
+  void report(std::vector<std::string> &lines) const;
+  void log_report(Logger *log) const;
+  void reset();
+
+  time_t since() const {
+    return m_since.tv_sec;
+  }
+
+protected:
+  class TypeStats {
+  public:
+    TypeStats() :
+        m_bytes(0) {
+    }
+    uint64_t m_bytes;
+    LatencyHistogram m_queued;
+    LatencyHistogram m_handled;
+    LatencyHistogram m_db;
+  };
+  std::map<int32_t, TypeStats*> m_types;
+  std::map<std::string, LatencyHistogram*> m_transactors;
+  struct timeval m_since;
+
+  // the message being handled right now
+  TypeStats *m_cur;
+  struct timeval m_cur_start;
+  uint32_t m_cur_db;
+
+  static uint32_t usecs_since(const struct timeval &start, const struct timeval &now);
+  static void format_histogram(std::string &line, const char *label, const LatencyHistogram &hist);
+};
+
+#endif /* _BACKEND_STATS_H_ */
@@ -18,8 +18,9 @@
 
 /*
  * Typecodes for backend messages. They are composed of a class code and
- * an ID per class. The class code is so that, if someday there is more than
- * one backend server, dispatch can be done based on the class code.
+ * an ID per class. The class code is so that, when there is more than one
+ * backend server (see "services" in backend.cfg), dispatch can be done
+ * based on the class code.
  */
 
 #ifndef _BACKEND_TYPECODES_H_
@@ -119,6 +120,11 @@ enum BackendMessageType_e {
 // this next message will be used if multiple "connections" are merged into
 // one TCP connection
   ADMIN_BYE =              (CLASS_ADMIN|0xff),
+// backend <-> backend, when auth, vault and tracking run as separate services
+  ADMIN_PEER_ENTITY =      (CLASS_ADMIN|0x40), ///< connection entity state
+  ADMIN_PEER_PROPAGATE =   (CLASS_ADMIN|0x41), ///< ask vault to notify clients
+// for monitoring tools
+  ADMIN_STATS =            (CLASS_ADMIN|0x50), ///< fetch per-message-type timings
 
 /* frontend servers must tell tracking server about themselves */
   TRACK_PING =             (CLASS_TRACK|0x00),
@@ -126,8 +132,8 @@ enum BackendMessageType_e {
   TRACK_DISPATCHER_BYE =   (CLASS_TRACK|0x02), ///< obsolete
   TRACK_GAME_HELLO =       (CLASS_TRACK|0x03),
   TRACK_GAME_BYE =         (CLASS_TRACK|0x04),
-// for load-balancing if we ever need it
-  TRACK_STATUS =           (CLASS_TRACK|0x05), ///< unimplemented
+// for load-balancing
+  TRACK_STATUS =           (CLASS_TRACK|0x05), ///< dispatcher reports its load
 // for tracking what age a player is in (the info is also in the vault,
 // the client puts the intended age and its UUID in the vault before starting
 // the link, but this form is more direct)
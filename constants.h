@@ -61,4 +61,56 @@
 // maximum amount of time a given client can hold an object lock (game server)
 #define MAX_LOCK_TIME 5 /* XXX made up */
 
+// how often a game server writes the SDL that changed since its age state
+// file was saved (seconds)
+#define AGESTATE_CHECKPOINT_INTERVAL 120
+
+// how many initial age state messages a game server queues for a joining
+// client per pass through the select loop; it waits for the client's queue
+// to drop below this before sending more
+#define STATE_TRANSFER_BATCH 32
+
+// with interest management, how often a game server sends players' latest
+// movement to those not near them (milliseconds)
+#define INTEREST_FAR_INTERVAL 1000
+
+// how many voice messages may wait to be written to a client; beyond this
+// the oldest are dropped (each holds a few speech frames, about 1/10 s)
+#define VOICE_QUEUE_FRAMES 8
+
+// the range allowed for game_tick_rate and an age's TickRate (per second)
+#define GAME_TICK_MIN_RATE 20
+#define GAME_TICK_MAX_RATE 60
+
+// how often a dispatcher reports its load to the tracking server (s)
+#define TRACK_STATUS_INTERVAL 30
+// in a dispatcher's load, a game server counts as this many players
+#define TRACK_LOAD_AGE_WEIGHT 4
+// a new age instance goes to the dispatcher running the age the player is
+// linking from unless its load is this many players over the least loaded
+#define TRACK_AFFINITY_SLACK 16
+
+// game messages and their buffers come from per-thread free lists; this is
+// how many bytes of free blocks each thread keeps in each size class
+#define GAME_POOL_FREE_BYTES 262144
+
+// how long the backend holds on to prefetched vault nodes (seconds), and the
+// most nodes it will prefetch for one VaultFetchNodeRefs
+#define VAULT_PREFETCH_LIFETIME 30
+#define VAULT_PREFETCH_MAX 2000
+
+// when the backend services are split, how long to wait before trying
+// again to connect to a peer service that could not be reached (seconds)
+#define BACKEND_PEER_RETRY 10
+
+// when the backend services are split, how long a client request that needs
+// the client's player is held waiting for the peer service that owns it to
+// say who that is, before it is handled anyway (seconds)
+#define BACKEND_PEER_ENTITY_WAIT 5
+
+// the first node ID the in-memory vault store hands out in an empty vault,
+// and how many changes it logs before writing a new snapshot
+#define MEMORY_VAULT_FIRST_NODE 10000
+#define MEMORY_VAULT_LOG_MAX 500000
+
 #endif /* _CONSTANTS_H_ */
@@ -28,7 +28,10 @@
 
 #include <exception>
 #include <list>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 #include <sstream>
 #include <iomanip>
 
@@ -48,6 +51,7 @@
 #include "VaultNode.h"
 
 #include "Logger.h"
+#include "vault_store.h"
 
 #include "db_requests.h"
 
@@ -46,6 +46,7 @@
 //#include "util.h"
 //#include "UruString.h"
 //#include "VaultNode.h"
+//#include "vault_store.h"
 //
 //#include "Logger.h"
 #ifndef _DB_REQUESTS_H_
@@ -290,22 +291,6 @@ void AuthAcctLogin_AcctQuery(BackendObj *conn, char *name,
 #endif /* USE_PQXX */
 #endif /* USE_POSTGRES */
 
-class AuthAcctLogin_PlayerQuery_Player {
-public:
-  AuthAcctLogin_PlayerQuery_Player() :
-      kinum(0), name(), gender(), explorer_type(GUEST_CUSTOMER) {
-  }
-  ;
-
-  AuthAcctLogin_PlayerQuery_Player(const AuthAcctLogin_PlayerQuery_Player &other) :
-      kinum(other.kinum), name(other.name), gender(other.gender), explorer_type(other.explorer_type) {
-  }
-
-  kinum_t kinum;
-  UruString name;
-  UruString gender;
-  customer_type_t explorer_type;
-};
 #ifdef USE_PQXX
 class AuthAcctLogin_PlayerQuery: public pqxx::transactor<pqxx::nontransaction> {
 public:
@@ -637,12 +622,6 @@ protected:
 };
 #endif /* USE_PQXX */
 
-typedef struct {
-  uint32_t parent;
-  uint32_t child;
-  uint32_t owner;
-} VaultFetchRefs_VaultRef;
-
 #ifdef USE_PQXX
 static bool string_output(pqxx::transaction_base &T, std::ostream &ostr, const VaultNode *node, VaultNode::datatype_t type,
     vault_bitfield_t bit) {
@@ -859,6 +838,80 @@ protected:
   bool m_allow_vm;
 };
 
+// Fill in a VaultNode from one row of fetchnode() output. The row must have
+// a non-null v_nodetype.
+static void fill_node_from_row(const pqxx::result &R, pqxx::result::size_type row, uint32_t nodeid, VaultNode &node,
+    Logger *log) {
+  int type;
+  R[row]["v_nodetype"].to(type);
+  VaultNode::vault_nodetype_t ntype = (VaultNode::vault_nodetype_t) type;
+  uint32_t bits = VaultNode::all_bits_for_type(ntype);
+
+  node.num_ref(NodeID) = htole32(nodeid);
+  const VaultNode::ColumnSpec *col;
+  for (uint32_t i = 1; i < 32; i++) {
+    vault_bitfield_t bit = (vault_bitfield_t) (1 << i);
+    if (bits & bit) {
+      col = VaultNode::get_spec(ntype, bit);
+      pqxx::field F = R[row][col->fetch_name];
+      if (F.is_null()) {
+        if (col->fetch_required) {
+          log_net(log, "Field 0x%08x was expected from vault node %d "
+              "fetch of type %d, yet it is not present in the DB!\n", (uint32_t) bit, nodeid, type);
+          log_net(log, "If this field is allowed to be null, edit the "
+              "VaultNode ColumnSpec; if not, investigate the missing "
+              "data.\n");
+          // but, go on anyway
+        }
+      } else {
+        switch (col->datatype) {
+        case VaultNode::Int: {
+          int32_t val;
+          F.to(val);
+          node.num_ref(bit) = htole32(val);
+        }
+          break;
+        case VaultNode::UInt: {
+          uint32_t val;
+          F.to(val);
+          node.num_ref(bit) = htole32(val);
+        }
+          break;
+        case VaultNode::UUID:
+          if (uuid_string_to_bytes(node.uuid_ptr(bit), UUID_RAW_LEN, F.c_str(), strlen(F.c_str()), 1, 1)) {
+            memset(node.uuid_ptr(bit), 0, UUID_RAW_LEN);
+          }
+          break;
+        case VaultNode::String: {
+          UruString str((const uint8_t*) F.c_str(), strlen(F.c_str()) + 1, false, false, false/* unneeded*/);
+          size_t str_len = str.send_len(false, true, true);
+          memcpy(node.data_ptr(bit, str_len), str.get_str(false, true, true), str_len);
+        }
+          break;
+        case VaultNode::Blob: {
+          pqxx::binarystring blob(F);
+          size_t blob_len = read32(blob.data(), 0);
+          if (blob_len + 4 != blob.length()) {
+            // the data from the vault is wrong
+            log_err(log, "Length mismatch in blob from DB! Data claims "
+                "%d, DB claims %d\n", blob_len + 4, blob.length());
+            if (blob_len + 4 > blob.length()) {
+              blob_len = blob.length() - 4;
+            }
+          }
+          memcpy(node.data_ptr(bit, blob_len), blob.data() + 4, blob_len);
+        }
+          break;
+        default:
+          // programmer error
+          log_err(log, "Unhandled vault node field type!\n");
+          break;
+        }
+      }
+    }
+  }
+}
+
 class VaultFetchNode_Request: public pqxx::transactor<pqxx::nontransaction> {
 public:
   VaultFetchNode_Request(uint32_t nodeid, status_code_t &result, VaultNode &node, Logger *log) :
@@ -889,83 +942,124 @@ public:
       m_result = NO_ERROR;
     }
 
-    int type;
-    R[0]["v_nodetype"].to(type);
-    VaultNode::vault_nodetype_t ntype = (VaultNode::vault_nodetype_t) type;
-    uint32_t bits = VaultNode::all_bits_for_type(ntype);
+    fill_node_from_row(R, 0, m_id, m_node, m_log);
+  }
 
-    m_node.num_ref(NodeID) = htole32(m_id);
-    const VaultNode::ColumnSpec *col;
-    for (uint32_t i = 1; i < 32; i++) {
-      vault_bitfield_t bit = (vault_bitfield_t) (1 << i);
-      if (bits & bit) {
-        col = VaultNode::get_spec(ntype, bit);
-        pqxx::field F = R[0][col->fetch_name];
-        if (F.is_null()) {
-          if (col->fetch_required) {
-            log_net(m_log, "Field 0x%08x was expected from vault node %d "
-                "fetch of type %d, yet it is not present in the DB!\n", (uint32_t) bit, m_id, type);
-            log_net(m_log, "If this field is allowed to be null, edit the "
-                "VaultNode ColumnSpec; if not, investigate the missing "
-                "data.\n");
-            // but, go on anyway
-          }
-        } else {
-          switch (col->datatype) {
-          case VaultNode::Int: {
-            int32_t val;
-            F.to(val);
-            m_node.num_ref(bit) = htole32(val);
-          }
-            break;
-          case VaultNode::UInt: {
-            uint32_t val;
-            F.to(val);
-            m_node.num_ref(bit) = htole32(val);
-          }
-            break;
-          case VaultNode::UUID:
-            if (uuid_string_to_bytes(m_node.uuid_ptr(bit), UUID_RAW_LEN, F.c_str(), strlen(F.c_str()), 1, 1)) {
-              memset(m_node.uuid_ptr(bit), 0, UUID_RAW_LEN);
-            }
-            break;
-          case VaultNode::String: {
-            UruString str((const uint8_t*) F.c_str(), strlen(F.c_str()) + 1, false, false, false/* unneeded*/);
-            size_t str_len = str.send_len(false, true, true);
-            memcpy(m_node.data_ptr(bit, str_len), str.get_str(false, true, true), str_len);
-          }
-            break;
-          case VaultNode::Blob: {
-            pqxx::binarystring blob(F);
-            size_t blob_len = read32(blob.data(), 0);
-            if (blob_len + 4 != blob.length()) {
-              // the data from the vault is wrong
-              log_err(m_log, "Length mismatch in blob from DB! Data claims "
-                  "%d, DB claims %d\n", blob_len + 4, blob.length());
-              if (blob_len + 4 > blob.length()) {
-                blob_len = blob.length() - 4;
-              }
-            }
-            memcpy(m_node.data_ptr(bit, blob_len), blob.data() + 4, blob_len);
-          }
-            break;
-          default:
-            // programmer error
-            log_err(m_log, "Unhandled vault node field type!\n");
-            break;
-          }
-        }
+protected:
+  uint32_t m_id;
+  status_code_t &m_result;
+  VaultNode &m_node;
+  Logger *m_log;
+};
+
+/*
+ * Fetch a batch of nodes in one query, for vault prefetching. Nodes that do
+ * not exist are simply absent from the results. The caller owns the
+ * VaultNodes left in the map.
+ */
+class VaultFetchNodes_Request: public pqxx::transactor<pqxx::nontransaction> {
+public:
+  VaultFetchNodes_Request(const std::vector<uint32_t> &nodeids, status_code_t &result, std::map<uint32_t, VaultNode*> &nodes,
+      Logger *log) :
+      pqxx::transactor<pqxx::nontransaction>("VaultFetchNodes_Request"), m_ids(nodeids), m_result(result), m_nodes(nodes), m_log(
+          log) {
+  }
+
+  VaultFetchNodes_Request(const VaultFetchNodes_Request &other) :
+      pqxx::transactor<pqxx::nontransaction>("VaultFetchNodes_Request"), m_ids(other.m_ids), m_result(other.m_result), m_nodes(
+          other.m_nodes), m_log(other.m_log) {
+  }
+
+  void operator()(argument_type &T) {
+    if (m_nodes.size() != 0) {
+      // this should not happen
+      throw std::runtime_error("We appear to have restarted what should be a "
+          "nontransaction which only sets local state after "
+          "the entire DB interaction succeeds!");
+    }
+    m_result = NO_ERROR;
+    if (m_ids.size() == 0) {
+      return;
+    }
+
+    std::stringstream qstr;
+    qstr << "SELECT n.id AS v_nodeid, f.* FROM unnest(ARRAY[";
+    for (size_t i = 0; i < m_ids.size(); i++) {
+      if (i > 0) {
+        qstr << ",";
       }
+      qstr << m_ids[i];
+    }
+    qstr << "]::numeric[]) AS n(id), LATERAL fetchnode(n.id) AS f";
+    pqxx::result R(T.exec(qstr));
+
+    for (pqxx::result::size_type i = 0; i < R.size(); i++) {
+      if (R[i]["v_nodetype"].is_null()) {
+        continue;
+      }
+      uint32_t nodeid;
+      R[i]["v_nodeid"].to(nodeid);
+      if (m_nodes.find(nodeid) != m_nodes.end()) {
+        // the caller asked for the node twice
+        continue;
+      }
+      VaultNode *node = new VaultNode();
+      fill_node_from_row(R, i, nodeid, *node, m_log);
+      m_nodes[nodeid] = node;
     }
   }
 
 protected:
-  uint32_t m_id;
+  const std::vector<uint32_t> &m_ids;
   status_code_t &m_result;
-  VaultNode &m_node;
+  std::map<uint32_t, VaultNode*> &m_nodes;
   Logger *m_log;
 };
 
+/*
+ * The IDs of every node and every ref, for copying the vault into another
+ * VaultStore.
+ */
+class VaultAllNodes_Request: public pqxx::transactor<pqxx::nontransaction> {
+public:
+  VaultAllNodes_Request(std::vector<uint32_t> &nodeids, std::vector<VaultFetchRefs_VaultRef> &refs) :
+      pqxx::transactor<pqxx::nontransaction>("VaultAllNodes_Request"), m_ids(nodeids), m_refs(refs) {
+  }
+
+  VaultAllNodes_Request(const VaultAllNodes_Request &other) :
+      pqxx::transactor<pqxx::nontransaction>("VaultAllNodes_Request"), m_ids(other.m_ids), m_refs(other.m_refs) {
+  }
+
+  void operator()(argument_type &T) {
+    if (m_ids.size() != 0 || m_refs.size() != 0) {
+      // this should not happen
+      throw std::runtime_error("We appear to have restarted what should be a "
+          "nontransaction which only sets local state after "
+          "the entire DB interaction succeeds!");
+    }
+    pqxx::result R(T.exec("SELECT nodeid FROM nodes ORDER BY nodeid"));
+    m_ids.reserve(R.size());
+    for (pqxx::result::const_iterator row = R.begin(); row != R.end(); row++) {
+      uint32_t nodeid;
+      row[0].to(nodeid);
+      m_ids.push_back(nodeid);
+    }
+    pqxx::result RR(T.exec("SELECT parent,child,ownerid FROM noderefs"));
+    m_refs.reserve(RR.size());
+    for (pqxx::result::const_iterator row = RR.begin(); row != RR.end(); row++) {
+      VaultFetchRefs_VaultRef ref;
+      row["parent"].to(ref.parent);
+      row["child"].to(ref.child);
+      row["ownerid"].to(ref.owner);
+      m_refs.push_back(ref);
+    }
+  }
+
+protected:
+  std::vector<uint32_t> &m_ids;
+  std::vector<VaultFetchRefs_VaultRef> &m_refs;
+};
+
 class VaultSaveNode_Request: public pqxx::transactor<> {
 public:
   VaultSaveNode_Request(uint32_t nodeid, const VaultNode *node, status_code_t &result, Logger *log) :
@@ -1281,18 +1375,7 @@ protected:
   uint32_t my_age_info_node;
   status_code_t my_result;
 };
-#endif /* USE_PQXX */
-
-typedef struct {
-  uint8_t uuid[UUID_RAW_LEN];
-  UruString instance_name;
-  UruString user_defined;
-  UruString display_name;
-  uint32_t instance_num;
-  uint32_t num_owners;
-} VaultAgeList_AgeInfo;
 
-#ifdef USE_PQXX
 class VaultAgeList_Request: public pqxx::transactor<pqxx::nontransaction> {
 public:
   VaultAgeList_Request(UruString &filename, status_code_t &result, std::vector<VaultAgeList_AgeInfo> &ages) :
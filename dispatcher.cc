@@ -45,6 +45,7 @@
 #include <sys/socket.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 
 #include <arpa/inet.h> /* for inet_ntop() */
 #include <netinet/in.h>
@@ -53,6 +54,7 @@
 #include <stdexcept>
 #include <deque>
 #include <map>
+#include <set>
 #include <list>
 #include <vector>
 #include <string>
@@ -104,7 +106,12 @@
 #include "FileMessage.h"
 #include "FileServer.h"
 #include "GameState.h"
+#include "AgeCheckpoint.h"
+#include "AgeStateFile.h"
+#include "SDLRegistry.h"
+#include "SDLCompressor.h"
 #include "GameServer.h"
+#include "GameHost.h"
 #include "GatekeeperServer.h"
 
 #define RELOAD 0
@@ -148,11 +155,11 @@ public:
   Server::reason_t signalled(int32_t *todo, Server *s);
 
   DispatcherProcessor(Logger *logger, const char *config_file) :
-      bind_addr_name(NULL), track_addr_name(NULL), log_dir(NULL), log_level(NULL), pid_file(NULL), server_types(NULL),
+      bind_addr_name(NULL), track_addr_name(NULL), auth_svc_addr_name(NULL), vault_svc_addr_name(NULL), log_dir(NULL), log_level(NULL), pid_file(NULL), server_types(NULL),
       ext_addr_name(NULL), m_ext_addr(0), m_ext_port(0), child_name(NULL), auth_dir(NULL), file_dir(NULL), game_dir(NULL),
       auth_log_level(NULL), file_log_level(NULL), game_log_level(NULL), gate_log_level(NULL), game_addr_name(NULL),
       auth_key_file(NULL), game_key_file(NULL), gate_key_file(NULL), status_str(NULL), allow_vaultmanager(false),
-      always_resolve(false), bind_port(0), track_port(0), status_len(0), m_thread_manager(NULL), m_do_auth(0), m_do_file(0),
+      always_resolve(false), bind_port(0), track_port(0), auth_svc_port(0), vault_svc_port(0), status_len(0), game_sdl_merge_ms(0), game_interest_radius(0), game_tick_rate(0), game_warm_ages(NULL), game_warm_count(0), game_host_threads(0), game_sdl_compress_level(0), game_async_compress(false), m_thread_manager(NULL), m_do_auth(0), m_do_file(0),
       m_do_game(0), m_do_gate(0), m_do_status(0), m_cfg_file(config_file), m_log(logger) {
   }
   void set_logger(Logger *logger) {
@@ -161,10 +168,14 @@ public:
   void register_options() {
     m_disp_config.register_config("bind_address",         &bind_addr_name,     "");
     m_disp_config.register_config("bind_port",            &bind_port,          DEFAULT_PORT_SERVER);
-    // note, if there is ever a separate vault and tracking server, add and
-    // use track_* here
+    // vault_address is the tracking server; it is also the auth and vault
+    // server unless the backend services are split up
     m_disp_config.register_config("vault_address",        &track_addr_name,    "");
     m_disp_config.register_config("vault_port",           &track_port,         DEFAULT_PORT_BACKEND);
+    m_disp_config.register_config("auth_service_address", &auth_svc_addr_name, "");
+    m_disp_config.register_config("auth_service_port",    &auth_svc_port,      0);
+    m_disp_config.register_config("vault_service_address", &vault_svc_addr_name, "");
+    m_disp_config.register_config("vault_service_port",   &vault_svc_port,     0);
     m_disp_config.register_config("log_dir",              &log_dir,            "log");
     m_disp_config.register_config("log_level",            &log_level,          "NET");
     m_disp_config.register_config("pid_file",             &pid_file,           "/var/run/moss.pid");
@@ -185,6 +196,14 @@ public:
     m_disp_config.register_config("game_key_file",        &game_key_file,      DEFAULT_GAME_KEY);
     m_disp_config.register_config("gatekeeper_key_file",  &gate_key_file,      DEFAULT_GATE_KEY);
     m_disp_config.register_config("status_message",       &status_str,         "Welcome to MOSS");
+    m_disp_config.register_config("game_sdl_merge_ms",    &game_sdl_merge_ms,  0);
+    m_disp_config.register_config("game_interest_radius", &game_interest_radius, 0);
+    m_disp_config.register_config("game_tick_rate",       &game_tick_rate,     0);
+    m_disp_config.register_config("game_warm_ages",       &game_warm_ages,     "");
+    m_disp_config.register_config("game_warm_count",      &game_warm_count,    1);
+    m_disp_config.register_config("game_host_threads",    &game_host_threads,  0);
+    m_disp_config.register_config("game_sdl_compress_level", &game_sdl_compress_level, 0);
+    m_disp_config.register_config("game_async_compress",  &game_async_compress, false);
   }
   bool read_config(bool complain) {
     try {
@@ -203,6 +222,10 @@ public:
     m_disp_config.unregister_config("bind_port");
     m_disp_config.unregister_config("vault_address");
     m_disp_config.unregister_config("vault_port");
+    m_disp_config.unregister_config("auth_service_address");
+    m_disp_config.unregister_config("auth_service_port");
+    m_disp_config.unregister_config("vault_service_address");
+    m_disp_config.unregister_config("vault_service_port");
     m_disp_config.unregister_config("pid_file");
   }
   virtual ~DispatcherProcessor();
@@ -273,6 +296,31 @@ public:
       }
       return false;
     }
+    if (auth_svc_port > 65535 || auth_svc_port < 0) {
+      log_err(m_log, "Invalid auth_service_port: %d\n", auth_svc_port);
+      return false;
+    }
+    if (vault_svc_port > 65535 || vault_svc_port < 0) {
+      log_err(m_log, "Invalid vault_service_port: %d\n", vault_svc_port);
+      return false;
+    }
+    return true;
+  }
+  // an unset address or port for a backend service means the same as
+  // vault_address/vault_port
+  bool resolve_service_addr(const char *name, int32_t port, const struct sockaddr_in &track_addr,
+      struct sockaddr_in *addr, Logger *log) {
+    *addr = track_addr;
+    if (port) {
+      addr->sin_port = (uint16_t) htons(port);
+    }
+    if (name && name[0] != '\0') {
+      const char *result = resolve_hostname(name, &addr->sin_addr.s_addr);
+      if (result) {
+        log_err(log, "Could not resolve \"%s\": %s\n", name, result);
+        return false;
+      }
+    }
     return true;
   }
   bool resolve_ext_addr(bool config_load, struct sockaddr_in *bind_addr, Logger *log) {
@@ -359,11 +407,19 @@ public:
     }
   }
 
-  char *bind_addr_name, *track_addr_name, *log_dir, *log_level, *pid_file, *server_types, *ext_addr_name, *child_name,
+  char *bind_addr_name, *track_addr_name, *auth_svc_addr_name, *vault_svc_addr_name, *log_dir, *log_level, *pid_file, *server_types, *ext_addr_name, *child_name,
       *auth_dir, *file_dir, *game_dir, *auth_log_level, *file_log_level, *game_log_level, *gate_log_level,
       *game_addr_name, *auth_key_file, *game_key_file, *gate_key_file, *status_str;
   bool always_resolve, allow_vaultmanager;
-  int32_t bind_port, track_port, status_len;
+  int32_t bind_port, track_port, auth_svc_port, vault_svc_port, status_len;
+  int32_t game_sdl_merge_ms;
+  int32_t game_interest_radius;
+  int32_t game_tick_rate;
+  char *game_warm_ages;
+  int32_t game_warm_count;
+  int32_t game_host_threads;
+  int32_t game_sdl_compress_level;
+  bool game_async_compress;
 
   ThreadManager *m_thread_manager;
   uint8_t m_do_auth, m_do_file, m_do_game, m_do_gate, m_do_status;
@@ -380,13 +436,15 @@ protected:
 
 class Dispatcher: public Server {
 public:
-  Dispatcher(int32_t listen_fd, struct sockaddr_in &ipaddr, struct sockaddr_in &track_address) :
-      Server(listen_fd, ipaddr), m_track_addr(track_address),
+  Dispatcher(int32_t listen_fd, struct sockaddr_in &ipaddr, struct sockaddr_in &track_address,
+      struct sockaddr_in &auth_service_address, struct sockaddr_in &vault_service_address) :
+      Server(listen_fd, ipaddr), m_track_addr(track_address), m_auth_svc_addr(auth_service_address), m_vault_svc_addr(
+          vault_service_address),
 #ifndef FORK_ENABLE
           m_auth_log(NULL), m_file_log(NULL),
 #endif
-          m_gate_log(NULL), m_auth_keydata(NULL), m_game_keydata(NULL), m_gate_keydata(NULL), m_track(NULL), m_retry(
-              false) {
+          m_gate_log(NULL), m_auth_keydata(NULL), m_game_keydata(NULL), m_gate_keydata(NULL), m_sdl(NULL), m_compressor(NULL), m_track(NULL),
+          m_retry(false) {
     int32_t err = pthread_attr_init(&m_thread_attr);
     if (err) {
       log_err(m_log, "pthread_attr_init() failed: %s\n", strerror(err));
@@ -440,9 +498,26 @@ public:
     m_track->enqueue(msg);
   }
   void* update_keydata(const char *fname, int32_t auth_game_gate);
+#ifndef FORK_GAME_TOO
+  // drop the GameHosts that are done, before the ThreadManager deletes them
+  void forget_done_hosts();
+  // same for warm game servers
+  void forget_done_warm();
+  // read the SDL again for the next game server (the warm game servers
+  // are started again too)
+  void reload_sdl() {
+    drop_warm_pool();
+    if (m_sdl) {
+      m_sdl->del_ref();
+      m_sdl = NULL;
+    }
+    fill_warm_pool();
+  }
+#endif
 
 protected:
   struct sockaddr_in m_track_addr;
+  struct sockaddr_in m_auth_svc_addr, m_vault_svc_addr; // for AuthServer only
 #ifndef FORK_ENABLE
   Logger *m_auth_log, *m_file_log;
 #endif
@@ -450,15 +525,56 @@ protected:
   void *m_auth_keydata, *m_game_keydata, *m_gate_keydata;
 
   pthread_attr_t m_thread_attr;
-  std::list<SDLDesc*> m_common_sdl;
+  // the SDL for game servers, read in when the first one starts
+  SDLRegistry *m_sdl;
+  // compresses initial age state, if game_async_compress is set
+  SDLCompressor *m_compressor;
 
   // state for talking to tracking server
   BackendConnection *m_track;
   bool m_retry;
   int32_t do_connect();
+  // the time and CPU time used at the last TRACK_STATUS
+  struct timeval m_status_at, m_status_cpu;
+  void cpu_used(struct timeval &used);
+  // tell the tracking server how busy we are; this doubles as a TRACK_PING
+  void send_status();
 
   // state for managing connections to game servers
   std::map<uint32_t, GameServer*> m_games;
+#ifndef FORK_GAME_TOO
+  // the GameHost threads, when game_host_threads is set
+  std::list<GameHost*> m_hosts;
+  // the least busy GameHost, starting another if there are fewer than
+  // count; NULL if none can be had
+  GameHost* pick_host(uint32_t count);
+
+  // read in an age's .age file; returns NULL if there isn't one or it
+  // can't be parsed (which is logged)
+  AgeDesc* read_age(const char *filename);
+  // a new game server, not started and without its ID or logger, or NULL;
+  // it takes age, or deletes it
+  GameServer* make_game_server(const char *filename, const uint8_t *uuid, AgeDesc *age);
+  // Game servers for the ages in game_warm_ages, started ahead of time so
+  // a player linking to one of those does not wait for the SDL, the .age
+  // file, or the connection to the backend; keyed by age filename. They
+  // are running and in the ThreadManager, but have no age instance until
+  // start_warm() binds one. (There are none when game_host_threads is set,
+  // as the GameHost's backend connection is already up.)
+  std::multimap<std::string, GameServer*> m_warm;
+  // start game servers until there are game_warm_count for each age
+  void fill_warm_pool();
+  // tell the warm game servers to shut down (the ThreadManager deletes
+  // them)
+  void drop_warm_pool();
+  bool is_warm(const GameServer *server) const;
+  // give the age instance to a warm game server for the age; false if
+  // there is none to use
+  bool start_warm(const char *filename, const uint8_t *uuid);
+#endif
+  // make the directory for a game server's log file, and return the file
+  // name, or an empty string if the directory cannot be made
+  std::string game_log_file(const char *filename, const char *name);
 };
 
 static const char *http_reply = "HTTP/1.0 200 OK\r\nContent-Type: text/html\r\n\r\n";
@@ -470,7 +586,7 @@ int32_t main(int32_t argc, char *argv[]) {
   long return_value = 0;
 
   /* config stuff */
-  struct sockaddr_in bind_addr, track_addr;
+  struct sockaddr_in bind_addr, track_addr, auth_svc_addr, vault_svc_addr;
   int32_t fd = -1;
 
   /* server stuff */
@@ -576,6 +692,10 @@ int32_t main(int32_t argc, char *argv[]) {
   } else {
     track_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
   }
+  if (!dp->resolve_service_addr(dp->auth_svc_addr_name, dp->auth_svc_port, track_addr, &auth_svc_addr, log)
+      || !dp->resolve_service_addr(dp->vault_svc_addr_name, dp->vault_svc_port, track_addr, &vault_svc_addr, log)) {
+    return_value = 1;
+  }
   if (!dp->resolve_ext_addr(true, &bind_addr, log)) {
     return_value = 1;
   }
@@ -723,7 +843,7 @@ int32_t main(int32_t argc, char *argv[]) {
       uint8_t *addrp = (uint8_t*) &bind_addr.sin_addr;
       get_random_data(addrp + 1, sizeof(bind_addr.sin_addr));
     }
-    server = new Dispatcher(fd, bind_addr, track_addr);
+    server = new Dispatcher(fd, bind_addr, track_addr, auth_svc_addr, vault_svc_addr);
     server->set_logger(log);
     server->set_signal_data(todo, SIGNAL_RESPONSES, dp);
   } catch (const std::bad_alloc&) {
@@ -799,9 +919,8 @@ int32_t main(int32_t argc, char *argv[]) {
   }
 
   return_value = (long) serv_main((void*) server);
-  // we must wait for all child threads to finish before deleting server,
-  // because doing so deletes m_common_sdl, which is shared with game servers
-  // and then they will try to access freed memory
+  // wait for all child threads to finish (and delete them) before deleting
+  // server; the game servers hold their own references to the SDL
   dp->m_thread_manager->finish_shutdown();
 
   delete server;
@@ -841,6 +960,10 @@ Server::reason_t DispatcherProcessor::signalled(int32_t *todo, Server *s) {
   }
   if (todo[THREAD_JOIN]) {
     todo[THREAD_JOIN] = 0;
+#ifndef FORK_GAME_TOO
+    server->forget_done_hosts();
+    server->forget_done_warm();
+#endif
     m_thread_manager->thread_join();
   }
 #ifdef FORK_ENABLE
@@ -1026,6 +1149,10 @@ Server::reason_t DispatcherProcessor::signalled(int32_t *todo, Server *s) {
       free(old_game_dir);
     }
     setup_status_str();
+#ifndef FORK_GAME_TOO
+    // pick up changed SDL files
+    server->reload_sdl();
+#endif
     todo[RELOAD] = 0;
   }
   return Server::NO_SHUTDOWN;
@@ -1106,7 +1233,8 @@ void Dispatcher::add_client_conn(int32_t fd, uint8_t type) {
     // any other common auth infrastructure goes here
     AuthServer *server = NULL;
     try {
-      server = new AuthServer(fd, dp->auth_dir, true, m_track_addr, dp->allow_vaultmanager);
+      server = new AuthServer(fd, dp->auth_dir, true, m_track_addr, dp->allow_vaultmanager, &m_auth_svc_addr,
+          &m_vault_svc_addr);
     } catch (const std::bad_alloc&) {
       log_err(m_log, "Cannot allocate memory for Auth server\n");
       log_err(m_log, "Closing connection!\n");
@@ -1345,6 +1473,9 @@ int32_t Dispatcher::init() {
     return -1;
   }
   m_conns.push_back(m_track);
+#ifndef FORK_GAME_TOO
+  fill_warm_pool();
+#endif
   return 0;
 }
 
@@ -1414,8 +1545,10 @@ void Dispatcher::conn_completed(Connection *conn) {
   conn->set_in_connect(false);
   if (conn == m_track) {
     m_retry = false;
-    conn->m_interval = BACKEND_KEEPALIVE_INTERVAL;
+    conn->m_interval = TRACK_STATUS_INTERVAL;
     gettimeofday(&conn->m_timeout, NULL);
+    m_status_at = conn->m_timeout;
+    cpu_used(m_status_cpu);
     conn->m_timeout.tv_sec += conn->m_interval;
 
     log_msgs(m_log, "Sending Hello to backend\n");
@@ -1476,14 +1609,26 @@ Server::reason_t Dispatcher::message_read(Connection *conn, NetworkMessage *msg)
           format_uuid(request->age_uuid(), uuid);
           log_msgs(m_log, "TRACK_START_GAME %s (%s)\n", request->filename()->c_str(), uuid);
         }
+
+        // resolve the address if necessary
+        if (dp->always_resolve) {
+          if (!dp->resolve_ext_addr(false, NULL, m_log) && m_log->would_log_at(Logger::LOG_WARN)) {
+            char addr[INET_ADDRSTRLEN];
+            if (inet_ntop(AF_INET, &dp->m_ext_addr, addr, INET_ADDRSTRLEN)) {
+              log_warn(m_log, "Using old external address %s\n", addr);
+            } else {
+              log_warn(m_log, "Using old external address 0x%08x\n", dp->m_ext_addr);
+            }
+          }
+        }
 #ifndef FORK_GAME_TOO
         // read in the common SDL if necessary
-        if (m_common_sdl.size() == 0) {
-          std::string directory(dp->game_dir);
-          directory = directory + PATH_SEPARATOR + "SDL" + PATH_SEPARATOR + "common";
-          if (SDLDesc::parse_directory(m_log, m_common_sdl, directory, true, true)) {
+        if (!m_sdl) {
+          m_sdl = new SDLRegistry(dp->game_dir, m_log);
+          if (m_sdl->load_common()) {
 #ifndef STANDALONE
-            m_common_sdl.clear();
+            m_sdl->del_ref();
+            m_sdl = NULL;
             // can't actually start up a game server
             log_err(m_log, "Cannot read common SDL\n");
             log_info(m_log, "Telling backend we cannot create new game servers "
@@ -1505,23 +1650,14 @@ Server::reason_t Dispatcher::message_read(Connection *conn, NetworkMessage *msg)
           }
         }
 
-        // read in the .age file
-        AgeDesc *newage = NULL;
-        {
-          std::string fname(dp->game_dir);
-          fname = fname + PATH_SEPARATOR + "age" + PATH_SEPARATOR + request->filename()->c_str() + ".age";
-          std::ifstream file(fname.c_str(), std::ios_base::in);
-          if (file.fail()) {
-            log_warn(m_log, "Request for unavailable age %s\n", request->filename()->c_str());
-          } else {
-            try {
-              newage = AgeDesc::parse_file(file);
-            } catch (const parse_error &e) {
-              log_err(m_log, "Parse error in %s.age, line %u: %s\n", request->filename()->c_str(), e.lineno(), e.what());
-
-            }
-          }
+        // a warm game server for the age is already running and connected
+        // to the backend, and only needs the age instance
+        if (start_warm(request->filename()->c_str(), request->age_uuid())) {
+          break;
         }
+
+        // read in the .age file
+        AgeDesc *newage = read_age(request->filename()->c_str());
         if (!newage) {
           TrackStartAge_ToBackendMessage *reject = new TrackStartAge_ToBackendMessage(id1(), id2(), request->age_uuid(),
               TrackStartAge_ToBackendMessage::NO_AGE);
@@ -1542,18 +1678,6 @@ Server::reason_t Dispatcher::message_read(Connection *conn, NetworkMessage *msg)
     }
 #endif /* !FORK_GAME_TOO */
 
-        // resolve the address if necessary
-        if (dp->always_resolve) {
-          if (!dp->resolve_ext_addr(false, NULL, m_log) && m_log->would_log_at(Logger::LOG_WARN)) {
-            char addr[INET_ADDRSTRLEN];
-            if (inet_ntop(AF_INET, &dp->m_ext_addr, addr, INET_ADDRSTRLEN)) {
-              log_warn(m_log, "Using old external address %s\n", addr);
-            } else {
-              log_warn(m_log, "Using old external address 0x%08x\n", dp->m_ext_addr);
-            }
-          }
-        }
-
         uint32_t new_id;
         do {
           get_random_data((uint8_t*) &new_id, 4);
@@ -1581,45 +1705,29 @@ Server::reason_t Dispatcher::message_read(Connection *conn, NetworkMessage *msg)
                sockets[1]);
 #else
         // set up new game server thread
-        GameServer *server = NULL;
-        try {
-          server = new GameServer(dp->game_dir, true, m_track_addr, request->age_uuid(), request->filename()->c_str(),
-              dp->m_ext_addr, dp->m_ext_port, newage, m_common_sdl);
-        } catch (const std::bad_alloc&) {
-          log_err(m_log, "Cannot allocate memory for Game server\n");
+        GameServer *server = make_game_server(request->filename()->c_str(), request->age_uuid(), newage);
+        if (!server) {
           TrackStartAge_ToBackendMessage *reject = new TrackStartAge_ToBackendMessage(id1(), id2(), request->age_uuid(),
               TrackStartAge_ToBackendMessage::NO_RESOURCE);
           conn->enqueue(reject);
-          delete newage;
           break;
         }
         server->set_id(new_id);
+        set_message_compression_level(dp->game_sdl_compress_level);
 #endif
 
-        size_t len = sizeof("game///.log") + UUID_STR_LEN;
-        len += dp->log_dir ? strlen(dp->log_dir) + 1 : 2;
-        len += request->filename()->send_len(false, false, false);
-        char temp_str[len];
-        snprintf(temp_str, len, "%s%sgame%s%s", dp->log_dir ? dp->log_dir : ".", PATH_SEPARATOR,
-        PATH_SEPARATOR, request->filename()->c_str());
-
-        log_debug(m_log, "Game %s log dir %s\n", request->filename()->c_str(), temp_str);
-
-        if (recursive_mkdir(temp_str, S_IRWXU | S_IRWXG)) {
-          log_warn(m_log, "Cannot create game server log directory %s: %s\n", temp_str, strerror(errno));
-        } else {
-          len = strlen(temp_str);
-          temp_str[len++] = PATH_SEPARATOR[0];
-          format_uuid(request->age_uuid(), temp_str + len);
-          strcat(temp_str, ".log");
+        char log_name[UUID_STR_LEN];
+        format_uuid(request->age_uuid(), log_name);
+        std::string log_file = game_log_file(request->filename()->c_str(), log_name);
 #ifndef FORK_GAME_TOO
+        if (!log_file.empty()) {
           try {
-            Logger *game_log = new Logger("game", temp_str, Logger::str_to_level(dp->game_log_level));
+            Logger *game_log = new Logger("game", log_file.c_str(), Logger::str_to_level(dp->game_log_level));
             server->set_logger(game_log);
           } catch (const std::bad_alloc&) {
           }
-#endif
         }
+#endif
 
 #ifdef FORK_GAME_TOO
     char fdnum[100], idstr[100];
@@ -1657,6 +1765,25 @@ Server::reason_t Dispatcher::message_read(Connection *conn, NetworkMessage *msg)
       }
     }
 #else
+        GameHost *host = NULL;
+        if (dp->game_host_threads > 0) {
+          // a host that has just started shutting down refuses the game
+          // server, and is passed over when picking again
+          for (int32_t tries = 0; tries <= dp->game_host_threads; tries++) {
+            host = pick_host((uint32_t) dp->game_host_threads);
+            if (!host || host->add_server(server)) {
+              break;
+            }
+            host = NULL;
+          }
+        }
+        if (host) {
+          // the host's thread starts it up
+          dp->m_thread_manager->new_hosted(server, host, new_id);
+          dp->m_thread_manager->signal_thread(host, SIGUSR2);
+          break;
+        }
+
         // now actually make and start the thread
         pthread_t tid;
 
@@ -1734,8 +1861,7 @@ Server::reason_t Dispatcher::message_read(Connection *conn, NetworkMessage *msg)
 
 Server::reason_t Dispatcher::conn_timeout(Connection *conn, reason_t why) {
   if (conn == m_track) {
-    TrackPing_BackendMessage *msg = new TrackPing_BackendMessage(id1(), id2());
-    conn->enqueue(msg);
+    send_status();
     conn->m_timeout.tv_sec += conn->m_interval;
     return NO_SHUTDOWN;
   } else {
@@ -1786,6 +1912,328 @@ Server::reason_t Dispatcher::conn_shutdown(Connection *conn, reason_t why) {
   return NO_SHUTDOWN;
 }
 
+void Dispatcher::cpu_used(struct timeval &used) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage)) {
+    used.tv_sec = 0;
+    used.tv_usec = 0;
+    return;
+  }
+  used = usage.ru_utime;
+  timeval_add(used, usage.ru_stime);
+}
+
+void Dispatcher::send_status() {
+  uint32_t games = 0, players = 0, clients = 0, lag = 0;
+  DispatcherProcessor *dp = (DispatcherProcessor*) m_signal_processor;
+  std::list<Server*> servers;
+  dp->m_thread_manager->get_servers(servers);
+  std::list<Server*>::iterator iter;
+  for (iter = servers.begin(); iter != servers.end(); iter++) {
+    Server *server = *iter;
+    if (server->shutdown_done()) {
+      continue;
+    }
+    // a GameHost is TYPE_GAME too, but its game servers are counted
+    // themselves
+    GameServer *game = dynamic_cast<GameServer*>(server);
+#ifndef FORK_GAME_TOO
+    if (game && is_warm(game)) {
+      // it has no age yet
+      continue;
+    }
+#endif
+    if (game) {
+      games++;
+      players += game->player_count();
+      lag = MAX(lag, game->loop_lag());
+    } else if (server->type() == TYPE_AUTH || server->type() == TYPE_FILE) {
+      clients++;
+    }
+  }
+
+  struct timeval now, cpu, wall, used;
+  gettimeofday(&now, NULL);
+  cpu_used(cpu);
+  timeval_difference(now, m_status_at, wall);
+  timeval_difference(cpu, m_status_cpu, used);
+  uint64_t wall_ms = (wall.tv_sec * 1000) + (wall.tv_usec / 1000);
+  uint64_t used_ms = (used.tv_sec * 1000) + (used.tv_usec / 1000);
+  uint32_t cpu_percent = wall_ms > 0 ? (uint32_t) ((used_ms * 100) / wall_ms) : 0;
+  m_status_at = now;
+  m_status_cpu = cpu;
+
+  log_debug(m_log, "Sending status: games: %u players: %u clients: %u CPU: %u%% lag: %ums\n",
+      games, players, clients, cpu_percent, lag);
+  TrackStatus_BackendMessage *msg = new TrackStatus_BackendMessage(id1(), id2(), games, players, clients, cpu_percent,
+      lag);
+  m_track->enqueue(msg);
+}
+
+#ifndef FORK_GAME_TOO
+GameHost* Dispatcher::pick_host(uint32_t count) {
+  DispatcherProcessor *dp = (DispatcherProcessor*) m_signal_processor;
+  GameHost *best = NULL;
+  uint32_t best_load = 0;
+  uint32_t running = 0;
+  std::list<GameHost*>::iterator iter;
+  for (iter = m_hosts.begin(); iter != m_hosts.end(); iter++) {
+    GameHost *host = *iter;
+    if (!host->accepting()) {
+      continue;
+    }
+    running++;
+    uint32_t load = host->load();
+    if (!best || load < best_load) {
+      best = host;
+      best_load = load;
+    }
+  }
+  if (best && (running >= count || best_load == 0)) {
+    return best;
+  }
+
+  // start up another one
+  GameHost *host = NULL;
+  try {
+    host = new GameHost(dp->game_dir, m_track_addr, dp->m_ext_addr, dp->m_ext_port);
+  } catch (const std::bad_alloc&) {
+    log_err(m_log, "Cannot allocate memory for Game host\n");
+    return best;
+  }
+  // the ID only goes in its TRACK_PINGs; it is not given to the
+  // ThreadManager because clients must not be able to join it
+  uint32_t host_id;
+  do {
+    get_random_data((uint8_t*) &host_id, 4);
+  } while (!dp->m_thread_manager->is_id_available(host_id));
+  host->set_id(host_id);
+
+  size_t len = sizeof("game/host_.log") + 8;
+  len += dp->log_dir ? strlen(dp->log_dir) + 1 : 2;
+  char temp_str[len];
+  snprintf(temp_str, len, "%s%sgame", dp->log_dir ? dp->log_dir : ".", PATH_SEPARATOR);
+  if (recursive_mkdir(temp_str, S_IRWXU | S_IRWXG)) {
+    log_warn(m_log, "Cannot create game server log directory %s: %s\n", temp_str, strerror(errno));
+  } else {
+    size_t used = strlen(temp_str);
+    snprintf(temp_str + used, len - used, "%shost_%08x.log", PATH_SEPARATOR, host_id);
+    try {
+      Logger *host_log = new Logger("game", temp_str, Logger::str_to_level(dp->game_log_level));
+      host->set_logger(host_log);
+    } catch (const std::bad_alloc&) {
+    }
+  }
+
+  pthread_t tid;
+  int32_t ret = pthread_create(&tid, &m_thread_attr, serv_main, host);
+  if (ret) {
+    log_err(m_log, "Game host pthread_create failed: %s\n", strerror(ret));
+    delete host;
+    return best;
+  }
+  dp->m_thread_manager->new_thread(tid, host);
+  m_hosts.push_back(host);
+  log_info(m_log, "Started game host %08x (%u running)\n", host_id, running + 1);
+  return host;
+}
+
+AgeDesc* Dispatcher::read_age(const char *filename) {
+  DispatcherProcessor *dp = (DispatcherProcessor*) m_signal_processor;
+  AgeDesc *age = NULL;
+  std::string fname(dp->game_dir);
+  fname = fname + PATH_SEPARATOR + "age" + PATH_SEPARATOR + filename + ".age";
+  std::ifstream file(fname.c_str(), std::ios_base::in);
+  if (file.fail()) {
+    log_warn(m_log, "Request for unavailable age %s\n", filename);
+  } else {
+    try {
+      age = AgeDesc::parse_file(file);
+    } catch (const parse_error &e) {
+      log_err(m_log, "Parse error in %s.age, line %u: %s\n", filename, e.lineno(), e.what());
+    }
+  }
+  return age;
+}
+
+GameServer* Dispatcher::make_game_server(const char *filename, const uint8_t *uuid, AgeDesc *age) {
+  DispatcherProcessor *dp = (DispatcherProcessor*) m_signal_processor;
+  GameServer *server = NULL;
+  try {
+    server = new GameServer(dp->game_dir, true, m_track_addr, uuid, filename, dp->m_ext_addr, dp->m_ext_port, age, m_sdl,
+        m_sdl->age_sdl(filename));
+  } catch (const std::bad_alloc&) {
+    log_err(m_log, "Cannot allocate memory for Game server\n");
+    delete age;
+    return NULL;
+  }
+  server->set_sdl_merge_ms(dp->game_sdl_merge_ms > 0 ? dp->game_sdl_merge_ms : 0);
+  server->set_interest_radius(dp->game_interest_radius > 0 ? dp->game_interest_radius : 0);
+  int32_t tick_rate = age->tick_rate() >= 0 ? age->tick_rate() : dp->game_tick_rate;
+  server->set_tick_rate(tick_rate > 0 ? tick_rate : 0);
+  if (dp->game_async_compress) {
+    if (!m_compressor) {
+      m_compressor = new SDLCompressor();
+      int32_t err = m_compressor->start();
+      if (err) {
+        // it still works, compressing in the game server's thread
+        log_warn(m_log, "Cannot start SDL compression thread: %s\n", strerror(err));
+      }
+    }
+    server->set_compressor(m_compressor);
+  }
+  return server;
+}
+
+void Dispatcher::fill_warm_pool() {
+  DispatcherProcessor *dp = (DispatcherProcessor*) m_signal_processor;
+  if (!dp->m_do_game || dp->game_host_threads > 0 || !dp->game_warm_ages || !dp->game_warm_ages[0]
+      || dp->game_warm_count <= 0) {
+    return;
+  }
+  if (!m_sdl) {
+    m_sdl = new SDLRegistry(dp->game_dir, m_log);
+    if (m_sdl->load_common()) {
+      // the next request to start a game server deals with this
+      log_warn(m_log, "Cannot read common SDL for warm game servers\n");
+      m_sdl->del_ref();
+      m_sdl = NULL;
+      return;
+    }
+  }
+  uint32_t count;
+  char **ages = ConfigParser::split_string(dp->game_warm_ages, &count);
+  if (!ages) {
+    log_err(m_log, "Can't allocate memory!\n");
+    return;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t have = m_warm.count(ages[i]);
+    while (have < (uint32_t) dp->game_warm_count) {
+      AgeDesc *age = read_age(ages[i]);
+      if (!age) {
+        break;
+      }
+      GameServer *server = make_game_server(ages[i], NULL, age);
+      if (!server) {
+        break;
+      }
+      uint32_t new_id;
+      do {
+        get_random_data((uint8_t*) &new_id, 4);
+      } while (!dp->m_thread_manager->is_id_available(new_id));
+      server->set_id(new_id);
+      server->set_warm();
+      // until it has an age instance, it logs to the age's warm.log
+      std::string log_file = game_log_file(ages[i], "warm");
+      if (!log_file.empty()) {
+        try {
+          Logger *game_log = new Logger("game", log_file.c_str(), Logger::str_to_level(dp->game_log_level));
+          server->set_logger(game_log);
+        } catch (const std::bad_alloc&) {
+        }
+      }
+      pthread_t tid;
+      int32_t ret = pthread_create(&tid, &m_thread_attr, serv_main, server);
+      if (ret) {
+        log_err(m_log, "Warm game pthread_create failed: %s\n", strerror(ret));
+        delete server;
+        break;
+      }
+      dp->m_thread_manager->new_thread(tid, server, new_id);
+      m_warm.insert(std::pair<std::string, GameServer*>(ages[i], server));
+      have++;
+      log_debug(m_log, "Warm game server %08x started for %s (%u)\n", new_id, ages[i], have);
+    }
+    free(ages[i]);
+  }
+  free(ages);
+}
+
+void Dispatcher::drop_warm_pool() {
+  DispatcherProcessor *dp = (DispatcherProcessor*) m_signal_processor;
+  std::multimap<std::string, GameServer*>::iterator iter;
+  for (iter = m_warm.begin(); iter != m_warm.end(); iter++) {
+    iter->second->request_shutdown();
+    dp->m_thread_manager->signal_thread(iter->second, SIGUSR2);
+  }
+  m_warm.clear();
+}
+
+bool Dispatcher::is_warm(const GameServer *server) const {
+  std::multimap<std::string, GameServer*>::const_iterator iter;
+  for (iter = m_warm.begin(); iter != m_warm.end(); iter++) {
+    if (iter->second == server) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Dispatcher::start_warm(const char *filename, const uint8_t *uuid) {
+  DispatcherProcessor *dp = (DispatcherProcessor*) m_signal_processor;
+  std::multimap<std::string, GameServer*>::iterator found;
+  while ((found = m_warm.find(filename)) != m_warm.end()) {
+    GameServer *server = found->second;
+    m_warm.erase(found);
+    if (server->ipaddr() != dp->m_ext_addr || server->ipport() != dp->m_ext_port) {
+      // the backend knows it by the old address
+      log_debug(m_log, "Dropping warm game server for %s with an old address\n", filename);
+      server->request_shutdown();
+      dp->m_thread_manager->signal_thread(server, SIGUSR2);
+      continue;
+    }
+    char log_name[UUID_STR_LEN];
+    format_uuid(uuid, log_name);
+    if (server->bind_instance(uuid, game_log_file(filename, log_name))) {
+      log_msgs(m_log, "Using a warm game server for %s\n", filename);
+      set_message_compression_level(dp->game_sdl_compress_level);
+      dp->m_thread_manager->signal_thread(server, SIGUSR2);
+      // replace it
+      fill_warm_pool();
+      return true;
+    }
+    // it is shutting down, and the ThreadManager deletes it
+  }
+  return false;
+}
+
+void Dispatcher::forget_done_hosts() {
+  std::list<GameHost*>::iterator iter = m_hosts.begin();
+  while (iter != m_hosts.end()) {
+    if ((*iter)->shutdown_done()) {
+      iter = m_hosts.erase(iter);
+    } else {
+      iter++;
+    }
+  }
+}
+
+void Dispatcher::forget_done_warm() {
+  std::multimap<std::string, GameServer*>::iterator iter = m_warm.begin();
+  while (iter != m_warm.end()) {
+    if (iter->second->shutdown_done()) {
+      m_warm.erase(iter++);
+    } else {
+      iter++;
+    }
+  }
+}
+#endif /* !FORK_GAME_TOO */
+
+std::string Dispatcher::game_log_file(const char *filename, const char *name) {
+  DispatcherProcessor *dp = (DispatcherProcessor*) m_signal_processor;
+  std::string dir = std::string(dp->log_dir ? dp->log_dir : ".") + PATH_SEPARATOR + "game" + PATH_SEPARATOR + filename;
+
+  log_debug(m_log, "Game %s log dir %s\n", filename, dir.c_str());
+
+  if (recursive_mkdir(dir.c_str(), S_IRWXU | S_IRWXG)) {
+    log_warn(m_log, "Cannot create game server log directory %s: %s\n", dir.c_str(), strerror(errno));
+    return std::string();
+  }
+  return dir + PATH_SEPARATOR + name + ".log";
+}
+
 Dispatcher::~Dispatcher() {
 #ifndef FORK_ENABLE
   if (m_file_log) {
@@ -1829,9 +2277,12 @@ Dispatcher::~Dispatcher() {
 #endif
   }
 
-  for (std::list<SDLDesc*>::iterator iter = m_common_sdl.begin(); iter != m_common_sdl.end(); iter++) {
-    SDLDesc *sdl = *iter;
-    delete sdl;
+  if (m_sdl) {
+    // game servers still running have their own references
+    m_sdl->del_ref();
+  }
+  if (m_compressor) {
+    m_compressor->del_ref();
   }
   pthread_attr_destroy(&m_thread_attr);
 }
@@ -1843,6 +2294,12 @@ DispatcherProcessor::~DispatcherProcessor() {
   if (track_addr_name) {
     free(track_addr_name);
   }
+  if (auth_svc_addr_name) {
+    free(auth_svc_addr_name);
+  }
+  if (vault_svc_addr_name) {
+    free(vault_svc_addr_name);
+  }
   if (log_dir) {
     free(log_dir);
   }
@@ -1897,6 +2354,9 @@ DispatcherProcessor::~DispatcherProcessor() {
   if (status_str) {
     free(status_str);
   }
+  if (game_warm_ages) {
+    free(game_warm_ages);
+  }
 }
 
 bool DispatcherProcessor::parse_server_types() {
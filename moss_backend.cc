@@ -44,7 +44,11 @@
 #include <exception>
 #include <stdexcept>
 #include <list>
+#include <map>
+#include <set>
 #include <deque>
+#include <vector>
+#include <string>
 
 #ifdef USE_POSTGRES
 #ifdef USE_PQXX
@@ -69,12 +73,16 @@
 #include "util.h"
 #include "UruString.h"
 #include "Buffer.h"
+#include "VaultNode.h"
 
 #include "Logger.h"
 #include "ConfigParser.h"
 #include "NetworkMessage.h"
 #include "BackendMessage.h"
 #include "MessageQueue.h"
+#include "backend_stats.h"
+#include "backend_capture.h"
+#include "vault_store.h"
 
 #include "moss_serv.h"
 #include "moss_backend.h"
@@ -143,7 +151,8 @@ public:
 
   BackendProcessor(Logger *logger, const char *config_file) :
       bind_addr_name(NULL), log_dir(NULL), log_level(NULL), pid_file(NULL), db_addr(NULL), db_user(NULL), db_passwd(NULL),
-      db_name(NULL), db_params(NULL), bind_port(0), db_port(0), egg_mask(0), m_log(logger), m_cfg_file(config_file), m_egg_disable(NULL) {
+      db_name(NULL), db_params(NULL), bind_port(0), db_port(0), egg_mask(0), vault_prefetch(false), stats_interval(0), services(0), capture_file(NULL), vault_storage(NULL), vault_storage_dir(NULL), m_log(logger), m_cfg_file(
+          config_file), m_egg_disable(NULL), m_services(NULL), m_peers(NULL) {
   }
   void set_logger(Logger *logger) {
     m_log = logger;
@@ -161,6 +170,13 @@ public:
     m_back_config.register_config("db_name", &db_name, "moss");
     m_back_config.register_config("db_params", &db_params, "");
     m_back_config.register_config("egg_disable", &m_egg_disable, "");
+    m_back_config.register_config("vault_prefetch", &vault_prefetch, false);
+    m_back_config.register_config("stats_interval", &stats_interval, 3600);
+    m_back_config.register_config("services", &m_services, "auth,vault,track");
+    m_back_config.register_config("peers", &m_peers, "");
+    m_back_config.register_config("capture_file", &capture_file, "");
+    m_back_config.register_config("vault_storage", &vault_storage, "postgres");
+    m_back_config.register_config("vault_storage_dir", &vault_storage_dir, "vault");
   }
   bool read_config(bool complain) {
     try {
@@ -205,7 +221,14 @@ public:
     m_back_config.unregister_config("db_password");
     m_back_config.unregister_config("db_name");
     m_back_config.unregister_config("db_params");
-  }
+    m_back_config.unregister_config("services");
+    m_back_config.unregister_config("peers");
+    m_back_config.unregister_config("capture_file");
+    m_back_config.unregister_config("vault_storage");
+    m_back_config.unregister_config("vault_storage_dir");
+  }
+  bool parse_services();
+  bool parse_peers();
   virtual ~BackendProcessor() {
     if (bind_addr_name) {
       free(bind_addr_name);
@@ -237,18 +260,125 @@ public:
     if (m_egg_disable) {
       free(m_egg_disable);
     }
+    if (m_services) {
+      free(m_services);
+    }
+    if (m_peers) {
+      free(m_peers);
+    }
+    if (capture_file) {
+      free(capture_file);
+    }
+    if (vault_storage) {
+      free(vault_storage);
+    }
+    if (vault_storage_dir) {
+      free(vault_storage_dir);
+    }
   }
 
   char *bind_addr_name, *log_dir, *log_level, *pid_file, *db_addr, *db_user, *db_passwd, *db_name, *db_params;
   int32_t bind_port, db_port;
   uint32_t egg_mask;
+  bool vault_prefetch;
+  int32_t stats_interval;
+  uint32_t services;
+  std::vector<struct sockaddr_in> peers;
+  char *capture_file;
+  char *vault_storage;
+  char *vault_storage_dir;
 protected:
   Logger *m_log;
   const char *m_cfg_file;
   char *m_egg_disable;
+  char *m_services, *m_peers;
   ConfigParser m_back_config;
 };
 
+bool BackendProcessor::parse_services() {
+  uint32_t count;
+  bool return_value = true;
+
+  if (!m_services) {
+    log_err(m_log, "At least one service must be specified\n");
+    return false;
+  }
+  char **s_types = ConfigParser::split_string(m_services, &count);
+  if (!s_types) {
+    log_err(m_log, "Can't allocate memory!\n");
+    return false;
+  }
+
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    if (!strcasecmp(s_types[i], "auth")) {
+      mask |= CLASS_AUTH;
+    } else if (!strcasecmp(s_types[i], "vault")) {
+      mask |= CLASS_VAULT;
+    } else if (!strcasecmp(s_types[i], "track")) {
+      // markers are kept with the game servers
+      mask |= CLASS_TRACK | CLASS_MARKER;
+    } else {
+      log_err(m_log, "Invalid service: %s\n", s_types[i]);
+      return_value = false;
+    }
+    free(s_types[i]);
+  }
+  free(s_types);
+  if (!mask) {
+    log_err(m_log, "At least one service must be specified\n");
+    return_value = false;
+  }
+  if (return_value) {
+    services = mask;
+  }
+  return return_value;
+}
+
+bool BackendProcessor::parse_peers() {
+  uint32_t count;
+  bool return_value = true;
+
+  peers.clear();
+  if (!m_peers || m_peers[0] == '\0') {
+    return true;
+  }
+  char **p_list = ConfigParser::split_string(m_peers, &count);
+  if (!p_list) {
+    log_err(m_log, "Can't allocate memory!\n");
+    return false;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = PF_INET;
+
+    int32_t port = DEFAULT_PORT_BACKEND;
+    char *colon = strrchr(p_list[i], ':');
+    if (colon) {
+      *colon = '\0';
+      if (sscanf(colon + 1, "%d", &port) != 1 || port < 1 || port > 65535) {
+        log_err(m_log, "Invalid port for peer %s: %s\n", p_list[i], colon + 1);
+        return_value = false;
+        free(p_list[i]);
+        continue;
+      }
+    }
+    addr.sin_port = (uint16_t) htons(port);
+    const char *result = resolve_hostname(p_list[i], &addr.sin_addr.s_addr);
+    if (result) {
+      log_err(m_log, "Could not resolve peer \"%s\": %s\n", p_list[i], result);
+      return_value = false;
+    } else {
+      peers.push_back(addr);
+    }
+    free(p_list[i]);
+  }
+  free(p_list);
+  return return_value;
+}
+
 int32_t main(int32_t argc, char *argv[]) {
   int32_t ret, fd = -1;
   long return_value = 0;
@@ -329,6 +459,9 @@ int32_t main(int32_t argc, char *argv[]) {
     log_err(log, "A valid database name must be provided\n");
     return_value = 1;
   }
+  if (!bp->parse_services() || !bp->parse_peers()) {
+    return_value = 1;
+  }
   if (return_value == 1) {
     goto early_shutdown;
   }
@@ -441,7 +574,8 @@ int32_t main(int32_t argc, char *argv[]) {
 
   try {
     server = new BackendServer(fd, bind_addr, bp->db_addr, bp->db_port, bp->db_user, bp->db_passwd, bp->db_name, bp->db_params,
-        bp->egg_mask);
+        bp->egg_mask, bp->vault_prefetch, bp->stats_interval, bp->services, bp->peers, bp->capture_file,
+        bp->vault_storage, bp->vault_storage_dir);
     server->set_logger(log);
     server->set_signal_data(todo, SIGNAL_RESPONSES, bp);
   } catch (const std::bad_alloc&) {
@@ -22,8 +22,12 @@
  * BackendServer is the class for a backend server. There are three kinds
  * of backend server: auth, vault, and tracking.
  *
- * At the moment all three are handled by one server, but they could be
- * split up.
+ * By default all three are handled by one server. With the "services" and
+ * "peers" options, each can instead run in its own process (with its own
+ * DB connection), and frontends connect to each one separately. The
+ * processes then keep each other informed about connection entities (who
+ * is logged in as what, which game server is where) with ADMIN_PEER_*
+ * messages; see the "peer services" section below.
  */
 
 //#include <sys/time.h>
@@ -31,11 +35,16 @@
 //#include <stdexcept>
 //#include <map>
 //#include <vector>
+//#include <string>
 //
+//#include "constants.h"
 //#include "backend_typecodes.h"
 //#include "UruString.h"
 //
 //#include "BackendMessage.h"
+//#include "backend_stats.h"
+//#include "backend_capture.h"
+//#include "vault_store.h"
 //
 //#include "moss_serv.h"
 #ifndef _MOSS_BACKEND_H_
@@ -48,15 +57,23 @@ class BackendObj;
 class BackendServer: public Server {
 public:
   BackendServer(int32_t listen_fd, struct sockaddr_in &ipaddr, const char *db_address, const int32_t db_port, const char *db_user,
-      const char *db_password, const char *db_name, const char *db_params, const uint32_t &egg_mask) :
-      Server(listen_fd, ipaddr), my(NULL), m_egg_mask(egg_mask), m_db_addr(db_address), m_db_port(db_port), m_db_params(
-          db_params), m_db_user(db_user), m_db_passwd(db_password), m_db_name(db_name), m_next_dispatcher(0), m_next_file(
-          0), m_next_auth(0), m_timers(NULL), m_next_gameid(100) {
+      const char *db_password, const char *db_name, const char *db_params, const uint32_t &egg_mask,
+      const bool &vault_prefetch, const int32_t &stats_interval, uint32_t services,
+      const std::vector<struct sockaddr_in> &peers, const char *capture_file, const char *vault_storage,
+      const char *vault_storage_dir) :
+      Server(listen_fd, ipaddr), my(NULL), m_egg_mask(egg_mask), m_vault_prefetch(vault_prefetch), m_stats_interval(
+          stats_interval), m_services(services), m_storage(vault_storage), m_storage_dir(vault_storage_dir), m_store(
+          NULL), m_db_store(NULL), m_db_addr(db_address), m_db_port(db_port), m_db_params(db_params), m_db_user(db_user), m_db_passwd(
+          db_password), m_db_name(db_name), m_next_dispatcher(0), m_next_file(0), m_next_auth(0), m_held_timers(NULL), m_timers(NULL), m_next_gameid(
+          100), m_capture_fname(capture_file), m_next_stream(1) {
+    for (std::vector<struct sockaddr_in>::const_iterator iter = peers.begin(); iter != peers.end(); iter++) {
+      m_peers.push_back(new PeerLink(*iter));
+    }
   }
   virtual ~BackendServer();
 
   int32_t type() const {
-    return CLASS_AUTH | CLASS_VAULT | CLASS_TRACK | CLASS_ADMIN;
+    return m_services | CLASS_ADMIN;
   }
   const char* type_name() const {
     return "Backend";
@@ -68,12 +85,87 @@ public:
   reason_t message_read(Connection *conn, NetworkMessage *msg);
 
   void add_client_conn(int32_t fd, uint8_t first);
+  void conn_completed(Connection *conn);
   reason_t conn_timeout(Connection *conn, reason_t why);
   reason_t conn_shutdown(Connection *conn, reason_t why);
 
 protected:
   BackendObj *my;
   const uint32_t &m_egg_mask;
+  const bool &m_vault_prefetch;
+  const int32_t &m_stats_interval; // seconds between logging m_stats
+
+  // where the time goes (ADMIN_STATS)
+  BackendStats m_stats;
+  // perform a DB transactor, timing it
+  template<class T> void db_perform(const T &transactor);
+
+  // the message classes handled here; CLASS_MARKER goes with CLASS_TRACK
+  const uint32_t m_services;
+  bool serves(uint32_t msg_class) const {
+    return (m_services & msg_class) != 0;
+  }
+
+  /*
+   * vault storage
+   *
+   * Everything that reads or changes the vault goes through m_store, which
+   * is m_db_store unless vault_storage is "memory". Calls to m_db_store can
+   * throw pqxx exceptions like any other DB request. Accounts, scores and
+   * marker games are always in the DB.
+   */
+  const char *m_storage;
+  const char *m_storage_dir;
+  VaultStore *m_store;
+
+  class PostgresVaultStore: public VaultStore {
+  public:
+    PostgresVaultStore(BackendServer *server) :
+        m_server(server) {
+    }
+
+    const char* name() const {
+      return "PostgreSQL";
+    }
+
+    void fetch_node(uint32_t nodeid, status_code_t &result, VaultNode &node);
+    void fetch_nodes(const std::vector<uint32_t> &nodeids, status_code_t &result, std::map<uint32_t, VaultNode*> &nodes);
+    void fetch_refs(uint32_t nodeid, status_code_t &result, std::vector<VaultFetchRefs_VaultRef> &refs);
+    void find_playerinfo(uint32_t player, status_code_t &result, uint32_t &nodeid);
+    void find_nodes(const VaultNode *templ, status_code_t &result, std::vector<uint32_t> &found);
+    void save_node(uint32_t nodeid, const VaultNode *node, status_code_t &result);
+    void create_node(const VaultNode *node, const uint8_t *acctid, kinum_t creator, uint32_t &nodeid);
+    void add_ref(uint32_t parent, uint32_t child, uint32_t owner, status_code_t &result);
+    void remove_ref(uint32_t parent, uint32_t child, int32_t &removed);
+    void dump(std::map<uint32_t, VaultNode*> &nodes, std::vector<VaultFetchRefs_VaultRef> &refs);
+
+    void acct_players(const uint8_t *acctid, std::list<AuthAcctLogin_PlayerQuery_Player> &players);
+    void validate_ki(const uint8_t *acctid, kinum_t kinum, status_code_t &result, UruString &name);
+    void player_connected(kinum_t kinum, status_code_t &result);
+    void player_offline(kinum_t kinum, bool &was_online, uint32_t &info_node, status_code_t &result);
+    void create_player(const uint8_t *acctid, const char *name, const char *gender,
+        AuthAcctLogin_PlayerQuery_Player &player, uint32_t &neighbors_list, uint32_t &info_node);
+    void delete_player(kinum_t kinum, status_code_t &result, std::multimap<kinum_t, uint32_t> &tell_who,
+        uint32_t &info_node);
+    void create_age(const char *filename, const char *instance, const char *user_defined, const char *display,
+        const uint8_t *createuuid, const uint8_t *parentuuid, uint32_t &age_node, uint32_t &age_info_node,
+        status_code_t &result);
+    void age_list(UruString &filename, status_code_t &result, std::vector<VaultAgeList_AgeInfo> &ages);
+    void set_age_public(uint32_t age_info_node, bool to_public, status_code_t &result);
+    void age_by_uuid(const uint8_t *uuid, uint32_t &age_node, uint32_t &age_info_node, UruString &filename,
+        status_code_t &result);
+    void delete_age(uint32_t age_info_node, status_code_t &result);
+    void age_sdl(uint32_t age_info_node, UruString &filename, uint8_t **outbuf, uint32_t &buflen,
+        status_code_t &result);
+    void global_sdl(UruString &filename, uint8_t **outbuf, uint32_t &buflen, status_code_t &result);
+    void age_uuid_for(uint32_t sdl_node, uint8_t *uuid, status_code_t &result);
+    void players_referring_to(uint32_t nodeid, status_code_t &result, std::vector<kinum_t> &players);
+    void age_referring_to(uint32_t nodeid, uint8_t *uuid, status_code_t &result);
+
+  protected:
+    BackendServer *m_server;
+  };
+  PostgresVaultStore *m_db_store;
 
   // "arguments"
   const char *m_db_addr;
@@ -118,8 +210,8 @@ protected:
   // connection) so the pointer for that is stored in this object
   class ConnectionEntity {
   public:
-    ConnectionEntity(Connection *c, uint32_t type) :
-        m_conn(c), m_type(type), m_kinum(0), m_id(0), m_ipaddr(0), m_shutdown(false), m_players(0) {
+    ConnectionEntity(Connection *c, uint32_t type, bool replica = false) :
+        m_conn(c), m_type(type), m_kinum(0), m_id(0), m_ipaddr(0), m_shutdown(false), m_players(0), m_replica(replica) {
 
       memset(m_uuid, 0, UUID_RAW_LEN);
     }
@@ -128,6 +220,16 @@ protected:
     Connection* conn() const {
       return m_conn;
     }
+    // a replica is an entity another backend service told us about; its
+    // Connection is the link to that service, which relays what is queued
+    bool is_replica() const {
+      return m_replica;
+    }
+    // the frontend has now connected to us directly
+    void adopt(Connection *c) {
+      m_conn = c;
+      m_replica = false;
+    }
     // type of server
     uint32_t type() const {
       return m_type;
@@ -192,6 +294,9 @@ protected:
       if (m_players > 0)
         m_players--;
     }
+    void set_player_count(uint32_t count) {
+      m_players = count;
+    }
 
   protected:
     Connection *m_conn;
@@ -203,6 +308,7 @@ protected:
     uint32_t m_ipaddr; // host order
     bool m_shutdown;
     uint32_t m_players;
+    bool m_replica;
   private:
     ConnectionEntity() {
     }
@@ -215,7 +321,118 @@ protected:
   // XXX this should be a hash_map but that's nonstandard; unordered_map is
   // up-and-coming but let's just use map for now
   std::map<HashKey, ConnectionEntity*> m_hash_table;
-  // more to come -- vault refs tree cache
+
+  /*
+   * peer services
+   *
+   * When the services are split up, each backend connects to every other
+   * one listed in "peers". Whenever a service changes something it owns
+   * about a connection entity (auth: account and player; tracking: game
+   * servers and where players are) it sends an ADMIN_PEER_ENTITY to all
+   * peers, which keep a replica of the entity. A replica's conn() is the
+   * link from the owning service, so anything queued to it (a
+   * TrackSDLUpdate from the vault, say) goes back there and is relayed to
+   * the frontend. Node changes made outside the vault service are sent to
+   * it as ADMIN_PEER_PROPAGATE so it can tell the interested clients.
+   *
+   * The links are connected at startup and again, at most every
+   * BACKEND_PEER_RETRY seconds, when there is something to send; each
+   * (re)connection resends everything we own.
+   */
+  class PeerLink {
+  public:
+    PeerLink(const struct sockaddr_in &addr) :
+        m_addr(addr), m_conn(NULL), m_next_try(0) {
+    }
+    struct sockaddr_in m_addr;
+    Connection *m_conn;
+    time_t m_next_try;
+  };
+  std::vector<PeerLink*> m_peers;
+  void connect_peer(PeerLink *peer);
+  // msg is always consumed
+  void send_to_peers(BackendMessage *msg);
+  // the AdminPeerEntity_BackendMessage fields this service is the source of
+  uint32_t owned_fields(const ConnectionEntity *entity) const;
+  void share_entity(const HashKey &key, ConnectionEntity *entity, uint32_t fields);
+  void apply_peer_entity(Connection *c, AdminPeerEntity_BackendMessage *msg);
+  // clean up after a (non-replica) entity that is gone, which has already
+  // been taken out of m_hash_table
+  void entity_left(const HashKey &key, ConnectionEntity *leaver);
+  // deliver a FROM_SERVER message a peer queued to one of our replicas
+  void relay_from_peer(BackendMessage *msg);
+  // Our links to peer services. Only FROM_SERVER messages come back on
+  // them, and those are for our frontends, so they are read as
+  // Relay_BackendMessages, which can be passed on as they are.
+  class PeerConnection: public BackendConnection {
+  public:
+    virtual NetworkMessage* make_if_enough(const uint8_t *buf, size_t len, int32_t *want_len, bool become_owner = false);
+  };
+
+  /*
+   * A frontend sends a client's requests to each service on its own link,
+   * so a request to tracking or the vault can arrive before the
+   * ADMIN_PEER_ENTITY from auth saying which player the client is. Requests
+   * that need the player (TRACK_FIND_GAME, VAULT_CREATENODE, and
+   * VAULT_SAVENODE of SDL, which is forwarded to a game server) are held here
+   * until it arrives, or for at most BACKEND_PEER_ENTITY_WAIT seconds,
+   * after which they are handled anyway (and fail as they would have).
+   */
+  class HeldRequest {
+  public:
+    HeldRequest(Connection *conn, BackendMessage *msg, time_t when) :
+        m_conn(conn), m_msg(msg), m_when(when) {
+    }
+    Connection *m_conn;
+    BackendMessage *m_msg;
+    time_t m_when;
+  };
+  std::multimap<HashKey, HeldRequest> m_held_requests;
+  // returns true if the request was held, in which case it has a new ref
+  bool hold_for_entity(Connection *c, BackendMessage *in);
+  // handle the requests held for key, or if key is NULL, the ones held
+  // since when or before
+  void release_held_requests(const HashKey *key, time_t when);
+  // forget the requests held for key, or that arrived on conn (all of them
+  // if both are NULL)
+  void drop_held_requests(const HashKey *key, const Connection *conn);
+  // one of these goes off BACKEND_PEER_ENTITY_WAIT seconds after each
+  // request is held, so it is handled even if no more messages arrive;
+  // they have their own queue because everything in m_timers is a Waiter
+  class HeldExpiry: public TimerQueue::Timer {
+  public:
+    HeldExpiry(struct timeval &when, BackendServer *me) :
+        Timer(when), m_server(me) {
+    }
+    void callback();
+
+    BackendServer *m_server;
+  };
+  TimerQueue *m_held_timers;
+
+  /*
+   * vault node prefetch cache
+   *
+   * When vault_prefetch is on, the nodes named in a VAULT_FETCHREFS reply
+   * are loaded from the DB in a single query and kept here, so the
+   * VAULT_FETCH requests the client sends next do not each wait on the DB.
+   * An entry is handed out only once, is dropped as soon as the node is
+   * changed, and expires after VAULT_PREFETCH_LIFETIME seconds regardless.
+   */
+  class PrefetchedNode {
+  public:
+    PrefetchedNode(VaultNode *node, time_t when) :
+        m_node(node), m_when(when) {
+    }
+    VaultNode *m_node;
+    time_t m_when;
+  };
+  std::map<uint32_t, PrefetchedNode> m_prefetched;
+  void prefetch_nodes(const std::vector<uint32_t> &nodeids);
+  // returns NULL if the node is not cached; otherwise the caller owns it
+  VaultNode* take_prefetched(uint32_t nodeid);
+  void forget_prefetched(uint32_t nodeid);
+  void expire_prefetched(time_t now);
 
   /*
    * tracking server state
@@ -224,18 +441,28 @@ protected:
    * because the inefficiency is really not an issue for single-player.
    * Really we should maintain a second hash table going from UUID to
    * ConnectionEntity, we should maintain a two-way mapping of
-   * auth<->game servers, the method of choosing the next dispatcher
-   * should be handled much better, etc.
+   * auth<->game servers, etc.
    */
   class DispatcherInfo {
   public:
     DispatcherInfo(uint32_t id1, uint32_t id2, Connection *conn) :
-        m_id1(id1), m_id2(id2), m_conn(conn), m_accepting_new_game_servers(false), m_handles_file_service(false), m_handles_auth_service(
-            false), m_use_fa_hostname(true), m_fa_ipaddr(0), m_fa_ipport(0) {
+        m_id1(id1), m_id2(id2), m_conn(conn), m_games(0), m_players(0), m_clients(0), m_cpu(0), m_lag(0), m_starting(0), m_sent(
+            0), m_accepting_new_game_servers(false), m_handles_file_service(false), m_handles_auth_service(false), m_use_fa_hostname(
+            true), m_fa_ipaddr(0), m_fa_ipport(0) {
     }
     uint32_t m_id1, m_id2;
     Connection *m_conn;
-    // statistics (TRACK_STATUS) here, if we ever care about load-balancing
+    // the last TRACK_STATUS
+    uint32_t m_games, m_players, m_clients, m_cpu, m_lag;
+    // game servers asked for and clients sent there since then
+    uint32_t m_starting, m_sent;
+    // how busy the dispatcher is, in players: game servers are weighted
+    // by TRACK_LOAD_AGE_WEIGHT, and the total is scaled up by the CPU
+    // percentage and lag in ms
+    uint32_t load() const {
+      uint32_t count = (m_games + m_starting) * TRACK_LOAD_AGE_WEIGHT + m_players + m_clients + m_sent;
+      return (count * (100 + m_cpu + m_lag)) / 100;
+    }
     bool m_accepting_new_game_servers;
     bool m_handles_file_service, m_handles_auth_service;
     bool m_use_fa_hostname;
@@ -244,7 +471,16 @@ protected:
     UruString m_fa_hostname;
   };
   std::vector<DispatcherInfo*> m_dispatchers;
+  // where the search for the least loaded dispatcher starts, so ties go
+  // round-robin
   uint32_t m_next_dispatcher, m_next_file, m_next_auth;
+  typedef enum {
+    GAME_SERVICE, FILE_SERVICE, AUTH_SERVICE
+  } service_t;
+  // the least loaded dispatcher offering the service, or NULL
+  DispatcherInfo* pick_dispatcher(service_t service, uint32_t &next);
+  // the dispatcher each age instance (raw UUID) was started on
+  std::map<std::string, DispatcherInfo*> m_age_dispatcher;
   KillClient_BackendMessage::kill_reason_t
   handle_age_request(const uint8_t *age_uuid, UruString *filename, bool force_new, uint32_t user_id1, uint32_t user_id2,
       uint32_t reqid);
@@ -304,6 +540,29 @@ protected:
   // for GameMgrs
   uint32_t m_next_gameid;
 
+  /*
+   * message capture (capture_file), for test/backend_replay
+   *
+   * Every message read from an accepted connection is written out, in
+   * order, before it is handled. That includes connections a peer service
+   * opened to us; only the connections we open to peer services are not
+   * captured, since each peer captures what it reads itself.
+   */
+  const char *m_capture_fname;
+  BackendCapture m_capture;
+  uint32_t m_next_stream;
+
+  class CaptureConnection: public BackendConnection {
+  public:
+    CaptureConnection(int32_t fd, BackendCapture *capture, uint32_t stream) :
+        BackendConnection(fd), m_capture(capture), m_stream(stream) {
+    }
+    virtual NetworkMessage* make_if_enough(const uint8_t *buf, size_t len, int32_t *want_len, bool become_owner = false);
+
+    BackendCapture *m_capture;
+    const uint32_t m_stream;
+  };
+
   /*
    * helper functions
    */
@@ -54,6 +54,8 @@
 #include <stdexcept>
 #include <deque>
 #include <list>
+#include <map>
+#include <set>
 #include <vector>
 
 #ifdef HAVE_OPENSSL_RC4
@@ -66,6 +68,7 @@
 #include "exceptions.h"
 #include "constants.h"
 #include "protocol.h"
+#include "backend_typecodes.h"
 #include "util.h"
 #include "UruString.h"
 #include "Buffer.h"
@@ -140,6 +143,7 @@ int32_t main(int32_t argc, char *argv[]) {
   char *vault_addr_name, *log_dir, *log_level, *auth_dir, *file_dir, *game_dir,
     *auth_key_file, *game_key_file;
   int32_t vault_port;
+  int32_t game_sdl_merge_ms = 0, game_interest_radius = 0;
   vault_addr_name = log_dir = log_level = auth_dir = file_dir = game_dir
     = auth_key_file = NULL;
   ConfigParser *disp_config = new ConfigParser();
@@ -160,6 +164,9 @@ int32_t main(int32_t argc, char *argv[]) {
     disp_config->register_config("game_data_dir", &game_dir, "auth");
     disp_config->register_config("game_key_file", &game_key_file,
          "./game_key.der");
+    disp_config->register_config("game_sdl_merge_ms", &game_sdl_merge_ms, 0);
+    disp_config->register_config("game_interest_radius",
+         &game_interest_radius, 0);
   }
   else {
     disp_config->register_config("file_log_level", &log_level, "NET");
@@ -256,7 +263,11 @@ int32_t main(int32_t argc, char *argv[]) {
     }
 #ifdef FORK_GAME_TOO
     else if (is_game) {
-      server = new GameServer(fd, game_dir, false, vault_addr);
+      GameServer *game = new GameServer(fd, game_dir, false, vault_addr);
+      game->set_sdl_merge_ms(game_sdl_merge_ms > 0 ? game_sdl_merge_ms : 0);
+      game->set_interest_radius(game_interest_radius > 0
+        ? game_interest_radius : 0);
+      server = game;
     }
 #endif
     else {
@@ -58,7 +58,6 @@
 #include <deque>
 #include <list>
 #include <vector>
-#include <algorithm> /* for heap */
 
 #ifdef HAVE_OPENSSL
 #include <sys/stat.h>
@@ -194,8 +193,9 @@ void Server::internal_setup_logger(int32_t conn_fd, const char *log_level,
 }
 
 Server::BackendConnection *
-Server::connect_to_backend(const struct sockaddr_in *vault_addr) {
-  BackendConnection *vault = new BackendConnection();
+Server::connect_to_backend(const struct sockaddr_in *vault_addr,
+         BackendConnection *conn) {
+  BackendConnection *vault = (conn ? conn : new BackendConnection());
   vault->set_in_connect(false);
   vault->set_fd(socket(PF_INET, SOCK_STREAM, IPPROTO_TCP));
   if (vault->fd() < 0) {
@@ -466,31 +466,95 @@ Server::TimerQueue::~TimerQueue() {
   std::deque<Timer*>::iterator iter;
   for (iter = m_queue.begin(); iter != m_queue.end(); iter++) {
     Timer *t = *iter;
-    delete t;
+    if (t->m_queue_owns) {
+      delete t;
+    } else {
+      t->m_index = Timer::NOT_QUEUED;
+    }
   }
 }
 
 void Server::TimerQueue::insert(Server::TimerQueue::Timer *el) {
   m_queue.push_back(el);
-  push_heap(m_queue.begin(), m_queue.end(), timer_compare);
+  el->m_index = m_queue.size() - 1;
+  sift_up(el->m_index);
   set_timeout();
 }
 
+void Server::TimerQueue::remove(Server::TimerQueue::Timer *el) {
+  if (el->m_index != Timer::NOT_QUEUED) {
+    remove_at(el->m_index);
+    set_timeout();
+  }
+  if (el->m_queue_owns) {
+    delete el;
+  }
+}
+
 void Server::TimerQueue::handle_timeout(struct timeval &time) {
   while (m_queue.size() > 0
    && (timeval_lessthan(m_queue[0]->m_when, time)
        || m_queue[0]->m_cancelled)) {
     Timer *t = m_queue[0];
+    // out of the queue first, so the callback may insert timers (even
+    // this one, if the queue does not own it)
+    remove_at(0);
     if (!t->m_cancelled) {
       t->callback();
     }
-    pop_heap(m_queue.begin(), m_queue.end(), timer_compare);
-    m_queue.pop_back();
-    delete t;
+    if (t->m_queue_owns) {
+      delete t;
+    }
   }
   set_timeout();
 }
 
+void Server::TimerQueue::remove_at(size_t i) {
+  Timer *t = m_queue[i];
+  t->m_index = Timer::NOT_QUEUED;
+  Timer *last = m_queue.back();
+  m_queue.pop_back();
+  if (last != t) {
+    place(last, i);
+    sift_up(i);
+    sift_down(last->m_index);
+  }
+}
+
+void Server::TimerQueue::sift_up(size_t i) {
+  Timer *t = m_queue[i];
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (!timeval_lessthan(t->m_when, m_queue[parent]->m_when)) {
+      break;
+    }
+    place(m_queue[parent], i);
+    i = parent;
+  }
+  place(t, i);
+}
+
+void Server::TimerQueue::sift_down(size_t i) {
+  Timer *t = m_queue[i];
+  size_t size = m_queue.size();
+  for (;;) {
+    size_t child = 2 * i + 1;
+    if (child >= size) {
+      break;
+    }
+    if (child + 1 < size
+        && timeval_lessthan(m_queue[child + 1]->m_when, m_queue[child]->m_when)) {
+      child++;
+    }
+    if (!timeval_lessthan(m_queue[child]->m_when, t->m_when)) {
+      break;
+    }
+    place(m_queue[child], i);
+    i = child;
+  }
+  place(t, i);
+}
+
 void Server::TimerQueue::set_timeout() {
   if (m_queue.size() == 0) {
     // disable timeout
@@ -536,6 +600,7 @@ void* serv_main(void *serv) {
   fd_set zerofds, savefds, readfds, writefds;
   int32_t nfds, save_nfds = 0, fd_ct;
   struct timeval timeout, next, now;
+  bool more_work;
 #define IN_SHUTDOWN() (shutdown_reason != Server::NO_SHUTDOWN)
   // this macro makes sure that if we are already in shutdown, we don't
   // re-shutdown or worse, clear shutdown_reason
@@ -634,6 +699,9 @@ void* serv_main(void *serv) {
     }
     // check for explicit shutdown request
     CHECK_SHUTDOWN((server->shutdown_requested() ? Server::SERVER_SHUTDOWN : Server::NO_SHUTDOWN),);
+    // let the server do a piece of any spread-out work, before working out
+    // what to write
+    more_work = !IN_SHUTDOWN() && server->loop_pass();
     // set up and check the listen socket
     writefds = zerofds;
     if (IN_SHUTDOWN()) {
@@ -715,6 +783,11 @@ void* serv_main(void *serv) {
       timeout.tv_sec = 0;
       timeout.tv_usec = 1;
     }
+    if (more_work) {
+      // just poll
+      timeout.tv_sec = 0;
+      timeout.tv_usec = 0;
+    }
 #ifdef DEBUG_ENABLE
     if (0) {
       char rfd_list[1024];
@@ -131,6 +131,12 @@ public:
   virtual reason_t conn_shutdown(Connection *conn,
          reason_t why) { return why; }
 
+  // Called once each time through the select loop, before the select, for
+  // servers that spread work out so that it does not hold up everything
+  // else. Return true if there is more to do right away (the select will
+  // not wait).
+  virtual bool loop_pass() { return false; }
+
   // Function to call when shutting down. Returns true if immediate shutdown
   // is ok, false if any connection must be flushed because a message needs to
   // be sent (generally to another server).
@@ -301,8 +307,10 @@ protected:
 
   virtual void internal_setup_logger(int32_t conn_fd, const char *log_level,
              Logger *to_share, const char *log_dir);
-  // utility function
-  BackendConnection * connect_to_backend(const struct sockaddr_in *vault_addr);
+  // utility function; connects conn if given (it is deleted on failure),
+  // otherwise a new BackendConnection
+  BackendConnection * connect_to_backend(const struct sockaddr_in *vault_addr,
+           BackendConnection *conn = NULL);
 #ifdef FORK_ENABLE
 public:
 #endif
@@ -329,7 +337,9 @@ public:
     void set_in_connect(bool c) { m_in_connect = c; }
     bool in_shutdown() const { return m_in_shutdown; }
     void set_in_shutdown(bool s) { m_in_shutdown = s; }
-    void enqueue(NetworkMessage *msg,
+    // virtual so a connection holding messages of its own (a game client
+    // between ticks) can send them first
+    virtual void enqueue(NetworkMessage *msg,
      MessageQueue::priority_t p = MessageQueue::NORMAL) {
       m_msg_queue->enqueue(msg, p);
     }
@@ -469,8 +479,10 @@ public:
    * the TimerQueue must add the object to their connections list and
    * handle the conn_timeout() callback for them.
    *
-   * Note that Timers can only be added or cancelled. If you need to
-   * change the timeout of one, cancel it and add a new one.
+   * Timers can be cancelled, which leaves them in the queue until their
+   * time comes, or removed. Each Timer knows its place in the queue, so
+   * removing one is as cheap as adding it. If you need to change the
+   * timeout of one, remove it and add it again.
    */
   class TimerQueue : public Connection {
   public:
@@ -484,25 +496,40 @@ public:
     // Subclass Timer and implement the callback method, which is called
     // at expiration time unless the timer has been cancelled. Note that
     // Timer* is the container's element, and that it is automatically
-    // deleted when the timer fires, so beware dangling pointers.
+    // deleted when the timer fires, so beware dangling pointers. A Timer
+    // made with queue_owns false is never deleted by the queue; its owner
+    // must remove() it before deleting it.
     class Timer {
       friend class TimerQueue;
     public:
-      Timer(struct timeval &when) : m_cancelled(false) { m_when = when; }
+      Timer(const struct timeval &when, bool queue_owns = true)
+        : m_cancelled(false), m_queue_owns(queue_owns), m_index(NOT_QUEUED) {
+        m_when = when;
+      }
       virtual ~Timer() { };
 
       void cancel() { m_cancelled = true; }
       bool cancelled() const { return m_cancelled; }
+      bool queued() const { return m_index != NOT_QUEUED; }
+      // only while the timer is not queued
+      void set_when(const struct timeval &when) { m_when = when; }
 
       virtual void callback() = 0;
 
     protected:
       struct timeval m_when;
       bool m_cancelled;
+      bool m_queue_owns;
+      // the timer's place in m_queue
+      size_t m_index;
+      static const size_t NOT_QUEUED = (size_t)-1;
     };
 
     // for queue management
     void insert(Timer *el);
+    // take the timer out of the queue without calling it, and delete it if
+    // the queue owns it
+    void remove(Timer *el);
     void handle_timeout(struct timeval &time);
 
     // for iterating through queue
@@ -511,9 +538,15 @@ public:
   protected:
     std::deque<Timer*> m_queue;
     void set_timeout();
-    static int32_t timer_compare(const Timer *a, const Timer *b) {
-      return timeval_lessthan(b->m_when, a->m_when);
+    // the heap is kept by hand so that each Timer's m_index stays right
+    void sift_up(size_t i);
+    void sift_down(size_t i);
+    void place(Timer *el, size_t i) {
+      m_queue[i] = el;
+      el->m_index = i;
     }
+    // takes the timer at i out of the heap
+    void remove_at(size_t i);
   };
 };
 
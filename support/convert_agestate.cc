@@ -0,0 +1,93 @@
+/*
+ MOSS - A server for the Myst Online: Uru Live client/protocol
+ Copyright (C) 2008-2011  a'moaca'
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+/*
+ * This program converts an agestate.moss file into the agestate.bin
+ * format. The records are copied without being parsed, so the SDL files
+ * are not needed. The game server does the same conversion by itself the
+ * next time it shuts down, so this is only to do them all up front.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <iconv.h>
+#include <sys/time.h>
+#include <fstream>
+#include <string>
+#include <stdexcept>
+#include <list>
+#include <map>
+#include <vector>
+
+#include "machine_arch.h"
+#include "protocol.h"
+#include "exceptions.h"
+#include "util.h"
+#include "UruString.h"
+#include "PlKey.h"
+#include "Logger.h"
+#include "SDL.h"
+#include "AgeStateFile.h"
+
+int main(int argc, char *argv[]) {
+	static const char *usage = "Usage: %s <agestate.moss> <agestate.bin>\n";
+	if (argc != 3) {
+		fprintf(stderr, usage, argv[0]);
+		return 1;
+	}
+
+	std::ifstream in(argv[1], std::ios_base::in | std::ios_base::binary);
+	if (in.fail()) {
+		fprintf(stderr, "Cannot open %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+	AgeStateFile::Writer out;
+	uint32_t count = 0;
+	std::vector<uint8_t> msg;
+	uint8_t lenbuf[4];
+	while (in.read((char*) lenbuf, 4)) {
+		uint32_t len = read32(lenbuf, 0);
+		msg.resize(len);
+		if (len == 0 || !in.read((char*) &msg[0], len)) {
+			fprintf(stderr, "%s is truncated after %u records\n", argv[1], count);
+			return 1;
+		}
+		if (!out.add(&msg[0], len)) {
+			fprintf(stderr, "Record %u in %s is not an SDL message\n", count, argv[1]);
+			return 1;
+		}
+		count++;
+	}
+	if (in.gcount() != 0) {
+		fprintf(stderr, "%s is truncated after %u records\n", argv[1], count);
+		return 1;
+	}
+	if (!out.write(argv[2])) {
+		fprintf(stderr, "Error writing %s: %s\n", argv[2], strerror(errno));
+		return 1;
+	}
+	printf("Converted %u SDL states\n", count);
+	return 0;
+}
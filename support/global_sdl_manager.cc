@@ -51,6 +51,8 @@
 #include <sstream>
 #include <stdexcept>
 #include <list>
+#include <map>
+#include <set>
 #include <vector>
 
 #include "machine_arch.h"
@@ -71,6 +73,7 @@
 #endif
 #endif
 #include "VaultNode.h"
+#include "vault_store.h"
 #include "db_requests.h"
 
 // DB queries
@@ -33,6 +33,7 @@
 #include <sstream>
 #include <stdexcept>
 #include <list>
+#include <map>
 #include <vector>
 
 #include "machine_arch.h"
@@ -0,0 +1,427 @@
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * backend_replay sends the messages in a backend capture file (see
+ * capture_file in backend.cfg) to a backend server, one TCP connection per
+ * captured stream, and reports how fast the backend answered.
+ *
+ * Messages are sent with the same spacing they were captured with, divided
+ * by the speed given with -s; -s 0 sends each message as soon as the one
+ * before it is written. Replies are matched to requests per connection:
+ * vault replies by transaction ID, anything else by being the next reply of
+ * the same type. Messages known never to get a reply (VAULT_SENDNODE,
+ * VAULT_SET_AGE_PUBLIC and VAULT_SET_SEEN) are not waited for at all; any
+ * other request still without a reply at the end (e.g. TRACK_GAME_HELLO) is
+ * counted as unanswered. Neither affects the times.
+ *
+ * The results only mean much if the backend's DB is in the state it was in
+ * when the capture started, so to benchmark:
+ *   1. dump the DB, and start the backend with capture_file set
+ *   2. run the servers and clients for a while, then stop the backend
+ *   3. make a fresh DB from postgresql/moss.sql and load the dump into it
+ *   4. start the backend on the fresh DB (without capture_file), and run
+ *      backend_replay against it
+ * A capture started against a freshly-created moss.sql DB can simply be
+ * replayed against another one.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <iconv.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <map>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "machine_arch.h"
+#include "constants.h"
+#include "protocol.h"
+#include "backend_typecodes.h"
+#include "util.h"
+#include "UruString.h"
+
+#include "Logger.h"
+#include "NetworkMessage.h"
+#include "BackendMessage.h"
+
+#include "backend_stats.h"
+#include "backend_capture.h"
+
+#define READBUF_SIZE 65536
+
+typedef struct {
+  struct timeval when;
+  uint32_t stream;
+  uint8_t *buf; // NULL for a close
+  uint32_t len;
+} record_t;
+
+// a request waiting for its reply
+typedef struct {
+  int32_t type;
+  uint32_t reqid;
+  struct timeval sent;
+} pending_t;
+
+typedef struct {
+  int fd;
+  std::vector<uint8_t> readbuf;
+  std::list<pending_t> pending;
+} stream_t;
+
+static std::map<int32_t, LatencyHistogram*> type_stats;
+static LatencyHistogram all_stats;
+static uint32_t replies = 0, unmatched = 0;
+
+static uint32_t usecs_between(const struct timeval &start, const struct timeval &end) {
+  if (timeval_lessthan(end, start)) {
+    return 0;
+  }
+  uint64_t usecs = ((uint64_t) (end.tv_sec - start.tv_sec) * 1000000) + end.tv_usec - start.tv_usec;
+  return (usecs > 0xffffffff ? 0xffffffff : (uint32_t) usecs);
+}
+
+/*
+ * Work out what reply a message expects; for vault messages the type is
+ * made from the Uru message type, so it is the same as the VAULT_* codes.
+ * Returns false if there is no reply.
+ */
+static bool classify(const uint8_t *buf, uint32_t len, int32_t *type, uint32_t *reqid) {
+  int32_t want_len;
+  NetworkMessage *msg = BackendMessage::make_if_enough(buf, len, &want_len, false);
+  *type = read32(buf, 4);
+  *reqid = 0;
+  VaultPassthrough_BackendMessage *vmsg = dynamic_cast<VaultPassthrough_BackendMessage*>(msg);
+  if (vmsg) {
+    *type = (*type & FROM_SERVER) | CLASS_VAULT | (uint16_t) vmsg->uru_msgtype();
+    *reqid = vmsg->reqid();
+  }
+  if (msg) {
+    delete msg;
+  }
+  switch (static_cast<uint32_t>(*type)) {
+  case VAULT_SENDNODE:
+  case VAULT_SET_AGE_PUBLIC:
+  case VAULT_SET_SEEN:
+    return false;
+  default:
+    return true;
+  }
+}
+
+static void got_reply(stream_t *s, const uint8_t *buf, uint32_t len, const struct timeval &now) {
+  int32_t type;
+  uint32_t reqid;
+  classify(buf, len, &type, &reqid);
+  if (!(type & FROM_SERVER)) {
+    return;
+  }
+  bool is_vault = ((type & CLASS_VAULT) != 0);
+
+  for (std::list<pending_t>::iterator iter = s->pending.begin(); iter != s->pending.end(); iter++) {
+    bool match;
+    if (is_vault) {
+      match = ((iter->type & CLASS_VAULT) && iter->reqid == reqid);
+    } else {
+      match = (iter->type == (int32_t) (type & ~FROM_SERVER));
+    }
+    if (match) {
+      uint32_t usecs = usecs_between(iter->sent, now);
+      all_stats.record(usecs);
+      LatencyHistogram *hist = type_stats[iter->type];
+      if (!hist) {
+        hist = new LatencyHistogram();
+        type_stats[iter->type] = hist;
+      }
+      hist->record(usecs);
+      replies++;
+      s->pending.erase(iter);
+      return;
+    }
+  }
+  // vault notifications and the like
+  unmatched++;
+}
+
+// returns false if the connection closed
+static bool do_read(stream_t *s) {
+  uint8_t buf[READBUF_SIZE];
+  ssize_t ret = read(s->fd, buf, sizeof(buf));
+  if (ret <= 0) {
+    return false;
+  }
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  s->readbuf.insert(s->readbuf.end(), buf, buf + ret);
+
+  size_t used = 0;
+  while (s->readbuf.size() - used >= 16) {
+    uint32_t msg_len = read32(&s->readbuf[used], 0);
+    if (msg_len < 16) {
+      fprintf(stderr, "Bad message length %u from backend\n", msg_len);
+      return false;
+    }
+    if (s->readbuf.size() - used < msg_len) {
+      break;
+    }
+    got_reply(s, &s->readbuf[used], msg_len, now);
+    used += msg_len;
+  }
+  s->readbuf.erase(s->readbuf.begin(), s->readbuf.begin() + used);
+  return true;
+}
+
+// wait for replies until the deadline (or just poll if it has passed)
+static void read_until(std::map<uint32_t, stream_t*> &streams, const struct timeval &deadline) {
+  while (1) {
+    struct timeval now, timeout;
+    gettimeofday(&now, NULL);
+    if (timeval_lessthan(deadline, now)) {
+      timeout.tv_sec = 0;
+      timeout.tv_usec = 0;
+    } else {
+      uint32_t usecs = usecs_between(now, deadline);
+      timeout.tv_sec = usecs / 1000000;
+      timeout.tv_usec = usecs % 1000000;
+    }
+
+    fd_set readset;
+    FD_ZERO(&readset);
+    int maxfd = -1;
+    for (std::map<uint32_t, stream_t*>::iterator iter = streams.begin(); iter != streams.end(); iter++) {
+      if (iter->second->fd >= 0) {
+        FD_SET(iter->second->fd, &readset);
+        if (iter->second->fd > maxfd) {
+          maxfd = iter->second->fd;
+        }
+      }
+    }
+    int ret = select(maxfd + 1, &readset, NULL, NULL, &timeout);
+    if (ret < 0 && errno != EINTR) {
+      fprintf(stderr, "Select error: %s\n", strerror(errno));
+      return;
+    }
+    if (ret <= 0) {
+      if (timeout.tv_sec == 0 && timeout.tv_usec == 0) {
+        return;
+      }
+      continue;
+    }
+    for (std::map<uint32_t, stream_t*>::iterator iter = streams.begin(); iter != streams.end(); iter++) {
+      stream_t *s = iter->second;
+      if (s->fd >= 0 && FD_ISSET(s->fd, &readset) && !do_read(s)) {
+        fprintf(stderr, "Backend closed connection for stream %u\n", iter->first);
+        close(s->fd);
+        s->fd = -1;
+      }
+    }
+  }
+}
+
+static bool write_all(int fd, const uint8_t *buf, uint32_t len) {
+  while (len > 0) {
+    ssize_t ret = write(fd, buf, len);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buf += ret;
+    len -= ret;
+  }
+  return true;
+}
+
+static void print_histogram(const char *label, const LatencyHistogram &hist) {
+  printf("%-40s n=%-8u mean=%-8u p50=%-8u p90=%-8u p99=%-8u max=%u\n", label, hist.count(),
+      hist.count() ? (uint32_t) (hist.total() / hist.count()) : 0, hist.percentile(0.5), hist.percentile(0.9),
+      hist.percentile(0.99), hist.max());
+}
+
+int main(int argc, char *argv[]) {
+  double speed = 1.0;
+  int32_t linger = 5;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:w:")) != -1) {
+    switch (opt) {
+    case 's':
+      speed = atof(optarg);
+      break;
+    case 'w':
+      linger = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s speed] [-w wait] <capture file> <IP> <port>\n", argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 3 || speed < 0) {
+    fprintf(stderr, "Usage: %s [-s speed] [-w wait] <capture file> <IP> <port>\n", argv[0]);
+    fprintf(stderr, "  -s speed: 1 replays in real time (default), 2 twice as fast, etc.;\n"
+        "            0 sends as fast as possible\n");
+    fprintf(stderr, "  -w wait: seconds to wait for outstanding replies at the end (default 5)\n");
+    return 1;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(atoi(argv[optind + 2]));
+  if (inet_pton(AF_INET, argv[optind + 1], &addr.sin_addr) != 1) {
+    fprintf(stderr, "Bad IP address %s\n", argv[optind + 1]);
+    return 1;
+  }
+
+  BackendCapture capture;
+  int err = capture.open_read(argv[optind]);
+  if (err) {
+    fprintf(stderr, "Error opening capture file %s: %s\n", argv[optind], strerror(err));
+    return 1;
+  }
+  // load everything first so file I/O does not disturb the timing
+  std::vector<record_t> records;
+  record_t rec;
+  while (capture.read_record(&rec.when, &rec.stream, &rec.buf, &rec.len)) {
+    records.push_back(rec);
+  }
+  capture.close();
+  if (records.empty()) {
+    fprintf(stderr, "No messages in capture file %s\n", argv[optind]);
+    return 1;
+  }
+
+  struct sigaction sig;
+  memset(&sig, 0, sizeof(sig));
+  sig.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sig, NULL);
+
+  std::map<uint32_t, stream_t*> streams;
+  uint32_t sent = 0, no_reply = 0;
+  struct timeval start, deadline;
+  gettimeofday(&start, NULL);
+
+  for (std::vector<record_t>::iterator iter = records.begin(); iter != records.end(); iter++) {
+    if (speed > 0) {
+      double offset = ((iter->when.tv_sec - records[0].when.tv_sec)
+          + (iter->when.tv_usec - records[0].when.tv_usec) / 1000000.0) / speed;
+      uint64_t usecs = (uint64_t) (offset * 1000000);
+      deadline.tv_sec = start.tv_sec + (usecs + start.tv_usec) / 1000000;
+      deadline.tv_usec = (usecs + start.tv_usec) % 1000000;
+    } else {
+      deadline.tv_sec = 0;
+      deadline.tv_usec = 0;
+    }
+    read_until(streams, deadline);
+
+    std::map<uint32_t, stream_t*>::iterator s_iter = streams.find(iter->stream);
+    stream_t *s = (s_iter == streams.end() ? NULL : s_iter->second);
+    if (!iter->buf) {
+      // stream closed
+      if (s && s->fd >= 0) {
+        close(s->fd);
+        s->fd = -1;
+      }
+      continue;
+    }
+    if (!s) {
+      s = new stream_t();
+      streams[iter->stream] = s;
+      s->fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+      if (s->fd < 0 || connect(s->fd, (struct sockaddr*) &addr, sizeof(addr))) {
+        fprintf(stderr, "Error connecting to backend: %s\n", strerror(errno));
+        return 1;
+      }
+    }
+    if (s->fd < 0) {
+      continue;
+    }
+
+    pending_t req;
+    if (classify(iter->buf, iter->len, &req.type, &req.reqid)) {
+      gettimeofday(&req.sent, NULL);
+      s->pending.push_back(req);
+    }
+    if (!write_all(s->fd, iter->buf, iter->len)) {
+      fprintf(stderr, "Error writing stream %u: %s\n", iter->stream, strerror(errno));
+      close(s->fd);
+      s->fd = -1;
+      continue;
+    }
+    sent++;
+  }
+  struct timeval end;
+  gettimeofday(&end, NULL);
+
+  deadline = end;
+  deadline.tv_sec += linger;
+  read_until(streams, deadline);
+
+  for (std::map<uint32_t, stream_t*>::iterator iter = streams.begin(); iter != streams.end(); iter++) {
+    no_reply += iter->second->pending.size();
+    if (iter->second->fd >= 0) {
+      close(iter->second->fd);
+    }
+    delete iter->second;
+  }
+  for (std::vector<record_t>::iterator iter = records.begin(); iter != records.end(); iter++) {
+    if (iter->buf) {
+      delete[] iter->buf;
+    }
+  }
+
+  double elapsed = usecs_between(start, end) / 1000000.0;
+  printf("Sent %u messages on %u connections in %.3f s (%.1f msgs/s)\n", sent, (uint32_t) streams.size(), elapsed,
+      elapsed > 0 ? sent / elapsed : 0);
+  printf("Replies: %u matched, %u unmatched; %u messages unanswered\n", replies, unmatched, no_reply);
+  printf("Reply latency (us):\n");
+  print_histogram("all", all_stats);
+  for (std::map<int32_t, LatencyHistogram*>::iterator iter = type_stats.begin(); iter != type_stats.end(); iter++) {
+    char label[80];
+    char *name = BackendMessage::backend_msgtype_c_str_alloc(iter->first);
+    snprintf(label, sizeof(label), "<0x%08x>%s", iter->first, name ? name : "");
+    if (name) {
+      free(name);
+    }
+    print_histogram(label, *iter->second);
+    delete iter->second;
+  }
+  return 0;
+}
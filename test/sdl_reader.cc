@@ -26,6 +26,7 @@
 #include <stdarg.h>
 #include <iconv.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <getopt.h>
 #include <iostream>
 #include <fstream>
@@ -33,6 +34,7 @@
 #include <sstream>
 #include <stdexcept>
 #include <list>
+#include <map>
 #include <vector>
 
 #include "machine_arch.h"
@@ -45,21 +47,27 @@
 
 void print_info(std::list<SDLDesc*> &sdls, std::list<SDLState*> &state, bool print_index = false, bool verbose = false);
 void print_state(SDLState *st, int indent = 0);
+void benchmark(std::list<SDLDesc*> &sdls, std::list<SDLState*> &state, uint32_t iterations);
 
 int main(int argc, char *argv[]) {
 	static struct option options[] = {
 			{ "verbose", no_argument, 0, 'v' },
 			{ "interactive", no_argument, 0, 'i' },
 			{ "load", required_argument, 0, 'l' },
+			{ "benchmark", required_argument, 0, 'b' },
 			{ 0, 0, 0, 0 } };
-	static const char *usage = "Usage: %s [-i] [-l <saved state file>] <SDL file or directory>[...]\n";
+	static const char *usage = "Usage: %s [-i] [-l <saved state file> [-b <iterations>]] <SDL file or directory>[...]\n";
 	char c;
 	opterr = 0;
 	char *saved_state = NULL;
 	bool interactive = false;
 	bool verbose = false;
-	while ((c = getopt_long(argc, argv, "ivl:", options, NULL)) != -1) {
+	uint32_t iterations = 0;
+	while ((c = getopt_long(argc, argv, "ivl:b:", options, NULL)) != -1) {
 		switch (c) {
+		case 'b':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
 		case 'i':
 			interactive = true;
 			break;
@@ -124,7 +132,9 @@ int main(int argc, char *argv[]) {
 	}
 
 	// check on them
-	if (!interactive) {
+	if (iterations > 0) {
+		benchmark(sdls, state, iterations);
+	} else if (!interactive) {
 		print_info(sdls, state, true, verbose);
 	} else {
 		std::string input;
@@ -297,7 +307,7 @@ void print_info(std::list<SDLDesc*> &sdls, std::list<SDLState*> &state, bool pri
 		if (print_index)
 			printf("%d: ", index);
 		printf("Saved SDL object %s SDL name %s version %d\n",
-				s->key().m_name ? s->key().m_name->c_str() : "",
+				s->key().name(),
 				s->get_desc()->name(),
 				s->get_desc()->version());
 		// printf("print_info:pre-print_state\n");
@@ -386,3 +396,77 @@ void print_state(SDLState *st, int indent) {
 		}
 	}
 }
+
+/*
+ * Time reading and writing the states loaded from a saved file, as the
+ * server reads them from and sends them to clients (uncompressed).
+ */
+static double elapsed(struct timeval &start) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start.tv_sec) + ((now.tv_usec - start.tv_usec) / 1000000.0);
+}
+
+void benchmark(std::list<SDLDesc*> &sdls, std::list<SDLState*> &state, uint32_t iterations) {
+	if (state.empty()) {
+		fprintf(stderr, "Benchmarking requires a saved state file (-l)\n");
+		return;
+	}
+	SDLDescIndex descs(sdls);
+	std::vector<std::pair<uint8_t*, int32_t> > msgs;
+	uint64_t bytes = 0;
+	std::list<SDLState*>::iterator siter;
+	for (siter = state.begin(); siter != state.end(); siter++) {
+		SDLState *s = *siter;
+		uint32_t len = s->send_len();
+		uint8_t *buf = new uint8_t[len];
+		int32_t wrote = s->write_msg(buf, len, true);
+		if (wrote < 0) {
+			fprintf(stderr, "Could not write %s\n", s->get_desc()->name());
+			delete[] buf;
+			continue;
+		}
+		msgs.push_back(std::pair<uint8_t*, int32_t>(buf, wrote));
+		bytes += wrote;
+	}
+	double total_mb = (bytes * (double) iterations) / (1024.0 * 1024.0);
+	double total_msgs = msgs.size() * (double) iterations;
+	printf("%u messages, %llu bytes, %u iterations\n", (uint32_t) msgs.size(),
+			(unsigned long long) bytes, iterations);
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	for (uint32_t i = 0; i < iterations; i++) {
+		for (uint32_t m = 0; m < msgs.size(); m++) {
+			SDLState s;
+			try {
+				s.read_msg(msgs[m].first, msgs[m].second, descs);
+			} catch (const std::exception &e) {
+				fprintf(stderr, "Error reading message %u: %s\n", m, e.what());
+				i = iterations;
+				break;
+			}
+		}
+	}
+	double secs = elapsed(start);
+	printf("read:  %.3f s, %.1f MB/s, %.0f messages/s\n", secs, total_mb / secs, total_msgs / secs);
+
+	uint8_t *out = new uint8_t[bytes > 0 ? bytes : 1];
+	gettimeofday(&start, NULL);
+	for (uint32_t i = 0; i < iterations; i++) {
+		uint32_t offset = 0;
+		for (siter = state.begin(); siter != state.end(); siter++) {
+			int32_t wrote = (*siter)->write_msg(out + offset, bytes - offset, true);
+			if (wrote > 0) {
+				offset += wrote;
+			}
+		}
+	}
+	secs = elapsed(start);
+	printf("write: %.3f s, %.1f MB/s, %.0f messages/s\n", secs, total_mb / secs, total_msgs / secs);
+
+	delete[] out;
+	for (uint32_t m = 0; m < msgs.size(); m++) {
+		delete[] msgs[m].first;
+	}
+}
@@ -27,6 +27,8 @@
 
 #include <sys/param.h> /* for PATH_MAX */
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h> /* for fsync() */
 
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -36,8 +38,6 @@
 
 #ifdef HAVE_OPENSSL
 #include <openssl/rand.h>
-#else
-#include <unistd.h> /* for getpid() */
 #endif
 
 #include "machine_arch.h"
@@ -191,6 +191,19 @@ int32_t recursive_mkdir(const char *pathname, mode_t mode) {
   return 0;
 }
 
+int32_t sync_directory(const char *pathname) {
+  int32_t err = 0;
+  int fd = open(pathname, O_RDONLY);
+  if (fd < 0) {
+    return errno;
+  }
+  if (fsync(fd)) {
+    err = errno;
+  }
+  close(fd);
+  return err;
+}
+
 void do_random_seed() {
 #ifndef HAVE_OPENSSL
   struct timeval t;
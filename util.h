@@ -145,6 +145,9 @@ int32_t uuid_bytes_to_string(uint8_t *buf, uint32_t buflen, const uint8_t *uuid_
  * Utilities.
  */
 int32_t recursive_mkdir(const char *pathname, mode_t mode);
+/* fsync() a directory, so renames and creations in it are on disk;
+   returns 0 or an errno value */
+int32_t sync_directory(const char *pathname);
 void do_random_seed();
 void get_random_data(uint8_t *buf, uint32_t buflen);
 /*
@@ -0,0 +1,1526 @@
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stdarg.h>
+#include <pthread.h>
+#include <iconv.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h> /* for struct iovec */
+
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "machine_arch.h"
+#include "constants.h"
+#include "protocol.h"
+#include "util.h"
+#include "UruString.h"
+#include "VaultNode.h"
+
+#include "Logger.h"
+
+#include "vault_store.h"
+
+#define SNAPSHOT_MAGIC "MOSSVSNP"
+#define LOG_MAGIC "MOSSVLOG"
+#define STORE_VERSION 1
+
+// this is what is stored for every node; fields not in here are
+// ignored in saves and creates, as the DB's tables have no columns for them
+static uint32_t storable_bits(VaultNode::vault_nodetype_t type) {
+  return VaultNode::all_bits_for_type(type) | CreateAgeName | CreateAgeUUID;
+}
+
+static void copy_node(VaultNode &to, const VaultNode &from) {
+  uint32_t bits = from.bitfield1();
+  for (uint32_t i = 0; i < 32; i++) {
+    vault_bitfield_t bit = (vault_bitfield_t) (1 << i);
+    if (bits & bit) {
+      to.copy_field(from, bit);
+    }
+  }
+}
+
+MemoryVaultStore::MemoryVaultStore(Logger *log, const char *dir) :
+    m_log(log), m_logfile(NULL), m_log_records(0), m_next_id(MEMORY_VAULT_FIRST_NODE) {
+  std::string base(dir && dir[0] != '\0' ? dir : ".");
+  m_snap_fname = base + "/vault.snapshot";
+  m_log_fname = base + "/vault.log";
+}
+
+MemoryVaultStore::~MemoryVaultStore() {
+  if (m_logfile) {
+    snapshot();
+    fclose(m_logfile);
+  }
+  clear();
+}
+
+void MemoryVaultStore::clear() {
+  for (std::map<uint32_t, VaultNode*>::iterator iter = m_nodes.begin(); iter != m_nodes.end(); iter++) {
+    delete iter->second;
+  }
+  m_nodes.clear();
+  m_children.clear();
+  m_parents.clear();
+}
+
+void MemoryVaultStore::put_node(uint32_t nodeid, VaultNode *node) {
+  std::map<uint32_t, VaultNode*>::iterator iter = m_nodes.find(nodeid);
+  if (iter != m_nodes.end()) {
+    delete iter->second;
+    iter->second = node;
+  } else {
+    m_nodes[nodeid] = node;
+  }
+  if (nodeid >= m_next_id) {
+    m_next_id = nodeid + 1;
+  }
+}
+
+bool MemoryVaultStore::has_ref(uint32_t parent, uint32_t child) const {
+  std::pair<std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator,
+      std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator> range = m_children.equal_range(parent);
+  for (std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator iter = range.first; iter != range.second; iter++) {
+    if (iter->second.child == child) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void MemoryVaultStore::insert_ref(uint32_t parent, uint32_t child, uint32_t owner) {
+  VaultFetchRefs_VaultRef ref;
+  ref.parent = parent;
+  ref.child = child;
+  ref.owner = owner;
+  m_children.insert(std::pair<uint32_t, VaultFetchRefs_VaultRef>(parent, ref));
+  m_parents.insert(std::pair<uint32_t, uint32_t>(child, parent));
+}
+
+int32_t MemoryVaultStore::erase_ref(uint32_t parent, uint32_t child) {
+  int32_t removed = 0;
+  std::multimap<uint32_t, VaultFetchRefs_VaultRef>::iterator c_iter = m_children.lower_bound(parent);
+  while (c_iter != m_children.end() && c_iter->first == parent) {
+    if (c_iter->second.child == child) {
+      m_children.erase(c_iter++);
+      removed++;
+    } else {
+      c_iter++;
+    }
+  }
+  std::multimap<uint32_t, uint32_t>::iterator p_iter = m_parents.lower_bound(child);
+  while (p_iter != m_parents.end() && p_iter->first == child) {
+    if (p_iter->second == parent) {
+      m_parents.erase(p_iter++);
+    } else {
+      p_iter++;
+    }
+  }
+  return removed;
+}
+
+void MemoryVaultStore::erase_node(uint32_t nodeid) {
+  std::map<uint32_t, VaultNode*>::iterator iter = m_nodes.find(nodeid);
+  if (iter != m_nodes.end()) {
+    delete iter->second;
+    m_nodes.erase(iter);
+  }
+}
+
+/*
+ * operations
+ */
+
+void MemoryVaultStore::fetch_node(uint32_t nodeid, status_code_t &result, VaultNode &node) {
+  std::map<uint32_t, VaultNode*>::const_iterator iter = m_nodes.find(nodeid);
+  if (iter == m_nodes.end()) {
+    result = ERROR_NODE_NOT_FOUND;
+    return;
+  }
+  copy_node(node, *iter->second);
+  result = NO_ERROR;
+}
+
+void MemoryVaultStore::fetch_nodes(const std::vector<uint32_t> &nodeids, status_code_t &result,
+    std::map<uint32_t, VaultNode*> &nodes) {
+  for (std::vector<uint32_t>::const_iterator id = nodeids.begin(); id != nodeids.end(); id++) {
+    std::map<uint32_t, VaultNode*>::const_iterator iter = m_nodes.find(*id);
+    if (iter == m_nodes.end() || nodes.find(*id) != nodes.end()) {
+      continue;
+    }
+    VaultNode *node = new VaultNode();
+    copy_node(*node, *iter->second);
+    nodes[*id] = node;
+  }
+  result = NO_ERROR;
+}
+
+void MemoryVaultStore::fetch_refs(uint32_t nodeid, status_code_t &result, std::vector<VaultFetchRefs_VaultRef> &refs) {
+  // depth-first, each ref followed by the tree under its child, as
+  // fetchnoderefs() does; a node's subtree is only listed once, so a loop
+  // in the refs cannot run forever
+  std::set<uint32_t> seen;
+  std::vector<std::pair<std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator,
+      std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator> > stack;
+
+  seen.insert(nodeid);
+  stack.push_back(m_children.equal_range(nodeid));
+  while (!stack.empty()) {
+    if (stack.back().first == stack.back().second) {
+      stack.pop_back();
+      continue;
+    }
+    const VaultFetchRefs_VaultRef &ref = stack.back().first->second;
+    stack.back().first++;
+    refs.push_back(ref);
+    if (seen.insert(ref.child).second) {
+      stack.push_back(m_children.equal_range(ref.child));
+    }
+  }
+  result = NO_ERROR;
+}
+
+void MemoryVaultStore::find_playerinfo(uint32_t player, status_code_t &result, uint32_t &nodeid) {
+  status_code_t found = ERROR_NODE_NOT_FOUND;
+  std::pair<std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator,
+      std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator> range = m_children.equal_range(player);
+  for (std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator iter = range.first; iter != range.second; iter++) {
+    std::map<uint32_t, VaultNode*>::const_iterator n_iter = m_nodes.find(iter->second.child);
+    if (n_iter != m_nodes.end() && n_iter->second->type() == VaultNode::PlayerInfoNode) {
+      if (found == NO_ERROR) {
+        found = ERROR_INVALID_DATA;
+        break;
+      }
+      nodeid = iter->second.child;
+      found = NO_ERROR;
+    }
+  }
+  result = found;
+}
+
+void MemoryVaultStore::find_nodes(const VaultNode *templ, status_code_t &result, std::vector<uint32_t> &found) {
+  VaultNode::vault_nodetype_t ntype = templ->type();
+  if (ntype == VaultNode::InvalidNode) {
+    log_warn(m_log, "Denying a VaultNodeFind without the node type!\n");
+    result = ERROR_FORBIDDEN;
+    return;
+  }
+  // as with the DB, CreateTime and ModifyTime are not searchable
+  uint32_t findbits = templ->bitfield1() & VaultNode::all_bits_for_type(ntype) & ~(NodeType | CreateTime | ModifyTime);
+
+  for (std::map<uint32_t, VaultNode*>::const_iterator iter = m_nodes.begin(); iter != m_nodes.end(); iter++) {
+    const VaultNode *node = iter->second;
+    if (node->type() != ntype || (node->bitfield1() & findbits) != findbits) {
+      continue;
+    }
+    bool match = true;
+    for (uint32_t i = 0; match && i < 32; i++) {
+      vault_bitfield_t bit = (vault_bitfield_t) (1 << i);
+      if (findbits & bit) {
+        match = node->field_equals(*templ, bit, (bit == IString64_1 || bit == IString64_2));
+      }
+    }
+    if (match) {
+      found.push_back(iter->first);
+    }
+  }
+  result = (found.size() > 0 ? NO_ERROR : ERROR_NODE_NOT_FOUND);
+}
+
+void MemoryVaultStore::save_node(uint32_t nodeid, const VaultNode *node, status_code_t &result) {
+  std::map<uint32_t, VaultNode*>::iterator iter = m_nodes.find(nodeid);
+  if (iter == m_nodes.end()) {
+    result = ERROR_NODE_NOT_FOUND;
+    return;
+  }
+  VaultNode *saved = iter->second;
+  uint32_t savebits = node->bitfield1() & storable_bits(saved->type())
+      & ~(NodeID | NodeType | CreateTime | ModifyTime);
+  for (uint32_t i = 0; i < 32; i++) {
+    vault_bitfield_t bit = (vault_bitfield_t) (1 << i);
+    if (savebits & bit) {
+      saved->copy_field(*node, bit);
+    }
+  }
+  saved->num_ref(ModifyTime) = htole32((uint32_t) time(NULL));
+  log_node(nodeid, saved);
+  result = NO_ERROR;
+}
+
+void MemoryVaultStore::create_node(const VaultNode *node, const uint8_t *acctid, kinum_t creator, uint32_t &nodeid) {
+  VaultNode::vault_nodetype_t ntype = node->type();
+  if (ntype == VaultNode::InvalidNode) {
+    nodeid = (uint32_t) ERROR_INVALID_DATA;
+    return;
+  }
+  VaultNode *created = new VaultNode();
+  created->num_ref(NodeType) = htole32(ntype);
+  uint32_t bits = node->bitfield1() & storable_bits(ntype)
+      & ~(NodeID | NodeType | CreateTime | ModifyTime | CreatorAcctID | CreatorID);
+  for (uint32_t i = 0; i < 32; i++) {
+    vault_bitfield_t bit = (vault_bitfield_t) (1 << i);
+    if (bits & bit) {
+      created->copy_field(*node, bit);
+    }
+  }
+  nodeid = new_node(created, acctid, creator);
+}
+
+void MemoryVaultStore::add_ref(uint32_t parent, uint32_t child, uint32_t owner, status_code_t &result) {
+  if (has_ref(parent, child)) {
+    result = ERROR_INVALID_DATA;
+    return;
+  }
+  if (m_nodes.find(parent) == m_nodes.end() || m_nodes.find(child) == m_nodes.end()
+      || (owner != 0 && m_nodes.find(owner) == m_nodes.end())) {
+    result = ERROR_NODE_NOT_FOUND;
+    return;
+  }
+  insert_ref(parent, child, owner);
+  log_op(LOG_ADD_REF, parent, child, owner);
+  result = NO_ERROR;
+}
+
+void MemoryVaultStore::remove_ref(uint32_t parent, uint32_t child, int32_t &removed) {
+  removed = erase_ref(parent, child);
+  if (removed == 0) {
+    return;
+  }
+  log_op(LOG_DEL_REF, parent, child);
+  // like removenode(), taking an AgeLink away deletes its age, unless it
+  // still has owners or visitors
+  const VaultNode *node = get_node(child);
+  if (node && node->type() == VaultNode::AgeLinkNode) {
+    uint32_t info = child_of_type(child, VaultNode::AgeInfoNode);
+    if (info) {
+      status_code_t ignored;
+      unlink(child, info);
+      delete_age(info, ignored);
+    }
+  }
+  // and delete the child if nothing refers to it any more and it has no
+  // children
+  if (m_parents.find(child) == m_parents.end() && m_children.find(child) == m_children.end()
+      && m_nodes.find(child) != m_nodes.end()) {
+    erase_node(child);
+    log_op(LOG_DEL_NODE, child);
+  }
+}
+
+void MemoryVaultStore::dump(std::map<uint32_t, VaultNode*> &nodes, std::vector<VaultFetchRefs_VaultRef> &refs) {
+  for (std::map<uint32_t, VaultNode*>::const_iterator iter = m_nodes.begin(); iter != m_nodes.end(); iter++) {
+    VaultNode *node = new VaultNode();
+    copy_node(*node, *iter->second);
+    nodes[iter->first] = node;
+  }
+  refs.reserve(m_children.size());
+  for (std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator iter = m_children.begin(); iter != m_children.end();
+      iter++) {
+    refs.push_back(iter->second);
+  }
+}
+
+/*
+ * the schema operations
+ *
+ * These do what the stored procedures in postgresql/moss.sql do, so the
+ * trees built here look the same to the clients as the DB's.
+ */
+
+// the Folder, PlayerInfoList and AgeInfoList types (Int32_1) used here
+typedef enum {
+  InboxFolder = 1,
+  BuddyList = 2,
+  IgnoreList = 3,
+  PeopleIKnowAboutList = 4,
+  ChronicleFolder = 6,
+  AvatarOutfitFolder = 7,
+  SubAgesList = 9,
+  AllPlayersList = 12,
+  AgeJournalsFolder = 14,
+  AgeDevicesFolder = 15,
+  CanVisitList = 18,
+  AgeOwnersList = 19,
+  GlobalSDLFolder = 20,
+  AgesIOwnList = 23,
+  AgesICanVisitList = 24,
+  AvatarClosetFolder = 25,
+  PlayerInviteFolder = 28,
+  ChildAgesList = 31,
+  GameScoresFolder = 32
+} folder_type_t;
+
+// deleteage() leaves these alone
+static const char *static_age_uuids[] = {
+  "35624301-841e-4a07-8db6-b735cf8f1f53",
+  "381fb1ba-20a0-45fd-9bcb-fd5922439d05",
+  "e8306311-56d3-4954-a32d-3da01712e9b5",
+  "9420324e-11f8-41f9-b30b-c896171a8712",
+  "5cf4f457-d546-47dc-80eb-a07cdfefa95d",
+  "68e219e0-ee25-4df0-b855-0435584e29e2",
+  "e8a2aaed-5cab-40b6-97f3-6d19dd92a71f",
+  NULL
+};
+
+// the tops of the notifier trees; nothing else ever deletes these
+static bool is_top(VaultNode::vault_nodetype_t type) {
+  return (type == VaultNode::PlayerNode || type == VaultNode::SystemNode || type == VaultNode::AgeNode
+      || type == VaultNode::AgeInfoNode);
+}
+
+static void set_string(VaultNode &node, vault_bitfield_t bit, const char *value) {
+  UruString str(value);
+  size_t len = str.send_len(false, true, true);
+  memcpy(node.data_ptr(bit, len), str.get_str(false, true, true), len);
+}
+
+// an unset field reads as the empty string
+static void get_string(const VaultNode *node, vault_bitfield_t bit, UruString &value) {
+  if (node->bitfield1() & bit) {
+    const uint8_t *data = node->const_data_ptr(bit);
+    UruString str(data + 4, read32(data, 0), false, true, false);
+    value = str.c_str();
+  } else {
+    value = "";
+  }
+}
+
+static bool string_is(const VaultNode *node, vault_bitfield_t bit, const char *value) {
+  if (!(node->bitfield1() & bit)) {
+    return false;
+  }
+  VaultNode other;
+  set_string(other, bit, value);
+  return node->field_equals(other, bit);
+}
+
+static bool int_is(const VaultNode *node, vault_bitfield_t bit, int32_t value) {
+  return ((node->bitfield1() & bit) && (int32_t) node->num_val(bit) == value);
+}
+
+static bool uuid_is(const VaultNode *node, vault_bitfield_t bit, const uint8_t *uuid) {
+  return ((node->bitfield1() & bit) && !memcmp(node->const_uuid_ptr(bit), uuid, UUID_RAW_LEN));
+}
+
+// the blob is kept with its length in front, as in the DB
+static void copy_blob(const VaultNode *node, uint8_t **outbuf, uint32_t &buflen) {
+  if (!(node->bitfield1() & Blob_1)) {
+    return;
+  }
+  const uint8_t *data = node->const_data_ptr(Blob_1);
+  buflen = read32(data, 0);
+  *outbuf = new uint8_t[buflen];
+  memcpy(*outbuf, data + 4, buflen);
+}
+
+const VaultNode* MemoryVaultStore::get_node(uint32_t nodeid) const {
+  std::map<uint32_t, VaultNode*>::const_iterator iter = m_nodes.find(nodeid);
+  return (iter == m_nodes.end() ? NULL : iter->second);
+}
+
+// the store takes node, which must have its type set; the ID, times and
+// creator are filled in
+uint32_t MemoryVaultStore::new_node(VaultNode *node, const uint8_t *acctid, uint32_t creator) {
+  uint32_t id = m_next_id++;
+  uint32_t now = (uint32_t) time(NULL);
+
+  node->num_ref(NodeID) = htole32(id);
+  node->num_ref(CreateTime) = htole32(now);
+  node->num_ref(ModifyTime) = htole32(now);
+  memcpy(node->uuid_ptr(CreatorAcctID), acctid, UUID_RAW_LEN);
+  node->num_ref(CreatorID) = htole32(creator);
+  put_node(id, node);
+  log_node(id, node);
+  return id;
+}
+
+uint32_t MemoryVaultStore::new_list(VaultNode::vault_nodetype_t type, int32_t list_type, uint32_t parent, uint32_t owner,
+    const uint8_t *acctid, uint32_t creator) {
+  VaultNode *node = new VaultNode();
+  node->num_ref(NodeType) = htole32(type);
+  node->num_ref(Int32_1) = htole32((uint32_t) list_type);
+  uint32_t id = new_node(node, acctid, creator);
+  link(parent, id, owner);
+  return id;
+}
+
+// the AgeLink for one of a new player's ages; the client fills in the
+// link points where there is no default spawn point
+uint32_t MemoryVaultStore::new_agelink(uint32_t parent, kinum_t kinum, const uint8_t *acctid, bool default_spawn) {
+  static const char spawn[] = "Default:LinkInPointDefault:;";
+
+  VaultNode *node = new VaultNode();
+  node->num_ref(NodeType) = htole32(VaultNode::AgeLinkNode);
+  node->num_ref(Int32_1) = htole32(0);
+  if (default_spawn) {
+    memcpy(node->data_ptr(Blob_1, sizeof(spawn) - 1), spawn, sizeof(spawn) - 1);
+  }
+  uint32_t id = new_node(node, acctid, kinum);
+  link(parent, id, kinum);
+  return id;
+}
+
+void MemoryVaultStore::link(uint32_t parent, uint32_t child, uint32_t owner) {
+  if (!has_ref(parent, child)) {
+    insert_ref(parent, child, owner);
+    log_op(LOG_ADD_REF, parent, child, owner);
+  }
+}
+
+void MemoryVaultStore::unlink(uint32_t parent, uint32_t child) {
+  if (erase_ref(parent, child)) {
+    log_op(LOG_DEL_REF, parent, child);
+  }
+}
+
+// a copy, for callers that change the refs as they go
+void MemoryVaultStore::children(uint32_t parent, std::vector<uint32_t> &kids) const {
+  std::pair<std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator,
+      std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator> range = m_children.equal_range(parent);
+  for (std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator iter = range.first; iter != range.second; iter++) {
+    kids.push_back(iter->second.child);
+  }
+}
+
+uint32_t MemoryVaultStore::child_list(uint32_t parent, VaultNode::vault_nodetype_t type, int32_t list_type) const {
+  std::pair<std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator,
+      std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator> range = m_children.equal_range(parent);
+  for (std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator iter = range.first; iter != range.second; iter++) {
+    const VaultNode *node = get_node(iter->second.child);
+    if (node && node->type() == type && int_is(node, Int32_1, list_type)) {
+      return iter->second.child;
+    }
+  }
+  return 0;
+}
+
+uint32_t MemoryVaultStore::child_of_type(uint32_t parent, VaultNode::vault_nodetype_t type) const {
+  std::pair<std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator,
+      std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator> range = m_children.equal_range(parent);
+  for (std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator iter = range.first; iter != range.second; iter++) {
+    const VaultNode *node = get_node(iter->second.child);
+    if (node && node->type() == type) {
+      return iter->second.child;
+    }
+  }
+  return 0;
+}
+
+uint32_t MemoryVaultStore::parent_of_type(uint32_t child, VaultNode::vault_nodetype_t type) const {
+  std::pair<std::multimap<uint32_t, uint32_t>::const_iterator, std::multimap<uint32_t, uint32_t>::const_iterator> range =
+      m_parents.equal_range(child);
+  for (std::multimap<uint32_t, uint32_t>::const_iterator iter = range.first; iter != range.second; iter++) {
+    const VaultNode *node = get_node(iter->second);
+    if (node && node->type() == type) {
+      return iter->second;
+    }
+  }
+  return 0;
+}
+
+size_t MemoryVaultStore::child_count(uint32_t parent) const {
+  return m_children.count(parent);
+}
+
+uint32_t MemoryVaultStore::last_in_sequence(const VaultNode &templ) {
+  status_code_t ignored;
+  std::vector<uint32_t> found;
+  find_nodes(&templ, ignored, found);
+  uint32_t last = 0;
+  int32_t last_seq = 0;
+  for (std::vector<uint32_t>::const_iterator iter = found.begin(); iter != found.end(); iter++) {
+    int32_t seq = (int32_t) get_node(*iter)->num_val(Int32_1);
+    if (!last || seq > last_seq) {
+      last = *iter;
+      last_seq = seq;
+    }
+  }
+  return last;
+}
+
+// Unlink top from everything and delete it, along with whatever under it
+// is left without a parent. Other tops (the System node, players, ages)
+// are only unlinked.
+void MemoryVaultStore::remove_tree(uint32_t top) {
+  std::vector<uint32_t> kids;
+  children(top, kids);
+  for (std::vector<uint32_t>::const_iterator iter = kids.begin(); iter != kids.end(); iter++) {
+    unlink(top, *iter);
+    const VaultNode *node = get_node(*iter);
+    if (node && !is_top(node->type()) && m_parents.find(*iter) == m_parents.end()) {
+      remove_tree(*iter);
+    }
+  }
+  std::vector<uint32_t> parents;
+  std::pair<std::multimap<uint32_t, uint32_t>::const_iterator, std::multimap<uint32_t, uint32_t>::const_iterator> range =
+      m_parents.equal_range(top);
+  for (std::multimap<uint32_t, uint32_t>::const_iterator iter = range.first; iter != range.second; iter++) {
+    parents.push_back(iter->second);
+  }
+  for (std::vector<uint32_t>::const_iterator iter = parents.begin(); iter != parents.end(); iter++) {
+    unlink(*iter, top);
+  }
+  // a loop in the refs can bring us back here
+  if (m_nodes.find(top) != m_nodes.end()) {
+    erase_node(top);
+    log_op(LOG_DEL_NODE, top);
+  }
+}
+
+// The top of the tree the parent is in. The DB works this out once, when
+// a ref is added (see addnode()), and keeps it in the ref; this follows the
+// first parents up instead, which comes to the same thing for the trees
+// the stored procedures build.
+uint32_t MemoryVaultStore::notifier(uint32_t parent) const {
+  // the depth limit is only there in case of a loop in the refs
+  for (uint32_t depth = 0; depth < 64; depth++) {
+    const VaultNode *node = get_node(parent);
+    if (!node) {
+      return 0;
+    }
+    if (is_top(node->type())) {
+      return parent;
+    }
+    std::multimap<uint32_t, uint32_t>::const_iterator iter = m_parents.lower_bound(parent);
+    if (iter == m_parents.end() || iter->first != parent) {
+      return 0;
+    }
+    parent = iter->second;
+  }
+  return 0;
+}
+
+// the notifiers of all the refs to nodeid
+void MemoryVaultStore::notifiers(uint32_t nodeid, std::set<uint32_t> &tops) const {
+  std::pair<std::multimap<uint32_t, uint32_t>::const_iterator, std::multimap<uint32_t, uint32_t>::const_iterator> range =
+      m_parents.equal_range(nodeid);
+  for (std::multimap<uint32_t, uint32_t>::const_iterator iter = range.first; iter != range.second; iter++) {
+    uint32_t top = notifier(iter->second);
+    if (top) {
+      tops.insert(top);
+    }
+  }
+}
+
+void MemoryVaultStore::acct_players(const uint8_t *acctid, std::list<AuthAcctLogin_PlayerQuery_Player> &players) {
+  VaultNode templ;
+  templ.num_ref(NodeType) = htole32(VaultNode::PlayerNode);
+  memcpy(templ.uuid_ptr(UUID_1), acctid, UUID_RAW_LEN);
+  status_code_t ignored;
+  std::vector<uint32_t> found;
+  find_nodes(&templ, ignored, found);
+
+  for (std::vector<uint32_t>::const_iterator iter = found.begin(); iter != found.end(); iter++) {
+    const VaultNode *node = get_node(*iter);
+    AuthAcctLogin_PlayerQuery_Player player;
+    player.kinum = *iter;
+    get_string(node, IString64_1, player.name);
+    get_string(node, String64_1, player.gender);
+    player.explorer_type = (customer_type_t) node->num_val(Int32_2);
+    players.push_back(player);
+  }
+}
+
+void MemoryVaultStore::validate_ki(const uint8_t *acctid, kinum_t kinum, status_code_t &result, UruString &name) {
+  const VaultNode *node = get_node(kinum);
+  if (node && node->type() == VaultNode::PlayerNode && uuid_is(node, UUID_1, acctid)) {
+    get_string(node, IString64_1, name);
+    result = NO_ERROR;
+  } else {
+    result = ERROR_PLAYER_NOT_FOUND;
+  }
+}
+
+void MemoryVaultStore::player_connected(kinum_t kinum, status_code_t &result) {
+  m_connected.insert(kinum);
+  result = NO_ERROR;
+}
+
+void MemoryVaultStore::player_offline(kinum_t kinum, bool &was_online, uint32_t &info_node, status_code_t &result) {
+  m_connected.erase(kinum);
+
+  status_code_t found;
+  uint32_t info = 0;
+  find_playerinfo(kinum, found, info);
+  if (found != NO_ERROR && found != ERROR_INVALID_DATA) {
+    result = ERROR_NODE_NOT_FOUND;
+    return;
+  }
+  VaultNode *node = m_nodes[info];
+  was_online = ((node->bitfield1() & Int32_1) && node->num_val(Int32_1) != 0);
+  node->num_ref(Int32_1) = htole32(0);
+  memset(node->uuid_ptr(UUID_1), 0, UUID_RAW_LEN);
+  set_string(*node, String64_1, "");
+  log_node(info, node);
+  info_node = info;
+  result = NO_ERROR;
+}
+
+void MemoryVaultStore::create_player(const uint8_t *acctid, const char *name, const char *gender,
+    AuthAcctLogin_PlayerQuery_Player &player, uint32_t &neighbors_list, uint32_t &info_node) {
+  status_code_t ignored;
+  std::vector<uint32_t> found;
+
+  VaultNode templ;
+  templ.num_ref(NodeType) = htole32(VaultNode::SystemNode);
+  find_nodes(&templ, ignored, found);
+  if (found.size() == 0) {
+    // we have to have a System node
+    player.kinum = ERROR_INTERNAL;
+    return;
+  }
+  uint32_t system = found[0];
+
+  VaultNode acct_templ;
+  acct_templ.num_ref(NodeType) = htole32(VaultNode::PlayerNode);
+  memcpy(acct_templ.uuid_ptr(UUID_1), acctid, UUID_RAW_LEN);
+  found.clear();
+  find_nodes(&acct_templ, ignored, found);
+  if (found.size() > 4) {
+    player.kinum = ERROR_MAX_PLAYERS;
+    return;
+  }
+
+  VaultNode name_templ;
+  name_templ.num_ref(NodeType) = htole32(VaultNode::PlayerNode);
+  set_string(name_templ, IString64_1, name);
+  found.clear();
+  find_nodes(&name_templ, ignored, found);
+  if (found.size() > 0) {
+    player.kinum = ERROR_PLAYER_EXISTS;
+    return;
+  }
+
+  // createplayer() makes players of visitor accounts visitors, but
+  // accounts are not in the vault; everyone here is an explorer
+  VaultNode *node = new VaultNode();
+  node->num_ref(NodeType) = htole32(VaultNode::PlayerNode);
+  node->num_ref(Int32_1) = htole32(0);
+  node->num_ref(Int32_2) = htole32(PAYING_CUSTOMER);
+  node->num_ref(UInt32_1) = htole32(0);
+  memcpy(node->uuid_ptr(UUID_1), acctid, UUID_RAW_LEN);
+  set_string(*node, String64_1, gender);
+  set_string(*node, IString64_1, name);
+  // as in the DB, the player node's creator is 0
+  kinum_t ki = new_node(node, acctid, 0);
+  link(ki, system, 0);
+
+  node = new VaultNode();
+  node->num_ref(NodeType) = htole32(VaultNode::PlayerInfoNode);
+  node->num_ref(UInt32_1) = htole32(ki);
+  set_string(*node, IString64_1, name);
+  uint32_t pinfo = new_node(node, acctid, ki);
+  link(ki, pinfo, ki);
+
+  VaultNode all_templ;
+  all_templ.num_ref(NodeType) = htole32(VaultNode::PlayerInfoListNode);
+  all_templ.num_ref(Int32_1) = htole32(AllPlayersList);
+  found.clear();
+  find_nodes(&all_templ, ignored, found);
+  if (found.size() > 0) {
+    link(found[0], pinfo, 0);
+  }
+
+  new_list(VaultNode::PlayerInfoListNode, BuddyList, ki, ki, acctid, ki);
+  new_list(VaultNode::FolderNode, AgeJournalsFolder, ki, ki, acctid, ki);
+  new_list(VaultNode::FolderNode, AvatarClosetFolder, ki, ki, acctid, ki);
+  new_list(VaultNode::FolderNode, ChronicleFolder, ki, ki, acctid, ki);
+  uint32_t owned = new_list(VaultNode::AgeInfoListNode, AgesIOwnList, ki, ki, acctid, ki);
+
+  uint8_t uuid[UUID_RAW_LEN];
+  uint32_t age;
+  status_code_t age_result;
+
+  // the newest DRC hood, or a new one if it is full
+  uint32_t agelink = new_agelink(owned, ki, acctid, true);
+  VaultNode hood_templ;
+  hood_templ.num_ref(NodeType) = htole32(VaultNode::AgeInfoNode);
+  set_string(hood_templ, String64_2, "Neighborhood");
+  set_string(hood_templ, String64_3, "Bevin");
+  set_string(hood_templ, String64_4, "DRC");
+  uint32_t hood = last_in_sequence(hood_templ);
+  uint32_t neighbors = (hood ? child_list(hood, VaultNode::PlayerInfoListNode, AgeOwnersList) : 0);
+  if (!hood || child_count(neighbors) > 20) {
+    gen_uuid(uuid, 0);
+    create_age("Neighborhood", "Bevin", "DRC", "", uuid, NULL, age, hood, age_result);
+    neighbors = child_list(hood, VaultNode::PlayerInfoListNode, AgeOwnersList);
+  }
+  link(agelink, hood, ki);
+  if (neighbors) {
+    link(neighbors, pinfo, ki);
+  }
+
+  // the Relto
+  agelink = new_agelink(owned, ki, acctid, true);
+  std::string user_defined(name);
+  user_defined += "'s";
+  std::string display(user_defined + " Relto");
+  uint32_t relto;
+  gen_uuid(uuid, 0);
+  create_age("Personal", "Relto", user_defined.c_str(), display.c_str(), uuid, NULL, age, relto, age_result);
+  link(agelink, relto, ki);
+  uint32_t owners = child_list(relto, VaultNode::PlayerInfoListNode, AgeOwnersList);
+  if (owners) {
+    link(owners, pinfo, ki);
+  }
+  // AgesIOwn is under the Relto age as well
+  link(age, owned, ki);
+
+  // the city; the client fills in this link
+  agelink = new_agelink(owned, ki, acctid, false);
+  VaultNode city_templ;
+  city_templ.num_ref(NodeType) = htole32(VaultNode::AgeInfoNode);
+  set_string(city_templ, String64_2, "city");
+  set_string(city_templ, String64_3, "Ae'gura");
+  city_templ.num_ref(Int32_2) = htole32(1);
+  found.clear();
+  find_nodes(&city_templ, ignored, found);
+  for (std::vector<uint32_t>::const_iterator iter = found.begin(); iter != found.end(); iter++) {
+    if (!(get_node(*iter)->bitfield1() & String64_4)) {
+      link(agelink, *iter, ki);
+      break;
+    }
+  }
+
+  new_list(VaultNode::AgeInfoListNode, AgesICanVisitList, ki, ki, acctid, ki);
+  new_list(VaultNode::PlayerInfoListNode, IgnoreList, ki, ki, acctid, ki);
+  new_list(VaultNode::FolderNode, InboxFolder, ki, ki, acctid, ki);
+  new_list(VaultNode::FolderNode, PlayerInviteFolder, ki, ki, acctid, ki);
+  new_list(VaultNode::PlayerInfoListNode, PeopleIKnowAboutList, ki, ki, acctid, ki);
+  new_list(VaultNode::FolderNode, AvatarOutfitFolder, ki, ki, acctid, ki);
+
+  player.kinum = ki;
+  player.name = name;
+  player.gender = gender;
+  player.explorer_type = PAYING_CUSTOMER;
+  neighbors_list = neighbors;
+  info_node = pinfo;
+}
+
+// Unlike deleteplayer(), this also takes the PlayerInfo out of other
+// players' lists, as they are told it is gone. Marker game templates and
+// scores are in the DB and are not deleted.
+void MemoryVaultStore::delete_player(kinum_t kinum, status_code_t &result, std::multimap<kinum_t, uint32_t> &tell_who,
+    uint32_t &info_node) {
+  const VaultNode *player = get_node(kinum);
+  if (!player || player->type() != VaultNode::PlayerNode) {
+    result = ERROR_NODE_NOT_FOUND;
+    return;
+  }
+  status_code_t found;
+  uint32_t pinfo = 0;
+  find_playerinfo(kinum, found, pinfo);
+
+  if (pinfo) {
+    std::vector<uint32_t> lists;
+    std::pair<std::multimap<uint32_t, uint32_t>::const_iterator, std::multimap<uint32_t, uint32_t>::const_iterator> range =
+        m_parents.equal_range(pinfo);
+    for (std::multimap<uint32_t, uint32_t>::const_iterator iter = range.first; iter != range.second; iter++) {
+      if (iter->second != kinum) {
+        lists.push_back(iter->second);
+      }
+    }
+    for (std::vector<uint32_t>::const_iterator iter = lists.begin(); iter != lists.end(); iter++) {
+      const VaultNode *list = get_node(*iter);
+      if (list && list->type() == VaultNode::PlayerInfoListNode) {
+        int32_t list_type = (int32_t) list->num_val(Int32_1);
+        if (list_type == BuddyList || list_type == IgnoreList || list_type == PeopleIKnowAboutList) {
+          // the list's player
+          kinum_t owner = list->num_val(CreatorID);
+          if (m_connected.find(owner) != m_connected.end()) {
+            tell_who.insert(std::pair<kinum_t, uint32_t>(owner, *iter));
+          }
+        } else if (list_type == CanVisitList || list_type == AgeOwnersList) {
+          // the age's other owners
+          uint32_t info = parent_of_type(*iter, VaultNode::AgeInfoNode);
+          uint32_t owners = (info ? child_list(info, VaultNode::PlayerInfoListNode, AgeOwnersList) : 0);
+          std::vector<uint32_t> infos;
+          if (owners) {
+            children(owners, infos);
+          }
+          for (std::vector<uint32_t>::const_iterator o_iter = infos.begin(); o_iter != infos.end(); o_iter++) {
+            const VaultNode *other = get_node(*o_iter);
+            if (*o_iter != pinfo && other && other->type() == VaultNode::PlayerInfoNode
+                && m_connected.find(other->num_val(UInt32_1)) != m_connected.end()) {
+              tell_who.insert(std::pair<kinum_t, uint32_t>(other->num_val(UInt32_1), *iter));
+            }
+          }
+        }
+      }
+      unlink(*iter, pinfo);
+    }
+  }
+
+  // taking the links out of AgesIOwn deletes the ages nobody else owns, as
+  // removenode() does
+  uint32_t owned = child_list(kinum, VaultNode::AgeInfoListNode, AgesIOwnList);
+  if (owned) {
+    std::vector<uint32_t> links;
+    children(owned, links);
+    for (std::vector<uint32_t>::const_iterator iter = links.begin(); iter != links.end(); iter++) {
+      int32_t removed;
+      remove_ref(owned, *iter, removed);
+    }
+  }
+
+  remove_tree(kinum);
+  info_node = pinfo;
+  result = NO_ERROR;
+}
+
+void MemoryVaultStore::create_age(const char *filename, const char *instance, const char *user_defined,
+    const char *display, const uint8_t *createuuid, const uint8_t *parentuuid, uint32_t &age_node,
+    uint32_t &age_info_node, status_code_t &result) {
+  static const uint8_t null_uuid[UUID_RAW_LEN] = { 0 };
+  status_code_t ignored;
+  std::vector<uint32_t> found;
+
+  VaultNode templ;
+  templ.num_ref(NodeType) = htole32(VaultNode::SystemNode);
+  find_nodes(&templ, ignored, found);
+  if (found.size() == 0) {
+    // we have to have a System node
+    result = ERROR_INTERNAL;
+    return;
+  }
+  uint32_t system = found[0];
+
+  bool child = (!memcmp(createuuid, null_uuid, UUID_RAW_LEN) && parentuuid
+      && memcmp(parentuuid, null_uuid, UUID_RAW_LEN));
+  uint8_t ageuuid[UUID_RAW_LEN];
+  VaultNode age_templ;
+  age_templ.num_ref(NodeType) = htole32(VaultNode::AgeNode);
+  if (child) {
+    // a child age is found by its parent and filename
+    memcpy(age_templ.uuid_ptr(UUID_2), parentuuid, UUID_RAW_LEN);
+    set_string(age_templ, String64_1, filename);
+    gen_uuid(ageuuid, 0);
+  } else {
+    memcpy(ageuuid, createuuid, UUID_RAW_LEN);
+    memcpy(age_templ.uuid_ptr(UUID_1), ageuuid, UUID_RAW_LEN);
+  }
+  found.clear();
+  find_nodes(&age_templ, ignored, found);
+  if (found.size() > 0) {
+    age_node = found[0];
+    age_info_node = child_of_type(age_node, VaultNode::AgeInfoNode);
+    result = NO_ERROR;
+    return;
+  }
+
+  VaultNode *node = new VaultNode();
+  node->num_ref(NodeType) = htole32(VaultNode::AgeNode);
+  memcpy(node->uuid_ptr(UUID_1), ageuuid, UUID_RAW_LEN);
+  if (child) {
+    memcpy(node->uuid_ptr(UUID_2), parentuuid, UUID_RAW_LEN);
+  }
+  set_string(*node, String64_1, filename);
+  // the age is its own creator
+  uint32_t age = new_node(node, ageuuid, m_next_id);
+  link(age, system, 0);
+
+  new_list(VaultNode::FolderNode, AgeDevicesFolder, age, 0, ageuuid, age);
+  new_list(VaultNode::FolderNode, ChronicleFolder, age, 0, ageuuid, age);
+  new_list(VaultNode::AgeInfoListNode, SubAgesList, age, 0, ageuuid, age);
+  new_list(VaultNode::PlayerInfoListNode, PeopleIKnowAboutList, age, 0, ageuuid, age);
+
+  // the DRC hoods and Bahro caves are numbered, and some ages are public
+  int32_t seq = 0;
+  bool is_public = false;
+  bool global_city = (!strcmp(filename, "city") && !strcmp(instance, "Ae'gura") && !user_defined);
+  VaultNode seq_templ;
+  seq_templ.num_ref(NodeType) = htole32(VaultNode::AgeInfoNode);
+  if (!strcmp(filename, "Neighborhood") && user_defined && !strcmp(user_defined, "DRC")) {
+    set_string(seq_templ, String64_2, "Neighborhood");
+    set_string(seq_templ, String64_3, "Bevin");
+    set_string(seq_templ, String64_4, "DRC");
+    uint32_t last = last_in_sequence(seq_templ);
+    seq = (last ? (int32_t) get_node(last)->num_val(Int32_1) + 1 : 1);
+    is_public = true;
+  } else if (global_city
+      || (!strcmp(filename, "Neighborhood02") && !strcmp(instance, "Kirel") && !user_defined)
+      || (!strcmp(filename, "GreatTreePub") && !strcmp(instance, "The Watcher's Pub") && !user_defined)) {
+    is_public = true;
+  } else if ((!strcmp(filename, "BahroCave") || !strcmp(filename, "LiveBahroCaves")) && !strcmp(instance, filename)
+      && user_defined && !strcmp(user_defined, filename) && !strcmp(display, filename)) {
+    set_string(seq_templ, String64_2, filename);
+    set_string(seq_templ, String64_4, filename);
+    set_string(seq_templ, Text_1, filename);
+    uint32_t last = last_in_sequence(seq_templ);
+    seq = (last ? (int32_t) get_node(last)->num_val(Int32_1) + 1 : 1);
+  } else if (!strcmp(filename, "Neighborhood") && user_defined) {
+    // a player's own hood
+    is_public = true;
+  }
+
+  node = new VaultNode();
+  node->num_ref(NodeType) = htole32(VaultNode::AgeInfoNode);
+  node->num_ref(Int32_1) = htole32((uint32_t) seq);
+  if (is_public) {
+    node->num_ref(Int32_2) = htole32(1);
+  }
+  node->num_ref(Int32_3) = htole32((uint32_t) -1);
+  node->num_ref(UInt32_1) = htole32(age);
+  node->num_ref(UInt32_2) = htole32(0);
+  node->num_ref(UInt32_3) = htole32(0);
+  memcpy(node->uuid_ptr(UUID_1), ageuuid, UUID_RAW_LEN);
+  if (child) {
+    memcpy(node->uuid_ptr(UUID_2), parentuuid, UUID_RAW_LEN);
+  }
+  set_string(*node, String64_2, filename);
+  set_string(*node, String64_3, instance);
+  if (user_defined) {
+    set_string(*node, String64_4, user_defined);
+  }
+  set_string(*node, Text_1, display);
+  uint32_t info = new_node(node, ageuuid, age);
+  link(age, info, 0);
+
+  new_list(VaultNode::PlayerInfoListNode, CanVisitList, info, 0, ageuuid, age);
+  node = new VaultNode();
+  node->num_ref(NodeType) = htole32(VaultNode::SDLNode);
+  memcpy(node->uuid_ptr(CreateAgeUUID), ageuuid, UUID_RAW_LEN);
+  set_string(*node, CreateAgeName, filename);
+  node->num_ref(Int32_1) = htole32(0);
+  set_string(*node, String64_1, filename);
+  link(info, new_node(node, ageuuid, age), 0);
+  new_list(VaultNode::PlayerInfoListNode, AgeOwnersList, info, 0, ageuuid, age);
+  new_list(VaultNode::AgeInfoListNode, ChildAgesList, info, 0, ageuuid, age);
+  if (global_city) {
+    new_list(VaultNode::FolderNode, GameScoresFolder, info, 0, ageuuid, age);
+  }
+
+  age_node = age;
+  age_info_node = info;
+  result = NO_ERROR;
+}
+
+void MemoryVaultStore::age_list(UruString &filename, status_code_t &result, std::vector<VaultAgeList_AgeInfo> &ages) {
+  VaultNode templ;
+  templ.num_ref(NodeType) = htole32(VaultNode::AgeInfoNode);
+  set_string(templ, String64_2, filename.c_str());
+  templ.num_ref(Int32_2) = htole32(1);
+  status_code_t ignored;
+  std::vector<uint32_t> found;
+  find_nodes(&templ, ignored, found);
+
+  // the most recently changed first; MOUL sends at most 50
+  std::vector<std::pair<uint32_t, uint32_t> > by_time;
+  for (std::vector<uint32_t>::const_iterator iter = found.begin(); iter != found.end(); iter++) {
+    by_time.push_back(std::pair<uint32_t, uint32_t>(get_node(*iter)->num_val(ModifyTime), *iter));
+  }
+  std::sort(by_time.begin(), by_time.end(), std::greater<std::pair<uint32_t, uint32_t> >());
+  if (by_time.size() > 50) {
+    by_time.resize(50);
+  }
+
+  ages.reserve(by_time.size());
+  for (std::vector<std::pair<uint32_t, uint32_t> >::const_iterator iter = by_time.begin(); iter != by_time.end();
+      iter++) {
+    const VaultNode *node = get_node(iter->second);
+    VaultAgeList_AgeInfo age;
+    if (node->bitfield1() & UUID_1) {
+      memcpy(age.uuid, node->const_uuid_ptr(UUID_1), UUID_RAW_LEN);
+    } else {
+      memset(age.uuid, 0, UUID_RAW_LEN);
+    }
+    get_string(node, String64_3, age.instance_name);
+    get_string(node, String64_4, age.user_defined);
+    get_string(node, Text_1, age.display_name);
+    age.instance_num = node->num_val(Int32_1);
+    uint32_t owners = child_list(iter->second, VaultNode::PlayerInfoListNode, AgeOwnersList);
+    age.num_owners = (owners ? child_count(owners) : 0);
+    ages.push_back(age);
+  }
+  result = NO_ERROR;
+}
+
+void MemoryVaultStore::set_age_public(uint32_t age_info_node, bool to_public, status_code_t &result) {
+  std::map<uint32_t, VaultNode*>::iterator iter = m_nodes.find(age_info_node);
+  if (iter != m_nodes.end()) {
+    // when setting to private, the value must be 0, not unset (see
+    // VaultSetAgePublic_Request)
+    iter->second->num_ref(Int32_2) = htole32(to_public ? 1 : 0);
+    iter->second->num_ref(ModifyTime) = htole32((uint32_t) time(NULL));
+    log_node(age_info_node, iter->second);
+  }
+  result = NO_ERROR;
+}
+
+void MemoryVaultStore::age_by_uuid(const uint8_t *uuid, uint32_t &age_node, uint32_t &age_info_node,
+    UruString &filename, status_code_t &result) {
+  VaultNode templ;
+  templ.num_ref(NodeType) = htole32(VaultNode::AgeNode);
+  memcpy(templ.uuid_ptr(UUID_1), uuid, UUID_RAW_LEN);
+  status_code_t ignored;
+  std::vector<uint32_t> found;
+  find_nodes(&templ, ignored, found);
+  if (found.size() == 0) {
+    age_node = 0;
+    age_info_node = 0;
+    filename = "";
+    result = ERROR_AGE_NOT_FOUND;
+    return;
+  }
+  age_node = found[0];
+  age_info_node = child_of_type(age_node, VaultNode::AgeInfoNode);
+  get_string(get_node(age_node), String64_1, filename);
+  result = NO_ERROR;
+}
+
+// Hood scores are in the DB and are not deleted.
+void MemoryVaultStore::delete_age(uint32_t age_info_node, status_code_t &result) {
+  result = NO_ERROR;
+  const VaultNode *info = get_node(age_info_node);
+  // the global ages have no String64_4
+  if (!info || info->type() != VaultNode::AgeInfoNode || !(info->bitfield1() & String64_4)) {
+    return;
+  }
+  for (uint32_t i = 0; static_age_uuids[i]; i++) {
+    uint8_t uuid[UUID_RAW_LEN];
+    if (!uuid_string_to_bytes(uuid, UUID_RAW_LEN, static_age_uuids[i], strlen(static_age_uuids[i]), 1, 1)
+        && uuid_is(info, UUID_1, uuid)) {
+      return;
+    }
+  }
+  uint32_t owners = child_list(age_info_node, VaultNode::PlayerInfoListNode, AgeOwnersList);
+  uint32_t visitors = child_list(age_info_node, VaultNode::PlayerInfoListNode, CanVisitList);
+  if ((owners && child_count(owners) > 0) || (visitors && child_count(visitors) > 0)) {
+    return;
+  }
+
+  // child ages and sub-ages go too
+  uint32_t age = parent_of_type(age_info_node, VaultNode::AgeNode);
+  uint32_t lists[2] = { child_list(age_info_node, VaultNode::AgeInfoListNode, ChildAgesList), (
+      age ? child_list(age, VaultNode::AgeInfoListNode, SubAgesList) : 0) };
+  for (uint32_t i = 0; i < 2; i++) {
+    std::vector<uint32_t> links;
+    if (lists[i]) {
+      children(lists[i], links);
+    }
+    for (std::vector<uint32_t>::const_iterator iter = links.begin(); iter != links.end(); iter++) {
+      uint32_t linked = child_of_type(*iter, VaultNode::AgeInfoNode);
+      if (linked) {
+        status_code_t ignored;
+        unlink(*iter, linked);
+        delete_age(linked, ignored);
+      }
+    }
+  }
+
+  remove_tree(age_info_node);
+  if (age) {
+    remove_tree(age);
+  }
+}
+
+void MemoryVaultStore::age_sdl(uint32_t age_info_node, UruString &filename, uint8_t **outbuf, uint32_t &buflen,
+    status_code_t &result) {
+  std::vector<uint32_t> kids;
+  children(age_info_node, kids);
+  for (std::vector<uint32_t>::const_iterator iter = kids.begin(); iter != kids.end(); iter++) {
+    const VaultNode *node = get_node(*iter);
+    if (node && node->type() == VaultNode::SDLNode && string_is(node, String64_1, filename.c_str())) {
+      copy_blob(node, outbuf, buflen);
+      break;
+    }
+  }
+  result = NO_ERROR;
+}
+
+void MemoryVaultStore::global_sdl(UruString &filename, uint8_t **outbuf, uint32_t &buflen, status_code_t &result) {
+  VaultNode templ;
+  templ.num_ref(NodeType) = htole32(VaultNode::FolderNode);
+  templ.num_ref(Int32_1) = htole32(GlobalSDLFolder);
+  status_code_t ignored;
+  std::vector<uint32_t> found;
+  find_nodes(&templ, ignored, found);
+  if (found.size() > 0) {
+    age_sdl(found[0], filename, outbuf, buflen, ignored);
+  }
+  result = NO_ERROR;
+}
+
+void MemoryVaultStore::age_uuid_for(uint32_t sdl_node, uint8_t *uuid, status_code_t &result) {
+  const VaultNode *node = get_node(sdl_node);
+  if (!node || !(node->bitfield1() & CreateAgeUUID)) {
+    result = ERROR_NODE_NOT_FOUND;
+    return;
+  }
+  memcpy(uuid, node->const_uuid_ptr(CreateAgeUUID), UUID_RAW_LEN);
+  result = NO_ERROR;
+}
+
+void MemoryVaultStore::players_referring_to(uint32_t nodeid, status_code_t &result, std::vector<kinum_t> &players) {
+  std::set<uint32_t> tops;
+  notifiers(nodeid, tops);
+  const VaultNode *node = get_node(nodeid);
+  if (node && is_top(node->type())) {
+    tops.insert(nodeid);
+  }
+
+  std::set<kinum_t> kis;
+  for (std::set<uint32_t>::const_iterator iter = tops.begin(); iter != tops.end(); iter++) {
+    const VaultNode *top = get_node(*iter);
+    if (top->type() == VaultNode::SystemNode) {
+      // everyone
+      result = ERROR_MAX_PLAYERS;
+      return;
+    } else if (top->type() == VaultNode::PlayerNode) {
+      if (m_connected.find(*iter) != m_connected.end()) {
+        kis.insert(*iter);
+      }
+    } else if (top->type() == VaultNode::AgeInfoNode) {
+      // the age's owners and visitors
+      uint32_t lists[2] = { child_list(*iter, VaultNode::PlayerInfoListNode, CanVisitList), child_list(*iter,
+          VaultNode::PlayerInfoListNode, AgeOwnersList) };
+      for (uint32_t i = 0; i < 2; i++) {
+        std::vector<uint32_t> infos;
+        if (lists[i]) {
+          children(lists[i], infos);
+        }
+        for (std::vector<uint32_t>::const_iterator i_iter = infos.begin(); i_iter != infos.end(); i_iter++) {
+          const VaultNode *info = get_node(*i_iter);
+          if (info && info->type() == VaultNode::PlayerInfoNode
+              && m_connected.find(info->num_val(UInt32_1)) != m_connected.end()) {
+            kis.insert(info->num_val(UInt32_1));
+          }
+        }
+      }
+    }
+  }
+  players.assign(kis.begin(), kis.end());
+  result = NO_ERROR;
+}
+
+void MemoryVaultStore::age_referring_to(uint32_t nodeid, uint8_t *uuid, status_code_t &result) {
+  const VaultNode *node = get_node(nodeid);
+  // AgeInfo changes are for the players (see notifyage())
+  if (!node || node->type() == VaultNode::AgeInfoNode) {
+    result = ERROR_NODE_NOT_FOUND;
+    return;
+  }
+  std::set<uint32_t> tops;
+  notifiers(nodeid, tops);
+  if (node->type() == VaultNode::AgeNode) {
+    tops.insert(nodeid);
+  }
+  for (std::set<uint32_t>::const_iterator iter = tops.begin(); iter != tops.end(); iter++) {
+    const VaultNode *top = get_node(*iter);
+    if (top->type() == VaultNode::AgeNode) {
+      if (top->bitfield1() & UUID_1) {
+        memcpy(uuid, top->const_uuid_ptr(UUID_1), UUID_RAW_LEN);
+        result = NO_ERROR;
+      } else {
+        result = ERROR_INTERNAL;
+      }
+      return;
+    }
+  }
+  result = ERROR_NODE_NOT_FOUND;
+}
+
+/*
+ * persistence
+ *
+ * Both files start with a magic number and version. The snapshot has the
+ * next node ID, the node count and nodes (ID, length, node as sent on the
+ * wire), then the ref count and refs (parent, child, owner). Each log
+ * record is an op code followed by what it needs: a node (as in the
+ * snapshot), a node ID, or a ref. Everything is little-endian.
+ *
+ * Each log record is flushed as it is written, so nothing is lost if the
+ * backend dies, but nothing is synced to disk either.
+ */
+
+bool MemoryVaultStore::write_node(FILE *f, uint32_t nodeid, const VaultNode *node) {
+  uint32_t len = node->message_len();
+  uint8_t *buf = new uint8_t[len + 8];
+  bool msg_done;
+  uint32_t wrote = node->fill_buffer(buf + 8, len, 0, &msg_done);
+  write32(buf, 0, nodeid);
+  write32(buf, 4, wrote);
+  bool ok = (fwrite(buf, wrote + 8, 1, f) == 1);
+  delete[] buf;
+  return ok;
+}
+
+VaultNode* MemoryVaultStore::read_node(FILE *f, uint32_t *nodeid) {
+  uint8_t header[8];
+  if (fread(header, 8, 1, f) != 1) {
+    return NULL;
+  }
+  *nodeid = read32(header, 0);
+  uint32_t len = read32(header, 4);
+  if (len < 12 || len > 16 * 1024 * 1024) {
+    return NULL;
+  }
+  uint8_t *buf = new uint8_t[len];
+  VaultNode *node = NULL;
+  if (fread(buf, len, 1, f) == 1 && VaultNode::check_len_by_bitfields(buf, len)) {
+    node = new VaultNode(buf, true);
+  }
+  delete[] buf;
+  return node;
+}
+
+bool MemoryVaultStore::log_write(const uint8_t *buf, size_t len) {
+  if (!m_logfile) {
+    return false;
+  }
+  if (fwrite(buf, len, 1, m_logfile) != 1 || fflush(m_logfile)) {
+    log_err(m_log, "Error writing vault log %s: %s\n", m_log_fname.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void MemoryVaultStore::log_node(uint32_t nodeid, const VaultNode *node) {
+  if (!m_logfile) {
+    return;
+  }
+  uint8_t op[4];
+  write32(op, 0, LOG_PUT_NODE);
+  if (fwrite(op, 4, 1, m_logfile) != 1 || !write_node(m_logfile, nodeid, node) || fflush(m_logfile)) {
+    log_err(m_log, "Error writing vault log %s: %s\n", m_log_fname.c_str(), strerror(errno));
+  }
+  if (++m_log_records >= MEMORY_VAULT_LOG_MAX) {
+    snapshot();
+  }
+}
+
+void MemoryVaultStore::log_op(log_op_t op, uint32_t a, uint32_t b, uint32_t c) {
+  uint8_t buf[16];
+  write32(buf, 0, op);
+  write32(buf, 4, a);
+  write32(buf, 8, b);
+  write32(buf, 12, c);
+  switch (op) {
+  case LOG_DEL_NODE:
+    log_write(buf, 8);
+    break;
+  case LOG_DEL_REF:
+    log_write(buf, 12);
+    break;
+  default:
+    log_write(buf, 16);
+    break;
+  }
+  if (++m_log_records >= MEMORY_VAULT_LOG_MAX) {
+    snapshot();
+  }
+}
+
+bool MemoryVaultStore::replay_log(FILE *f) {
+  uint8_t buf[12];
+  while (fread(buf, 4, 1, f) == 1) {
+    uint32_t op = read32(buf, 0);
+    switch (op) {
+    case LOG_PUT_NODE: {
+      uint32_t nodeid;
+      VaultNode *node = read_node(f, &nodeid);
+      if (!node) {
+        return false;
+      }
+      put_node(nodeid, node);
+    }
+      break;
+    case LOG_DEL_NODE:
+      if (fread(buf, 4, 1, f) != 1) {
+        return false;
+      }
+      erase_node(read32(buf, 0));
+      break;
+    case LOG_ADD_REF:
+      if (fread(buf, 12, 1, f) != 1) {
+        return false;
+      }
+      insert_ref(read32(buf, 0), read32(buf, 4), read32(buf, 8));
+      break;
+    case LOG_DEL_REF:
+      if (fread(buf, 8, 1, f) != 1) {
+        return false;
+      }
+      erase_ref(read32(buf, 0), read32(buf, 4));
+      break;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+int MemoryVaultStore::open(VaultStore *seed) {
+  clear();
+  bool have_data = false;
+  uint8_t header[12];
+
+  FILE *f = fopen(m_snap_fname.c_str(), "rb");
+  if (f) {
+    have_data = true;
+    if (fread(header, 12, 1, f) != 1 || memcmp(header, SNAPSHOT_MAGIC, 8) || read32(header, 8) != STORE_VERSION) {
+      log_err(m_log, "%s is not a vault snapshot\n", m_snap_fname.c_str());
+      fclose(f);
+      return EINVAL;
+    }
+    uint8_t counts[8];
+    bool ok = (fread(counts, 8, 1, f) == 1);
+    if (ok) {
+      m_next_id = read32(counts, 0);
+      uint32_t node_ct = read32(counts, 4);
+      for (uint32_t i = 0; ok && i < node_ct; i++) {
+        uint32_t nodeid;
+        VaultNode *node = read_node(f, &nodeid);
+        if (node) {
+          put_node(nodeid, node);
+        } else {
+          ok = false;
+        }
+      }
+    }
+    if (ok) {
+      ok = (fread(counts, 4, 1, f) == 1);
+      uint32_t ref_ct = (ok ? read32(counts, 0) : 0);
+      uint8_t refbuf[12];
+      for (uint32_t i = 0; ok && i < ref_ct; i++) {
+        if (fread(refbuf, 12, 1, f) == 1) {
+          insert_ref(read32(refbuf, 0), read32(refbuf, 4), read32(refbuf, 8));
+        } else {
+          ok = false;
+        }
+      }
+    }
+    fclose(f);
+    if (!ok) {
+      log_err(m_log, "Vault snapshot %s is truncated or corrupt\n", m_snap_fname.c_str());
+      clear();
+      return EINVAL;
+    }
+  }
+
+  f = fopen(m_log_fname.c_str(), "rb");
+  if (f) {
+    have_data = true;
+    if (fread(header, 12, 1, f) == 1 && !memcmp(header, LOG_MAGIC, 8) && read32(header, 8) == STORE_VERSION) {
+      if (!replay_log(f)) {
+        // the last record may have been cut off when the backend died
+        log_warn(m_log, "Vault log %s ends with an incomplete record; ignoring it\n", m_log_fname.c_str());
+      }
+    } else {
+      log_warn(m_log, "Ignoring vault log %s without a valid header\n", m_log_fname.c_str());
+    }
+    fclose(f);
+  }
+
+  if (!have_data && seed) {
+    std::map<uint32_t, VaultNode*> nodes;
+    std::vector<VaultFetchRefs_VaultRef> refs;
+    // callers handle any exception, so don't leak if there is one
+    try {
+      seed->dump(nodes, refs);
+    } catch (...) {
+      for (std::map<uint32_t, VaultNode*>::iterator iter = nodes.begin(); iter != nodes.end(); iter++) {
+        delete iter->second;
+      }
+      throw;
+    }
+    for (std::map<uint32_t, VaultNode*>::iterator iter = nodes.begin(); iter != nodes.end(); iter++) {
+      put_node(iter->first, iter->second);
+    }
+    for (std::vector<VaultFetchRefs_VaultRef>::const_iterator iter = refs.begin(); iter != refs.end(); iter++) {
+      insert_ref(iter->parent, iter->child, iter->owner);
+    }
+    log_info(m_log, "Seeded in-memory vault from %s store\n", seed->name());
+  }
+  log_info(m_log, "In-memory vault has %u nodes and %u refs\n", (uint32_t) m_nodes.size(), (uint32_t) m_children.size());
+
+  return (snapshot() ? 0 : (errno ? errno : EIO));
+}
+
+bool MemoryVaultStore::snapshot() {
+  std::string tmp_fname = m_snap_fname + ".new";
+  FILE *f = fopen(tmp_fname.c_str(), "wb");
+  if (!f) {
+    log_err(m_log, "Cannot write vault snapshot %s: %s\n", tmp_fname.c_str(), strerror(errno));
+    return false;
+  }
+  setvbuf(f, NULL, _IOFBF, 65536);
+
+  uint8_t buf[12];
+  memcpy(buf, SNAPSHOT_MAGIC, 8);
+  write32(buf, 8, STORE_VERSION);
+  bool ok = (fwrite(buf, 12, 1, f) == 1);
+  write32(buf, 0, m_next_id);
+  write32(buf, 4, m_nodes.size());
+  ok = ok && (fwrite(buf, 8, 1, f) == 1);
+  for (std::map<uint32_t, VaultNode*>::const_iterator iter = m_nodes.begin(); ok && iter != m_nodes.end(); iter++) {
+    ok = write_node(f, iter->first, iter->second);
+  }
+  write32(buf, 0, m_children.size());
+  ok = ok && (fwrite(buf, 4, 1, f) == 1);
+  for (std::multimap<uint32_t, VaultFetchRefs_VaultRef>::const_iterator iter = m_children.begin();
+      ok && iter != m_children.end(); iter++) {
+    write32(buf, 0, iter->second.parent);
+    write32(buf, 4, iter->second.child);
+    write32(buf, 8, iter->second.owner);
+    ok = (fwrite(buf, 12, 1, f) == 1);
+  }
+  if (fclose(f) || !ok) {
+    log_err(m_log, "Error writing vault snapshot %s: %s\n", tmp_fname.c_str(), strerror(errno));
+    ::unlink(tmp_fname.c_str());
+    return false;
+  }
+  if (rename(tmp_fname.c_str(), m_snap_fname.c_str())) {
+    log_err(m_log, "Cannot rename vault snapshot to %s: %s\n", m_snap_fname.c_str(), strerror(errno));
+    return false;
+  }
+
+  // everything is in the snapshot, so start the log over
+  if (m_logfile) {
+    fclose(m_logfile);
+  }
+  m_log_records = 0;
+  m_logfile = fopen(m_log_fname.c_str(), "wb");
+  if (!m_logfile) {
+    log_err(m_log, "Cannot write vault log %s: %s\n", m_log_fname.c_str(), strerror(errno));
+    return false;
+  }
+  memcpy(buf, LOG_MAGIC, 8);
+  write32(buf, 8, STORE_VERSION);
+  return log_write(buf, 12);
+}
@@ -0,0 +1,288 @@
+/* -*- c++ -*- */
+
+/*
+  MOSS - A server for the Myst Online: Uru Live client/protocol
+  Copyright (C) 2008-2011  a'moaca'
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * A VaultStore holds the vault's nodes and the refs between them. The
+ * backend does everything that reads or changes the vault through one: the
+ * node and ref operations the clients ask for (fetch, find, save, create,
+ * add and remove refs), and the operations the DB does with stored
+ * procedures (creating and deleting players and ages, age lists, vault SDL
+ * lookups, and working out who to notify of a change). So the vault can be
+ * served by something other than the DB.
+ *
+ * The PostgreSQL store (in backend_all.cc) runs the same transactors as
+ * always, and its calls may throw the pqxx exceptions they always did, so
+ * callers keep their retry and error handling. MemoryVaultStore keeps
+ * everything in memory and never throws; it persists to a snapshot plus an
+ * append-only log of changes, which is replayed and folded into a new
+ * snapshot each time the store is opened.
+ *
+ * Accounts, scores and marker game templates are not vault nodes, and stay
+ * in the DB whatever the store.
+ *
+ * The arguments follow the transactors': results are passed back by
+ * reference and the status is left alone unless the operation completes.
+ */
+
+//#include <stdio.h>
+//
+//#include <list>
+//#include <map>
+//#include <set>
+//#include <string>
+//#include <vector>
+//
+//#include "protocol.h"
+//#include "UruString.h"
+//#include "VaultNode.h"
+//#include "Logger.h"
+
+#ifndef _VAULT_STORE_H_
+#define _VAULT_STORE_H_
+
+typedef struct {
+  uint32_t parent;
+  uint32_t child;
+  uint32_t owner;
+} VaultFetchRefs_VaultRef;
+
+class AuthAcctLogin_PlayerQuery_Player {
+public:
+  AuthAcctLogin_PlayerQuery_Player() :
+      kinum(0), name(), gender(), explorer_type(GUEST_CUSTOMER) {
+  }
+  ;
+
+  AuthAcctLogin_PlayerQuery_Player(const AuthAcctLogin_PlayerQuery_Player &other) :
+      kinum(other.kinum), name(other.name), gender(other.gender), explorer_type(other.explorer_type) {
+  }
+
+  kinum_t kinum;
+  UruString name;
+  UruString gender;
+  customer_type_t explorer_type;
+};
+
+typedef struct {
+  uint8_t uuid[UUID_RAW_LEN];
+  UruString instance_name;
+  UruString user_defined;
+  UruString display_name;
+  uint32_t instance_num;
+  uint32_t num_owners;
+} VaultAgeList_AgeInfo;
+
+class VaultStore {
+public:
+  virtual ~VaultStore() {
+  }
+
+  virtual const char* name() const = 0;
+
+  virtual void fetch_node(uint32_t nodeid, status_code_t &result, VaultNode &node) = 0;
+  // nodes that do not exist are left out; the caller owns what is returned
+  virtual void fetch_nodes(const std::vector<uint32_t> &nodeids, status_code_t &result,
+      std::map<uint32_t, VaultNode*> &nodes) = 0;
+  // all the refs in the tree under nodeid
+  virtual void fetch_refs(uint32_t nodeid, status_code_t &result, std::vector<VaultFetchRefs_VaultRef> &refs) = 0;
+  // the PlayerInfo node under a player node; ERROR_INVALID_DATA means
+  // more than one was found (nodeid is the first)
+  virtual void find_playerinfo(uint32_t player, status_code_t &result, uint32_t &nodeid) = 0;
+  // the nodes matching all the fields set in templ
+  virtual void find_nodes(const VaultNode *templ, status_code_t &result, std::vector<uint32_t> &found) = 0;
+  virtual void save_node(uint32_t nodeid, const VaultNode *node, status_code_t &result) = 0;
+  // nodeid is set to the new node's ID, or an error code (< MIN_NODEVAL)
+  virtual void create_node(const VaultNode *node, const uint8_t *acctid, kinum_t creator, uint32_t &nodeid) = 0;
+  // ERROR_INVALID_DATA if the ref exists, ERROR_NODE_NOT_FOUND if a node
+  // does not
+  virtual void add_ref(uint32_t parent, uint32_t child, uint32_t owner, status_code_t &result) = 0;
+  // removed is set to the number of refs removed
+  virtual void remove_ref(uint32_t parent, uint32_t child, int32_t &removed) = 0;
+
+  // copy out the whole vault, for seeding another store; the caller owns
+  // the VaultNodes
+  virtual void dump(std::map<uint32_t, VaultNode*> &nodes, std::vector<VaultFetchRefs_VaultRef> &refs) = 0;
+
+  /*
+   * players
+   */
+  virtual void acct_players(const uint8_t *acctid, std::list<AuthAcctLogin_PlayerQuery_Player> &players) = 0;
+  // ERROR_PLAYER_NOT_FOUND unless the player is in the account
+  virtual void validate_ki(const uint8_t *acctid, kinum_t kinum, status_code_t &result, UruString &name) = 0;
+  // only connected players are told of changes
+  virtual void player_connected(kinum_t kinum, status_code_t &result) = 0;
+  // marks the PlayerInfo offline; ERROR_NODE_NOT_FOUND if there is none
+  virtual void player_offline(kinum_t kinum, bool &was_online, uint32_t &info_node, status_code_t &result) = 0;
+  // player.kinum is set to the new KI number, or an error code
+  // (< MIN_NODEVAL); neighbors_list is the hood's AgeOwners list, which
+  // now has the new PlayerInfo in it
+  virtual void create_player(const uint8_t *acctid, const char *name, const char *gender,
+      AuthAcctLogin_PlayerQuery_Player &player, uint32_t &neighbors_list, uint32_t &info_node) = 0;
+  // tell_who gets (KI, list) for each connected player whose list had the
+  // PlayerInfo removed from it
+  virtual void delete_player(kinum_t kinum, status_code_t &result, std::multimap<kinum_t, uint32_t> &tell_who,
+      uint32_t &info_node) = 0;
+
+  /*
+   * ages
+   */
+  // an existing age with the UUID (or, for a child age, the parent and
+  // filename) is returned rather than making another
+  virtual void create_age(const char *filename, const char *instance, const char *user_defined, const char *display,
+      const uint8_t *createuuid, const uint8_t *parentuuid, uint32_t &age_node, uint32_t &age_info_node,
+      status_code_t &result) = 0;
+  // the public instances of an age
+  virtual void age_list(UruString &filename, status_code_t &result, std::vector<VaultAgeList_AgeInfo> &ages) = 0;
+  virtual void set_age_public(uint32_t age_info_node, bool to_public, status_code_t &result) = 0;
+  // ERROR_AGE_NOT_FOUND if there is no such age
+  virtual void age_by_uuid(const uint8_t *uuid, uint32_t &age_node, uint32_t &age_info_node, UruString &filename,
+      status_code_t &result) = 0;
+  // does nothing for the global ages, or if the age has owners or visitors
+  virtual void delete_age(uint32_t age_info_node, status_code_t &result) = 0;
+
+  /*
+   * SDL; *outbuf must be NULL, and is left NULL if there is no SDL
+   */
+  virtual void age_sdl(uint32_t age_info_node, UruString &filename, uint8_t **outbuf, uint32_t &buflen,
+      status_code_t &result) = 0;
+  virtual void global_sdl(UruString &filename, uint8_t **outbuf, uint32_t &buflen, status_code_t &result) = 0;
+  // the UUID of the age an SDL node is for
+  virtual void age_uuid_for(uint32_t sdl_node, uint8_t *uuid, status_code_t &result) = 0;
+
+  /*
+   * who to notify of a change to a node
+   */
+  // the connected players with the node in their vault trees; result is
+  // ERROR_MAX_PLAYERS if the node is in the System tree, meaning everyone
+  virtual void players_referring_to(uint32_t nodeid, status_code_t &result, std::vector<kinum_t> &players) = 0;
+  // the age whose tree the node is in; ERROR_NODE_NOT_FOUND if none
+  virtual void age_referring_to(uint32_t nodeid, uint8_t *uuid, status_code_t &result) = 0;
+};
+
+class MemoryVaultStore: public VaultStore {
+public:
+  // the snapshot and log are kept in dir
+  MemoryVaultStore(Logger *log, const char *dir);
+  // writes a final snapshot
+  virtual ~MemoryVaultStore();
+
+  const char* name() const {
+    return "memory";
+  }
+
+  // Load the snapshot and replay the log, then write a new snapshot and
+  // start a new log. If there is neither, and seed is not NULL, start with
+  // a copy of the seed store's vault. Returns 0 for success or an errno.
+  int open(VaultStore *seed);
+  // write out everything and truncate the log; returns false on failure
+  bool snapshot();
+
+  void fetch_node(uint32_t nodeid, status_code_t &result, VaultNode &node);
+  void fetch_nodes(const std::vector<uint32_t> &nodeids, status_code_t &result, std::map<uint32_t, VaultNode*> &nodes);
+  void fetch_refs(uint32_t nodeid, status_code_t &result, std::vector<VaultFetchRefs_VaultRef> &refs);
+  void find_playerinfo(uint32_t player, status_code_t &result, uint32_t &nodeid);
+  void find_nodes(const VaultNode *templ, status_code_t &result, std::vector<uint32_t> &found);
+  void save_node(uint32_t nodeid, const VaultNode *node, status_code_t &result);
+  void create_node(const VaultNode *node, const uint8_t *acctid, kinum_t creator, uint32_t &nodeid);
+  void add_ref(uint32_t parent, uint32_t child, uint32_t owner, status_code_t &result);
+  void remove_ref(uint32_t parent, uint32_t child, int32_t &removed);
+  void dump(std::map<uint32_t, VaultNode*> &nodes, std::vector<VaultFetchRefs_VaultRef> &refs);
+
+  void acct_players(const uint8_t *acctid, std::list<AuthAcctLogin_PlayerQuery_Player> &players);
+  void validate_ki(const uint8_t *acctid, kinum_t kinum, status_code_t &result, UruString &name);
+  void player_connected(kinum_t kinum, status_code_t &result);
+  void player_offline(kinum_t kinum, bool &was_online, uint32_t &info_node, status_code_t &result);
+  void create_player(const uint8_t *acctid, const char *name, const char *gender, AuthAcctLogin_PlayerQuery_Player &player,
+      uint32_t &neighbors_list, uint32_t &info_node);
+  void delete_player(kinum_t kinum, status_code_t &result, std::multimap<kinum_t, uint32_t> &tell_who, uint32_t &info_node);
+  void create_age(const char *filename, const char *instance, const char *user_defined, const char *display,
+      const uint8_t *createuuid, const uint8_t *parentuuid, uint32_t &age_node, uint32_t &age_info_node, status_code_t &result);
+  void age_list(UruString &filename, status_code_t &result, std::vector<VaultAgeList_AgeInfo> &ages);
+  void set_age_public(uint32_t age_info_node, bool to_public, status_code_t &result);
+  void age_by_uuid(const uint8_t *uuid, uint32_t &age_node, uint32_t &age_info_node, UruString &filename,
+      status_code_t &result);
+  void delete_age(uint32_t age_info_node, status_code_t &result);
+  void age_sdl(uint32_t age_info_node, UruString &filename, uint8_t **outbuf, uint32_t &buflen, status_code_t &result);
+  void global_sdl(UruString &filename, uint8_t **outbuf, uint32_t &buflen, status_code_t &result);
+  void age_uuid_for(uint32_t sdl_node, uint8_t *uuid, status_code_t &result);
+  void players_referring_to(uint32_t nodeid, status_code_t &result, std::vector<kinum_t> &players);
+  void age_referring_to(uint32_t nodeid, uint8_t *uuid, status_code_t &result);
+
+protected:
+  Logger *m_log;
+  std::string m_snap_fname;
+  std::string m_log_fname;
+  FILE *m_logfile;
+  uint32_t m_log_records;
+
+  uint32_t m_next_id;
+  std::map<uint32_t, VaultNode*> m_nodes;
+  // refs by parent, and the parents of each child
+  std::multimap<uint32_t, VaultFetchRefs_VaultRef> m_children;
+  std::multimap<uint32_t, uint32_t> m_parents;
+  // the players online, as in the DB's connected table (not persisted)
+  std::set<kinum_t> m_connected;
+
+  // log record types
+  typedef enum {
+    LOG_PUT_NODE = 1, // the whole node after a create or save
+    LOG_DEL_NODE = 2,
+    LOG_ADD_REF = 3,
+    LOG_DEL_REF = 4
+  } log_op_t;
+
+  void clear();
+  void put_node(uint32_t nodeid, VaultNode *node);
+  bool has_ref(uint32_t parent, uint32_t child) const;
+  void insert_ref(uint32_t parent, uint32_t child, uint32_t owner);
+  int32_t erase_ref(uint32_t parent, uint32_t child);
+  void erase_node(uint32_t nodeid);
+
+  // helpers for the schema operations, which build and take apart trees
+  // the way the DB's stored procedures do
+  const VaultNode* get_node(uint32_t nodeid) const;
+  uint32_t new_node(VaultNode *node, const uint8_t *acctid, uint32_t creator);
+  uint32_t new_list(VaultNode::vault_nodetype_t type, int32_t list_type, uint32_t parent, uint32_t owner,
+      const uint8_t *acctid, uint32_t creator);
+  uint32_t new_agelink(uint32_t parent, kinum_t kinum, const uint8_t *acctid, bool default_spawn);
+  void link(uint32_t parent, uint32_t child, uint32_t owner);
+  void unlink(uint32_t parent, uint32_t child);
+  void children(uint32_t parent, std::vector<uint32_t> &kids) const;
+  uint32_t child_list(uint32_t parent, VaultNode::vault_nodetype_t type, int32_t list_type) const;
+  uint32_t child_of_type(uint32_t parent, VaultNode::vault_nodetype_t type) const;
+  uint32_t parent_of_type(uint32_t child, VaultNode::vault_nodetype_t type) const;
+  size_t child_count(uint32_t parent) const;
+  // the node with the highest Int32_1 of those matching templ, or 0
+  uint32_t last_in_sequence(const VaultNode &templ);
+  void remove_tree(uint32_t top);
+  uint32_t notifier(uint32_t parent) const;
+  void notifiers(uint32_t nodeid, std::set<uint32_t> &tops) const;
+
+  // the append-only log
+  void log_node(uint32_t nodeid, const VaultNode *node);
+  void log_op(log_op_t op, uint32_t a, uint32_t b = 0, uint32_t c = 0);
+  bool log_write(const uint8_t *buf, size_t len);
+  bool replay_log(FILE *f);
+
+  static bool write_node(FILE *f, uint32_t nodeid, const VaultNode *node);
+  static VaultNode* read_node(FILE *f, uint32_t *nodeid);
+};
+
+#endif /* _VAULT_STORE_H_ */